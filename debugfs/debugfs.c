@@ -36,6 +36,7 @@ extern char *optarg;
 #include "e2p/e2p.h"
 
 #include <ext2fs/ext2_ext_attr.h>
+#include <ext2fs/cimage.h>
 
 #include "../version.h"
 #include "jfs_user.h"
@@ -169,6 +170,11 @@ static void open_filesystem(char *device, int open_flags, blk64_t superblock,
 
 	if (catastrophic)
 		open_flags |= EXT2_FLAG_SKIP_MMP | EXT2_FLAG_IGNORE_SB_ERRORS;
+	else if (!(open_flags & (EXT2_FLAG_RW | EXT2_FLAG_IMAGE_FILE)))
+		open_flags |= EXT2_FLAG_LAZY_LOAD;
+
+	if (ext2fs_cimage_probe(device))
+		io_ptr = cimage_io_manager;
 
 	if (undo_file) {
 		retval = debugfs_setup_tdb(device, undo_file, &io_ptr);
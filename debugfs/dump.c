@@ -36,6 +36,9 @@ extern char *optarg;
 #define O_LARGEFILE 0
 #endif
 
+/* How much of a file dump_file reads at a time */
+#define DUMP_BUFLEN	(1024 * 1024)
+
 /*
  * The mode_xlate function translates a linux mode into a native-OS mode_t.
  */
@@ -105,7 +108,8 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 	char		*buf = 0;
 	ext2_file_t	e2_file;
 	int		nbytes;
-	unsigned int	got, blocksize = current_fs->blocksize;
+	unsigned int	got;
+	__u64		pos = 0;
 
 	if (debugfs_read_inode(ino, &inode, cmdname))
 		return;
@@ -115,19 +119,21 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 		com_err(cmdname, retval, "while opening ext2 file");
 		return;
 	}
-	retval = ext2fs_get_mem(blocksize, &buf);
+	retval = ext2fs_get_mem(DUMP_BUFLEN, &buf);
 	if (retval) {
 		com_err(cmdname, retval, "while allocating memory");
 		return;
 	}
 	while (1) {
-		retval = ext2fs_file_read(e2_file, buf, blocksize, &got);
+		retval = ext2fs_file_pread(e2_file, buf, DUMP_BUFLEN, pos,
+					   &got);
 		if (retval) {
 			com_err(cmdname, retval, "while reading ext2 file");
 			return;
 		}
 		if (got == 0)
 			break;
+		pos += got;
 		nbytes = write(fd, buf, got);
 		if ((unsigned) nbytes != got)
 			com_err(cmdname, errno, "while writing file");
@@ -21,6 +21,7 @@ struct dir_info_db {
 	ext2_ino_t	size;
 	struct dir_info *array;
 	struct dir_info *last_lookup;
+	int		scratch;	/* array is in scratch memory */
 #ifdef CONFIG_TDB
 	char		*tdb_fn;
 	TDB_CONTEXT	*tdb;
@@ -144,9 +145,15 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 		old_size = ctx->dir_info->size * sizeof(struct dir_info);
 		ctx->dir_info->size += 10;
 		old_array = ctx->dir_info->array;
-		retval = ext2fs_resize_mem(old_size, ctx->dir_info->size *
-					   sizeof(struct dir_info),
-					   &ctx->dir_info->array);
+		if (ctx->dir_info->scratch)
+			retval = ext2fs_resize_scratch_mem(ctx->dir_info->size *
+						sizeof(struct dir_info),
+						&ctx->dir_info->array);
+		else
+			retval = ext2fs_resize_mem(old_size,
+						ctx->dir_info->size *
+						sizeof(struct dir_info),
+						&ctx->dir_info->array);
 		if (retval) {
 			fprintf(stderr, "Couldn't reallocate dir_info "
 				"structure to %u entries\n",
@@ -333,7 +340,9 @@ void e2fsck_free_dir_info(e2fsck_t ctx)
 			ext2fs_free_mem(&ctx->dir_info->tdb_fn);
 		}
 #endif
-		if (ctx->dir_info->array)
+		if (ctx->dir_info->scratch)
+			ext2fs_free_scratch_mem(&ctx->dir_info->array);
+		else if (ctx->dir_info->array)
 			ext2fs_free_mem(&ctx->dir_info->array);
 		ctx->dir_info->array = 0;
 		ctx->dir_info->size = 0;
@@ -343,6 +352,38 @@ void e2fsck_free_dir_info(e2fsck_t ctx)
 	}
 }
 
+/*
+ * Move the dir_info array out of the heap into a scratch file in dir
+ */
+errcode_t e2fsck_dir_info_use_scratch(e2fsck_t ctx, const char *dir)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	errcode_t		retval;
+
+	if (!db || !db->array || db->scratch)
+		return 0;
+	retval = ext2fs_move_to_scratch_mem(dir, db->size *
+					    sizeof(struct dir_info),
+					    &db->array);
+	if (retval)
+		return retval;
+	db->last_lookup = NULL;
+	db->scratch = 1;
+	return 0;
+}
+
+/*
+ * Return the number of bytes of heap memory used by the dir_info array
+ */
+unsigned long long e2fsck_dir_info_heap_size(e2fsck_t ctx)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+
+	if (!db || db->scratch)
+		return 0;
+	return (unsigned long long) db->size * sizeof(struct dir_info);
+}
+
 /*
  * Return the count of number of directories in the dir_info structure
  */
@@ -259,6 +259,7 @@ int e2fsck_run(e2fsck_t ctx)
 			break;
 		if (e2fsck_mmp_update(ctx->fs))
 			fatal_error(ctx, 0);
+		e2fsck_check_memory_limit(ctx);
 		e2fsck_pass(ctx);
 		if (ctx->progress)
 			(void) (ctx->progress)(ctx, 0, 0, 0);
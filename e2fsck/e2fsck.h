@@ -186,6 +186,7 @@ struct resource_track {
 #define E2F_OPT_UNSHARE_BLOCKS  0x40000
 #define E2F_OPT_CLEAR_UNINIT	0x80000 /* Hack to clear the uninit bit */
 #define E2F_OPT_CHECK_ENCODING  0x100000 /* Force verification of encoded filenames */
+#define E2F_OPT_ICOUNT_NO_GROUPMAP 0x200000 /* use bitmaps and a sorted list */
 
 /*
  * E2fsck flags
@@ -448,6 +449,17 @@ struct e2fsck_struct {
 	/* How much are we allowed to readahead? */
 	unsigned long long readahead_kb;
 
+	/* Budget in bytes for the large tables (0 means unlimited) */
+	unsigned long long memory_limit;
+
+	/* Worker threads requested via -E threads=N (0 means serial) */
+	int num_threads;
+	struct e2fsck_itable_prefetch *itable_prefetch;
+	struct e2fsck_dblist_prefetch *dblist_prefetch;
+
+	/* Bitmap backend from [options] bitmap_type (0 means default) */
+	unsigned int bitmap_type;
+
 	/*
 	 * Inodes to rebuild extent trees
 	 */
@@ -519,6 +531,8 @@ extern int e2fsck_dir_info_get_parent(e2fsck_t ctx, ext2_ino_t ino,
 				      ext2_ino_t *parent);
 extern int e2fsck_dir_info_get_dotdot(e2fsck_t ctx, ext2_ino_t ino,
 				      ext2_ino_t *dotdot);
+extern errcode_t e2fsck_dir_info_use_scratch(e2fsck_t ctx, const char *dir);
+extern unsigned long long e2fsck_dir_info_heap_size(e2fsck_t ctx);
 
 /* dx_dirinfo.c */
 extern void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino,
@@ -550,6 +564,9 @@ extern errcode_t ea_refcount_decrement(ext2_refcount_t refcount,
 extern errcode_t ea_refcount_store(ext2_refcount_t refcount, ea_key_t ea_key,
 				   ea_value_t count);
 extern size_t ext2fs_get_refcount_size(ext2_refcount_t refcount);
+extern errcode_t ea_refcount_use_scratch(ext2_refcount_t refcount,
+					 const char *dir);
+extern unsigned long long ea_refcount_heap_size(ext2_refcount_t refcount);
 extern void ea_refcount_intr_begin(ext2_refcount_t refcount);
 extern ea_key_t ea_refcount_intr_next(ext2_refcount_t refcount,
 				      ea_value_t *ret);
@@ -595,6 +612,9 @@ extern int e2fsck_fix_ext3_journal_hint(e2fsck_t ctx);
 /* logfile.c */
 extern void set_up_logging(e2fsck_t ctx);
 
+/* memlimit.c */
+extern void e2fsck_check_memory_limit(e2fsck_t ctx);
+
 /* quota.c */
 extern void e2fsck_hide_quota(e2fsck_t ctx);
 extern void e2fsck_validate_quota_inodes(e2fsck_t ctx);
@@ -642,6 +662,15 @@ errcode_t e2fsck_readahead_dblist(ext2_filsys fs, int flags,
 				  unsigned long long count);
 int e2fsck_can_readahead(ext2_filsys fs);
 unsigned long long e2fsck_guess_readahead(ext2_filsys fs);
+errcode_t e2fsck_start_itable_prefetch(e2fsck_t ctx);
+void e2fsck_itable_prefetch_group(e2fsck_t ctx, dgrp_t group);
+void e2fsck_stop_itable_prefetch(e2fsck_t ctx);
+errcode_t e2fsck_start_dblist_prefetch(e2fsck_t ctx, ext2_dblist dblist);
+void e2fsck_dblist_prefetch_advance(e2fsck_t ctx, unsigned long long idx);
+errcode_t e2fsck_dblist_prefetch_read(e2fsck_t ctx, unsigned long long idx,
+				      blk64_t blk, void *buf, ext2_ino_t ino);
+void e2fsck_dblist_prefetch_invalidate(e2fsck_t ctx, blk64_t blk);
+void e2fsck_stop_dblist_prefetch(e2fsck_t ctx);
 
 /* region.c */
 extern region_t region_create(region_addr_t min, region_addr_t max);
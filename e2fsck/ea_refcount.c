@@ -34,6 +34,7 @@ struct ea_refcount {
 	size_t		count;
 	size_t		size;
 	size_t		cursor;
+	int		scratch;	/* list is in scratch memory */
 	struct ea_refcount_el	*list;
 };
 
@@ -42,7 +43,9 @@ void ea_refcount_free(ext2_refcount_t refcount)
 	if (!refcount)
 		return;
 
-	if (refcount->list)
+	if (refcount->scratch)
+		ext2fs_free_scratch_mem(&refcount->list);
+	else if (refcount->list)
 		ext2fs_free_mem(&refcount->list);
 	ext2fs_free_mem(&refcount);
 }
@@ -122,11 +125,16 @@ static struct ea_refcount_el *insert_refcount_el(ext2_refcount_t refcount,
 #ifdef DEBUG
 		printf("Reallocating refcount %zu entries...\n", new_size);
 #endif
-		retval = ext2fs_resize_mem((size_t) refcount->size *
-					   sizeof(struct ea_refcount_el),
-					   (size_t) new_size *
-					   sizeof(struct ea_refcount_el),
-					   &refcount->list);
+		if (refcount->scratch)
+			retval = ext2fs_resize_scratch_mem((size_t) new_size *
+					sizeof(struct ea_refcount_el),
+					&refcount->list);
+		else
+			retval = ext2fs_resize_mem((size_t) refcount->size *
+					sizeof(struct ea_refcount_el),
+					(size_t) new_size *
+					sizeof(struct ea_refcount_el),
+					&refcount->list);
 		if (retval)
 			return 0;
 		refcount->size = new_size;
@@ -273,6 +281,35 @@ size_t ext2fs_get_refcount_size(ext2_refcount_t refcount)
 	return refcount->size;
 }
 
+/*
+ * Move the refcount list out of the heap into a scratch file in dir
+ */
+errcode_t ea_refcount_use_scratch(ext2_refcount_t refcount, const char *dir)
+{
+	errcode_t	retval;
+
+	if (!refcount || refcount->scratch)
+		return 0;
+	retval = ext2fs_move_to_scratch_mem(dir, refcount->size *
+					    sizeof(struct ea_refcount_el),
+					    &refcount->list);
+	if (retval)
+		return retval;
+	refcount->scratch = 1;
+	return 0;
+}
+
+/*
+ * Return the number of bytes of heap memory used by the refcount list
+ */
+unsigned long long ea_refcount_heap_size(ext2_refcount_t refcount)
+{
+	if (!refcount || refcount->scratch)
+		return 0;
+	return (unsigned long long) refcount->size *
+		sizeof(struct ea_refcount_el);
+}
+
 void ea_refcount_intr_begin(ext2_refcount_t refcount)
 {
 	refcount->cursor = 0;
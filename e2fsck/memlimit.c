@@ -0,0 +1,161 @@
+/*
+ * memlimit.c --- keep e2fsck's largest tables within a memory budget
+ *
+ * When a memory limit is given with -E memory_limit=, the heap used by
+ * the tables which grow with the size of the file system (the directory
+ * info array, the directory block list, the inode link counts and the
+ * EA refcounts) is added up at regular points during the check.  Once
+ * the total goes over the limit, the largest tables are moved into
+ * scratch files which are mapped into memory, until the total fits
+ * again.  The tables keep their sorted-array layout, so lookups are
+ * still binary searches; the kernel simply writes back and drops their
+ * pages under memory pressure.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "e2fsck.h"
+
+#define MEM_DIR_INFO	0
+#define MEM_DBLIST	1
+#define MEM_ICOUNT	2
+#define MEM_REFCOUNT	3
+
+struct mem_user {
+	const char		*name;
+	int			type;
+	void			*obj;
+	unsigned long long	size;
+};
+
+static unsigned long long mem_user_size(e2fsck_t ctx, struct mem_user *u)
+{
+	switch (u->type) {
+	case MEM_DIR_INFO:
+		return e2fsck_dir_info_heap_size(ctx);
+	case MEM_DBLIST:
+		return ext2fs_dblist_heap_size((ext2_dblist) u->obj);
+	case MEM_ICOUNT:
+		return ext2fs_icount_heap_size((ext2_icount_t) u->obj);
+	case MEM_REFCOUNT:
+		return ea_refcount_heap_size((ext2_refcount_t) u->obj);
+	}
+	return 0;
+}
+
+static errcode_t mem_user_move(e2fsck_t ctx, struct mem_user *u,
+			       const char *dir)
+{
+	switch (u->type) {
+	case MEM_DIR_INFO:
+		return e2fsck_dir_info_use_scratch(ctx, dir);
+	case MEM_DBLIST:
+		return ext2fs_dblist_use_scratch((ext2_dblist) u->obj, dir);
+	case MEM_ICOUNT:
+		return ext2fs_icount_use_scratch((ext2_icount_t) u->obj, dir);
+	case MEM_REFCOUNT:
+		return ea_refcount_use_scratch((ext2_refcount_t) u->obj, dir);
+	}
+	return 0;
+}
+
+/*
+ * The scratch files go in the [scratch_files] directory if one is
+ * configured, and in $TMPDIR or /tmp otherwise.
+ */
+static char *get_scratch_dir(e2fsck_t ctx)
+{
+	char	*dir = NULL;
+	const char *tmp;
+
+	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
+			   &dir);
+	if (dir && !access(dir, W_OK))
+		return dir;
+	free(dir);
+	tmp = getenv("TMPDIR");
+	if (!tmp || access(tmp, W_OK))
+		tmp = "/tmp";
+	return strdup(tmp);
+}
+
+void e2fsck_check_memory_limit(e2fsck_t ctx)
+{
+	struct mem_user		users[16];
+	unsigned long long	total = 0;
+	struct mem_user		*u, *largest;
+	errcode_t		retval;
+	char			*dir;
+	int			i, n = 0;
+
+	if (!ctx->memory_limit)
+		return;
+
+#define ADD_USER(n_, t_, o_)				\
+	do {						\
+		if (o_) {				\
+			users[n].name = (n_);		\
+			users[n].type = (t_);		\
+			users[n].obj = (o_);		\
+			n++;				\
+		}					\
+	} while (0)
+
+	ADD_USER(_("directory info"), MEM_DIR_INFO, ctx->dir_info);
+	ADD_USER(_("directory block list"), MEM_DBLIST, ctx->fs->dblist);
+	ADD_USER(_("inode link counts"), MEM_ICOUNT, ctx->inode_link_info);
+	ADD_USER(_("inode reference counts"), MEM_ICOUNT, ctx->inode_count);
+	ADD_USER(_("EA block refcounts"), MEM_REFCOUNT, ctx->refcount);
+	ADD_USER(_("EA block refcounts"), MEM_REFCOUNT, ctx->refcount_extra);
+	ADD_USER(_("EA block quota"), MEM_REFCOUNT,
+		 ctx->ea_block_quota_blocks);
+	ADD_USER(_("EA block quota"), MEM_REFCOUNT,
+		 ctx->ea_block_quota_inodes);
+	ADD_USER(_("EA inode refcounts"), MEM_REFCOUNT, ctx->ea_inode_refs);
+#undef ADD_USER
+
+	for (i = 0, u = users; i < n; i++, u++) {
+		u->size = mem_user_size(ctx, u);
+		total += u->size;
+	}
+	if (total <= ctx->memory_limit)
+		return;
+
+	dir = get_scratch_dir(ctx);
+	if (!dir)
+		return;
+	while (total > ctx->memory_limit) {
+		largest = NULL;
+		for (i = 0, u = users; i < n; i++, u++)
+			if (u->size && (!largest || u->size > largest->size))
+				largest = u;
+		if (!largest)
+			break;
+		retval = mem_user_move(ctx, largest, dir);
+		if (retval) {
+			log_err(ctx, _("Couldn't move %s to a scratch file "
+				       "in %s: %s\n"), largest->name, dir,
+				error_message(retval));
+			/* Don't keep trying on every check */
+			ctx->memory_limit = 0;
+			break;
+		}
+		if (ctx->options & E2F_OPT_DEBUG)
+			log_out(ctx, "Moved %s (%llu bytes) to a scratch "
+				"file in %s\n", largest->name, largest->size,
+				dir);
+		total -= largest->size;
+		largest->size = 0;
+	}
+	free(dir);
+}
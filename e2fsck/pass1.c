@@ -893,6 +893,10 @@ extern errcode_t e2fsck_setup_icount(e2fsck_t ctx, const char *icount_name,
 			       &save_type);
 	if (ctx->options & E2F_OPT_ICOUNT_FULLMAP)
 		flags |= EXT2_ICOUNT_OPT_FULLMAP;
+	/* The per-group tables can't be moved to scratch files */
+	if (!(ctx->options & E2F_OPT_ICOUNT_NO_GROUPMAP) &&
+	    !(flags & EXT2_ICOUNT_OPT_FULLMAP) && !ctx->memory_limit)
+		flags |= EXT2_ICOUNT_OPT_GROUPMAP;
 	retval = ext2fs_create_icount2(ctx->fs, flags, 0, hint, ret);
 	ctx->fs->default_bitmap_type = save_type;
 	return retval;
@@ -1404,6 +1408,21 @@ void e2fsck_pass1(e2fsck_t ctx)
 	scan_struct.ctx = ctx;
 	scan_struct.block_buf = block_buf;
 	ext2fs_set_inode_callback(scan, scan_callback, &scan_struct);
+	/*
+	 * threads=N only reads the inode tables ahead of us; the scan
+	 * and every check below still run in this thread, in inode
+	 * order.  Sharding the checks would need private bitmaps, icount
+	 * and dir_info per thread plus a merge step, and is not done.
+	 */
+	if (ctx->num_threads > 1 && e2fsck_start_itable_prefetch(ctx) == 0 &&
+	    ctx->itable_prefetch) {
+		/* The prefetch threads replace the fadvise readahead */
+		ra_group = fs->group_desc_count;
+		ino_threshold = fs->super->s_inodes_count;
+	}
+	/* Our own readahead replaces the scanner's */
+	if (ctx->readahead_kb || ctx->itable_prefetch)
+		ext2fs_inode_scan_flags(scan, EXT2_SF_NO_READAHEAD, 0);
 	if (ctx->progress && ((ctx->progress)(ctx, 1, 0,
 					      ctx->fs->group_desc_count)))
 		goto endit;
@@ -2081,6 +2100,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	process_inodes(ctx, block_buf);
 	ext2fs_close_inode_scan(scan);
 	scan = NULL;
+	e2fsck_stop_itable_prefetch(ctx);
 
 	reserve_block_for_root_repair(ctx);
 	reserve_block_for_lnf_repair(ctx);
@@ -2183,6 +2203,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	}
 	ctx->flags |= E2F_FLAG_ALLOC_OK;
 endit:
+	e2fsck_stop_itable_prefetch(ctx);
 	e2fsck_use_inode_shortcuts(ctx, 0);
 	ext2fs_free_mem(&inodes_to_process);
 	inodes_to_process = 0;
@@ -2222,6 +2243,8 @@ static errcode_t scan_callback(ext2_filsys fs,
 	ctx = scan_struct->ctx;
 
 	process_inodes((e2fsck_t) fs->priv_data, scan_struct->block_buf);
+	e2fsck_itable_prefetch_group(ctx, group + 1);
+	e2fsck_check_memory_limit(ctx);
 
 	if (ctx->progress)
 		if ((ctx->progress)(ctx, 1, group+1,
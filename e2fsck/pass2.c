@@ -186,9 +186,16 @@ void e2fsck_pass2(e2fsck_t ctx)
 	if (ext2fs_has_feature_dir_index(fs->super))
 		ext2fs_dblist_sort2(fs->dblist, special_dir_block_cmp);
 
-	check_dir_func = cd.ra_entries ? check_dir_block2 : check_dir_block;
+	/* The prefetch threads replace the fadvise readahead */
+	if (e2fsck_start_dblist_prefetch(ctx, fs->dblist) == 0 &&
+	    ctx->dblist_prefetch)
+		cd.ra_entries = 0;
+
+	check_dir_func = (cd.ra_entries || ctx->dblist_prefetch) ?
+		check_dir_block2 : check_dir_block;
 	cd.pctx.errcode = ext2fs_dblist_iterate2(fs->dblist, check_dir_func,
 						 &cd);
+	e2fsck_stop_dblist_prefetch(ctx);
 	if (ctx->flags & E2F_FLAG_RESTART_LATER) {
 		ctx->flags |= E2F_FLAG_RESTART;
 		ctx->flags &= ~E2F_FLAG_RESTART_LATER;
@@ -1031,6 +1038,7 @@ static int check_dir_block2(ext2_filsys fs,
 		cd->next_ra_off = cd->list_offset + (cd->ra_entries * 7 / 8);
 	}
 
+	e2fsck_dblist_prefetch_advance(cd->ctx, cd->list_offset);
 	err = check_dir_block(fs, db, priv_data);
 	cd->list_offset++;
 	return err;
@@ -1179,8 +1187,9 @@ skip_first_read_swab:
 				0);
 #endif
 	} else
-		cd->pctx.errcode = ext2fs_read_dir_block4(fs, block_nr,
-							  buf, 0, ino);
+		cd->pctx.errcode = e2fsck_dblist_prefetch_read(ctx,
+							cd->list_offset,
+							block_nr, buf, ino);
 inline_read_fail:
 	pctx.ino = ino;
 	pctx.num = inline_data_size;
@@ -1801,9 +1810,11 @@ skip_second_write_swab:
 			cd->pctx.errcode =
 				ext2fs_inline_data_set(fs, ino, 0, buf,
 						       inline_data_size);
-		} else
+		} else {
 			cd->pctx.errcode = ext2fs_write_dir_block4(fs, block_nr,
 								   buf, 0, ino);
+			e2fsck_dblist_prefetch_invalidate(ctx, block_nr);
+		}
 		if (will_rehash)
 			ctx->fs->flags = (flags &
 					  EXT2_FLAG_IGNORE_CSUM_ERRORS) |
@@ -2182,6 +2193,7 @@ static int allocate_dir_block(e2fsck_t ctx,
 
 	pctx->errcode = ext2fs_write_dir_block4(fs, blk, block, 0, db->ino);
 	ext2fs_free_mem(&block);
+	e2fsck_dblist_prefetch_invalidate(ctx, blk);
 	if (pctx->errcode) {
 		pctx->str = "ext2fs_write_dir_block";
 		fix_problem(ctx, PR_2_ALLOC_DIRBOCK, pctx);
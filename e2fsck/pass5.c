@@ -322,12 +322,7 @@ static void check_block_bitmaps(e2fsck_t ctx)
 	int		fixit, had_problem;
 	errcode_t	retval;
 	int	redo_flag = 0;
-	char *actual_buf, *bitmap_buf;
-
-	actual_buf = (char *) e2fsck_allocate_memory(ctx, fs->blocksize,
-						     "actual bitmap buffer");
-	bitmap_buf = (char *) e2fsck_allocate_memory(ctx, fs->blocksize,
-						     "bitmap block buffer");
+	blk64_t	next_diff_check;
 
 	clear_problem_context(&pctx);
 	free_array = (unsigned int *) e2fsck_allocate_memory(ctx,
@@ -366,51 +361,56 @@ static void check_block_bitmaps(e2fsck_t ctx)
 redo_counts:
 	had_problem = 0;
 	save_problem = 0;
+	next_diff_check = 0;
 	pctx.blk = pctx.blk2 = NO_BLK;
 	for (i = B2C(fs->super->s_first_data_block);
 	     i < ext2fs_blocks_count(fs->super);
 	     i += EXT2FS_CLUSTER_RATIO(fs)) {
-		int first_block_in_bg = (B2C(i) -
-					 B2C(fs->super->s_first_data_block)) %
-			fs->super->s_clusters_per_group == 0;
-		int n, nbytes = fs->super->s_clusters_per_group / 8;
-
-		actual = ext2fs_fast_test_block_bitmap2(ctx->block_found_map, i);
-
 		/*
-		 * Try to optimize pass5 by extracting a bitmap block
-		 * as expected from what we have on disk, and then
-		 * comparing the two.  If they are identical, then
-		 * update the free block counts and go on to the next
-		 * block group.  This is much faster than doing the
-		 * individual bit-by-bit comparison.  The one downside
-		 * is that this doesn't work if we are asking e2fsck
-		 * to do a discard operation.
+		 * Rather than comparing the bitmaps bit by bit, find
+		 * the next run of clusters in this group where they
+		 * differ, and count the clusters before it in bulk.
+		 * The last cluster before the run is left to the loop,
+		 * so that the end of the group is handled in one
+		 * place.  Once the on-disk bitmap has been replaced by
+		 * the one we computed there is nothing left to
+		 * compare.  This doesn't work if we are asking e2fsck
+		 * to do a discard operation, which needs to see each
+		 * free cluster.
 		 */
-		if (!first_block_in_bg ||
-		    (group == fs->group_desc_count - 1) ||
-		    (ctx->options & E2F_OPT_DISCARD))
-			goto no_optimize;
-
-		retval = ext2fs_get_block_bitmap_range2(ctx->block_found_map,
-				B2C(i), fs->super->s_clusters_per_group,
-				actual_buf);
-		if (retval)
-			goto no_optimize;
-		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-				B2C(i), fs->super->s_clusters_per_group,
-				bitmap_buf);
-		if (retval)
-			goto no_optimize;
-		if (memcmp(actual_buf, bitmap_buf, nbytes) != 0)
-			goto no_optimize;
-		n = ext2fs_bitcount(actual_buf, nbytes);
-		group_free = fs->super->s_clusters_per_group - n;
-		free_blocks += group_free;
-		i += EXT2FS_C2B(fs, fs->super->s_clusters_per_group - 1);
-		goto next_group;
-	no_optimize:
+		if (i >= next_diff_check &&
+		    !(ctx->options & E2F_OPT_DISCARD)) {
+			blk64_t last = ext2fs_group_last_block2(fs, group);
+			blk64_t diff_start, diff_end, used, n;
+
+			if (redo_flag)
+				retval = ENOENT;
+			else
+				retval = ext2fs_find_first_diff_block_bitmap2(
+					ctx->block_found_map, fs->block_map,
+					i, last, &diff_start, &diff_end);
+			if (retval == ENOENT) {
+				diff_start = EXT2FS_C2B(fs, B2C(last) + 1);
+				diff_end = last;
+			} else if (retval) {
+				diff_start = i;
+				diff_end = last;
+			}
+			next_diff_check = EXT2FS_C2B(fs, B2C(diff_end) + 1);
+
+			n = B2C(diff_start) - B2C(i);
+			if (n > 1 &&
+			    !ext2fs_count_set_block_bitmap2(ctx->block_found_map,
+					i, EXT2FS_C2B(fs, B2C(diff_start) - 1) - 1,
+					&used)) {
+				group_free += n - 1 - used;
+				free_blocks += n - 1 - used;
+				blocks += n - 1;
+				i = EXT2FS_C2B(fs, B2C(diff_start) - 1);
+			}
+		}
 
+		actual = ext2fs_fast_test_block_bitmap2(ctx->block_found_map, i);
 		if (redo_flag)
 			bitmap = actual;
 		else
@@ -485,7 +485,6 @@ redo_counts:
 			if (!bitmap && i >= first_free)
 				e2fsck_discard_blocks(ctx, first_free,
 						      (i - first_free) + 1);
-		next_group:
 			first_free = ext2fs_blocks_count(fs->super);
 
 			free_array[group] = group_free;
@@ -554,8 +553,44 @@ redo_counts:
 	}
 errout:
 	ext2fs_free_mem(&free_array);
-	ext2fs_free_mem(&actual_buf);
-	ext2fs_free_mem(&bitmap_buf);
+}
+
+/*
+ * Count the inodes in use, and the directories among them, in
+ * start..end, a stretch of a single group.
+ */
+static void count_used_inodes(e2fsck_t ctx, ext2_ino_t start, ext2_ino_t end,
+			      char *used_buf, char *dir_buf,
+			      ext2_ino_t *used, ext2_ino_t *dirs)
+{
+	unsigned int	num = end - start + 1, full = num / 8, i;
+
+	*used = *dirs = 0;
+	if (ext2fs_get_inode_bitmap_range2(ctx->inode_used_map, start, num,
+					   used_buf) ||
+	    ext2fs_get_inode_bitmap_range2(ctx->inode_dir_map, start, num,
+					   dir_buf)) {
+		for (i = start; i <= end; i++) {
+			if (!ext2fs_fast_test_inode_bitmap2(ctx->inode_used_map,
+							    i))
+				continue;
+			(*used)++;
+			if (ext2fs_test_inode_bitmap2(ctx->inode_dir_map, i))
+				(*dirs)++;
+		}
+		return;
+	}
+	for (i = 0; i < full; i++)
+		dir_buf[i] &= used_buf[i];
+	*used = ext2fs_bitcount(used_buf, full);
+	*dirs = ext2fs_bitcount(dir_buf, full);
+	for (i = full * 8; i < num; i++) {
+		if (!ext2fs_test_bit(i, used_buf))
+			continue;
+		(*used)++;
+		if (ext2fs_test_bit(i, dir_buf))
+			(*dirs)++;
+	}
 }
 
 static void check_inode_bitmaps(e2fsck_t ctx)
@@ -578,6 +613,15 @@ static void check_inode_bitmaps(e2fsck_t ctx)
 	int		skip_group = 0;
 	int		redo_flag = 0;
 	ext2_ino_t		first_free = fs->super->s_inodes_per_group + 1;
+	__u64		next_diff_check;
+	char		*used_buf, *dir_buf;
+
+	used_buf = (char *) e2fsck_allocate_memory(ctx,
+			fs->super->s_inodes_per_group / 8 + 1,
+			"inode used bitmap buffer");
+	dir_buf = (char *) e2fsck_allocate_memory(ctx,
+			fs->super->s_inodes_per_group / 8 + 1,
+			"directory bitmap buffer");
 
 	clear_problem_context(&pctx);
 	free_array = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
@@ -618,6 +662,7 @@ redo_counts:
 	had_problem = 0;
 	save_problem = 0;
 	pctx.ino = pctx.ino2 = 0;
+	next_diff_check = 0;
 	if (csum_flag &&
 	    (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT)))
 		skip_group++;
@@ -649,6 +694,51 @@ redo_counts:
 			}
 		}
 
+		/*
+		 * As for the block bitmap, count the inodes before the
+		 * next run where the bitmaps differ in bulk, leaving
+		 * the last one to the loop.
+		 */
+		if (i >= next_diff_check && !skip_group &&
+		    !(ctx->options & E2F_OPT_DISCARD)) {
+			__u64	last, diff_start, diff_end, n;
+			ext2_ino_t ds, de, used, dirs;
+
+			last = (__u64) (group + 1) *
+				fs->super->s_inodes_per_group;
+			if (last > fs->super->s_inodes_count)
+				last = fs->super->s_inodes_count;
+			if (redo_flag)
+				retval = ENOENT;
+			else
+				retval = ext2fs_find_first_diff_inode_bitmap2(
+					ctx->inode_used_map, fs->inode_map,
+					i, last, &ds, &de);
+			if (retval == ENOENT) {
+				diff_start = last + 1;
+				diff_end = last;
+			} else if (retval) {
+				diff_start = i;
+				diff_end = last;
+			} else {
+				diff_start = ds;
+				diff_end = de;
+			}
+			next_diff_check = diff_end + 1;
+
+			n = diff_start - i;
+			if (n > 1) {
+				count_used_inodes(ctx, i, diff_start - 2,
+						  used_buf, dir_buf,
+						  &used, &dirs);
+				inodes += n - 1;
+				group_free += n - 1 - used;
+				free_inodes += n - 1 - used;
+				dirs_count += dirs;
+				i = diff_start - 1;
+			}
+		}
+
 		actual = ext2fs_fast_test_inode_bitmap2(ctx->inode_used_map, i);
 		if (redo_flag)
 			bitmap = actual;
@@ -831,6 +921,8 @@ do_counts:
 errout:
 	ext2fs_free_mem(&free_array);
 	ext2fs_free_mem(&dir_array);
+	ext2fs_free_mem(&used_buf);
+	ext2fs_free_mem(&dir_buf);
 }
 
 static void check_inode_end(e2fsck_t ctx)
@@ -11,6 +11,9 @@
 
 #include "config.h"
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "e2fsck.h"
 
@@ -252,3 +255,532 @@ unsigned long long e2fsck_guess_readahead(ext2_filsys fs)
 
 	return 0;
 }
+
+#ifdef HAVE_PTHREAD
+/*
+ * Threaded inode table prefetch.
+ *
+ * When the user asks for more than one thread, pass 1 hands the inode
+ * tables of the groups ahead of the scan to a pool of worker threads.
+ * Each worker claims the next group, and reads the in-use part of its
+ * inode table through a private read-only io_channel, so that by the
+ * time ext2fs_get_next_inode_full() gets there the blocks are already
+ * in the page cache.  Unlike posix_fadvise() this keeps one real read
+ * in flight per worker, which is what fast devices need to reach full
+ * bandwidth.  The inode scan itself (and all problem fixing) stays
+ * serial, so the results are identical to a single-threaded run.
+ */
+struct itable_extent {
+	blk64_t		blk;
+	blk_t		num;
+};
+
+struct e2fsck_itable_prefetch {
+	e2fsck_t		ctx;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	struct itable_extent	*extents;
+	dgrp_t			next_group;	/* next group to be read */
+	dgrp_t			scan_group;	/* group pass 1 is scanning */
+	dgrp_t			window;		/* max groups ahead of scan */
+	int			stop;
+	int			num_threads;
+	pthread_t		*threads;
+};
+
+/* Blocks read per request by a prefetch worker */
+#define ITABLE_PREFETCH_CHUNK	64
+
+static void *itable_prefetch_thread(void *arg)
+{
+	struct e2fsck_itable_prefetch *pf = arg;
+	ext2_filsys fs = pf->ctx->fs;
+	io_channel io;
+	char *buf = NULL;
+	struct itable_extent *ext;
+	blk64_t blk, num;
+	dgrp_t grp;
+	int n;
+
+	if (fs->io->manager->open(fs->device_name, 0, &io))
+		return NULL;
+	if (io_channel_set_blksize(io, fs->blocksize) ||
+	    (pf->ctx->io_options &&
+	     io_channel_set_options(io, pf->ctx->io_options)) ||
+	    io_channel_alloc_buf(io, ITABLE_PREFETCH_CHUNK, &buf))
+		goto out;
+	/*
+	 * The blocks are only wanted in the page cache.  The channel has
+	 * no read_error handler, so errors are left for the real scan.
+	 */
+	io_channel_set_options(io, "cache=off");
+
+	while (1) {
+		pthread_mutex_lock(&pf->mutex);
+		while (!pf->stop && pf->next_group < fs->group_desc_count &&
+		       pf->next_group >= pf->scan_group + pf->window)
+			pthread_cond_wait(&pf->cond, &pf->mutex);
+		if (pf->stop || pf->next_group >= fs->group_desc_count) {
+			pthread_mutex_unlock(&pf->mutex);
+			break;
+		}
+		grp = pf->next_group++;
+		pthread_mutex_unlock(&pf->mutex);
+
+		ext = &pf->extents[grp];
+		for (blk = ext->blk, num = ext->num; num; blk += n, num -= n) {
+			n = num > ITABLE_PREFETCH_CHUNK ?
+				ITABLE_PREFETCH_CHUNK : num;
+			if (io_channel_read_blk64(io, blk, n, buf))
+				break;
+		}
+	}
+out:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	io_channel_close(io);
+	return NULL;
+}
+
+errcode_t e2fsck_start_itable_prefetch(e2fsck_t ctx)
+{
+	ext2_filsys fs = ctx->fs;
+	struct e2fsck_itable_prefetch *pf;
+	ext2_ino_t inodes_per_block, used;
+	errcode_t retval;
+	dgrp_t grp;
+	int i;
+
+	if (ctx->num_threads <= 1 || ctx->itable_prefetch ||
+	    !fs->device_name)
+		return 0;
+	if (fs->io->manager != unix_io_manager &&
+	    fs->io->manager != uring_io_manager)
+		return 0;
+
+	retval = ext2fs_get_memzero(sizeof(*pf), &pf);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(fs->group_desc_count,
+				  sizeof(struct itable_extent), &pf->extents);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(ctx->num_threads, sizeof(pthread_t),
+				  &pf->threads);
+	if (retval)
+		goto errout;
+
+	/*
+	 * Snapshot the inode table locations now, so the workers never
+	 * look at group descriptors that pass 1 might be changing.
+	 */
+	inodes_per_block = EXT2_INODES_PER_BLOCK(fs->super);
+	for (grp = 0; grp < fs->group_desc_count; grp++) {
+		pf->extents[grp].blk = ext2fs_inode_table_loc(fs, grp);
+		pf->extents[grp].num = 0;
+		if (ext2fs_bg_flags_test(fs, grp, EXT2_BG_INODE_UNINIT) ||
+		    !pf->extents[grp].blk)
+			continue;
+		used = fs->super->s_inodes_per_group -
+			ext2fs_bg_itable_unused(fs, grp);
+		pf->extents[grp].num = (used + inodes_per_block - 1) /
+					inodes_per_block;
+		if (pf->extents[grp].num > fs->inode_blocks_per_group)
+			pf->extents[grp].num = fs->inode_blocks_per_group;
+	}
+
+	pf->ctx = ctx;
+	pf->window = 2 * ctx->num_threads;
+	pthread_mutex_init(&pf->mutex, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	for (i = 0; i < ctx->num_threads; i++) {
+		if (pthread_create(&pf->threads[i], NULL,
+				   itable_prefetch_thread, pf))
+			break;
+	}
+	pf->num_threads = i;
+	ctx->itable_prefetch = pf;
+	return 0;
+
+errout:
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&pf->extents);
+	ext2fs_free_mem(&pf);
+	return retval;
+}
+
+void e2fsck_itable_prefetch_group(e2fsck_t ctx, dgrp_t group)
+{
+	struct e2fsck_itable_prefetch *pf = ctx->itable_prefetch;
+
+	if (!pf)
+		return;
+	pthread_mutex_lock(&pf->mutex);
+	pf->scan_group = group;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+}
+
+void e2fsck_stop_itable_prefetch(e2fsck_t ctx)
+{
+	struct e2fsck_itable_prefetch *pf = ctx->itable_prefetch;
+	int i;
+
+	if (!pf)
+		return;
+	pthread_mutex_lock(&pf->mutex);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+	for (i = 0; i < pf->num_threads; i++)
+		pthread_join(pf->threads[i], NULL);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->mutex);
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&pf->extents);
+	ext2fs_free_mem(&ctx->itable_prefetch);
+}
+
+/*
+ * Threaded directory block prefetch for pass 2.
+ *
+ * Pass 2 walks the sorted dblist and checks one directory block at a
+ * time.  Everything check_dir_block() does to the entries (link counts,
+ * dir_info, dx_dir_info, problem fixes) has to stay in dblist order for
+ * the results to match a serial run, so only the reads are handed out.
+ * A pool of workers fills a ring of buffers with the blocks just ahead
+ * of the one being checked, each through a private read-only io_channel,
+ * and e2fsck_dblist_prefetch_read() hands them to check_dir_block() in
+ * place of ext2fs_read_dir_block4().  The checksum is still verified by
+ * the caller, since that needs the directory inode.
+ *
+ * Blocks which pass 2 has rewritten, and so may only be current in the
+ * io_channel cache, are recorded by e2fsck_dblist_prefetch_invalidate()
+ * and always read the usual way afterwards.  So is anything that isn't
+ * in the ring, so read errors are reported just as they would be
+ * without threads.
+ */
+enum dblist_slot_state {
+	DB_SLOT_EMPTY,
+	DB_SLOT_READING,
+	DB_SLOT_READY,
+};
+
+struct dblist_slot {
+	unsigned long long	idx;
+	blk64_t			blk;
+	enum dblist_slot_state	state;
+	errcode_t		err;
+	char			*buf;
+};
+
+struct e2fsck_dblist_prefetch {
+	e2fsck_t		ctx;
+	ext2_dblist		dblist;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	unsigned long long	count;
+	unsigned long long	next;	/* next entry to be read */
+	unsigned long long	filled;	/* entries published in want[] */
+	int			nslots;
+	struct dblist_slot	*slots;
+	blk64_t			*want;	/* block of each entry in the ring */
+	ext2fs_block_bitmap	written; /* blocks rewritten by pass 2 */
+	int			stop;
+	int			num_threads;
+	pthread_t		*threads;
+};
+
+static int copy_db_entry(ext2_filsys fs EXT2FS_ATTR((unused)),
+			 struct ext2_db_entry2 *db, void *priv_data)
+{
+	*(struct ext2_db_entry2 *) priv_data = *db;
+	return DBLIST_ABORT;
+}
+
+static void *dblist_prefetch_thread(void *arg)
+{
+	struct e2fsck_dblist_prefetch *pf = arg;
+	ext2_filsys fs = pf->ctx->fs;
+	struct dblist_slot *slot;
+	io_channel io;
+	errcode_t err;
+	blk64_t blk;
+
+	if (fs->io->manager->open(fs->device_name, 0, &io))
+		return NULL;
+	if (io_channel_set_blksize(io, fs->blocksize) ||
+	    (pf->ctx->io_options &&
+	     io_channel_set_options(io, pf->ctx->io_options)))
+		goto out;
+	io_channel_set_options(io, "cache=off");
+
+	pthread_mutex_lock(&pf->mutex);
+	while (1) {
+		slot = &pf->slots[pf->next % pf->nslots];
+		if (pf->stop || pf->next >= pf->count)
+			break;
+		if (pf->next >= pf->filled ||
+		    slot->state == DB_SLOT_READING) {
+			pthread_cond_wait(&pf->cond, &pf->mutex);
+			continue;
+		}
+		blk = pf->want[pf->next % pf->nslots];
+		slot->idx = pf->next++;
+		slot->blk = blk;
+		if (!blk) {
+			slot->state = DB_SLOT_EMPTY;
+			continue;
+		}
+		slot->state = DB_SLOT_READING;
+		pthread_mutex_unlock(&pf->mutex);
+
+		err = io_channel_read_blk64(io, blk, 1, slot->buf);
+
+		pthread_mutex_lock(&pf->mutex);
+		slot->err = err;
+		slot->state = DB_SLOT_READY;
+		pthread_cond_broadcast(&pf->cond);
+	}
+	pthread_mutex_unlock(&pf->mutex);
+out:
+	io_channel_close(io);
+	return NULL;
+}
+
+errcode_t e2fsck_start_dblist_prefetch(e2fsck_t ctx, ext2_dblist dblist)
+{
+	ext2_filsys fs = ctx->fs;
+	struct e2fsck_dblist_prefetch *pf;
+	errcode_t retval;
+	int i;
+
+	if (ctx->num_threads <= 1 || ctx->dblist_prefetch ||
+	    !fs->device_name || !ext2fs_dblist_count2(dblist))
+		return 0;
+	if (fs->io->manager != unix_io_manager &&
+	    fs->io->manager != uring_io_manager)
+		return 0;
+
+	/*
+	 * The workers read from disk, so directory blocks which earlier
+	 * passes left dirty in the unix_io cache (pass 1b clones them,
+	 * for instance) must be written out first, or they would be
+	 * handed stale copies.  The uring manager writes through, so it
+	 * needs nothing.  A block written here and dirtied again later
+	 * goes out twice, which s_kbytes_written then reports, as it
+	 * counts what was actually written.
+	 */
+	if (fs->io->manager == unix_io_manager) {
+		retval = io_channel_flush(fs->io);
+		if (retval)
+			return retval;
+	}
+
+	retval = ext2fs_get_memzero(sizeof(*pf), &pf);
+	if (retval)
+		return retval;
+	pf->nslots = 16 * ctx->num_threads;
+	retval = ext2fs_get_arrayzero(pf->nslots, sizeof(struct dblist_slot),
+				      &pf->slots);
+	if (retval)
+		goto errout;
+	for (i = 0; i < pf->nslots; i++) {
+		retval = io_channel_alloc_buf(fs->io, 1, &pf->slots[i].buf);
+		if (retval)
+			goto errout;
+	}
+	retval = ext2fs_get_array(pf->nslots, sizeof(blk64_t), &pf->want);
+	if (retval)
+		goto errout;
+	retval = e2fsck_allocate_block_bitmap(fs,
+					      _("rewritten directory block map"),
+					      EXT2FS_BMAP64_RBTREE,
+					      "dblist_prefetch_written",
+					      &pf->written);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(ctx->num_threads, sizeof(pthread_t),
+				  &pf->threads);
+	if (retval)
+		goto errout;
+
+	pf->ctx = ctx;
+	pf->dblist = dblist;
+	pf->count = ext2fs_dblist_count2(dblist);
+	pthread_mutex_init(&pf->mutex, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	for (i = 0; i < ctx->num_threads; i++) {
+		if (pthread_create(&pf->threads[i], NULL,
+				   dblist_prefetch_thread, pf))
+			break;
+	}
+	pf->num_threads = i;
+	ctx->dblist_prefetch = pf;
+	return 0;
+
+errout:
+	if (pf->slots)
+		for (i = 0; i < pf->nslots; i++)
+			if (pf->slots[i].buf)
+				ext2fs_free_mem(&pf->slots[i].buf);
+	if (pf->written)
+		ext2fs_free_block_bitmap(pf->written);
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&pf->want);
+	ext2fs_free_mem(&pf->slots);
+	ext2fs_free_mem(&pf);
+	return retval;
+}
+
+/*
+ * Pass 2 is about to check dblist entry idx.  Publish the blocks of the
+ * entries which now fit in the ring; only this thread looks at the
+ * dblist itself, since pass 2 may change entries as it goes.
+ */
+void e2fsck_dblist_prefetch_advance(e2fsck_t ctx, unsigned long long idx)
+{
+	struct e2fsck_dblist_prefetch *pf = ctx->dblist_prefetch;
+	struct ext2_db_entry2 db;
+
+	if (!pf)
+		return;
+	pthread_mutex_lock(&pf->mutex);
+	/* If the workers have fallen behind, don't let them catch up */
+	if (pf->next <= idx)
+		pf->next = idx + 1;
+	if (pf->filled < pf->next)
+		pf->filled = pf->next;
+	while (pf->filled < pf->count && pf->filled < idx + pf->nslots) {
+		db.blk = 0;
+		ext2fs_dblist_iterate3(pf->dblist, copy_db_entry, pf->filled,
+				       1, &db);
+		pf->want[pf->filled++ % pf->nslots] = db.blk;
+	}
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+}
+
+/*
+ * Read directory block blk, which is dblist entry idx of directory ino,
+ * with the same results as ext2fs_read_dir_block4().
+ */
+errcode_t e2fsck_dblist_prefetch_read(e2fsck_t ctx, unsigned long long idx,
+				      blk64_t blk, void *buf, ext2_ino_t ino)
+{
+	struct e2fsck_dblist_prefetch *pf = ctx->dblist_prefetch;
+	ext2_filsys fs = ctx->fs;
+	struct dblist_slot *slot;
+	errcode_t retval = 0;
+	int hit = 0;
+
+	if (!pf)
+		return ext2fs_read_dir_block4(fs, blk, buf, 0, ino);
+
+	pthread_mutex_lock(&pf->mutex);
+	slot = &pf->slots[idx % pf->nslots];
+	while (slot->idx == idx && slot->state == DB_SLOT_READING)
+		pthread_cond_wait(&pf->cond, &pf->mutex);
+	if (slot->idx == idx && slot->state == DB_SLOT_READY &&
+	    slot->blk == blk && !slot->err &&
+	    !ext2fs_fast_test_block_bitmap2(pf->written, blk)) {
+		memcpy(buf, slot->buf, fs->blocksize);
+		hit = 1;
+	}
+	if (slot->idx == idx)
+		slot->state = DB_SLOT_EMPTY;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+
+	if (!hit)
+		return ext2fs_read_dir_block4(fs, blk, buf, 0, ino);
+
+	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+	    !ext2fs_dir_block_csum_verify(fs, ino,
+					  (struct ext2_dir_entry *) buf))
+		retval = EXT2_ET_DIR_CSUM_INVALID;
+#ifdef WORDS_BIGENDIAN
+	{
+		errcode_t err = ext2fs_dirent_swab_in(fs, buf, 0);
+
+		if (err)
+			retval = err;
+	}
+#endif
+	return retval;
+}
+
+/* Pass 2 has written blk; never hand out a copy read from disk again */
+void e2fsck_dblist_prefetch_invalidate(e2fsck_t ctx, blk64_t blk)
+{
+	struct e2fsck_dblist_prefetch *pf = ctx->dblist_prefetch;
+
+	if (pf)
+		ext2fs_mark_block_bitmap2(pf->written, blk);
+}
+
+void e2fsck_stop_dblist_prefetch(e2fsck_t ctx)
+{
+	struct e2fsck_dblist_prefetch *pf = ctx->dblist_prefetch;
+	int i;
+
+	if (!pf)
+		return;
+	pthread_mutex_lock(&pf->mutex);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+	for (i = 0; i < pf->num_threads; i++)
+		pthread_join(pf->threads[i], NULL);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->mutex);
+	for (i = 0; i < pf->nslots; i++)
+		ext2fs_free_mem(&pf->slots[i].buf);
+	ext2fs_free_block_bitmap(pf->written);
+	ext2fs_free_mem(&pf->slots);
+	ext2fs_free_mem(&pf->want);
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&ctx->dblist_prefetch);
+}
+#else
+errcode_t e2fsck_start_itable_prefetch(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+void e2fsck_itable_prefetch_group(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				  dgrp_t group EXT2FS_ATTR((unused)))
+{
+}
+
+void e2fsck_stop_itable_prefetch(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+
+errcode_t e2fsck_start_dblist_prefetch(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				       ext2_dblist dblist EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+void e2fsck_dblist_prefetch_advance(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				    unsigned long long idx EXT2FS_ATTR((unused)))
+{
+}
+
+errcode_t e2fsck_dblist_prefetch_read(e2fsck_t ctx,
+				      unsigned long long idx EXT2FS_ATTR((unused)),
+				      blk64_t blk, void *buf, ext2_ino_t ino)
+{
+	return ext2fs_read_dir_block4(ctx->fs, blk, buf, 0, ino);
+}
+
+void e2fsck_dblist_prefetch_invalidate(e2fsck_t ctx EXT2FS_ATTR((unused)),
+				       blk64_t blk EXT2FS_ATTR((unused)))
+{
+}
+
+void e2fsck_stop_dblist_prefetch(e2fsck_t ctx EXT2FS_ATTR((unused)))
+{
+}
+#endif /* HAVE_PTHREAD */
@@ -54,6 +54,7 @@ extern int optind;
 #include "support/plausible.h"
 #include "support/devname.h"
 #include "e2fsck.h"
+#include "ext2fs/cimage.h"
 #include "problem.h"
 #include "jfs_user.h"
 #include "../version.h"
@@ -673,6 +674,7 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 	int	ea_ver;
 	int	extended_usage = 0;
 	unsigned long long reada_kb;
+	unsigned long num_threads;
 
 	buf = string_copy(ctx, opts, 0);
 	for (token = buf; token && *token; token = next) {
@@ -714,6 +716,31 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 				continue;
 			}
 			ctx->readahead_kb = reada_kb;
+		} else if (strcmp(token, "threads") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			num_threads = strtoul(arg, &p, 0);
+			if (*p || num_threads < 1 || num_threads > 1024) {
+				fprintf(stderr, "%s",
+					_("Invalid number of threads.\n"));
+				extended_usage++;
+				continue;
+			}
+			ctx->num_threads = num_threads;
+		} else if (strcmp(token, "memory_limit") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->memory_limit = parse_num_blocks2(arg, -1);
+			if (!ctx->memory_limit) {
+				fprintf(stderr, "%s",
+					_("Invalid memory limit.\n"));
+				extended_usage++;
+				continue;
+			}
 		} else if (strcmp(token, "fragcheck") == 0) {
 			ctx->options |= E2F_OPT_FRAGCHECK;
 			continue;
@@ -741,6 +768,12 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		} else if (strcmp(token, "no_inode_count_fullmap") == 0) {
 			ctx->options &= ~E2F_OPT_ICOUNT_FULLMAP;
 			continue;
+		} else if (strcmp(token, "inode_count_groupmap") == 0) {
+			ctx->options &= ~E2F_OPT_ICOUNT_NO_GROUPMAP;
+			continue;
+		} else if (strcmp(token, "no_inode_count_groupmap") == 0) {
+			ctx->options |= E2F_OPT_ICOUNT_NO_GROUPMAP;
+			continue;
 		} else if (strcmp(token, "log_filename") == 0) {
 			if (!arg)
 				extended_usage++;
@@ -793,7 +826,11 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs("\tno_optimize_extents\n", stderr);
 		fputs("\tinode_count_fullmap\n", stderr);
 		fputs("\tno_inode_count_fullmap\n", stderr);
+		fputs("\tinode_count_groupmap\n", stderr);
+		fputs("\tno_inode_count_groupmap\n", stderr);
 		fputs(_("\treadahead_kb=<buffer size>\n"), stderr);
+		fputs(_("\tthreads=<number of prefetch threads>\n"), stderr);
+		fputs(_("\tmemory_limit=<size>\n"), stderr);
 		fputs("\tbmap2extent\n", stderr);
 		fputs("\tunshare_blocks\n", stderr);
 		fputs("\tfixes_only\n", stderr);
@@ -1076,6 +1113,19 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 	if (c)
 		ctx->options |= E2F_OPT_ICOUNT_FULLMAP;
 
+	profile_get_boolean(ctx->profile, "options", "inode_count_groupmap",
+			    0, 1, &c);
+	if (!c)
+		ctx->options |= E2F_OPT_ICOUNT_NO_GROUPMAP;
+
+	profile_get_string(ctx->profile, "options", "bitmap_type", 0, 0, &cp);
+	if (cp) {
+		if (ext2fs_parse_bitmap_type(cp, &ctx->bitmap_type))
+			log_err(ctx, _("Invalid bitmap_type '%s' in "
+				       "e2fsck.conf; ignoring\n"), cp);
+		free(cp);
+	}
+
 	if (ctx->readahead_kb == ~0ULL) {
 		profile_get_integer(ctx->profile, "options",
 				    "readahead_mem_pct", 0, -1, &c);
@@ -1502,10 +1552,14 @@ restart:
 #ifdef CONFIG_TESTIO_DEBUG
 	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
 		io_ptr = test_io_manager;
-		test_io_backing_manager = unix_io_manager;
+		test_io_backing_manager =
+			io_channel_select_manager(unix_io_manager);
 	} else
 #endif
-		io_ptr = unix_io_manager;
+	if (ext2fs_cimage_probe(ctx->filesystem_name))
+		io_ptr = cimage_io_manager;
+	else
+		io_ptr = io_channel_select_manager(unix_io_manager);
 	flags |= EXT2_FLAG_NOFREE_ON_ERROR;
 	profile_get_boolean(ctx->profile, "options", "old_bitmaps", 0, 0,
 			    &old_bitmaps);
@@ -1671,6 +1725,13 @@ failure:
 	 */
 	fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
 
+	/*
+	 * A compressed image file is much smaller than the file system
+	 * it holds, so its size says nothing about the device's size.
+	 */
+	if (fs->io->manager == cimage_io_manager)
+		ctx->flags |= E2F_FLAG_GOT_DEVSIZE;
+
 	if (!(ctx->flags & E2F_FLAG_GOT_DEVSIZE)) {
 		__u32 blocksize = EXT2_BLOCK_SIZE(fs->super);
 		int need_restart = 0;
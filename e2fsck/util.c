@@ -319,7 +319,25 @@ void e2fsck_read_bitmaps(e2fsck_t ctx)
 			       &save_type);
 	flags = ctx->fs->flags;
 	ctx->fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
-	retval = ext2fs_read_bitmaps(fs);
+	if (ctx->num_threads) {
+		int bmap_flags = 0, nthreads = -1;
+
+		if (!fs->inode_map)
+			bmap_flags |= EXT2FS_BITMAPS_INODE;
+		if (!fs->block_map)
+			bmap_flags |= EXT2FS_BITMAPS_BLOCK;
+		/*
+		 * ext2fs_read_bitmaps() already uses a thread per CPU;
+		 * threads= may only raise that, for slow devices.
+		 */
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
+		if (ctx->num_threads > sysconf(_SC_NPROCESSORS_CONF))
+			nthreads = ctx->num_threads;
+#endif
+		retval = bmap_flags ? ext2fs_rw_bitmaps(fs, bmap_flags,
+							nthreads) : 0;
+	} else
+		retval = ext2fs_read_bitmaps(fs);
 	ctx->fs->flags = (flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) |
 			 (ctx->fs->flags & ~EXT2_FLAG_IGNORE_CSUM_ERRORS);
 	fs->default_bitmap_type = save_type;
@@ -828,6 +846,8 @@ void e2fsck_set_bitmap_type(ext2_filsys fs, unsigned int default_type,
 
 	if (old_type)
 		*old_type = fs->default_bitmap_type;
+	if (ctx->bitmap_type)
+		default_type = ctx->bitmap_type;
 	profile_get_uint(ctx->profile, "bitmaps", profile_name, 0,
 			 default_type, &type);
 	profile_get_uint(ctx->profile, "bitmaps", "all", 0, type, &type);
@@ -24,7 +24,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -134,6 +134,10 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 			i = EXT2_FIRST_INODE(fs->super);
 	} while (i != start_inode);
 
+	/* Don't trust a lazily loaded bitmap which is missing a group */
+	retval = ext2fs_paged_bmap_error(map);
+	if (retval)
+		return retval;
 	if (ext2fs_test_inode_bitmap2(map, i))
 		return EXT2_ET_INODE_ALLOC_FAIL;
 	*ret = i;
@@ -190,6 +194,8 @@ errcode_t ext2fs_new_block3(ext2_filsys fs, blk64_t goal,
 	if ((retval == ENOENT) && (goal != fs->super->s_first_data_block))
 		retval = ext2fs_find_first_zero_block_bitmap2(map,
 			fs->super->s_first_data_block, goal - 1, &b);
+	if (ext2fs_paged_bmap_error(map))
+		return ext2fs_paged_bmap_error(map);
 allocated:
 	if (retval == ENOENT)
 		return EXT2_ET_BLOCK_ALLOC_FAIL;
@@ -308,11 +314,15 @@ errcode_t ext2fs_get_free_blocks2(ext2_filsys fs, blk64_t start, blk64_t finish,
 			b = fs->super->s_first_data_block;
 		}
 		if (ext2fs_fast_test_block_bitmap_range2(map, b, num)) {
+			if (ext2fs_paged_bmap_error(map))
+				return ext2fs_paged_bmap_error(map);
 			*ret = b;
 			return 0;
 		}
 		b += c_ratio;
 	} while (b != finish);
+	if (ext2fs_paged_bmap_error(map))
+		return ext2fs_paged_bmap_error(map);
 	return EXT2_ET_BLOCK_ALLOC_FAIL;
 }
 
@@ -475,6 +485,9 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 
 		if (!(flags & EXT2_NEWRANGE_MIN_LENGTH) ||
 		    (end - start) >= len) {
+			retval = ext2fs_paged_bmap_error(map);
+			if (retval)
+				goto errout;
 			/* Success! */
 			*pblk = start;
 			*plen = end - start;
@@ -502,7 +515,9 @@ allocated:
 	}
 
 fail:
-	retval = EXT2_ET_BLOCK_ALLOC_FAIL;
+	retval = ext2fs_paged_bmap_error(map);
+	if (!retval)
+		retval = EXT2_ET_BLOCK_ALLOC_FAIL;
 errout:
 	return retval;
 }
@@ -12,12 +12,22 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <string.h>
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
 
+#if defined(__GNUC__) && defined(__x86_64__) && \
+	(defined(__clang__) || __GNUC__ >= 5)
+#define EXT2FS_BITOPS_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define EXT2FS_BITOPS_NEON
+#include <arm_neon.h>
+#endif
+
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * C language bitmap functions written by Theodore Ts'o, 9/26/92.
@@ -113,36 +123,298 @@ static unsigned int popcount8(unsigned int w)
 	return (res + (res >> 4)) & 0x0F;
 }
 
-static unsigned int popcount32(unsigned int w)
+unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes)
 {
-	unsigned int res = w - ((w >> 1) & 0x55555555);
-	res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
-	res = (res + (res >> 4)) & 0x0F0F0F0F;
-	res = res + (res >> 8);
-	return (res + (res >> 16)) & 0x000000FF;
+	return (unsigned int) ext2fs_count_bits(addr, nbytes);
 }
 
-unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes)
+/*
+ * Bulk byte scanning and population counts.  Walking large bitarrays
+ * spends nearly all of its time in these two loops, so use vector
+ * instructions where the CPU has them.  The implementation is chosen
+ * at run time on first use, so that a single binary still runs on
+ * older processors.
+ */
+typedef size_t (*skip_bytes_fn)(const unsigned char *cp, size_t nbytes,
+				unsigned char c);
+typedef __u64 (*count_bits_fn)(const unsigned char *cp, size_t nbytes);
+
+static skip_bytes_fn skip_bytes_impl;
+static count_bits_fn count_bits_impl;
+
+static inline __u64 popcount64(__u64 w)
 {
-	const unsigned char *cp = addr;
-	const __u32 *p;
-	unsigned int res = 0;
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+}
 
-	while (((((uintptr_t) cp) & 3) != 0) && (nbytes > 0)) {
-		res += popcount8(*cp++);
-		nbytes--;
-	}
-	p = (const __u32 *) cp;
+static size_t skip_bytes_generic(const unsigned char *cp, size_t nbytes,
+				 unsigned char c)
+{
+	__u64 pattern = 0x0101010101010101ULL * c, w;
+	size_t i = 0;
 
-	while (nbytes > 4) {
-		res += popcount32(*p++);
-		nbytes -= 4;
+	for (; i + 8 <= nbytes; i += 8) {
+		memcpy(&w, cp + i, 8);
+		if (w != pattern)
+			break;
 	}
-	cp = (const unsigned char *) p;
+	for (; i < nbytes; i++)
+		if (cp[i] != c)
+			return i;
+	return nbytes;
+}
 
-	while (nbytes > 0) {
-		res += popcount8(*cp++);
-		nbytes--;
+static __u64 count_bits_generic(const unsigned char *cp, size_t nbytes)
+{
+	__u64 w, res = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= nbytes; i += 8) {
+		memcpy(&w, cp + i, 8);
+		res += popcount64(w);
 	}
+	for (; i < nbytes; i++)
+		res += popcount8(cp[i]);
 	return res;
 }
+
+#ifdef EXT2FS_BITOPS_X86
+/* SSE2 is part of the x86_64 baseline, so it needs no check. */
+static size_t skip_bytes_sse2(const unsigned char *cp, size_t nbytes,
+			      unsigned char c)
+{
+	__m128i v = _mm_set1_epi8((char) c);
+	size_t i = 0;
+	unsigned int m;
+
+	for (; i + 16 <= nbytes; i += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (cp + i)), v));
+		if (m != 0xFFFF)
+			return i + __builtin_ctz(~m);
+	}
+	return i + skip_bytes_generic(cp + i, nbytes - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t skip_bytes_avx2(const unsigned char *cp, size_t nbytes,
+			      unsigned char c)
+{
+	__m256i v = _mm256_set1_epi8((char) c);
+	__m256i a, b;
+	size_t i = 0;
+	unsigned int m;
+
+	for (; i + 64 <= nbytes; i += 64) {
+		a = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *) (cp + i)), v);
+		b = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *) (cp + i + 32)), v);
+		if ((unsigned int) _mm256_movemask_epi8(
+			    _mm256_and_si256(a, b)) == 0xFFFFFFFFU)
+			continue;
+		m = _mm256_movemask_epi8(a);
+		if (m != 0xFFFFFFFFU)
+			return i + __builtin_ctz(~m);
+		m = _mm256_movemask_epi8(b);
+		return i + 32 + __builtin_ctz(~m);
+	}
+	return i + skip_bytes_sse2(cp + i, nbytes - i, c);
+}
+
+__attribute__((target("popcnt")))
+static __u64 count_bits_popcnt(const unsigned char *cp, size_t nbytes)
+{
+	unsigned long long w0, w1, w2, w3;
+	__u64 r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= nbytes; i += 32) {
+		memcpy(&w0, cp + i, 8);
+		memcpy(&w1, cp + i + 8, 8);
+		memcpy(&w2, cp + i + 16, 8);
+		memcpy(&w3, cp + i + 24, 8);
+		r0 += __builtin_popcountll(w0);
+		r1 += __builtin_popcountll(w1);
+		r2 += __builtin_popcountll(w2);
+		r3 += __builtin_popcountll(w3);
+	}
+	for (; i + 8 <= nbytes; i += 8) {
+		memcpy(&w0, cp + i, 8);
+		r0 += __builtin_popcountll(w0);
+	}
+	for (; i < nbytes; i++)
+		r0 += __builtin_popcount(cp[i]);
+	return r0 + r1 + r2 + r3;
+}
+
+/*
+ * Nibble lookup through vpshufb, summed with vpsadbw; the per-byte
+ * counts can't overflow since each iteration adds at most 8 to a byte.
+ */
+__attribute__((target("avx2,popcnt")))
+static __u64 count_bits_avx2(const unsigned char *cp, size_t nbytes)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+						1, 2, 2, 3, 2, 3, 3, 4,
+						0, 1, 1, 2, 1, 2, 2, 3,
+						1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	__m256i acc = _mm256_setzero_si256(), v, cnt;
+	__u64 res;
+	size_t i = 0;
+
+	for (; i + 32 <= nbytes; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (cp + i));
+		cnt = _mm256_add_epi8(
+			_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+			_mm256_shuffle_epi8(lookup, _mm256_and_si256(
+				_mm256_srli_epi16(v, 4), low)));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt,
+						_mm256_setzero_si256()));
+	}
+	res = (__u64) _mm256_extract_epi64(acc, 0) +
+		(__u64) _mm256_extract_epi64(acc, 1) +
+		(__u64) _mm256_extract_epi64(acc, 2) +
+		(__u64) _mm256_extract_epi64(acc, 3);
+	return res + count_bits_popcnt(cp + i, nbytes - i);
+}
+#endif /* EXT2FS_BITOPS_X86 */
+
+#ifdef EXT2FS_BITOPS_NEON
+static size_t skip_bytes_neon(const unsigned char *cp, size_t nbytes,
+			      unsigned char c)
+{
+	uint8x16_t v = vdupq_n_u8(c);
+	size_t i = 0;
+
+	for (; i + 16 <= nbytes; i += 16)
+		if (vminvq_u8(vceqq_u8(vld1q_u8(cp + i), v)) != 0xFF)
+			break;
+	return i + skip_bytes_generic(cp + i, nbytes - i, c);
+}
+
+static __u64 count_bits_neon(const unsigned char *cp, size_t nbytes)
+{
+	uint16x8_t acc;
+	__u64 res = 0;
+	size_t i = 0, n;
+
+	while (i + 16 <= nbytes) {
+		/*
+		 * Each lane gains at most 16 per pass, so 4095 passes
+		 * (65520) is the most a u16 lane can take before it wraps.
+		 */
+		acc = vdupq_n_u16(0);
+		for (n = 0; n < 4095 && i + 16 <= nbytes; n++, i += 16)
+			acc = vpadalq_u8(acc, vcntq_u8(vld1q_u8(cp + i)));
+		res += vaddlvq_u16(acc);
+	}
+	return res + count_bits_generic(cp + i, nbytes - i);
+}
+#endif /* EXT2FS_BITOPS_NEON */
+
+static void select_bitops_impl(void)
+{
+	skip_bytes_fn skip = skip_bytes_generic;
+	count_bits_fn count = count_bits_generic;
+
+#if defined(EXT2FS_BITOPS_X86)
+	__builtin_cpu_init();
+	skip = skip_bytes_sse2;
+	if (__builtin_cpu_supports("popcnt"))
+		count = count_bits_popcnt;
+	if (__builtin_cpu_supports("avx2")) {
+		skip = skip_bytes_avx2;
+		if (__builtin_cpu_supports("popcnt"))
+			count = count_bits_avx2;
+	}
+#elif defined(EXT2FS_BITOPS_NEON)
+	skip = skip_bytes_neon;
+	count = count_bits_neon;
+#endif
+	count_bits_impl = count;
+	skip_bytes_impl = skip;
+}
+
+/*
+ * Return the offset of the first byte in addr[0..nbytes) which is not
+ * equal to c, or nbytes if they all are.
+ */
+size_t ext2fs_skip_bytes(const void *addr, size_t nbytes, int c)
+{
+	if (!skip_bytes_impl)
+		select_bitops_impl();
+	return skip_bytes_impl(addr, nbytes, (unsigned char) c);
+}
+
+/* Return the number of bits set in addr[0..nbytes). */
+__u64 ext2fs_count_bits(const void *addr, size_t nbytes)
+{
+	if (!count_bits_impl)
+		select_bitops_impl();
+	return count_bits_impl(addr, nbytes);
+}
+
+/*
+ * Find the first bit equal to "set" between start and end, inclusive,
+ * where both are bit offsets into addr.  Only the partial bytes at
+ * either end are handled here; the bytes in between are passed to
+ * ext2fs_skip_bytes().  Returns ENOENT if there is no such bit.
+ */
+errcode_t ext2fs_find_bit(const void *addr, __u64 start, __u64 end,
+			  int set, __u64 *out)
+{
+	const unsigned char *ADDR = (const unsigned char *) addr;
+	unsigned char skip = set ? 0 : 0xFF;
+	__u64 first = start >> 3, last = end >> 3, pos;
+	unsigned int c;
+
+	c = (ADDR[first] ^ skip) & (0xFF << (start & 7));
+	if (first == last)
+		c &= 0xFF >> (7 - (end & 7));
+	if (c) {
+		pos = first;
+		goto found;
+	}
+	if (first == last)
+		return ENOENT;
+
+	pos = first + 1;
+	pos += ext2fs_skip_bytes(ADDR + pos, last - pos, skip);
+	if (pos < last) {
+		c = ADDR[pos] ^ skip;
+		goto found;
+	}
+	c = (ADDR[last] ^ skip) & (0xFF >> (7 - (end & 7)));
+	if (!c)
+		return ENOENT;
+found:
+	*out = pos << 3;
+	while (!(c & 1)) {
+		c >>= 1;
+		(*out)++;
+	}
+	return 0;
+}
+
+/* Return the number of bits set between start and end, inclusive. */
+__u64 ext2fs_count_bit_range(const void *addr, __u64 start, __u64 end)
+{
+	const unsigned char *ADDR = (const unsigned char *) addr;
+	__u64 first = start >> 3, last = end >> 3, ret;
+	unsigned char c;
+
+	c = ADDR[first] & (0xFF << (start & 7));
+	if (first == last) {
+		c &= 0xFF >> (7 - (end & 7));
+		return ext2fs_count_bits(&c, 1);
+	}
+	ret = ext2fs_count_bits(&c, 1);
+	ret += ext2fs_count_bits(ADDR + first + 1, last - first - 1);
+	c = ADDR[last] & (0xFF >> (7 - (end & 7)));
+	return ret + ext2fs_count_bits(&c, 1);
+}
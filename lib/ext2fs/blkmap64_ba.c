@@ -212,73 +212,13 @@ static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
 				     __u64 start, unsigned int len)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	__u64 start_byte, len_byte = len >> 3;
-	unsigned int start_bit, len_bit = len % 8;
-	unsigned int first_bit = 0;
-	unsigned int last_bit  = 0;
-	int mark_count = 0;
-	int mark_bit = 0;
-	int i;
-	const char *ADDR;
-
-	ADDR = bp->bitarray;
-	start -= bitmap->start;
-	start_byte = start >> 3;
-	start_bit = start % 8;
-
-	if (start_bit != 0) {
-		/*
-		 * The compared start block number or start inode number
-		 * is not the first bit in a byte.
-		 */
-		mark_count = 8 - start_bit;
-		if (len < 8 - start_bit) {
-			mark_count = (int)len;
-			mark_bit = len + start_bit - 1;
-		} else
-			mark_bit = 7;
-
-		for (i = mark_count; i > 0; i--, mark_bit--)
-			first_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the first byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (first_bit & ADDR[start_byte])
-			return 0;
-		else if (len <= 8 - start_bit)
-			return 1;
-
-		start_byte++;
-		len_bit = (len - mark_count) % 8;
-		len_byte = (len - mark_count) >> 3;
-	}
+	__u64 pos;
 
-	/*
-	 * The compared start block number or start inode number is
-	 * the first bit in a byte.
-	 */
-	if (len_bit != 0) {
-		/*
-		 * The compared end block number or end inode number is
-		 * not the last bit in a byte.
-		 */
-		for (mark_bit = len_bit - 1; mark_bit >= 0; mark_bit--)
-			last_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the last byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (last_bit & ADDR[start_byte + len_byte])
-			return 0;
-		else if (len_byte == 0)
-			return 1;
-	}
-
-	/* Check whether all bytes are 0 */
-	return ext2fs_mem_is_zero(ADDR + start_byte, len_byte);
+	if (len == 0)
+		return 1;
+	start -= bitmap->start;
+	return ext2fs_find_bit(bp->bitarray, start, start + len - 1, 1,
+			       &pos) == ENOENT;
 }
 
 
@@ -328,73 +268,13 @@ static errcode_t ba_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
-
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
-	}
-
-	if (!count)
-		return ENOENT;
-
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0xff) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
-
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != ((__u64)-1))
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0xff) {
-				byte_found = 1;
-				break;
-			}
-			pos++;
-			i--;
-		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
-
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-	}
+	errcode_t retval;
 
-	return ENOENT;
+	retval = ext2fs_find_bit(bp->bitarray, start - bitmap->start,
+				 end - bitmap->start, 0, out);
+	if (!retval)
+		*out += bitmap->start;
+	return retval;
 }
 
 /* Find the first one bit between start and end, inclusive. */
@@ -402,73 +282,24 @@ static errcode_t ba_find_first_set(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
-
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
-	}
-
-	if (!count)
-		return ENOENT;
-
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
+	errcode_t retval;
 
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != 0)
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0) {
-				byte_found = 1;
-				break;
-			}
-			pos++;
-			i--;
-		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
+	retval = ext2fs_find_bit(bp->bitarray, start - bitmap->start,
+				 end - bitmap->start, 1, out);
+	if (!retval)
+		*out += bitmap->start;
+	return retval;
+}
 
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-	}
+/* Count the bits set between start and end, inclusive. */
+static errcode_t ba_count_set(ext2fs_generic_bitmap_64 bitmap,
+			      __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
 
-	return ENOENT;
+	*out = ext2fs_count_bit_range(bp->bitarray, start - bitmap->start,
+				      end - bitmap->start);
+	return 0;
 }
 
 struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
@@ -488,5 +319,6 @@ struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.clear_bmap = ba_clear_bmap,
 	.print_stats = ba_print_stats,
 	.find_first_zero = ba_find_first_zero,
-	.find_first_set = ba_find_first_set
+	.find_first_set = ba_find_first_set,
+	.count_set = ba_count_set,
 };
@@ -0,0 +1,617 @@
+/*
+ * blkmap64_paged.c --- bitarray split into pages which are allocated,
+ *	and optionally loaded, on first use
+ *
+ * The bits are kept in fixed-size pages, one per block group for block
+ * and inode bitmaps.  A page which was never touched takes no memory
+ * and reads as all zeroes.  If a page loader has been set with
+ * ext2fs_paged_bmap_set_loader(), a missing page is instead filled in
+ * by the loader the first time any of its bits is looked at; this is
+ * how the bitmaps of a file system opened with EXT2_FLAG_LAZY_LOAD are
+ * read from disk one group at a time.
+ *
+ * A page which fails to load, or can't be allocated for loading, reads
+ * as entirely in use, so that nothing in its group is handed out as
+ * free; ext2fs_paged_bmap_error() returns the error, and the allocators
+ * and write_bitmaps() refuse to go on once it is set.
+ *
+ * Pages are loaded without any locking, so a bitmap with a loader must
+ * not be used by several threads at once.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+/* Page size for bitmaps which don't belong to block groups */
+#define PG_DEFAULT_BITS		32768
+
+struct ext2fs_pg_private_struct {
+	__u64			page_bits;	/* a multiple of 8 */
+	__u64			nr_pages;
+	unsigned char		**pages;
+	ext2fs_bmap_page_load_t	load;
+	errcode_t		error;		/* first failed load */
+};
+
+typedef struct ext2fs_pg_private_struct *ext2fs_pg_private;
+
+static size_t pg_bytes(ext2fs_pg_private pp)
+{
+	return (size_t) (pp->page_bits >> 3);
+}
+
+static __u64 pg_count(ext2fs_pg_private pp, ext2fs_generic_bitmap_64 bitmap)
+{
+	return (bitmap->real_end - bitmap->start) / pp->page_bits + 1;
+}
+
+/*
+ * Return page idx.  A missing page is loaded if there is a loader, or
+ * allocated if alloc is set; otherwise NULL (all zeroes) is returned.
+ * NULL is also returned if a page to be loaded can't be allocated; the
+ * callers treat that as all ones.  The page is installed before the
+ * loader runs, so that the loader can use the ordinary bitmap functions
+ * on it.
+ */
+static unsigned char *pg_get(ext2fs_generic_bitmap_64 bitmap, __u64 idx,
+			     int alloc)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	unsigned char	*page = pp->pages[idx];
+	errcode_t	retval;
+
+	if (page || (!alloc && !pp->load))
+		return page;
+
+	retval = ext2fs_get_memzero(pg_bytes(pp), &page);
+	if (retval) {
+		if (!pp->error)
+			pp->error = retval;
+		return NULL;
+	}
+	pp->pages[idx] = page;
+	if (pp->load) {
+		retval = (pp->load)(bitmap->fs, (ext2fs_generic_bitmap) bitmap,
+				    idx, page);
+		if (retval) {
+			memset(page, 0xff, pg_bytes(pp));
+			if (!pp->error)
+				pp->error = retval;
+		}
+	}
+	return page;
+}
+
+static errcode_t pg_load_all(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		idx;
+
+	if (!pp->load)
+		return 0;
+	for (idx = 0; idx < pp->nr_pages; idx++)
+		pg_get(bitmap, idx, 0);
+	pp->load = NULL;
+	return pp->error;
+}
+
+static errcode_t pg_new_bmap(ext2_filsys fs, ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_pg_private pp;
+	errcode_t	retval;
+	__u64		bits;
+
+	switch (bitmap->magic) {
+	case EXT2_ET_MAGIC_BLOCK_BITMAP64:
+		bits = EXT2_CLUSTERS_PER_GROUP(fs->super);
+		break;
+	case EXT2_ET_MAGIC_INODE_BITMAP64:
+		bits = EXT2_INODES_PER_GROUP(fs->super);
+		break;
+	default:
+		bits = 0;
+	}
+	if (bits == 0 || (bits & 7))
+		bits = PG_DEFAULT_BITS;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_pg_private_struct),
+				    &pp);
+	if (retval)
+		return retval;
+	pp->page_bits = bits;
+	pp->nr_pages = pg_count(pp, bitmap);
+	retval = ext2fs_get_arrayzero(pp->nr_pages, sizeof(unsigned char *),
+				      &pp->pages);
+	if (retval) {
+		ext2fs_free_mem(&pp);
+		return retval;
+	}
+	bitmap->private = pp;
+	return 0;
+}
+
+static void pg_free_pages(ext2fs_pg_private pp)
+{
+	__u64		idx;
+
+	for (idx = 0; idx < pp->nr_pages; idx++)
+		if (pp->pages[idx])
+			ext2fs_free_mem(&pp->pages[idx]);
+}
+
+static void pg_free_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+
+	if (!pp)
+		return;
+	pg_free_pages(pp);
+	ext2fs_free_mem(&pp->pages);
+	ext2fs_free_mem(&pp);
+	bitmap->private = NULL;
+}
+
+/*
+ * Pages which haven't been loaded yet are left for the copy to load on
+ * its own, since nothing can have changed them.
+ */
+static errcode_t pg_copy_bmap(ext2fs_generic_bitmap_64 src,
+			      ext2fs_generic_bitmap_64 dest)
+{
+	ext2fs_pg_private src_pp = (ext2fs_pg_private) src->private;
+	ext2fs_pg_private pp;
+	errcode_t	retval;
+	__u64		idx;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_pg_private_struct),
+				    &pp);
+	if (retval)
+		return retval;
+	*pp = *src_pp;
+	retval = ext2fs_get_arrayzero(pp->nr_pages, sizeof(unsigned char *),
+				      &pp->pages);
+	if (retval) {
+		ext2fs_free_mem(&pp);
+		return retval;
+	}
+	dest->private = pp;
+
+	for (idx = 0; idx < pp->nr_pages; idx++) {
+		if (!src_pp->pages[idx])
+			continue;
+		retval = ext2fs_get_mem(pg_bytes(pp), &pp->pages[idx]);
+		if (retval) {
+			pg_free_bmap(dest);
+			return retval;
+		}
+		memcpy(pp->pages[idx], src_pp->pages[idx], pg_bytes(pp));
+	}
+	return 0;
+}
+
+static void pg_set_bits(unsigned char *page, __u64 bit, __u64 num, int set)
+{
+	for (; num && (bit & 7); bit++, num--) {
+		if (set)
+			ext2fs_fast_set_bit64(bit, page);
+		else
+			ext2fs_fast_clear_bit64(bit, page);
+	}
+	if (num >= 8) {
+		memset(page + (bit >> 3), set ? 0xff : 0, num >> 3);
+		bit += num & ~7ULL;
+		num &= 7;
+	}
+	for (; num; bit++, num--) {
+		if (set)
+			ext2fs_fast_set_bit64(bit, page);
+		else
+			ext2fs_fast_clear_bit64(bit, page);
+	}
+}
+
+/* Set or clear the bits at offsets [off, off + num) of the bitmap */
+static void pg_set_range(ext2fs_generic_bitmap_64 bitmap, __u64 off,
+			 __u64 num, int set)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	unsigned char	*page;
+	__u64		bit, n;
+
+	while (num) {
+		bit = off % pp->page_bits;
+		n = pp->page_bits - bit;
+		if (n > num)
+			n = num;
+		page = pg_get(bitmap, off / pp->page_bits, set);
+		if (page)
+			pg_set_bits(page, bit, n, set);
+		off += n;
+		num -= n;
+	}
+}
+
+static errcode_t pg_resize_bmap(ext2fs_generic_bitmap_64 bmap,
+				__u64 new_end, __u64 new_real_end)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bmap->private;
+	errcode_t	retval;
+	__u64		end, nr_pages, idx;
+
+	/* The loader only knows the layout it was set up for */
+	retval = pg_load_all(bmap);
+	if (retval)
+		return retval;
+
+	/*
+	 * If we're expanding the bitmap, make sure all of the new
+	 * parts of the bitmap are zero.
+	 */
+	if (new_end > bmap->end) {
+		end = bmap->real_end;
+		if (end > new_end)
+			end = new_end;
+		if (end > bmap->end)
+			pg_set_range(bmap, bmap->end + 1 - bmap->start,
+				     end - bmap->end, 0);
+	}
+	bmap->end = new_end;
+	if (new_real_end == bmap->real_end)
+		return 0;
+
+	nr_pages = (new_real_end - bmap->start) / pp->page_bits + 1;
+	for (idx = nr_pages; idx < pp->nr_pages; idx++)
+		if (pp->pages[idx])
+			ext2fs_free_mem(&pp->pages[idx]);
+	if (nr_pages != pp->nr_pages) {
+		retval = ext2fs_resize_mem(pp->nr_pages *
+					   sizeof(unsigned char *),
+					   nr_pages * sizeof(unsigned char *),
+					   &pp->pages);
+		if (retval)
+			return retval;
+		if (nr_pages > pp->nr_pages)
+			memset(pp->pages + pp->nr_pages, 0,
+			       (nr_pages - pp->nr_pages) *
+			       sizeof(unsigned char *));
+		pp->nr_pages = nr_pages;
+	}
+	if (new_real_end > bmap->real_end)
+		pg_set_range(bmap, bmap->real_end + 1 - bmap->start,
+			     new_real_end - bmap->real_end, 0);
+	bmap->real_end = new_real_end;
+	return 0;
+}
+
+static int pg_mark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		off = arg - bitmap->start;
+	unsigned char	*page;
+
+	page = pg_get(bitmap, off / pp->page_bits, 1);
+	if (!page)
+		return 0;
+	return ext2fs_set_bit64(off % pp->page_bits, page);
+}
+
+static int pg_unmark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		off = arg - bitmap->start;
+	unsigned char	*page;
+
+	page = pg_get(bitmap, off / pp->page_bits, 0);
+	if (!page)
+		return 0;
+	return ext2fs_clear_bit64(off % pp->page_bits, page);
+}
+
+static int pg_test_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		off = arg - bitmap->start;
+	unsigned char	*page;
+
+	page = pg_get(bitmap, off / pp->page_bits, 0);
+	if (!page)
+		return pp->load != NULL;
+	return ext2fs_test_bit64(off % pp->page_bits, page);
+}
+
+static void pg_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
+				unsigned int num)
+{
+	pg_set_range(bitmap, arg - bitmap->start, num, 1);
+}
+
+static void pg_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
+				  unsigned int num)
+{
+	pg_set_range(bitmap, arg - bitmap->start, num, 0);
+}
+
+/* Find the first bit equal to set between start and end, inclusive */
+static errcode_t pg_find_bit(ext2fs_generic_bitmap_64 bitmap, __u64 start,
+			     __u64 end, int set, __u64 *out)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		off = start - bitmap->start;
+	__u64		last = end - bitmap->start;
+	__u64		idx, bit, ebit, pos;
+	unsigned char	*page;
+
+	while (off <= last) {
+		idx = off / pp->page_bits;
+		bit = off % pp->page_bits;
+		ebit = pp->page_bits - 1;
+		if (ebit - bit > last - off)
+			ebit = bit + (last - off);
+		page = pg_get(bitmap, idx, 0);
+		if (!page) {
+			/* All zeroes, or all ones if it couldn't be loaded */
+			if (set == (pp->load != NULL)) {
+				*out = off + bitmap->start;
+				return 0;
+			}
+		} else if (ext2fs_find_bit(page, bit, ebit, set, &pos) == 0) {
+			*out = idx * pp->page_bits + pos + bitmap->start;
+			return 0;
+		}
+		off += ebit - bit + 1;
+	}
+	return ENOENT;
+}
+
+static int pg_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, unsigned int len)
+{
+	__u64 pos;
+
+	if (len == 0)
+		return 1;
+	return pg_find_bit(bitmap, start, start + len - 1, 1, &pos) == ENOENT;
+}
+
+/*
+ * As with the bitarray backend, a range starting on a byte boundary is
+ * copied a byte at a time, including any unused bits of its last byte.
+ */
+static errcode_t pg_set_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, size_t num, void *in)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	unsigned char	*page;
+	__u64		off = start - bitmap->start;
+	__u64		bit, n, i, ibit = 0;
+
+	while (num) {
+		bit = off % pp->page_bits;
+		n = pp->page_bits - bit;
+		if (n > num)
+			n = num;
+		page = pg_get(bitmap, off / pp->page_bits, 1);
+		if (!page)
+			return pp->error;
+		if ((bit & 7) == 0)
+			memcpy(page + (bit >> 3), (char *) in + (ibit >> 3),
+			       (n + 7) >> 3);
+		else {
+			for (i = 0; i < n; i++) {
+				if (ext2fs_test_bit64(ibit + i, in))
+					ext2fs_fast_set_bit64(bit + i, page);
+				else
+					ext2fs_fast_clear_bit64(bit + i, page);
+			}
+		}
+		ibit += n;
+		off += n;
+		num -= n;
+	}
+	return 0;
+}
+
+static errcode_t pg_get_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, size_t num, void *out)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	unsigned char	*page;
+	__u64		off = start - bitmap->start;
+	__u64		bit, n, i, obit = 0;
+
+	while (num) {
+		bit = off % pp->page_bits;
+		n = pp->page_bits - bit;
+		if (n > num)
+			n = num;
+		page = pg_get(bitmap, off / pp->page_bits, 0);
+		if (!page && pp->load)
+			return pp->error;
+		if ((bit & 7) == 0) {
+			if (page)
+				memcpy((char *) out + (obit >> 3),
+				       page + (bit >> 3), (n + 7) >> 3);
+			else
+				memset((char *) out + (obit >> 3), 0,
+				       (n + 7) >> 3);
+		} else {
+			for (i = 0; i < n; i++) {
+				if (page && ext2fs_test_bit64(bit + i, page))
+					ext2fs_fast_set_bit64(obit + i, out);
+				else
+					ext2fs_fast_clear_bit64(obit + i, out);
+			}
+		}
+		obit += n;
+		off += n;
+		num -= n;
+	}
+	return 0;
+}
+
+/* Once cleared, the pages must not be loaded from disk any more */
+static void pg_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+
+	pg_free_pages(pp);
+	pp->load = NULL;
+}
+
+#ifdef ENABLE_BMAP_STATS
+static void pg_print_stats(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		idx, n = 0;
+
+	for (idx = 0; idx < pp->nr_pages; idx++)
+		if (pp->pages[idx])
+			n++;
+	fprintf(stderr, "%16llu pages of %llu in use\n",
+		(unsigned long long) n, (unsigned long long) pp->nr_pages);
+	fprintf(stderr, "%16llu Bytes used by paged bitarray\n",
+		(unsigned long long) (n * pg_bytes(pp) +
+				      pp->nr_pages * sizeof(unsigned char *) +
+				      sizeof(struct ext2fs_pg_private_struct)));
+}
+#else
+static void pg_print_stats(ext2fs_generic_bitmap_64 bitmap EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+/* Find the first zero bit between start and end, inclusive. */
+static errcode_t pg_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return pg_find_bit(bitmap, start, end, 0, out);
+}
+
+/* Find the first one bit between start and end, inclusive. */
+static errcode_t pg_find_first_set(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return pg_find_bit(bitmap, start, end, 1, out);
+}
+
+/* Count the bits set between start and end, inclusive. */
+static errcode_t pg_count_set(ext2fs_generic_bitmap_64 bitmap,
+			      __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_pg_private pp = (ext2fs_pg_private) bitmap->private;
+	__u64		off = start - bitmap->start;
+	__u64		last = end - bitmap->start;
+	__u64		bit, ebit;
+	unsigned char	*page;
+
+	*out = 0;
+	while (off <= last) {
+		bit = off % pp->page_bits;
+		ebit = pp->page_bits - 1;
+		if (ebit - bit > last - off)
+			ebit = bit + (last - off);
+		page = pg_get(bitmap, off / pp->page_bits, 0);
+		if (page)
+			*out += ext2fs_count_bit_range(page, bit, ebit);
+		else if (pp->load)
+			*out += ebit - bit + 1;
+		off += ebit - bit + 1;
+	}
+	return 0;
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_paged = {
+	.type = EXT2FS_BMAP64_PAGED,
+	.new_bmap = pg_new_bmap,
+	.free_bmap = pg_free_bmap,
+	.copy_bmap = pg_copy_bmap,
+	.resize_bmap = pg_resize_bmap,
+	.mark_bmap = pg_mark_bmap,
+	.unmark_bmap = pg_unmark_bmap,
+	.test_bmap = pg_test_bmap,
+	.test_clear_bmap_extent = pg_test_clear_bmap_extent,
+	.mark_bmap_extent = pg_mark_bmap_extent,
+	.unmark_bmap_extent = pg_unmark_bmap_extent,
+	.set_bmap_range = pg_set_bmap_range,
+	.get_bmap_range = pg_get_bmap_range,
+	.clear_bmap = pg_clear_bmap,
+	.print_stats = pg_print_stats,
+	.find_first_zero = pg_find_first_zero,
+	.find_first_set = pg_find_first_set,
+	.count_set = pg_count_set,
+};
+
+static ext2fs_generic_bitmap_64 paged_bmap(ext2fs_generic_bitmap gen_bmap)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+
+	if (!bmap || !EXT2FS_IS_64_BITMAP(bmap) ||
+	    bmap->bitmap_ops != &ext2fs_blkmap64_paged)
+		return NULL;
+	return bmap;
+}
+
+/*
+ * Have the pages of a paged bitmap filled in by load when they are
+ * first used.  Page n of a block or inode bitmap holds the bits of
+ * block group n.
+ */
+errcode_t ext2fs_paged_bmap_set_loader(ext2fs_generic_bitmap gen_bmap,
+				       ext2fs_bmap_page_load_t load)
+{
+	ext2fs_generic_bitmap_64 bmap = paged_bmap(gen_bmap);
+
+	if (!bmap)
+		return EINVAL;
+	((ext2fs_pg_private) bmap->private)->load = load;
+	return 0;
+}
+
+/*
+ * Return whether a page of the bitmap is in memory, and so may differ
+ * from what its loader would read.  Bitmaps of other types are always
+ * entirely in memory.
+ */
+int ext2fs_paged_bmap_page_loaded(ext2fs_generic_bitmap gen_bmap, __u64 page)
+{
+	ext2fs_generic_bitmap_64 bmap = paged_bmap(gen_bmap);
+	ext2fs_pg_private pp;
+
+	if (!bmap)
+		return 1;
+	pp = (ext2fs_pg_private) bmap->private;
+	if (!pp->load)
+		return 1;
+	return page < pp->nr_pages && pp->pages[page] != NULL;
+}
+
+/* Return the error from the first page which failed to load, if any */
+errcode_t ext2fs_paged_bmap_error(ext2fs_generic_bitmap gen_bmap)
+{
+	ext2fs_generic_bitmap_64 bmap = paged_bmap(gen_bmap);
+
+	if (!bmap)
+		return 0;
+	return ((ext2fs_pg_private) bmap->private)->error;
+}
@@ -0,0 +1,1252 @@
+/*
+ * blkmap64_roaring.c --- Compressed bitmaps built from 64k-bit containers
+ *
+ * The bit space is split into chunks of 65536 bits.  Each chunk which
+ * has any bits set is stored in a container which is either a sorted
+ * array of 16-bit offsets, a plain 8k bitmap, or a sorted list of runs
+ * of set bits, whichever is the smallest for what it holds (this is
+ * the scheme used by "roaring" bitmaps).  The containers are kept in
+ * an array sorted by chunk number.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+#define ROAR_CHUNK_BITS		16
+#define ROAR_CHUNK_SIZE		(1U << ROAR_CHUNK_BITS)
+#define ROAR_CHUNK_MASK		(ROAR_CHUNK_SIZE - 1)
+#define ROAR_BITMAP_WORDS	(ROAR_CHUNK_SIZE / 64)
+#define ROAR_BITMAP_BYTES	(ROAR_CHUNK_SIZE / 8)
+
+#define ROAR_ARRAY	0
+#define ROAR_BITMAP	1
+#define ROAR_RUN	2
+
+struct roar_run {
+	__u16		start;
+	__u16		last;
+};
+
+struct roar_container {
+	__u64		key;		/* chunk number */
+	int		type;
+	__u32		card;		/* number of bits set */
+	__u32		nruns;		/* number of runs of set bits */
+	__u32		alloc;		/* array or run entries allocated */
+	union {
+		void		*ptr;
+		__u16		*array;
+		__u64		*words;
+		struct roar_run	*runs;
+	} u;
+};
+
+struct ext2fs_roar_private {
+	struct roar_container	*cont;
+	__u64			nr;
+	__u64			alloc;
+	__u64			cursor;
+};
+
+static inline unsigned int roar_popcount64(__u64 w)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(w);
+#else
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (unsigned int) ((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* w must not be zero */
+static inline unsigned int roar_ctz64(__u64 w)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(w);
+#else
+	unsigned int n = 0;
+
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/* Mask of bits lo through hi, inclusive, of a 64-bit word */
+static inline __u64 roar_mask(unsigned int lo, unsigned int hi)
+{
+	return (~0ULL >> (63 - hi)) & (~0ULL << lo);
+}
+
+static void *roar_alloc(size_t size)
+{
+	void *p;
+
+	if (ext2fs_get_mem(size, &p))
+		abort();
+	return p;
+}
+
+/*
+ * Routines which operate on the bitmap form of a container
+ */
+static inline int bm_test(const __u64 *words, unsigned int x)
+{
+	return (words[x >> 6] >> (x & 63)) & 1;
+}
+
+static unsigned int bm_count_range(const __u64 *words, unsigned int lo,
+				   unsigned int hi)
+{
+	unsigned int i, first = lo >> 6, last = hi >> 6, n;
+
+	if (first == last)
+		return roar_popcount64(words[first] &
+				       roar_mask(lo & 63, hi & 63));
+	n = roar_popcount64(words[first] & roar_mask(lo & 63, 63));
+	for (i = first + 1; i < last; i++)
+		n += roar_popcount64(words[i]);
+	return n + roar_popcount64(words[last] & roar_mask(0, hi & 63));
+}
+
+/* Returns the number of bits which changed */
+static unsigned int bm_change_range(__u64 *words, unsigned int lo,
+				    unsigned int hi, int set)
+{
+	unsigned int i, first = lo >> 6, last = hi >> 6, n = 0;
+	__u64 mask, old;
+
+	for (i = first; i <= last; i++) {
+		mask = roar_mask(i == first ? lo & 63 : 0,
+				 i == last ? hi & 63 : 63);
+		old = words[i];
+		if (set)
+			words[i] |= mask;
+		else
+			words[i] &= ~mask;
+		n += roar_popcount64(old ^ words[i]);
+	}
+	return n;
+}
+
+static void bm_recount(struct roar_container *c)
+{
+	unsigned int i, card = 0, nruns = 0;
+	__u64 w, carry = 0;
+
+	for (i = 0; i < ROAR_BITMAP_WORDS; i++) {
+		w = c->u.words[i];
+		card += roar_popcount64(w);
+		nruns += roar_popcount64(w & ~((w << 1) | carry));
+		carry = w >> 63;
+	}
+	c->card = card;
+	c->nruns = nruns;
+}
+
+/*
+ * Routines which search the array and run forms of a container
+ */
+
+/* Index of the first array entry >= x */
+static unsigned int arr_lower(const struct roar_container *c, unsigned int x)
+{
+	unsigned int low = 0, high = c->card, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (c->u.array[mid] < x)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Index of the first run which ends at or after x */
+static unsigned int run_lower(const struct roar_container *c, unsigned int x)
+{
+	unsigned int low = 0, high = c->nruns, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (c->u.runs[mid].last < x)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void arr_recount_runs(struct roar_container *c)
+{
+	unsigned int i, nruns = 0;
+
+	for (i = 0; i < c->card; i++)
+		if (i == 0 || c->u.array[i] != c->u.array[i - 1] + 1)
+			nruns++;
+	c->nruns = nruns;
+}
+
+/*
+ * Container conversions.  These rely on card and nruns being accurate
+ * for the current contents of the container.
+ */
+static size_t roar_type_size(const struct roar_container *c, int type)
+{
+	switch (type) {
+	case ROAR_ARRAY:
+		return c->card * sizeof(__u16);
+	case ROAR_RUN:
+		return c->nruns * sizeof(struct roar_run);
+	default:
+		return ROAR_BITMAP_BYTES;
+	}
+}
+
+static void roar_free_container(struct roar_container *c)
+{
+	if (c->u.ptr)
+		ext2fs_free_mem(&c->u.ptr);
+	c->alloc = 0;
+}
+
+static void roar_fill_words(const struct roar_container *c, __u64 *words)
+{
+	unsigned int i;
+
+	if (c->type == ROAR_BITMAP) {
+		memcpy(words, c->u.words, ROAR_BITMAP_BYTES);
+		return;
+	}
+	memset(words, 0, ROAR_BITMAP_BYTES);
+	if (c->type == ROAR_ARRAY) {
+		for (i = 0; i < c->card; i++)
+			words[c->u.array[i] >> 6] |=
+				1ULL << (c->u.array[i] & 63);
+	} else {
+		for (i = 0; i < c->nruns; i++)
+			bm_change_range(words, c->u.runs[i].start,
+					c->u.runs[i].last, 1);
+	}
+}
+
+static void roar_convert(struct roar_container *c, int type)
+{
+	void *new_data;
+	__u16 *array;
+	struct roar_run *runs;
+	unsigned int i, j, n = 0, start = 0;
+	__u64 w;
+	int in_run = 0;
+
+	if (type == c->type)
+		return;
+
+	if (type == ROAR_BITMAP) {
+		new_data = roar_alloc(ROAR_BITMAP_BYTES);
+		roar_fill_words(c, new_data);
+		c->alloc = 0;
+		goto out;
+	}
+
+	if (type == ROAR_ARRAY) {
+		c->alloc = c->card ? c->card : 1;
+		array = roar_alloc(c->alloc * sizeof(__u16));
+		if (c->type == ROAR_BITMAP) {
+			for (i = 0; i < ROAR_BITMAP_WORDS; i++) {
+				for (w = c->u.words[i]; w; w &= w - 1)
+					array[n++] = (i << 6) + roar_ctz64(w);
+			}
+		} else {
+			for (i = 0; i < c->nruns; i++)
+				for (j = c->u.runs[i].start;
+				     j <= c->u.runs[i].last; j++)
+					array[n++] = j;
+		}
+		new_data = array;
+		goto out;
+	}
+
+	c->alloc = c->nruns ? c->nruns : 1;
+	runs = roar_alloc(c->alloc * sizeof(struct roar_run));
+	if (c->type == ROAR_ARRAY) {
+		for (i = 0; i < c->card; i++) {
+			if (n && runs[n - 1].last + 1 == c->u.array[i]) {
+				runs[n - 1].last = c->u.array[i];
+				continue;
+			}
+			runs[n].start = runs[n].last = c->u.array[i];
+			n++;
+		}
+	} else {
+		for (i = 0; i < ROAR_CHUNK_SIZE; i++) {
+			if ((i & 63) == 0) {
+				w = c->u.words[i >> 6];
+				if ((!in_run && w == 0) ||
+				    (in_run && w == ~0ULL)) {
+					i += 63;
+					continue;
+				}
+			}
+			if (bm_test(c->u.words, i) == in_run)
+				continue;
+			if (!in_run)
+				start = i;
+			else {
+				runs[n].start = start;
+				runs[n++].last = i - 1;
+			}
+			in_run = !in_run;
+		}
+		if (in_run) {
+			runs[n].start = start;
+			runs[n++].last = ROAR_CHUNK_MASK;
+		}
+	}
+	new_data = runs;
+out:
+	ext2fs_free_mem(&c->u.ptr);
+	c->u.ptr = new_data;
+	c->type = type;
+}
+
+/*
+ * Switch the container to whichever form is smallest.  A little
+ * hysteresis keeps a container from flipping back and forth when its
+ * contents hover around the crossover point.
+ */
+static void roar_repack(struct roar_container *c)
+{
+	size_t cur = roar_type_size(c, c->type), size, best_size = cur;
+	int type, best = c->type;
+
+	for (type = ROAR_ARRAY; type <= ROAR_RUN; type++) {
+		size = roar_type_size(c, type);
+		if (size < best_size) {
+			best = type;
+			best_size = size;
+		}
+	}
+	if (best != c->type && best_size + best_size / 8 < cur)
+		roar_convert(c, best);
+}
+
+static void roar_grow(struct roar_container *c, unsigned int need,
+		      size_t entry_size)
+{
+	unsigned int new_alloc;
+
+	if (need <= c->alloc)
+		return;
+	new_alloc = c->alloc ? c->alloc * 2 : 4;
+	while (new_alloc < need)
+		new_alloc *= 2;
+	if (ext2fs_resize_mem(c->alloc * entry_size, new_alloc * entry_size,
+			      &c->u.ptr))
+		abort();
+	c->alloc = new_alloc;
+}
+
+/*
+ * Set bits lo through hi of a container.  Returns the number of bits
+ * which were newly set.
+ */
+static unsigned int roar_add(struct roar_container *c, unsigned int lo,
+			     unsigned int hi)
+{
+	unsigned int i, j, removed, old_card = c->card;
+	int left, right;
+
+	if (lo == 0 && hi == ROAR_CHUNK_MASK) {
+		roar_free_container(c);
+		c->u.runs = roar_alloc(sizeof(struct roar_run));
+		c->u.runs[0].start = 0;
+		c->u.runs[0].last = ROAR_CHUNK_MASK;
+		c->type = ROAR_RUN;
+		c->alloc = 1;
+		c->card = ROAR_CHUNK_SIZE;
+		c->nruns = 1;
+		return ROAR_CHUNK_SIZE - old_card;
+	}
+
+	if (c->type == ROAR_ARRAY && lo == hi) {
+		i = arr_lower(c, lo);
+		if (i < c->card && c->u.array[i] == lo)
+			return 0;
+		roar_grow(c, c->card + 1, sizeof(__u16));
+		memmove(c->u.array + i + 1, c->u.array + i,
+			(c->card - i) * sizeof(__u16));
+		c->u.array[i] = lo;
+		c->card++;
+		left = (i > 0 && c->u.array[i - 1] + 1 == lo);
+		right = (i + 1 < c->card && c->u.array[i + 1] == lo + 1);
+		if (left && right)
+			c->nruns--;
+		else if (!left && !right)
+			c->nruns++;
+		goto out;
+	}
+
+	if (c->type == ROAR_ARRAY)
+		roar_convert(c, ROAR_RUN);
+
+	if (c->type == ROAR_BITMAP) {
+		if (!bm_change_range(c->u.words, lo, hi, 1))
+			return 0;
+		if (lo == hi) {
+			left = (lo > 0 && bm_test(c->u.words, lo - 1));
+			right = (lo < ROAR_CHUNK_MASK &&
+				 bm_test(c->u.words, lo + 1));
+			c->card++;
+			if (left && right)
+				c->nruns--;
+			else if (!left && !right)
+				c->nruns++;
+		} else
+			bm_recount(c);
+		goto out;
+	}
+
+	/* Merge with every run which overlaps or touches [lo, hi] */
+	i = run_lower(c, lo ? lo - 1 : 0);
+	for (j = i, removed = 0; j < c->nruns &&
+		     c->u.runs[j].start <= hi + 1; j++)
+		removed += c->u.runs[j].last - c->u.runs[j].start + 1;
+	if (i == j) {
+		roar_grow(c, c->nruns + 1, sizeof(struct roar_run));
+		memmove(c->u.runs + i + 1, c->u.runs + i,
+			(c->nruns - i) * sizeof(struct roar_run));
+		c->nruns++;
+	} else {
+		if (c->u.runs[i].start < lo)
+			lo = c->u.runs[i].start;
+		if (c->u.runs[j - 1].last > hi)
+			hi = c->u.runs[j - 1].last;
+		memmove(c->u.runs + i + 1, c->u.runs + j,
+			(c->nruns - j) * sizeof(struct roar_run));
+		c->nruns -= j - i - 1;
+	}
+	c->u.runs[i].start = lo;
+	c->u.runs[i].last = hi;
+	c->card += (hi - lo + 1) - removed;
+out:
+	roar_repack(c);
+	return c->card - old_card;
+}
+
+/*
+ * Clear bits lo through hi of a container.  Returns the number of bits
+ * which were cleared.
+ */
+static unsigned int roar_remove(struct roar_container *c, unsigned int lo,
+				unsigned int hi)
+{
+	unsigned int i, j, removed, old_card = c->card;
+	struct roar_run first, last;
+	int left, right, keep;
+
+	if (c->type == ROAR_ARRAY) {
+		i = arr_lower(c, lo);
+		j = (hi == ROAR_CHUNK_MASK) ? c->card : arr_lower(c, hi + 1);
+		if (i == j)
+			return 0;
+		if (lo == hi) {
+			left = (i > 0 && c->u.array[i - 1] + 1 == lo);
+			right = (j < c->card && c->u.array[j] == lo + 1);
+			if (left && right)
+				c->nruns++;
+			else if (!left && !right)
+				c->nruns--;
+		}
+		memmove(c->u.array + i, c->u.array + j,
+			(c->card - j) * sizeof(__u16));
+		c->card -= j - i;
+		if (lo != hi)
+			arr_recount_runs(c);
+		goto out;
+	}
+
+	if (c->type == ROAR_BITMAP) {
+		if (!bm_change_range(c->u.words, lo, hi, 0))
+			return 0;
+		if (lo == hi) {
+			left = (lo > 0 && bm_test(c->u.words, lo - 1));
+			right = (lo < ROAR_CHUNK_MASK &&
+				 bm_test(c->u.words, lo + 1));
+			c->card--;
+			if (left && right)
+				c->nruns++;
+			else if (!left && !right)
+				c->nruns--;
+		} else
+			bm_recount(c);
+		goto out;
+	}
+
+	i = run_lower(c, lo);
+	for (j = i, removed = 0; j < c->nruns &&
+		     c->u.runs[j].start <= hi; j++)
+		removed += c->u.runs[j].last - c->u.runs[j].start + 1;
+	if (i == j)
+		return 0;
+
+	/* Keep whatever sticks out on either side of [lo, hi] */
+	first = c->u.runs[i];
+	last = c->u.runs[j - 1];
+	keep = 0;
+	if (first.start < lo) {
+		first.last = lo - 1;
+		removed -= first.last - first.start + 1;
+		keep++;
+	}
+	if (last.last > hi) {
+		last.start = hi + 1;
+		removed -= last.last - last.start + 1;
+		keep++;
+	}
+	if (keep > (int) (j - i)) {
+		roar_grow(c, c->nruns + 1, sizeof(struct roar_run));
+		memmove(c->u.runs + j + 1, c->u.runs + j,
+			(c->nruns - j) * sizeof(struct roar_run));
+		c->nruns++;
+		j++;
+	}
+	if (first.start < lo)
+		c->u.runs[i++] = first;
+	if (last.last > hi)
+		c->u.runs[i++] = last;
+	memmove(c->u.runs + i, c->u.runs + j,
+		(c->nruns - j) * sizeof(struct roar_run));
+	c->nruns -= j - i;
+	c->card -= removed;
+out:
+	if (c->card)
+		roar_repack(c);
+	return old_card - c->card;
+}
+
+static int roar_test(const struct roar_container *c, unsigned int x)
+{
+	unsigned int i;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		i = arr_lower(c, x);
+		return (i < c->card && c->u.array[i] == x);
+	case ROAR_BITMAP:
+		return bm_test(c->u.words, x);
+	default:
+		i = run_lower(c, x);
+		return (i < c->nruns && c->u.runs[i].start <= x);
+	}
+}
+
+/* Find the first set bit in [lo, hi]; returns 0 if there is none */
+static int roar_next_set(const struct roar_container *c, unsigned int lo,
+			 unsigned int hi, unsigned int *out)
+{
+	unsigned int i, last;
+	__u64 w;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		i = arr_lower(c, lo);
+		if (i >= c->card || c->u.array[i] > hi)
+			return 0;
+		*out = c->u.array[i];
+		return 1;
+	case ROAR_BITMAP:
+		last = hi >> 6;
+		w = c->u.words[lo >> 6] & roar_mask(lo & 63, 63);
+		for (i = lo >> 6; ; w = c->u.words[++i]) {
+			if (i == last)
+				w &= roar_mask(0, hi & 63);
+			if (w) {
+				*out = (i << 6) + roar_ctz64(w);
+				return 1;
+			}
+			if (i == last)
+				return 0;
+		}
+	default:
+		i = run_lower(c, lo);
+		if (i >= c->nruns || c->u.runs[i].start > hi)
+			return 0;
+		*out = c->u.runs[i].start > lo ? c->u.runs[i].start : lo;
+		return 1;
+	}
+}
+
+/* Find the first clear bit in [lo, hi]; returns 0 if there is none */
+static int roar_next_zero(const struct roar_container *c, unsigned int lo,
+			  unsigned int hi, unsigned int *out)
+{
+	unsigned int i, last, x;
+	__u64 w;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		for (i = arr_lower(c, lo), x = lo;
+		     i < c->card && c->u.array[i] == x && x <= hi; i++, x++)
+			;
+		break;
+	case ROAR_BITMAP:
+		last = hi >> 6;
+		w = ~c->u.words[lo >> 6] & roar_mask(lo & 63, 63);
+		for (i = lo >> 6; ; w = ~c->u.words[++i]) {
+			if (i == last)
+				w &= roar_mask(0, hi & 63);
+			if (w) {
+				*out = (i << 6) + roar_ctz64(w);
+				return 1;
+			}
+			if (i == last)
+				return 0;
+		}
+	default:
+		/* Adjacent runs are always merged */
+		i = run_lower(c, lo);
+		x = lo;
+		if (i < c->nruns && c->u.runs[i].start <= lo)
+			x = c->u.runs[i].last + 1;
+		break;
+	}
+	if (x > hi)
+		return 0;
+	*out = x;
+	return 1;
+}
+
+static unsigned int roar_count(const struct roar_container *c,
+			       unsigned int lo, unsigned int hi)
+{
+	unsigned int i, n = 0, s, e;
+
+	if (lo == 0 && hi == ROAR_CHUNK_MASK)
+		return c->card;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		return ((hi == ROAR_CHUNK_MASK) ? c->card :
+			arr_lower(c, hi + 1)) - arr_lower(c, lo);
+	case ROAR_BITMAP:
+		return bm_count_range(c->u.words, lo, hi);
+	default:
+		for (i = run_lower(c, lo); i < c->nruns &&
+			     c->u.runs[i].start <= hi; i++) {
+			s = c->u.runs[i].start > lo ? c->u.runs[i].start : lo;
+			e = c->u.runs[i].last < hi ? c->u.runs[i].last : hi;
+			n += e - s + 1;
+		}
+		return n;
+	}
+}
+
+/*
+ * Routines which manage the sorted array of containers
+ */
+
+/* Index of the first container whose key is >= key */
+static __u64 roar_lower(struct ext2fs_roar_private *bp, __u64 key)
+{
+	__u64 low = 0, high = bp->nr, mid;
+
+	if (bp->cursor < bp->nr && bp->cont[bp->cursor].key <= key) {
+		if (bp->cont[bp->cursor].key == key)
+			return bp->cursor;
+		if (bp->cursor + 1 >= bp->nr ||
+		    bp->cont[bp->cursor + 1].key >= key)
+			return bp->cursor + 1;
+		low = bp->cursor + 1;
+	}
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (bp->cont[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static struct roar_container *roar_find(struct ext2fs_roar_private *bp,
+					__u64 key)
+{
+	__u64 i = roar_lower(bp, key);
+
+	if (i >= bp->nr || bp->cont[i].key != key)
+		return NULL;
+	bp->cursor = i;
+	return &bp->cont[i];
+}
+
+static struct roar_container *roar_get(struct ext2fs_roar_private *bp,
+				       __u64 key)
+{
+	struct roar_container *c;
+	__u64 i = roar_lower(bp, key), new_alloc;
+
+	if (i < bp->nr && bp->cont[i].key == key)
+		goto out;
+
+	if (bp->nr == bp->alloc) {
+		new_alloc = bp->alloc ? bp->alloc * 2 : 16;
+		if (ext2fs_resize_mem(bp->alloc * sizeof(struct roar_container),
+				      new_alloc * sizeof(struct roar_container),
+				      &bp->cont))
+			abort();
+		bp->alloc = new_alloc;
+	}
+	memmove(bp->cont + i + 1, bp->cont + i,
+		(bp->nr - i) * sizeof(struct roar_container));
+	bp->nr++;
+	c = &bp->cont[i];
+	memset(c, 0, sizeof(struct roar_container));
+	c->key = key;
+	c->type = ROAR_ARRAY;
+out:
+	bp->cursor = i;
+	return &bp->cont[i];
+}
+
+static void roar_drop_if_empty(struct ext2fs_roar_private *bp,
+			       struct roar_container *c)
+{
+	__u64 i = c - bp->cont;
+
+	if (c->card)
+		return;
+	roar_free_container(c);
+	memmove(bp->cont + i, bp->cont + i + 1,
+		(bp->nr - i - 1) * sizeof(struct roar_container));
+	bp->nr--;
+	bp->cursor = i ? i - 1 : 0;
+}
+
+/*
+ * Set or clear the bits start through end (relative to the start of
+ * the bitmap).  Returns the number of bits which changed.
+ */
+static __u64 roar_change_bits(struct ext2fs_roar_private *bp, __u64 start,
+			      __u64 end, int set)
+{
+	struct roar_container *c;
+	__u64 key, skey = start >> ROAR_CHUNK_BITS;
+	__u64 ekey = end >> ROAR_CHUNK_BITS, i, n = 0;
+	unsigned int lo, hi;
+
+	if (set) {
+		for (key = skey; key <= ekey; key++) {
+			lo = (key == skey) ? start & ROAR_CHUNK_MASK : 0;
+			hi = (key == ekey) ? end & ROAR_CHUNK_MASK :
+				ROAR_CHUNK_MASK;
+			n += roar_add(roar_get(bp, key), lo, hi);
+		}
+		return n;
+	}
+
+	for (i = roar_lower(bp, skey); i < bp->nr; ) {
+		c = &bp->cont[i];
+		if (c->key > ekey)
+			break;
+		lo = (c->key == skey) ? start & ROAR_CHUNK_MASK : 0;
+		hi = (c->key == ekey) ? end & ROAR_CHUNK_MASK :
+			ROAR_CHUNK_MASK;
+		n += roar_remove(c, lo, hi);
+		if (c->card)
+			i++;
+		else
+			roar_drop_if_empty(bp, c);
+	}
+	return n;
+}
+
+static void roar_free_all(struct ext2fs_roar_private *bp)
+{
+	__u64 i;
+
+	for (i = 0; i < bp->nr; i++)
+		roar_free_container(&bp->cont[i]);
+	if (bp->cont)
+		ext2fs_free_mem(&bp->cont);
+	bp->nr = bp->alloc = bp->cursor = 0;
+}
+
+/*
+ * The bitmap operations
+ */
+static errcode_t roar_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			       ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_roar_private *bp;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_roar_private), &bp);
+	if (retval)
+		return retval;
+	bitmap->private = bp;
+	return 0;
+}
+
+static void roar_free_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+
+	if (!bp)
+		return;
+	roar_free_all(bp);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t roar_copy_bmap(ext2fs_generic_bitmap_64 src,
+				ext2fs_generic_bitmap_64 dest)
+{
+	struct ext2fs_roar_private *src_bp = src->private, *bp;
+	struct roar_container *c;
+	errcode_t	retval;
+	size_t		size;
+	__u64		i;
+
+	retval = roar_new_bmap(src->fs, dest);
+	if (retval)
+		return retval;
+	bp = dest->private;
+	if (!src_bp->nr)
+		return 0;
+
+	retval = ext2fs_get_array(src_bp->nr, sizeof(struct roar_container),
+				  &bp->cont);
+	if (retval)
+		goto errout;
+	bp->alloc = src_bp->nr;
+	for (i = 0; i < src_bp->nr; i++) {
+		c = &bp->cont[i];
+		*c = src_bp->cont[i];
+		size = roar_type_size(c, c->type);
+		if (c->type != ROAR_BITMAP)
+			c->alloc = c->type == ROAR_ARRAY ? c->card : c->nruns;
+		retval = ext2fs_get_mem(size, &c->u.ptr);
+		if (retval)
+			goto errout;
+		memcpy(c->u.ptr, src_bp->cont[i].u.ptr, size);
+		bp->nr++;
+	}
+	return 0;
+
+errout:
+	roar_free_bmap(dest);
+	return retval;
+}
+
+static errcode_t roar_resize_bmap(ext2fs_generic_bitmap_64 bmap,
+				  __u64 new_end, __u64 new_real_end)
+{
+	struct ext2fs_roar_private *bp = bmap->private;
+	__u64 last;
+
+	/*
+	 * If we're expanding the bitmap, make sure all of the new
+	 * parts of the bitmap are zero, and drop anything that falls
+	 * off the end if we're shrinking it.
+	 */
+	if (new_end > bmap->end) {
+		last = (bmap->real_end < new_end) ? bmap->real_end : new_end;
+		if (last > bmap->end)
+			roar_change_bits(bp, bmap->end + 1 - bmap->start,
+					 last - bmap->start, 0);
+	}
+	if (new_real_end < bmap->real_end)
+		roar_change_bits(bp, new_real_end + 1 - bmap->start,
+				 bmap->real_end - bmap->start, 0);
+
+	bmap->end = new_end;
+	bmap->real_end = new_real_end;
+	return 0;
+}
+
+static int roar_mark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	arg -= bitmap->start;
+	return !roar_change_bits(bitmap->private, arg, arg, 1);
+}
+
+static int roar_unmark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	arg -= bitmap->start;
+	return roar_change_bits(bitmap->private, arg, arg, 0) != 0;
+}
+
+static int roar_test_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	struct roar_container *c;
+
+	arg -= bitmap->start;
+	c = roar_find(bitmap->private, arg >> ROAR_CHUNK_BITS);
+	return c ? roar_test(c, arg & ROAR_CHUNK_MASK) : 0;
+}
+
+static void roar_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				  __u64 arg, unsigned int num)
+{
+	if (!num)
+		return;
+	arg -= bitmap->start;
+	roar_change_bits(bitmap->private, arg, arg + num - 1, 1);
+}
+
+static void roar_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 arg, unsigned int num)
+{
+	if (!num)
+		return;
+	arg -= bitmap->start;
+	roar_change_bits(bitmap->private, arg, arg + num - 1, 0);
+}
+
+static errcode_t roar_find_first_set(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	__u64 i, skey, ekey;
+	unsigned int lo, hi, x;
+
+	start -= bitmap->start;
+	end -= bitmap->start;
+	if (start > end)
+		return EINVAL;
+
+	skey = start >> ROAR_CHUNK_BITS;
+	ekey = end >> ROAR_CHUNK_BITS;
+	for (i = roar_lower(bp, skey); i < bp->nr; i++) {
+		c = &bp->cont[i];
+		if (c->key > ekey)
+			break;
+		lo = (c->key == skey) ? start & ROAR_CHUNK_MASK : 0;
+		hi = (c->key == ekey) ? end & ROAR_CHUNK_MASK :
+			ROAR_CHUNK_MASK;
+		if (roar_next_set(c, lo, hi, &x)) {
+			bp->cursor = i;
+			*out = (c->key << ROAR_CHUNK_BITS) + x + bitmap->start;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+static errcode_t roar_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
+				      __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	__u64 i, key, pos, ekey;
+	unsigned int hi, x;
+
+	start -= bitmap->start;
+	end -= bitmap->start;
+	if (start > end)
+		return EINVAL;
+
+	ekey = end >> ROAR_CHUNK_BITS;
+	pos = start;
+	for (i = roar_lower(bp, start >> ROAR_CHUNK_BITS); ; i++) {
+		key = pos >> ROAR_CHUNK_BITS;
+		if (i >= bp->nr || bp->cont[i].key != key)
+			break;
+		c = &bp->cont[i];
+		hi = (key == ekey) ? end & ROAR_CHUNK_MASK : ROAR_CHUNK_MASK;
+		if (roar_next_zero(c, pos & ROAR_CHUNK_MASK, hi, &x)) {
+			pos = (key << ROAR_CHUNK_BITS) + x;
+			break;
+		}
+		if (key == ekey)
+			return ENOENT;
+		pos = (key + 1) << ROAR_CHUNK_BITS;
+	}
+	*out = pos + bitmap->start;
+	return 0;
+}
+
+static int roar_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				       __u64 start, unsigned int len)
+{
+	__u64 out;
+
+	if (len == 0)
+		return 1;
+	return roar_find_first_set(bitmap, start, start + len - 1,
+				   &out) == ENOENT;
+}
+
+static errcode_t roar_count_set(ext2fs_generic_bitmap_64 bitmap,
+				__u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	__u64 i, skey, ekey, n = 0;
+
+	start -= bitmap->start;
+	end -= bitmap->start;
+	if (start > end)
+		return EINVAL;
+
+	skey = start >> ROAR_CHUNK_BITS;
+	ekey = end >> ROAR_CHUNK_BITS;
+	for (i = roar_lower(bp, skey); i < bp->nr; i++) {
+		c = &bp->cont[i];
+		if (c->key > ekey)
+			break;
+		n += roar_count(c, (c->key == skey) ?
+				start & ROAR_CHUNK_MASK : 0,
+				(c->key == ekey) ?
+				end & ROAR_CHUNK_MASK : ROAR_CHUNK_MASK);
+	}
+	*out = n;
+	return 0;
+}
+
+/* Set bits [pos, pos + n) in a little-endian bit buffer */
+static void roar_fill_bits(unsigned char *buf, __u64 pos, __u64 n)
+{
+	while (n && (pos & 7)) {
+		ext2fs_fast_set_bit64(pos++, buf);
+		n--;
+	}
+	if (n >= 8) {
+		memset(buf + (pos >> 3), 0xff, n >> 3);
+		pos += n & ~7ULL;
+		n &= 7;
+	}
+	while (n--)
+		ext2fs_fast_set_bit64(pos++, buf);
+}
+
+static errcode_t roar_get_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, size_t num, void *out)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	unsigned char *buf = out;
+	__u64 i, skey, ekey, base, end, w, le;
+	unsigned int j, lo, hi, s, e;
+
+	memset(out, 0, (num + 7) >> 3);
+	if (!num)
+		return 0;
+	start -= bitmap->start;
+	end = start + num - 1;
+	skey = start >> ROAR_CHUNK_BITS;
+	ekey = end >> ROAR_CHUNK_BITS;
+
+	for (i = roar_lower(bp, skey); i < bp->nr; i++) {
+		c = &bp->cont[i];
+		if (c->key > ekey)
+			break;
+		lo = (c->key == skey) ? start & ROAR_CHUNK_MASK : 0;
+		hi = (c->key == ekey) ? end & ROAR_CHUNK_MASK :
+			ROAR_CHUNK_MASK;
+		/* Bit x of the container goes to bit base + x of out */
+		base = (c->key << ROAR_CHUNK_BITS) - start;
+
+		switch (c->type) {
+		case ROAR_ARRAY:
+			for (j = arr_lower(c, lo);
+			     j < c->card && c->u.array[j] <= hi; j++)
+				ext2fs_fast_set_bit64(base + c->u.array[j],
+						      buf);
+			break;
+		case ROAR_RUN:
+			for (j = run_lower(c, lo); j < c->nruns &&
+				     c->u.runs[j].start <= hi; j++) {
+				s = c->u.runs[j].start > lo ?
+					c->u.runs[j].start : lo;
+				e = c->u.runs[j].last < hi ?
+					c->u.runs[j].last : hi;
+				roar_fill_bits(buf, base + s, e - s + 1);
+			}
+			break;
+		default:
+			for (j = lo >> 6; j <= (hi >> 6); j++) {
+				w = c->u.words[j] &
+					roar_mask(j == (lo >> 6) ? lo & 63 : 0,
+						  j == (hi >> 6) ? hi & 63 : 63);
+				if (!w)
+					continue;
+				if (((base + (j << 6)) & 7) == 0 &&
+				    (j << 6) >= lo && (j << 6) + 63 <= hi) {
+					le = ext2fs_cpu_to_le64(w);
+					memcpy(buf + ((base + (j << 6)) >> 3),
+					       &le, sizeof(le));
+					continue;
+				}
+				for (; w; w &= w - 1)
+					ext2fs_fast_set_bit64(base + (j << 6) +
+							roar_ctz64(w), buf);
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+static errcode_t roar_set_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, size_t num, void *in)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	unsigned char *buf = in;
+	__u64 key, skey, ekey, end, src, le, *words = NULL;
+	unsigned int lo, hi, x;
+	errcode_t retval;
+
+	if (!num)
+		return 0;
+	start -= bitmap->start;
+	end = start + num - 1;
+	skey = start >> ROAR_CHUNK_BITS;
+	ekey = end >> ROAR_CHUNK_BITS;
+
+	for (key = skey; key <= ekey; key++) {
+		lo = (key == skey) ? start & ROAR_CHUNK_MASK : 0;
+		hi = (key == ekey) ? end & ROAR_CHUNK_MASK : ROAR_CHUNK_MASK;
+		/* Bit x of the chunk comes from bit src + x of in */
+		src = (key << ROAR_CHUNK_BITS) - start;
+
+		if (!words) {
+			retval = ext2fs_get_mem(ROAR_BITMAP_BYTES, &words);
+			if (retval)
+				return retval;
+		}
+		c = roar_find(bp, key);
+		if (c) {
+			roar_fill_words(c, words);
+			bm_change_range(words, lo, hi, 0);
+		} else
+			memset(words, 0, ROAR_BITMAP_BYTES);
+
+		for (x = lo; x <= hi; ) {
+			if ((x & 63) == 0 && x + 63 <= hi &&
+			    ((src + x) & 7) == 0) {
+				memcpy(&le, buf + ((src + x) >> 3),
+				       sizeof(le));
+				words[x >> 6] |= ext2fs_le64_to_cpu(le);
+				x += 64;
+				continue;
+			}
+			if (ext2fs_test_bit64(src + x, buf))
+				words[x >> 6] |= 1ULL << (x & 63);
+			x++;
+		}
+
+		if (!c) {
+			/* Nothing to store; reuse the buffer for the next chunk */
+			if (ext2fs_mem_is_zero((char *) words,
+					       ROAR_BITMAP_BYTES))
+				continue;
+			c = roar_get(bp, key);
+		}
+		roar_free_container(c);
+		c->type = ROAR_BITMAP;
+		c->u.words = words;
+		words = NULL;
+		bm_recount(c);
+		if (c->card)
+			roar_repack(c);
+		else
+			roar_drop_if_empty(bp, c);
+	}
+	if (words)
+		ext2fs_free_mem(&words);
+	return 0;
+}
+
+static void roar_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	roar_free_all(bitmap->private);
+}
+
+#ifdef ENABLE_BMAP_STATS
+static void roar_print_stats(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_roar_private *bp = bitmap->private;
+	struct roar_container *c;
+	__u64 count[3] = { 0, 0, 0 }, size = 0, bits = 0, i;
+	double eff;
+
+	for (i = 0; i < bp->nr; i++) {
+		c = &bp->cont[i];
+		count[c->type]++;
+		size += roar_type_size(c, c->type);
+		bits += c->card;
+	}
+	size += bp->alloc * sizeof(struct roar_container) +
+		sizeof(struct ext2fs_roar_private);
+	eff = (double) (size << 3) / (bitmap->real_end - bitmap->start + 1);
+
+	fprintf(stderr, "%16llu array containers\n"
+		"%16llu bitmap containers\n%16llu run containers\n",
+		(unsigned long long) count[ROAR_ARRAY],
+		(unsigned long long) count[ROAR_BITMAP],
+		(unsigned long long) count[ROAR_RUN]);
+	fprintf(stderr, "%16llu bytes used\n", (unsigned long long) size);
+	fprintf(stderr, "%16llu bits set in bitmap (out of %llu)\n",
+		(unsigned long long) bits,
+		(unsigned long long) bitmap->real_end - bitmap->start);
+	fprintf(stderr,
+		"%16.4lf memory / bitmap bit memory ratio (bitarray = 1)\n",
+		eff);
+}
+#else
+static void roar_print_stats(ext2fs_generic_bitmap_64 bitmap EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+struct ext2_bitmap_ops ext2fs_blkmap64_roaring = {
+	.type = EXT2FS_BMAP64_ROARING,
+	.new_bmap = roar_new_bmap,
+	.free_bmap = roar_free_bmap,
+	.copy_bmap = roar_copy_bmap,
+	.resize_bmap = roar_resize_bmap,
+	.mark_bmap = roar_mark_bmap,
+	.unmark_bmap = roar_unmark_bmap,
+	.test_bmap = roar_test_bmap,
+	.test_clear_bmap_extent = roar_test_clear_bmap_extent,
+	.mark_bmap_extent = roar_mark_bmap_extent,
+	.unmark_bmap_extent = roar_unmark_bmap_extent,
+	.set_bmap_range = roar_set_bmap_range,
+	.get_bmap_range = roar_get_bmap_range,
+	.clear_bmap = roar_clear_bmap,
+	.print_stats = roar_print_stats,
+	.find_first_zero = roar_find_first_zero,
+	.find_first_set = roar_find_first_set,
+	.count_set = roar_count_set,
+};
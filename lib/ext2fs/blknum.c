@@ -12,7 +12,7 @@
  */
 
 #include "config.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * Return the group # of a block
@@ -211,6 +211,9 @@ struct ext2_group_desc *ext2fs_group_desc(ext2_filsys fs,
 
 	if (group > fs->group_desc_count)
 		return NULL;
+	if (gdp && fs->lazy_gdt &&
+	    gdp == (struct opaque_ext2_group_desc *) fs->group_desc)
+		ext2fs_load_desc_block(fs, group / desc_per_blk);
 	if (gdp)
 		return (struct ext2_group_desc *)((char *)gdp +
 						  group * desc_size);
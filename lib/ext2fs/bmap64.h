@@ -100,7 +100,13 @@ struct ext2_bitmap_ops {
 	 * May be NULL, in which case a generic function is used. */
 	errcode_t (*find_first_set)(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out);
+	/* Count the set bits between start and end, inclusive.
+	 * May be NULL, in which case a generic function is used. */
+	errcode_t (*count_set)(ext2fs_generic_bitmap_64 bitmap,
+			       __u64 start, __u64 end, __u64 *out);
 };
 
 extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
 extern struct ext2_bitmap_ops ext2fs_blkmap64_rbtree;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_roaring;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_paged;
@@ -0,0 +1,110 @@
+/*
+ * cimage.h --- on-disk format of compressed e2image files
+ *
+ * A compressed image holds the blocks of a file system image (normally
+ * just its metadata, as written by "e2image -Z").  Blocks which are all
+ * zeroes are not stored at all, and a block whose contents were already
+ * stored is stored only once.  The distinct blocks are kept in the
+ * order they were first seen and packed into frames of frame_blocks
+ * blocks, each compressed on its own, so that any block can be read by
+ * decompressing a single frame.
+ *
+ * The block space of the image is divided into chunks of chunk_blocks
+ * blocks.  For each chunk which has any non-zero blocks a compressed
+ * chunk map is stored, giving for every block in the chunk the number
+ * of its distinct block, counting from 1, or 0 for a block of zeroes.
+ * The frame table and the (sorted) chunk table are written at the end
+ * of the file, and the header at the start of the file is written
+ * last, so that an image whose creation was interrupted is never
+ * mistaken for a complete one.
+ *
+ * A delta image (EXT2_CIMAGE_FLAG_DELTA) only stores the blocks which
+ * changed since an earlier image, its base.  A chunk map entry of
+ * EXT2_CIMAGE_BLOCK_BASE means the block is the same as in the base
+ * image, which may itself be a delta.  The base is found by the name
+ * in the header, relative to the directory holding the delta unless
+ * it is absolute, and must still have the header checksum recorded
+ * when the delta was written.
+ *
+ * All values are stored little-endian.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#ifndef _EXT2FS_CIMAGE_H
+#define _EXT2FS_CIMAGE_H
+
+#include <ext2fs/ext2_types.h>
+
+#define EXT2_CIMAGE_MAGIC	0x45324349	/* "E2CI" */
+#define EXT2_CIMAGE_VERSION	1
+
+#define EXT2_CIMAGE_CODEC_NONE	0
+#define EXT2_CIMAGE_CODEC_ZSTD	1
+#define EXT2_CIMAGE_CODEC_LZ4	2
+
+#define EXT2_CIMAGE_HDR_SIZE		512
+#define EXT2_CIMAGE_CHUNK_BLOCKS	8192
+#define EXT2_CIMAGE_FRAME_BLOCKS	256
+#define EXT2_CIMAGE_BASE_NAME_LEN	256
+
+#define EXT2_CIMAGE_FLAG_DELTA	0x0001	/* has a base image */
+
+/* Chunk map entry for a block which is the same as in the base image */
+#define EXT2_CIMAGE_BLOCK_BASE	(~0ULL)
+
+struct ext2_cimage_hdr {
+	__u32	magic;
+	__u32	version;
+	__u32	hdr_size;
+	__u32	codec;
+	__u32	block_size;
+	__u32	chunk_blocks;		/* blocks covered by a chunk map */
+	__u32	frame_blocks;		/* distinct blocks in a frame */
+	__u32	flags;
+	__u64	blocks_count;		/* size of the image, in blocks */
+	__u64	unique_blocks;		/* distinct non-zero blocks stored */
+	__u64	frame_table_offset;
+	__u64	nr_frames;
+	__u64	chunk_table_offset;
+	__u64	nr_chunks;		/* chunks with a chunk map */
+	__u32	base_checksum;		/* checksum of the base's header */
+	char	base_name[EXT2_CIMAGE_BASE_NAME_LEN];
+	__u32	reserved[42];
+	__u32	checksum;		/* crc32c of the header */
+};
+
+/* A compressed frame; it is stored as is if length == blocks * bs */
+struct ext2_cimage_frame {
+	__u64	offset;
+	__u32	length;
+	__u32	blocks;
+};
+
+struct ext2_cimage_chunk {
+	__u64	chunk;
+	__u64	offset;			/* of the compressed chunk map */
+	__u32	length;
+	__u32	reserved;
+};
+
+/* cimage_io.c */
+extern int ext2fs_cimage_codec(const char *name);
+extern const char *ext2fs_cimage_codec_name(int codec);
+extern errcode_t ext2fs_cimage_codec_init(int codec);
+extern errcode_t ext2fs_cimage_compress(int codec, const void *in,
+					size_t in_len, void *out,
+					size_t *out_len);
+extern errcode_t ext2fs_cimage_decompress(int codec, const void *in,
+					  size_t in_len, void *out,
+					  size_t out_len);
+extern void ext2fs_cimage_hdr_to_disk(struct ext2_cimage_hdr *hdr);
+extern errcode_t ext2fs_cimage_hdr_from_disk(struct ext2_cimage_hdr *hdr);
+extern errcode_t ext2fs_cimage_read_hdr(const char *name,
+					struct ext2_cimage_hdr *hdr);
+extern int ext2fs_cimage_probe(const char *name);
+
+#endif /* _EXT2FS_CIMAGE_H */
@@ -0,0 +1,980 @@
+/*
+ * cimage_io.c --- I/O manager which reads compressed e2image files.
+ *
+ * This gives read-only access to the file system image stored in a
+ * compressed image written by "e2image -Z" (see cimage.h for the
+ * format), so that debugfs, dumpe2fs and e2fsck -n can work on the
+ * image directly.  A small cache of decompressed frames and chunk maps
+ * is kept, since neighbouring metadata blocks usually come from the
+ * same frame.
+ *
+ * A delta image is read with its chain of base images stacked below
+ * it: blocks which the delta marks as unchanged are read from a channel
+ * opened on its base image.
+ *
+ * The zstd and lz4 codecs are built in when configure finds their
+ * headers.  Unless --with-zstd=direct or --with-lz4=direct was given,
+ * the libraries are then loaded at run time when an image needs them,
+ * so that they are not a dependency of libext2fs.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#if !defined(__FreeBSD__) && !defined(__NetBSD__) && !defined(__OpenBSD__)
+#define _XOPEN_SOURCE 600
+#ifndef _LARGEFILE_SOURCE
+#define _LARGEFILE_SOURCE
+#endif
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if defined(HAVE_ZSTD_H) && \
+	(defined(CONFIG_DLOPEN_LIBZSTD) || defined(HAVE_LIBZSTD))
+#define CIMAGE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(HAVE_LZ4_H) && \
+	(defined(CONFIG_DLOPEN_LIBLZ4) || defined(HAVE_LIBLZ4))
+#define CIMAGE_LZ4
+#include <lz4.h>
+#endif
+#if defined(CONFIG_DLOPEN_LIBZSTD) || defined(CONFIG_DLOPEN_LIBLZ4)
+#include <dlfcn.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "ext2fsP.h"
+#include "cimage.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define CIMAGE_ZSTD_LEVEL	3
+#define CIMAGE_FRAME_CACHE	8
+#define CIMAGE_CHUNK_CACHE	4
+#define CIMAGE_MAX_DEPTH	64	/* of a chain of delta images */
+
+/*
+ * Compression codecs
+ */
+#ifdef CIMAGE_ZSTD
+static size_t (*dl_ZSTD_compress)(void *, size_t, const void *, size_t, int);
+static size_t (*dl_ZSTD_decompress)(void *, size_t, const void *, size_t);
+static unsigned (*dl_ZSTD_isError)(size_t);
+
+#ifdef CONFIG_DLOPEN_LIBZSTD
+#if defined(__APPLE__)
+#define LIBZSTD_SO "libzstd.1.dylib"
+#else
+#define LIBZSTD_SO "libzstd.so.1"
+#endif
+
+static int libzstd_available(void)
+{
+	static void *handle;
+
+	if (handle)
+		return dl_ZSTD_isError != NULL;
+	handle = dlopen(LIBZSTD_SO, RTLD_NOW);
+	if (!handle)
+		return 0;
+	dl_ZSTD_compress = (size_t (*)(void *, size_t, const void *, size_t,
+				       int)) dlsym(handle, "ZSTD_compress");
+	dl_ZSTD_decompress = (size_t (*)(void *, size_t, const void *,
+					 size_t)) dlsym(handle,
+							"ZSTD_decompress");
+	dl_ZSTD_isError = (unsigned (*)(size_t)) dlsym(handle,
+						       "ZSTD_isError");
+	if (!dl_ZSTD_compress || !dl_ZSTD_decompress)
+		dl_ZSTD_isError = NULL;
+	return dl_ZSTD_isError != NULL;
+}
+#else
+static int libzstd_available(void)
+{
+	dl_ZSTD_compress = ZSTD_compress;
+	dl_ZSTD_decompress = ZSTD_decompress;
+	dl_ZSTD_isError = ZSTD_isError;
+	return 1;
+}
+#endif /* CONFIG_DLOPEN_LIBZSTD */
+#else
+static int libzstd_available(void)
+{
+	return 0;
+}
+#endif /* CIMAGE_ZSTD */
+
+#ifdef CIMAGE_LZ4
+static int (*dl_LZ4_compress_default)(const char *, char *, int, int);
+static int (*dl_LZ4_decompress_safe)(const char *, char *, int, int);
+
+#ifdef CONFIG_DLOPEN_LIBLZ4
+#if defined(__APPLE__)
+#define LIBLZ4_SO "liblz4.1.dylib"
+#else
+#define LIBLZ4_SO "liblz4.so.1"
+#endif
+
+static int liblz4_available(void)
+{
+	static void *handle;
+
+	if (handle)
+		return dl_LZ4_decompress_safe != NULL;
+	handle = dlopen(LIBLZ4_SO, RTLD_NOW);
+	if (!handle)
+		return 0;
+	dl_LZ4_compress_default = (int (*)(const char *, char *, int, int))
+		dlsym(handle, "LZ4_compress_default");
+	dl_LZ4_decompress_safe = (int (*)(const char *, char *, int, int))
+		dlsym(handle, "LZ4_decompress_safe");
+	if (!dl_LZ4_compress_default)
+		dl_LZ4_decompress_safe = NULL;
+	return dl_LZ4_decompress_safe != NULL;
+}
+#else
+static int liblz4_available(void)
+{
+	dl_LZ4_compress_default = LZ4_compress_default;
+	dl_LZ4_decompress_safe = LZ4_decompress_safe;
+	return 1;
+}
+#endif /* CONFIG_DLOPEN_LIBLZ4 */
+#else
+static int liblz4_available(void)
+{
+	return 0;
+}
+#endif /* CIMAGE_LZ4 */
+
+static const char *codec_names[] = { "none", "zstd", "lz4" };
+
+/* Return the codec called name, or -1 if there is no such codec */
+int ext2fs_cimage_codec(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++)
+		if (!strcmp(name, codec_names[i]))
+			return i;
+	return -1;
+}
+
+const char *ext2fs_cimage_codec_name(int codec)
+{
+	if (codec < 0 ||
+	    codec >= (int) (sizeof(codec_names) / sizeof(codec_names[0])))
+		return "unknown";
+	return codec_names[codec];
+}
+
+/*
+ * Make sure the library for codec can be used.  This must be called
+ * before the codec is used, and before any threads using it start.
+ */
+errcode_t ext2fs_cimage_codec_init(int codec)
+{
+	switch (codec) {
+	case EXT2_CIMAGE_CODEC_NONE:
+		return 0;
+	case EXT2_CIMAGE_CODEC_ZSTD:
+		return libzstd_available() ? 0 : EXT2_ET_CIMAGE_NO_CODEC;
+	case EXT2_CIMAGE_CODEC_LZ4:
+		return liblz4_available() ? 0 : EXT2_ET_CIMAGE_NO_CODEC;
+	}
+	return EXT2_ET_CIMAGE_NO_CODEC;
+}
+
+/*
+ * Compress in_len bytes from in into out, which has room for *out_len
+ * bytes, and set *out_len to the compressed size.  If the result would
+ * not fit, EXT2_ET_NO_MEMORY is returned; callers pass in_len - 1 to
+ * find out whether compressing is worth it.
+ */
+errcode_t ext2fs_cimage_compress(int codec, const void *in, size_t in_len,
+				 void *out, size_t *out_len)
+{
+	switch (codec) {
+#ifdef CIMAGE_ZSTD
+	case EXT2_CIMAGE_CODEC_ZSTD: {
+		size_t ret;
+
+		if (!dl_ZSTD_isError)
+			return EXT2_ET_CIMAGE_NO_CODEC;
+		ret = dl_ZSTD_compress(out, *out_len, in, in_len,
+				       CIMAGE_ZSTD_LEVEL);
+		if (dl_ZSTD_isError(ret))
+			return EXT2_ET_NO_MEMORY;
+		*out_len = ret;
+		return 0;
+	}
+#endif
+#ifdef CIMAGE_LZ4
+	case EXT2_CIMAGE_CODEC_LZ4: {
+		int ret;
+
+		if (!dl_LZ4_decompress_safe)
+			return EXT2_ET_CIMAGE_NO_CODEC;
+		ret = dl_LZ4_compress_default(in, out, in_len, *out_len);
+		if (ret <= 0)
+			return EXT2_ET_NO_MEMORY;
+		*out_len = ret;
+		return 0;
+	}
+#endif
+	case EXT2_CIMAGE_CODEC_NONE:
+		return EXT2_ET_NO_MEMORY;
+	}
+	return EXT2_ET_CIMAGE_NO_CODEC;
+}
+
+/* Decompress in_len bytes from in, which must give exactly out_len bytes */
+errcode_t ext2fs_cimage_decompress(int codec, const void *in, size_t in_len,
+				   void *out, size_t out_len)
+{
+	switch (codec) {
+#ifdef CIMAGE_ZSTD
+	case EXT2_CIMAGE_CODEC_ZSTD: {
+		size_t ret;
+
+		if (!dl_ZSTD_isError)
+			return EXT2_ET_CIMAGE_NO_CODEC;
+		ret = dl_ZSTD_decompress(out, out_len, in, in_len);
+		if (dl_ZSTD_isError(ret) || ret != out_len)
+			return EXT2_ET_CIMAGE_CORRUPTED;
+		return 0;
+	}
+#endif
+#ifdef CIMAGE_LZ4
+	case EXT2_CIMAGE_CODEC_LZ4: {
+		int ret;
+
+		if (!dl_LZ4_decompress_safe)
+			return EXT2_ET_CIMAGE_NO_CODEC;
+		ret = dl_LZ4_decompress_safe(in, out, in_len, out_len);
+		if (ret < 0 || (size_t) ret != out_len)
+			return EXT2_ET_CIMAGE_CORRUPTED;
+		return 0;
+	}
+#endif
+	case EXT2_CIMAGE_CODEC_NONE:
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	}
+	return EXT2_ET_CIMAGE_NO_CODEC;
+}
+
+/*
+ * Header conversion
+ */
+static void cimage_swap_hdr(struct ext2_cimage_hdr *hdr EXT2FS_ATTR((unused)))
+{
+#ifdef WORDS_BIGENDIAN
+	hdr->magic = ext2fs_swab32(hdr->magic);
+	hdr->version = ext2fs_swab32(hdr->version);
+	hdr->hdr_size = ext2fs_swab32(hdr->hdr_size);
+	hdr->codec = ext2fs_swab32(hdr->codec);
+	hdr->block_size = ext2fs_swab32(hdr->block_size);
+	hdr->chunk_blocks = ext2fs_swab32(hdr->chunk_blocks);
+	hdr->frame_blocks = ext2fs_swab32(hdr->frame_blocks);
+	hdr->flags = ext2fs_swab32(hdr->flags);
+	hdr->blocks_count = ext2fs_swab64(hdr->blocks_count);
+	hdr->unique_blocks = ext2fs_swab64(hdr->unique_blocks);
+	hdr->frame_table_offset = ext2fs_swab64(hdr->frame_table_offset);
+	hdr->nr_frames = ext2fs_swab64(hdr->nr_frames);
+	hdr->chunk_table_offset = ext2fs_swab64(hdr->chunk_table_offset);
+	hdr->nr_chunks = ext2fs_swab64(hdr->nr_chunks);
+	hdr->base_checksum = ext2fs_swab32(hdr->base_checksum);
+	hdr->checksum = ext2fs_swab32(hdr->checksum);
+#endif
+}
+
+static __u32 cimage_hdr_csum(struct ext2_cimage_hdr *hdr)
+{
+	return ext2fs_crc32c_le(~0U, (unsigned char *) hdr,
+				offsetof(struct ext2_cimage_hdr, checksum));
+}
+
+/* Convert hdr to its on-disk form and set its checksum */
+void ext2fs_cimage_hdr_to_disk(struct ext2_cimage_hdr *hdr)
+{
+	hdr->checksum = 0;
+	cimage_swap_hdr(hdr);
+	hdr->checksum = ext2fs_cpu_to_le32(cimage_hdr_csum(hdr));
+}
+
+/* Check a header read from disk and convert it to host byte order */
+errcode_t ext2fs_cimage_hdr_from_disk(struct ext2_cimage_hdr *hdr)
+{
+	if (ext2fs_le32_to_cpu(hdr->magic) != EXT2_CIMAGE_MAGIC)
+		return EXT2_ET_MAGIC_E2IMAGE;
+	if (ext2fs_le32_to_cpu(hdr->checksum) != cimage_hdr_csum(hdr))
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	cimage_swap_hdr(hdr);
+	if (hdr->version != EXT2_CIMAGE_VERSION ||
+	    hdr->hdr_size != EXT2_CIMAGE_HDR_SIZE ||
+	    (hdr->flags & ~EXT2_CIMAGE_FLAG_DELTA))
+		return EXT2_ET_UNIMPLEMENTED;
+	if ((hdr->flags & EXT2_CIMAGE_FLAG_DELTA) &&
+	    (!hdr->base_name[0] ||
+	     !memchr(hdr->base_name, 0, sizeof(hdr->base_name))))
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	if (hdr->block_size < EXT2_MIN_BLOCK_SIZE ||
+	    hdr->block_size > EXT2_MAX_BLOCK_SIZE ||
+	    (hdr->block_size & (hdr->block_size - 1)) ||
+	    hdr->chunk_blocks == 0 || hdr->chunk_blocks > (1U << 20) ||
+	    hdr->frame_blocks == 0 || hdr->frame_blocks > 4096 ||
+	    hdr->nr_frames != (hdr->unique_blocks + hdr->frame_blocks - 1) /
+				hdr->frame_blocks)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	return 0;
+}
+
+/* Read and check the header of the compressed image called name */
+errcode_t ext2fs_cimage_read_hdr(const char *name,
+				 struct ext2_cimage_hdr *hdr)
+{
+	ssize_t actual;
+	errcode_t retval;
+	int fd;
+
+	fd = ext2fs_open_file(name, O_RDONLY, 0);
+	if (fd < 0)
+		return errno;
+	actual = pread(fd, hdr, sizeof(*hdr), 0);
+	if (actual < 0)
+		retval = errno;
+	else if (actual != sizeof(*hdr))
+		retval = EXT2_ET_MAGIC_E2IMAGE;
+	else
+		retval = ext2fs_cimage_hdr_from_disk(hdr);
+	close(fd);
+	return retval;
+}
+
+/* Return 1 if the file called name is a compressed image */
+int ext2fs_cimage_probe(const char *name)
+{
+	struct ext2_cimage_hdr hdr;
+
+	return ext2fs_cimage_read_hdr(name, &hdr) == 0;
+}
+
+/*
+ * The I/O manager
+ */
+struct cimage_cache_ent {
+	__u64		num;
+	unsigned long	used;
+	char		*buf;
+};
+
+struct cimage_private_data {
+	int	magic;
+	int	dev;
+	int	flags;
+	struct ext2_cimage_hdr hdr;
+	struct ext2_cimage_frame *frames;
+	struct ext2_cimage_chunk *chunks;
+	char	*cbuf;		/* compressed data being read */
+	size_t	cbuf_size;
+	unsigned long tick;
+	struct cimage_cache_ent frame_cache[CIMAGE_FRAME_CACHE];
+	struct cimage_cache_ent chunk_cache[CIMAGE_CHUNK_CACHE];
+	io_channel base;	/* for a delta image */
+	char	*base_buf;
+	struct struct_io_stats io_stats;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
+};
+
+static inline void cimage_lock(struct cimage_private_data *data)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_lock(&data->mutex);
+#endif
+}
+
+static inline void cimage_unlock(struct cimage_private_data *data)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_unlock(&data->mutex);
+#endif
+}
+
+static errcode_t cimage_pread(struct cimage_private_data *data, void *buf,
+			      size_t size, ext2_loff_t offset)
+{
+	ssize_t actual;
+
+	actual = pread(data->dev, buf, size, offset);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	return 0;
+}
+
+/*
+ * Find num in cache.  On a miss, the least recently used entry is
+ * returned with *hit clear, for the caller to fill in.
+ */
+static struct cimage_cache_ent *
+cimage_cache_lookup(struct cimage_private_data *data,
+		    struct cimage_cache_ent *cache, int n, __u64 num, int *hit)
+{
+	struct cimage_cache_ent *ent, *lru = cache;
+	int i;
+
+	for (i = 0, ent = cache; i < n; i++, ent++) {
+		if (ent->used && ent->num == num) {
+			ent->used = ++data->tick;
+			*hit = 1;
+			return ent;
+		}
+		if (ent->used < lru->used)
+			lru = ent;
+	}
+	*hit = 0;
+	lru->used = 0;
+	lru->num = num;
+	return lru;
+}
+
+/* Read compressed data of length bytes at offset into out */
+static errcode_t cimage_load(struct cimage_private_data *data,
+			     __u64 offset, __u32 length, void *out,
+			     size_t out_len)
+{
+	errcode_t retval;
+
+	if (length > out_len)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	if (length == out_len)
+		return cimage_pread(data, out, out_len, offset);
+	retval = cimage_pread(data, data->cbuf, length, offset);
+	if (retval)
+		return retval;
+	return ext2fs_cimage_decompress(data->hdr.codec, data->cbuf, length,
+					out, out_len);
+}
+
+/* Return the chunk map of chunk, or NULL if it has no non-zero blocks */
+static errcode_t cimage_get_chunk(struct cimage_private_data *data,
+				  __u64 chunk, __u64 **map)
+{
+	struct ext2_cimage_chunk *c;
+	struct cimage_cache_ent *ent;
+	size_t	len = data->hdr.chunk_blocks * sizeof(__u64);
+	__u64	low = 0, high = data->hdr.nr_chunks, mid, *m;
+	errcode_t retval;
+	int	hit;
+	__u32	i;
+
+	*map = NULL;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (data->chunks[mid].chunk < chunk)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low >= data->hdr.nr_chunks || data->chunks[low].chunk != chunk)
+		return 0;
+	c = &data->chunks[low];
+
+	ent = cimage_cache_lookup(data, data->chunk_cache, CIMAGE_CHUNK_CACHE,
+				  chunk, &hit);
+	m = (__u64 *) ent->buf;
+	if (!hit) {
+		retval = cimage_load(data, c->offset, c->length, m, len);
+		if (retval)
+			return retval;
+		for (i = 0; i < data->hdr.chunk_blocks; i++) {
+			m[i] = ext2fs_le64_to_cpu(m[i]);
+			if (m[i] > data->hdr.unique_blocks &&
+			    !(m[i] == EXT2_CIMAGE_BLOCK_BASE && data->base))
+				return EXT2_ET_CIMAGE_CORRUPTED;
+		}
+		ent->used = ++data->tick;
+	}
+	*map = m;
+	return 0;
+}
+
+static errcode_t cimage_get_frame(struct cimage_private_data *data,
+				  __u64 frame, char **buf)
+{
+	struct ext2_cimage_frame *f = &data->frames[frame];
+	struct cimage_cache_ent *ent;
+	errcode_t retval;
+	int	hit;
+
+	ent = cimage_cache_lookup(data, data->frame_cache, CIMAGE_FRAME_CACHE,
+				  frame, &hit);
+	if (!hit) {
+		retval = cimage_load(data, f->offset, f->length, ent->buf,
+				     (size_t) f->blocks *
+				     data->hdr.block_size);
+		if (retval)
+			return retval;
+		ent->used = ++data->tick;
+	}
+	*buf = ent->buf;
+	return 0;
+}
+
+/* Find image block blk; *buf is set to NULL for a block of zeroes */
+static errcode_t cimage_get_block(struct cimage_private_data *data,
+				  __u64 blk, char **buf)
+{
+	__u64	*map, ref, frame;
+	errcode_t retval;
+	char	*fbuf;
+
+	*buf = NULL;
+	retval = cimage_get_chunk(data, blk / data->hdr.chunk_blocks, &map);
+	if (retval || !map)
+		return retval;
+	ref = map[blk % data->hdr.chunk_blocks];
+	if (!ref)
+		return 0;
+	if (ref == EXT2_CIMAGE_BLOCK_BASE) {
+		retval = io_channel_read_blk64(data->base, blk, 1,
+					       data->base_buf);
+		if (retval)
+			return retval;
+		*buf = data->base_buf;
+		return 0;
+	}
+	ref--;
+	frame = ref / data->hdr.frame_blocks;
+	if (ref % data->hdr.frame_blocks >= data->frames[frame].blocks)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	retval = cimage_get_frame(data, frame, &fbuf);
+	if (retval)
+		return retval;
+	*buf = fbuf + (ref % data->hdr.frame_blocks) * data->hdr.block_size;
+	return 0;
+}
+
+static errcode_t cimage_read_bytes(struct cimage_private_data *data,
+				   ext2_loff_t offset, size_t size, char *buf)
+{
+	ext2_loff_t end = (ext2_loff_t) data->hdr.blocks_count *
+		data->hdr.block_size;
+	unsigned int bs = data->hdr.block_size;
+	errcode_t retval;
+	size_t	n, boff;
+	char	*p;
+
+	while (size) {
+		if (offset >= end) {
+			memset(buf, 0, size);
+			return EXT2_ET_SHORT_READ;
+		}
+		boff = offset % bs;
+		n = bs - boff;
+		if (n > size)
+			n = size;
+		retval = cimage_get_block(data, offset / bs, &p);
+		if (retval)
+			return retval;
+		if (p)
+			memcpy(buf, p + boff, n);
+		else
+			memset(buf, 0, n);
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static errcode_t cimage_read_tables(struct cimage_private_data *data)
+{
+	struct ext2_cimage_hdr *hdr = &data->hdr;
+	ext2fs_struct_stat st;
+	size_t	frame_len, max_len;
+	errcode_t retval;
+	__u64	i;
+
+	if (ext2fs_fstat(data->dev, &st) < 0)
+		return errno;
+	if (hdr->nr_frames > (__u64) st.st_size / sizeof(*data->frames) ||
+	    hdr->nr_chunks > (__u64) st.st_size / sizeof(*data->chunks) ||
+	    hdr->frame_table_offset + hdr->nr_frames *
+	    sizeof(*data->frames) > (__u64) st.st_size ||
+	    hdr->chunk_table_offset + hdr->nr_chunks *
+	    sizeof(*data->chunks) > (__u64) st.st_size)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+
+	retval = ext2fs_get_array(hdr->nr_frames + 1, sizeof(*data->frames),
+				  &data->frames);
+	if (retval)
+		return retval;
+	retval = cimage_pread(data, data->frames,
+			      hdr->nr_frames * sizeof(*data->frames),
+			      hdr->frame_table_offset);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(hdr->nr_chunks + 1, sizeof(*data->chunks),
+				  &data->chunks);
+	if (retval)
+		return retval;
+	retval = cimage_pread(data, data->chunks,
+			      hdr->nr_chunks * sizeof(*data->chunks),
+			      hdr->chunk_table_offset);
+	if (retval)
+		return retval;
+
+	frame_len = (size_t) hdr->frame_blocks * hdr->block_size;
+	for (i = 0; i < hdr->nr_frames; i++) {
+		struct ext2_cimage_frame *f = &data->frames[i];
+
+		f->offset = ext2fs_le64_to_cpu(f->offset);
+		f->length = ext2fs_le32_to_cpu(f->length);
+		f->blocks = ext2fs_le32_to_cpu(f->blocks);
+		if (f->blocks == 0 || f->blocks > hdr->frame_blocks ||
+		    (i + 1 < hdr->nr_frames && f->blocks != hdr->frame_blocks))
+			return EXT2_ET_CIMAGE_CORRUPTED;
+	}
+	for (i = 0; i < hdr->nr_chunks; i++) {
+		struct ext2_cimage_chunk *c = &data->chunks[i];
+
+		c->chunk = ext2fs_le64_to_cpu(c->chunk);
+		c->offset = ext2fs_le64_to_cpu(c->offset);
+		c->length = ext2fs_le32_to_cpu(c->length);
+		if (i && c->chunk <= data->chunks[i - 1].chunk)
+			return EXT2_ET_CIMAGE_CORRUPTED;
+	}
+
+	max_len = hdr->chunk_blocks * sizeof(__u64);
+	if (max_len < frame_len)
+		max_len = frame_len;
+	data->cbuf_size = max_len;
+	retval = ext2fs_get_mem(max_len, &data->cbuf);
+	if (retval)
+		return retval;
+	for (i = 0; i < CIMAGE_FRAME_CACHE; i++) {
+		retval = ext2fs_get_mem(frame_len,
+					&data->frame_cache[i].buf);
+		if (retval)
+			return retval;
+	}
+	for (i = 0; i < CIMAGE_CHUNK_CACHE; i++) {
+		retval = ext2fs_get_mem(hdr->chunk_blocks * sizeof(__u64),
+					&data->chunk_cache[i].buf);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+static void cimage_free_data(struct cimage_private_data *data)
+{
+	int i;
+
+	if (data->dev >= 0)
+		close(data->dev);
+	if (data->base)
+		io_channel_close(data->base);
+	ext2fs_free_mem(&data->base_buf);
+	for (i = 0; i < CIMAGE_FRAME_CACHE; i++)
+		ext2fs_free_mem(&data->frame_cache[i].buf);
+	for (i = 0; i < CIMAGE_CHUNK_CACHE; i++)
+		ext2fs_free_mem(&data->chunk_cache[i].buf);
+	ext2fs_free_mem(&data->cbuf);
+	ext2fs_free_mem(&data->frames);
+	ext2fs_free_mem(&data->chunks);
+	ext2fs_free_mem(&data);
+}
+
+static errcode_t cimage_open_layer(const char *name, int flags, int depth,
+				   io_channel *channel);
+
+/*
+ * Open the base image of a delta image.  A relative base name is taken
+ * relative to the directory holding the delta image.
+ */
+static errcode_t cimage_open_base(io_channel io, int depth)
+{
+	struct cimage_private_data *data, *base_data;
+	const char *slash;
+	errcode_t retval;
+	char	*path;
+	size_t	dir_len = 0;
+
+	data = (struct cimage_private_data *) io->private_data;
+	if (depth >= CIMAGE_MAX_DEPTH)
+		return EXT2_ET_CIMAGE_CORRUPTED;
+	slash = strrchr(io->name, '/');
+	if (slash && data->hdr.base_name[0] != '/')
+		dir_len = slash - io->name + 1;
+	retval = ext2fs_get_mem(dir_len + strlen(data->hdr.base_name) + 1,
+				&path);
+	if (retval)
+		return retval;
+	memcpy(path, io->name, dir_len);
+	strcpy(path + dir_len, data->hdr.base_name);
+	retval = cimage_open_layer(path, 0, depth + 1, &data->base);
+	ext2fs_free_mem(&path);
+	if (retval)
+		return retval;
+
+	base_data = (struct cimage_private_data *) data->base->private_data;
+	if (base_data->hdr.checksum != data->hdr.base_checksum ||
+	    base_data->hdr.block_size != data->hdr.block_size)
+		return EXT2_ET_CIMAGE_BASE_CHANGED;
+	retval = io_channel_set_blksize(data->base, data->hdr.block_size);
+	if (retval)
+		return retval;
+	return ext2fs_get_mem(data->hdr.block_size, &data->base_buf);
+}
+
+static errcode_t cimage_open_layer(const char *name, int flags, int depth,
+				   io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct cimage_private_data *data = NULL;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (flags & IO_FLAG_RW)
+		return EROFS;
+
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct cimage_private_data), &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->io_stats.num_fields = 2;
+	data->flags = flags;
+	data->dev = -1;
+
+	io->manager = cimage_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	data->dev = ext2fs_open_file(name, O_RDONLY, 0);
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+	retval = cimage_pread(data, &data->hdr, sizeof(data->hdr), 0);
+	if (retval == EXT2_ET_CIMAGE_CORRUPTED)
+		retval = EXT2_ET_MAGIC_E2IMAGE;
+	if (retval)
+		goto cleanup;
+	retval = ext2fs_cimage_hdr_from_disk(&data->hdr);
+	if (retval)
+		goto cleanup;
+	retval = ext2fs_cimage_codec_init(data->hdr.codec);
+	if (retval)
+		goto cleanup;
+	retval = cimage_read_tables(data);
+	if (retval)
+		goto cleanup;
+	if (data->hdr.flags & EXT2_CIMAGE_FLAG_DELTA) {
+		retval = cimage_open_base(io, depth);
+		if (retval)
+			goto cleanup;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (flags & IO_FLAG_THREADS) {
+		io->flags |= CHANNEL_FLAGS_THREADS;
+		retval = pthread_mutex_init(&data->mutex, NULL);
+		if (retval)
+			goto cleanup;
+	}
+#endif
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data)
+		cimage_free_data(data);
+	if (io->name)
+		ext2fs_free_mem(&io->name);
+	ext2fs_free_mem(&io);
+	return retval;
+}
+
+static errcode_t cimage_open(const char *name, int flags,
+			     io_channel *channel)
+{
+	return cimage_open_layer(name, flags, 0, channel);
+}
+
+static errcode_t cimage_close(io_channel channel)
+{
+	struct cimage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct cimage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_destroy(&data->mutex);
+#endif
+	cimage_free_data(data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return 0;
+}
+
+static errcode_t cimage_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t cimage_read_blk64(io_channel channel,
+				   unsigned long long block, int count,
+				   void *buf)
+{
+	struct cimage_private_data *data;
+	size_t		size;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct cimage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? (size_t) -count :
+		(size_t) count * channel->block_size;
+	cimage_lock(data);
+	data->io_stats.bytes_read += size;
+	retval = cimage_read_bytes(data, (ext2_loff_t) block *
+				   channel->block_size, size, buf);
+	cimage_unlock(data);
+	if (retval && channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       size, 0, retval);
+	return retval;
+}
+
+static errcode_t cimage_read_blk(io_channel channel, unsigned long block,
+				 int count, void *buf)
+{
+	return cimage_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t cimage_write_blk64(io_channel channel EXT2FS_ATTR((unused)),
+				    unsigned long long block EXT2FS_ATTR((unused)),
+				    int count EXT2FS_ATTR((unused)),
+				    const void *buf EXT2FS_ATTR((unused)))
+{
+	return EROFS;
+}
+
+static errcode_t cimage_write_blk(io_channel channel, unsigned long block,
+				  int count, const void *buf)
+{
+	return cimage_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t cimage_write_byte(io_channel channel EXT2FS_ATTR((unused)),
+				   unsigned long offset EXT2FS_ATTR((unused)),
+				   int size EXT2FS_ATTR((unused)),
+				   const void *buf EXT2FS_ATTR((unused)))
+{
+	return EROFS;
+}
+
+static errcode_t cimage_flush(io_channel channel EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+static errcode_t cimage_set_option(io_channel channel EXT2FS_ATTR((unused)),
+				   const char *option EXT2FS_ATTR((unused)),
+				   const char *arg EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t cimage_get_stats(io_channel channel, io_stats *stats)
+{
+	struct cimage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct cimage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
+
+static struct struct_io_manager struct_cimage_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Compressed image I/O Manager",
+	.open		= cimage_open,
+	.close		= cimage_close,
+	.set_blksize	= cimage_set_blksize,
+	.read_blk	= cimage_read_blk,
+	.write_blk	= cimage_write_blk,
+	.flush		= cimage_flush,
+	.write_byte	= cimage_write_byte,
+	.set_option	= cimage_set_option,
+	.get_stats	= cimage_get_stats,
+	.read_blk64	= cimage_read_blk64,
+	.write_blk64	= cimage_write_blk64,
+};
+
+io_manager cimage_io_manager = &struct_cimage_manager;
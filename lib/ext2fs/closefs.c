@@ -250,24 +250,76 @@ void ext2fs_update_dynamic_rev(ext2_filsys fs)
 	/* other fields should be left alone */
 }
 
-static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
-				    blk64_t group_block,
+/*
+ * The backup superblocks and group descriptors are queued up and handed
+ * to the I/O manager FLUSH_BATCH at a time, so that it can merge
+ * adjacent writes and keep several of them in flight.  Each queued
+ * backup superblock needs its own copy, since s_block_group_nr and the
+ * checksum differ from group to group.
+ */
+#define FLUSH_BATCH	256
+
+struct flush_batch {
+	struct io_blk_req	*reqs;
+	char			*supers;
+	int			nr;
+};
+
+static errcode_t flush_batch_submit(ext2_filsys fs, struct flush_batch *b)
+{
+	errcode_t retval;
+
+	retval = io_channel_write_blkv(fs->io, b->reqs, b->nr, NULL, NULL);
+	b->nr = 0;
+	return retval;
+}
+
+static errcode_t flush_batch_add(ext2_filsys fs, struct flush_batch *b,
+				 blk64_t blk, int count, void *buf)
+{
+	struct io_blk_req *req;
+	errcode_t	retval;
+
+	if (b->nr == FLUSH_BATCH) {
+		retval = flush_batch_submit(fs, b);
+		if (retval)
+			return retval;
+	}
+	req = &b->reqs[b->nr++];
+	memset(req, 0, sizeof(*req));
+	req->block = blk;
+	req->count = count;
+	req->buf = buf;
+	return 0;
+}
+
+static errcode_t write_backup_super(ext2_filsys fs, struct flush_batch *b,
+				    dgrp_t group, blk64_t group_block,
 				    struct ext2_super_block *super_shadow)
 {
+	struct ext2_super_block *super;
 	errcode_t retval;
 	dgrp_t	sgrp = group;
 
+	if (b->nr == FLUSH_BATCH) {
+		retval = flush_batch_submit(fs, b);
+		if (retval)
+			return retval;
+	}
+	super = (struct ext2_super_block *) (b->supers +
+					     b->nr * SUPERBLOCK_SIZE);
+	memcpy(super, super_shadow, SUPERBLOCK_SIZE);
+
 	if (sgrp > ((1 << 16) - 1))
 		sgrp = (1 << 16) - 1;
 
-	super_shadow->s_block_group_nr = ext2fs_cpu_to_le16(sgrp);
+	super->s_block_group_nr = ext2fs_cpu_to_le16(sgrp);
 
-	retval = ext2fs_superblock_csum_set(fs, super_shadow);
+	retval = ext2fs_superblock_csum_set(fs, super);
 	if (retval)
 		return retval;
 
-	return io_channel_write_blk64(fs->io, group_block, -SUPERBLOCK_SIZE,
-				    super_shadow);
+	return flush_batch_add(fs, b, group_block, -SUPERBLOCK_SIZE, super);
 }
 
 errcode_t ext2fs_flush(ext2_filsys fs)
@@ -290,14 +342,26 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	char	*group_ptr;
 	blk64_t	old_desc_blocks;
 	struct ext2fs_numeric_progress_struct progress;
+	struct flush_batch batch;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	memset(&batch, 0, sizeof(batch));
 	if ((fs->flags & EXT2_FLAG_SUPER_ONLY) == 0 &&
 	    !ext2fs_has_feature_journal_dev(fs->super) &&
 	    fs->group_desc == NULL)
 		return EXT2_ET_NO_GDESC;
 
+	/*
+	 * Every copy of the descriptors is rewritten below, so any which
+	 * were never looked at have to be read in first.
+	 */
+	if ((fs->flags & EXT2_FLAG_SUPER_ONLY) == 0 && fs->lazy_gdt) {
+		retval = ext2fs_read_group_descs(fs);
+		if (retval)
+			return retval;
+	}
+
 	fs_state = fs->super->s_state;
 	feature_incompat = fs->super->s_feature_incompat;
 
@@ -374,6 +438,14 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	} else
 		old_desc_blocks = fs->desc_blocks;
 
+	retval = ext2fs_get_array(FLUSH_BATCH, sizeof(struct io_blk_req),
+				  &batch.reqs);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(FLUSH_BATCH, SUPERBLOCK_SIZE, &batch.supers);
+	if (retval)
+		goto errout;
+
 	if (fs->progress_ops && fs->progress_ops->init)
 		(fs->progress_ops->init)(fs, &progress, NULL,
 					 fs->group_desc_count);
@@ -388,7 +460,7 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 					 &new_desc_blk, 0);
 
 		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
-			retval = write_backup_super(fs, i, super_blk,
+			retval = write_backup_super(fs, &batch, i, super_blk,
 						    super_shadow);
 			if (retval)
 				goto errout;
@@ -397,20 +469,23 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 			continue;
 		if ((old_desc_blk) &&
 		    (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0))) {
-			retval = io_channel_write_blk64(fs->io,
-			      old_desc_blk, old_desc_blocks, group_ptr);
+			retval = flush_batch_add(fs, &batch, old_desc_blk,
+						 old_desc_blocks, group_ptr);
 			if (retval)
 				goto errout;
 		}
 		if (new_desc_blk) {
 			int meta_bg = i / EXT2_DESC_PER_BLOCK(fs->super);
 
-			retval = io_channel_write_blk64(fs->io, new_desc_blk,
-				1, group_ptr + (meta_bg*fs->blocksize));
+			retval = flush_batch_add(fs, &batch, new_desc_blk, 1,
+					group_ptr + (meta_bg*fs->blocksize));
 			if (retval)
 				goto errout;
 		}
 	}
+	retval = flush_batch_submit(fs, &batch);
+	if (retval)
+		goto errout;
 
 	if (fs->progress_ops && fs->progress_ops->close)
 		(fs->progress_ops->close)(fs, &progress, NULL);
@@ -434,7 +509,7 @@ write_primary_superblock_only:
 
 	retval = ext2fs_superblock_csum_set(fs, super_shadow);
 	if (retval)
-		return retval;
+		goto errout;
 
 	if (!(flags & EXT2_FLAG_FLUSH_NO_SYNC)) {
 		retval = io_channel_flush(fs->io);
@@ -454,6 +529,10 @@ write_primary_superblock_only:
 	}
 errout:
 	fs->super->s_state = fs_state;
+	if (batch.reqs)
+		ext2fs_free_mem(&batch.reqs);
+	if (batch.supers)
+		ext2fs_free_mem(&batch.supers);
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
 		ext2fs_free_mem(&super_shadow);
@@ -32,6 +32,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef UNITTEST
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #define min(x, y)		((x) > (y) ? (y) : (x))
 #define __ALIGN_KERNEL_MASK(x, mask)	(((x) + (mask)) & ~(mask))
 #define __ALIGN_KERNEL(x, a)	__ALIGN_KERNEL_MASK(x, (__typeof__(x))(a) - 1)
@@ -189,11 +196,263 @@ static inline uint32_t crc32_le_generic(uint32_t crc, unsigned char const *p,
 	return crc;
 }
 
-uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+static uint32_t crc32c_le_sw(uint32_t crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, crc32ctable_le, CRC32C_POLY_LE);
 }
 
+/*
+ * Hardware CRC32C.  With metadata_csum nearly every metadata block
+ * read or written is checksummed, so on CPUs which have a CRC32C
+ * instruction use it instead of the table driven code above.  The
+ * implementation is picked at run time on the first call.
+ *
+ * Buffers of a few kilobytes are split into three streams which are
+ * checksummed in parallel to hide the latency of the crc32 instruction,
+ * and the partial results are then shifted into place and combined.
+ * Shifting a raw CRC register over n zero bytes is a multiplication by
+ * x^(8n) modulo the polynomial, for which PCLMULQDQ is used when present.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && \
+	(defined(__clang__) || __GNUC__ >= 5)
+#define CRC32C_HW_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && !defined(__clang__) && defined(__aarch64__) && \
+	!defined(WORDS_BIGENDIAN) && defined(__linux__)
+#include <sys/auxv.h>
+#ifdef HWCAP_CRC32
+#define CRC32C_HW_ARM64
+#include <arm_acle.h>
+#endif
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, unsigned char const *p,
+			      size_t len);
+static crc32c_fn crc32c_le_impl;
+
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM64)
+/* Stream lengths, in bytes, for the three way interleaved loops */
+#define CRC32C_LONG	1024
+#define CRC32C_SHORT	256
+
+/*
+ * Multiply a and b modulo the CRC32C polynomial.  Both are in the
+ * reflected bit order used by the CRC register, so x^0 is 0x80000000.
+ */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 0x80000000, p = 0;
+
+	for (; m; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY_LE : b >> 1;
+	}
+	return p;
+}
+
+/* Return x^n modulo the CRC32C polynomial. */
+static uint32_t crc32c_xpow(unsigned int n)
+{
+	uint32_t sq = 0x40000000, p = 0x80000000;	/* x^1, x^0 */
+
+	for (; n; n >>= 1) {
+		if (n & 1)
+			p = crc32c_multmodp(sq, p);
+		sq = crc32c_multmodp(sq, sq);
+	}
+	return p;
+}
+
+/*
+ * Combine constants: shift_long[0] shifts a CRC over CRC32C_LONG bytes
+ * and shift_long[1] over twice that; likewise for shift_short.
+ */
+static uint32_t crc32c_shift_long[2], crc32c_shift_short[2];
+#endif
+
+#ifdef CRC32C_HW_X86
+/*
+ * _mm_crc32_u64(0, v) reduces the 64-bit carry-less product of two
+ * reflected 32-bit values and multiplies it by x^33, so the PCLMUL
+ * combine constants are x^(8n - 33) rather than x^(8n).
+ */
+static uint32_t crc32c_pclmul_shift_long[2], crc32c_pclmul_shift_short[2];
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_le_sse42(uint32_t crc, unsigned char const *p,
+				size_t len)
+{
+	uint64_t c = crc, v;
+
+	while (len && ((uintptr_t) p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+
+__attribute__((target("sse4.2")))
+static inline void crc32c_sse42_3way(uint64_t *c0, uint64_t *c1,
+				     uint64_t *c2, unsigned char const *p,
+				     size_t n)
+{
+	uint64_t a = *c0, b = *c1, c = *c2, v0, v1, v2;
+	unsigned char const *end = p + n;
+
+	for (; p < end; p += 8) {
+		memcpy(&v0, p, 8);
+		memcpy(&v1, p + n, 8);
+		memcpy(&v2, p + 2 * n, 8);
+		a = _mm_crc32_u64(a, v0);
+		b = _mm_crc32_u64(b, v1);
+		c = _mm_crc32_u64(c, v2);
+	}
+	*c0 = a;
+	*c1 = b;
+	*c2 = c;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_pclmul_shift(uint32_t crc, uint32_t k)
+{
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					    _mm_cvtsi32_si128(k), 0);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_le_pclmul(uint32_t crc, unsigned char const *p,
+				 size_t len)
+{
+	uint64_t c0 = crc, c1, c2;
+
+	while (len && ((uintptr_t) p & 7)) {
+		c0 = _mm_crc32_u8(c0, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG) {
+		c1 = c2 = 0;
+		crc32c_sse42_3way(&c0, &c1, &c2, p, CRC32C_LONG);
+		c0 = crc32c_pclmul_shift(c0, crc32c_pclmul_shift_long[1]) ^
+			crc32c_pclmul_shift(c1, crc32c_pclmul_shift_long[0]) ^
+			c2;
+		p += 3 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		c1 = c2 = 0;
+		crc32c_sse42_3way(&c0, &c1, &c2, p, CRC32C_SHORT);
+		c0 = crc32c_pclmul_shift(c0, crc32c_pclmul_shift_short[1]) ^
+			crc32c_pclmul_shift(c1, crc32c_pclmul_shift_short[0]) ^
+			c2;
+		p += 3 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+	return crc32c_le_sse42(c0, p, len);
+}
+#endif /* CRC32C_HW_X86 */
+
+#ifdef CRC32C_HW_ARM64
+__attribute__((target("+crc")))
+static uint32_t crc32c_le_arm64(uint32_t crc, unsigned char const *p,
+				size_t len)
+{
+	uint32_t c0 = crc, c1, c2;
+	uint64_t v0, v1, v2;
+	size_t i;
+
+	while (len && ((uintptr_t) p & 7)) {
+		c0 = __crc32cb(c0, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG) {
+		c1 = c2 = 0;
+		for (i = 0; i < CRC32C_LONG; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + i + CRC32C_LONG, 8);
+			memcpy(&v2, p + i + 2 * CRC32C_LONG, 8);
+			c0 = __crc32cd(c0, v0);
+			c1 = __crc32cd(c1, v1);
+			c2 = __crc32cd(c2, v2);
+		}
+		c0 = crc32c_multmodp(crc32c_shift_long[1], c0) ^
+			crc32c_multmodp(crc32c_shift_long[0], c1) ^ c2;
+		p += 3 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v0, p, 8);
+		c0 = __crc32cd(c0, v0);
+	}
+	while (len--)
+		c0 = __crc32cb(c0, *p++);
+	return c0;
+}
+#endif /* CRC32C_HW_ARM64 */
+
+static void crc32c_select_impl(void)
+{
+	crc32c_fn fn = crc32c_le_sw;
+
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM64)
+	crc32c_shift_long[0] = crc32c_xpow(8 * CRC32C_LONG);
+	crc32c_shift_long[1] = crc32c_xpow(16 * CRC32C_LONG);
+	crc32c_shift_short[0] = crc32c_xpow(8 * CRC32C_SHORT);
+	crc32c_shift_short[1] = crc32c_xpow(16 * CRC32C_SHORT);
+#endif
+#if defined(CRC32C_HW_X86)
+	crc32c_pclmul_shift_long[0] = crc32c_xpow(8 * CRC32C_LONG - 33);
+	crc32c_pclmul_shift_long[1] = crc32c_xpow(16 * CRC32C_LONG - 33);
+	crc32c_pclmul_shift_short[0] = crc32c_xpow(8 * CRC32C_SHORT - 33);
+	crc32c_pclmul_shift_short[1] = crc32c_xpow(16 * CRC32C_SHORT - 33);
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		fn = crc32c_le_sse42;
+		if (__builtin_cpu_supports("pclmul"))
+			fn = crc32c_le_pclmul;
+	}
+#elif defined(CRC32C_HW_ARM64)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		fn = crc32c_le_arm64;
+#endif
+	crc32c_le_impl = fn;
+}
+
+/*
+ * Pick the implementation exactly once; pthread_once also makes the
+ * shift constants and crc32c_le_impl visible to every thread which
+ * returns from it.
+ */
+#ifdef HAVE_PTHREAD
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static inline void crc32c_init(void)
+{
+	pthread_once(&crc32c_once, crc32c_select_impl);
+}
+#else
+static inline void crc32c_init(void)
+{
+	if (!crc32c_le_impl)
+		crc32c_select_impl();
+}
+#endif
+
+uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+	crc32c_init();
+	return crc32c_le_impl(crc, p, len);
+}
+
 /**
  * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
  * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
@@ -925,14 +1184,127 @@ static int test_crc32c(void)
 	return failures;
 }
 
+struct crc32c_impl {
+	const char	*name;
+	crc32c_fn	fn;
+	int		usable;
+};
+
+static struct crc32c_impl *crc32c_impls(void)
+{
+	static struct crc32c_impl impls[] = {
+		{ "table", crc32c_le_sw, 1 },
+#ifdef CRC32C_HW_X86
+		{ "sse4.2", crc32c_le_sse42, 0 },
+		{ "sse4.2+pclmul", crc32c_le_pclmul, 0 },
+#endif
+#ifdef CRC32C_HW_ARM64
+		{ "armv8 crc", crc32c_le_arm64, 0 },
+#endif
+		{ NULL, NULL, 0 },
+	};
+
+	crc32c_init();
+#ifdef CRC32C_HW_X86
+	impls[1].usable = __builtin_cpu_supports("sse4.2");
+	impls[2].usable = impls[1].usable && __builtin_cpu_supports("pclmul");
+#endif
+#ifdef CRC32C_HW_ARM64
+	impls[1].usable = crc32c_le_impl == crc32c_le_arm64;
+#endif
+	return impls;
+}
+
+/*
+ * Check every implementation the CPU supports against the table driven
+ * code, across enough lengths and alignments to reach all of the
+ * interleaved loops and their tails.
+ */
+static int test_crc32c_impls(void)
+{
+	struct crc32c_impl *impl;
+	unsigned char *buf;
+	size_t len, off, size = 4 * 3 * 1024 + 64;
+	uint32_t want, got;
+	int failures = 0;
+
+	buf = malloc(size);
+	if (!buf)
+		return 1;
+	srand(1);
+	for (off = 0; off < size; off++)
+		buf[off] = rand();
+
+	for (impl = crc32c_impls(); impl->name; impl++) {
+		if (!impl->usable)
+			continue;
+		for (off = 0; off < 16; off++) {
+			for (len = 0; len + off <= size;
+			     len += (len < 1024) ? 1 : 61) {
+				want = crc32c_le_sw(~off, buf + off, len);
+				got = impl->fn(~off, buf + off, len);
+				if (want == got)
+					continue;
+				printf("%s: offset %zu length %zu: %x != %x\n",
+				       impl->name, off, len, got, want);
+				if (++failures > 10)
+					goto out;
+			}
+		}
+	}
+out:
+	free(buf);
+	return failures;
+}
+
+static void benchmark_crc32c(void)
+{
+	struct crc32c_impl *impl;
+	struct timeval start, end;
+	unsigned char *buf;
+	size_t i, blksize, nblocks = 65536;
+	uint32_t crc = 0;
+	double secs;
+
+	buf = malloc(65536);
+	if (!buf)
+		return;
+	for (i = 0; i < 65536; i++)
+		buf[i] = rand();
+
+	for (blksize = 1024; blksize <= 65536; blksize *= 4) {
+		for (impl = crc32c_impls(); impl->name; impl++) {
+			if (!impl->usable)
+				continue;
+			gettimeofday(&start, NULL);
+			for (i = 0; i < nblocks; i++)
+				crc = impl->fn(crc, buf, blksize);
+			gettimeofday(&end, NULL);
+			secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_usec - start.tv_usec) / 1000000.0;
+			printf("%-14s %6zu byte blocks: %9.1f MB/s\n",
+			       impl->name, blksize,
+			       secs > 0 ? (double) blksize * nblocks /
+			       secs / 1048576 : 0.0);
+		}
+		nblocks /= 4;
+	}
+	printf("(checksum %08x)\n", crc);
+	free(buf);
+}
+
 int main(int argc, char *argv[])
 {
 	int ret;
 
 	ret = test_crc32c();
+	ret += test_crc32c_impls();
 	if (!ret)
 		printf("No failures.\n");
 
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		benchmark_crc32c();
+
 	return ret;
 }
 #endif /* UNITTEST */
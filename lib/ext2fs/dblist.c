@@ -141,9 +141,15 @@ errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 	if (dblist->count >= dblist->size) {
 		old_size = dblist->size * sizeof(struct ext2_db_entry2);
 		dblist->size += dblist->size > 200 ? dblist->size / 2 : 100;
-		retval = ext2fs_resize_mem(old_size, (size_t) dblist->size *
-					   sizeof(struct ext2_db_entry2),
-					   &dblist->list);
+		if (dblist->scratch)
+			retval = ext2fs_resize_scratch_mem((size_t) dblist->size *
+					sizeof(struct ext2_db_entry2),
+					&dblist->list);
+		else
+			retval = ext2fs_resize_mem(old_size,
+					(size_t) dblist->size *
+					sizeof(struct ext2_db_entry2),
+					&dblist->list);
 		if (retval) {
 			dblist->size = old_size / sizeof(struct ext2_db_entry2);
 			return retval;
@@ -275,6 +281,39 @@ errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist)
 	return 0;
 }
 
+/*
+ * Move the directory block list out of the heap into a scratch file in
+ * the directory dir, to cut the memory needed for very large file
+ * systems.  Entries added later go to the scratch file too.
+ */
+errcode_t ext2fs_dblist_use_scratch(ext2_dblist dblist, const char *dir)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+	if (dblist->scratch)
+		return 0;
+	retval = ext2fs_move_to_scratch_mem(dir, (size_t) dblist->size *
+					    sizeof(struct ext2_db_entry2),
+					    &dblist->list);
+	if (retval)
+		return retval;
+	dblist->scratch = 1;
+	return 0;
+}
+
+/*
+ * Return the number of bytes of heap memory used by the list
+ */
+unsigned long long ext2fs_dblist_heap_size(ext2_dblist dblist)
+{
+	if (!dblist || dblist->magic != EXT2_ET_MAGIC_DBLIST ||
+	    dblist->scratch)
+		return 0;
+	return dblist->size * sizeof(struct ext2_db_entry2);
+}
+
 /*
  * Legacy 32-bit versions
  */
@@ -36,6 +36,7 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 	fs->super = 0;
 	fs->orig_super = 0;
 	fs->group_desc = 0;
+	fs->lazy_gdt = 0;
 	fs->inode_map = 0;
 	fs->block_map = 0;
 	fs->badblocks = 0;
@@ -63,6 +64,9 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 		goto errout;
 	memcpy(fs->orig_super, src->orig_super, SUPERBLOCK_SIZE);
 
+	retval = ext2fs_read_group_descs(src);
+	if (retval)
+		goto errout;
 	retval = ext2fs_get_array(fs->desc_blocks, fs->blocksize,
 				&fs->group_desc);
 	if (retval)
@@ -73,8 +73,27 @@ struct struct_io_stats {
 	unsigned long long	bytes_written;
 	unsigned long long	cache_hits;
 	unsigned long long	cache_misses;
+	unsigned long long	cache_evictions;
 };
 
+/*
+ * One element of a vectored read or write submitted with
+ * io_channel_read_blkv() or io_channel_write_blkv().  As with
+ * io_channel_write_blk64(), a negative count for a write is a length in
+ * bytes.  The I/O manager fills in error when the request completes;
+ * priv is for the caller's use.
+ */
+struct io_blk_req {
+	unsigned long long	block;
+	int			count;
+	void			*buf;
+	errcode_t		error;
+	void			*priv;
+};
+
+typedef void (*io_blk_req_done)(io_channel channel, struct io_blk_req *req,
+				void *priv_data);
+
 struct struct_io_manager {
 	errcode_t magic;
 	const char *name;
@@ -102,7 +121,15 @@ struct struct_io_manager {
 				     unsigned long long count);
 	errcode_t (*zeroout)(io_channel channel, unsigned long long block,
 			     unsigned long long count);
-	long	reserved[14];
+	errcode_t (*read_blkv)(io_channel channel, struct io_blk_req *reqs,
+			       int nr, io_blk_req_done done, void *priv_data);
+	errcode_t (*copy_file_range)(io_channel channel,
+				     unsigned long long block, int fd,
+				     ext2_loff_t offset,
+				     unsigned long long count);
+	errcode_t (*write_blkv)(io_channel channel, struct io_blk_req *reqs,
+				int nr, io_blk_req_done done, void *priv_data);
+	long	reserved[11];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -145,6 +172,17 @@ extern errcode_t io_channel_alloc_buf(io_channel channel,
 extern errcode_t io_channel_cache_readahead(io_channel io,
 					    unsigned long long block,
 					    unsigned long long count);
+extern errcode_t io_channel_read_blkv(io_channel channel,
+				      struct io_blk_req *reqs, int nr,
+				      io_blk_req_done done, void *priv_data);
+extern errcode_t io_channel_write_blkv(io_channel channel,
+				       struct io_blk_req *reqs, int nr,
+				       io_blk_req_done done, void *priv_data);
+extern errcode_t io_channel_copy_file_range(io_channel channel,
+					    unsigned long long block, int fd,
+					    ext2_loff_t offset,
+					    unsigned long long count);
+extern io_manager io_channel_select_manager(io_manager def);
 
 #ifdef _WIN32
 /* windows_io.c */
@@ -157,6 +195,12 @@ extern io_manager unixfd_io_manager;
 #define default_io_manager unix_io_manager
 #endif
 
+/* uring_io.c */
+extern io_manager uring_io_manager;
+
+/* cimage_io.c */
+extern io_manager cimage_io_manager;
+
 /* sparse_io.c */
 extern io_manager sparse_io_manager;
 extern io_manager sparsefd_io_manager;
@@ -220,6 +220,7 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_IBITMAP_TAIL_PROBLEM	0x2000000
 #define EXT2_FLAG_THREADS		0x4000000
 #define EXT2_FLAG_IGNORE_SWAP_DIRENT	0x8000000
+#define EXT2_FLAG_LAZY_LOAD		0x10000000
 
 /*
  * Internal flags for use by the ext2fs library only
@@ -337,6 +338,9 @@ struct struct_ext2_filsys {
 	struct ext2fs_hashmap* block_sha_map;
 
 	const struct ext2fs_nls_table *encoding;
+
+	/* Descriptor blocks not yet read in (EXT2_FLAG_LAZY_LOAD) */
+	struct ext2fs_lazy_gdt		*lazy_gdt;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -351,6 +355,8 @@ struct struct_ext2_filsys {
 #define EXT2FS_BMAP64_BITARRAY	1
 #define EXT2FS_BMAP64_RBTREE	2
 #define EXT2FS_BMAP64_AUTODIR	3
+#define EXT2FS_BMAP64_ROARING	4
+#define EXT2FS_BMAP64_PAGED	5
 
 /*
  * Return flags for the block iterator functions
@@ -529,6 +535,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
 #define EXT2_SF_WARN_GARBAGE_INODES	0x0020
+#define EXT2_SF_NO_READAHEAD	0x0040
 
 /*
  * ext2fs_check_if_mounted flags
@@ -660,6 +667,7 @@ static inline time_t __sb_get_tstamp(__u32 *lo, __u8 *hi EXT2FS_ATTR((unused)))
  */
 #define EXT2_ICOUNT_OPT_INCREMENT	0x01
 #define EXT2_ICOUNT_OPT_FULLMAP		0x02
+#define EXT2_ICOUNT_OPT_GROUPMAP	0x04
 
 typedef struct ext2_icount *ext2_icount_t;
 
@@ -1269,6 +1277,9 @@ extern errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 extern errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
 					struct ext2_db_entry2 **entry);
 extern errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist);
+extern errcode_t ext2fs_dblist_use_scratch(ext2_dblist dblist,
+					   const char *dir);
+extern unsigned long long ext2fs_dblist_heap_size(ext2_dblist dblist);
 
 /* dblist_dir.c */
 extern errcode_t
@@ -1485,6 +1496,12 @@ extern errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 				  unsigned int wanted, unsigned int *got);
 extern errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 				   unsigned int nbytes, unsigned int *written);
+extern errcode_t ext2fs_file_pread(ext2_file_t file, void *buf,
+				   unsigned int count, __u64 offset,
+				   unsigned int *got);
+extern errcode_t ext2fs_file_pwrite(ext2_file_t file, const void *buf,
+				    unsigned int nbytes, __u64 offset,
+				    unsigned int *written);
 extern errcode_t ext2fs_file_llseek(ext2_file_t file, __u64 offset,
 				   int whence, __u64 *ret_pos);
 extern errcode_t ext2fs_file_lseek(ext2_file_t file, ext2_off_t offset,
@@ -1581,6 +1598,7 @@ errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
 				     blk64_t end, blk64_t *out);
 errcode_t ext2fs_count_used_blocks(ext2_filsys fs, blk64_t start,
 				   blk64_t end, blk64_t *out);
+errcode_t ext2fs_parse_bitmap_type(const char *str, unsigned int *type);
 extern unsigned int ext2fs_list_backups(ext2_filsys fs, unsigned int *three,
 				unsigned int *five, unsigned int *seven);
 
@@ -1646,6 +1664,9 @@ extern errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 				     __u16 count);
 extern ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount);
 errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
+extern errcode_t ext2fs_icount_use_scratch(ext2_icount_t icount,
+					   const char *dir);
+extern unsigned long long ext2fs_icount_heap_size(ext2_icount_t icount);
 
 /* inline.c */
 
@@ -1817,6 +1838,7 @@ extern blk_t ext2fs_descriptor_block_loc(ext2_filsys fs, blk_t group_block,
 errcode_t ext2fs_get_data_io(ext2_filsys fs, io_channel *old_io);
 errcode_t ext2fs_set_data_io(ext2_filsys fs, io_channel new_io);
 errcode_t ext2fs_rewrite_to_io(ext2_filsys fs, io_channel new_io);
+extern errcode_t ext2fs_read_group_descs(ext2_filsys fs);
 
 /* orphan.c */
 extern errcode_t ext2fs_create_orphan_file(ext2_filsys fs, blk_t num_blocks);
@@ -1886,6 +1908,14 @@ extern errcode_t ext2fs_write_bitmaps(ext2_filsys fs);
 extern errcode_t ext2fs_write_inode_bitmap(ext2_filsys fs);
 extern errcode_t ext2fs_write_block_bitmap (ext2_filsys fs);
 
+/* scratch_mem.c */
+extern errcode_t ext2fs_get_scratch_mem(const char *dir, unsigned long size,
+					void *ptr);
+extern errcode_t ext2fs_resize_scratch_mem(unsigned long size, void *ptr);
+extern void ext2fs_free_scratch_mem(void *ptr);
+extern errcode_t ext2fs_move_to_scratch_mem(const char *dir,
+					    unsigned long size, void *ptr);
+
 /*sha256.c */
 #define EXT2FS_SHA256_LENGTH 32
 #if 0
@@ -12,6 +12,9 @@
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2fs.h"
 
@@ -60,6 +63,7 @@ struct ext2_struct_dblist {
 	unsigned long long	size;
 	unsigned long long	count;
 	int			sorted;
+	int			scratch;	/* list is in scratch memory */
 	struct ext2_db_entry2 *	list;
 };
 
@@ -92,6 +96,11 @@ struct ext2_inode_cache {
 	unsigned int			cache_size;
 	int				refcount;
 	struct ext2_inode_cache_ent	*cache;
+#ifdef HAVE_PTHREAD
+	/* Held while using the cache or buffer, with EXT2_FLAG_THREADS */
+	int				threads;
+	pthread_mutex_t			mutex;
+#endif
 };
 
 struct ext2_inode_cache_ent {
@@ -118,8 +127,22 @@ struct ext2fs_nls_ops {
 			    const unsigned char *str2, size_t len2);
 };
 
+/*
+ * Group descriptor blocks which have not been read yet, when the file
+ * system was opened with EXT2_FLAG_LAZY_LOAD
+ */
+struct ext2fs_lazy_gdt {
+	blk64_t		group_block;
+	dgrp_t		first_meta_bg;
+	int		group_zero_adjust;
+	errcode_t	error;		/* first read error */
+	char		*loaded;	/* one bit per descriptor block */
+};
+
 /* Function prototypes */
 
+extern errcode_t ext2fs_load_desc_block(ext2_filsys fs, dgrp_t i);
+
 extern int ext2fs_process_dir_block(ext2_filsys  	fs,
 				    blk64_t		*blocknr,
 				    e2_blkcnt_t		blockcnt,
@@ -203,7 +226,23 @@ extern errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bitmap,
 					       void *out);
 extern void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap,const char *func);
 
+/* blkmap64_paged.c */
+typedef errcode_t (*ext2fs_bmap_page_load_t)(ext2_filsys fs,
+					     ext2fs_generic_bitmap bmap,
+					     __u64 page, void *bits);
+extern errcode_t ext2fs_paged_bmap_set_loader(ext2fs_generic_bitmap bmap,
+					      ext2fs_bmap_page_load_t load);
+extern int ext2fs_paged_bmap_page_loaded(ext2fs_generic_bitmap bmap,
+					 __u64 page);
+extern errcode_t ext2fs_paged_bmap_error(ext2fs_generic_bitmap bmap);
+
 extern int ext2fs_mem_is_zero(const char *mem, size_t len);
+extern size_t ext2fs_skip_bytes(const void *addr, size_t nbytes, int c);
+extern __u64 ext2fs_count_bits(const void *addr, size_t nbytes);
+extern errcode_t ext2fs_find_bit(const void *addr, __u64 start, __u64 end,
+				 int set, __u64 *out);
+extern __u64 ext2fs_count_bit_range(const void *addr, __u64 start,
+				    __u64 end);
 
 extern int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 					    struct ext2_inode *inode,
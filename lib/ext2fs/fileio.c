@@ -539,6 +539,341 @@ fail:
 	return retval;
 }
 
+/*
+ * Set up for mapping runs of a file's blocks with file_map_run().  Only
+ * extent-mapped files need a handle; *handle is left NULL for others.
+ */
+static errcode_t file_map_open(ext2_file_t file, ext2_extent_handle_t *handle)
+{
+	*handle = NULL;
+	if (!(file->inode.i_flags & EXT4_EXTENTS_FL))
+		return 0;
+	return ext2fs_extent_open2(file->fs, file->ino, &file->inode, handle);
+}
+
+/*
+ * Find the physical block of logical block lblk, and how many of the
+ * following blocks (up to max) are contiguous with it on disk and in
+ * the same state.  If lblk is in a hole, *pblk is zero and *count is
+ * the length of the hole.  Calls for increasing lblk walk forward
+ * through the extent tree rather than looking each one up again.
+ */
+static errcode_t file_map_run(ext2_file_t file, ext2_extent_handle_t handle,
+			      blk64_t lblk, blk64_t max, blk64_t *pblk,
+			      blk64_t *count, int *uninit)
+{
+	ext2_filsys		fs = file->fs;
+	struct ext2fs_extent	extent;
+	blk64_t			b, next;
+	int			ret_flags;
+	errcode_t		retval;
+
+	*pblk = 0;
+	*count = max;
+	*uninit = 0;
+
+	if (!handle) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
+				      0, lblk, &ret_flags, pblk);
+		if (retval)
+			return retval;
+		for (b = 1; b < max; b++) {
+			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+					      BMAP_BUFFER, 0, lblk + b,
+					      &ret_flags, &next);
+			if (retval)
+				return retval;
+			if (*pblk ? (next != *pblk + b) : (next != 0))
+				break;
+		}
+		*count = b;
+		return 0;
+	}
+
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	if (retval || extent.e_lblk > lblk) {
+		retval = ext2fs_extent_goto(handle, lblk);
+		if (retval && retval != EXT2_ET_EXTENT_NOT_FOUND)
+			return retval;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					   &extent);
+	}
+	while (retval == 0 && extent.e_lblk + extent.e_len <= lblk)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &extent);
+	if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+	    retval == EXT2_ET_NO_CURRENT_NODE)
+		return 0;
+	if (retval)
+		return retval;
+
+	if (extent.e_lblk > lblk) {
+		/* A hole ends where the next extent starts */
+		if (extent.e_lblk - lblk < max)
+			*count = extent.e_lblk - lblk;
+		return 0;
+	}
+	*pblk = extent.e_pblk + lblk - extent.e_lblk;
+	if (extent.e_lblk + extent.e_len - lblk < max)
+		*count = extent.e_lblk + extent.e_len - lblk;
+	*uninit = !!(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT);
+	return 0;
+}
+
+/*
+ * Read or write through the block buffer at offset, leaving the file
+ * position alone.  This is used for what ext2fs_file_pread/pwrite can't
+ * map directly.
+ */
+static errcode_t file_rw_at(ext2_file_t file, void *rbuf, const void *wbuf,
+			    unsigned int count, __u64 offset,
+			    unsigned int *done)
+{
+	__u64		pos = file->pos;
+	errcode_t	retval;
+
+	file->pos = offset;
+	if (rbuf)
+		retval = ext2fs_file_read(file, rbuf, count, done);
+	else
+		retval = ext2fs_file_write(file, wbuf, count, done);
+	file->pos = pos;
+	return retval;
+}
+
+/*
+ * Read count bytes at offset straight into buf, without moving the file
+ * position.  The blocks are mapped a run at a time, and every run of
+ * whole blocks is read with a single request.  Holes and uninitialized
+ * extents read as zeroes; nothing is read past EOF.
+ */
+errcode_t ext2fs_file_pread(ext2_file_t file, void *buf, unsigned int count,
+			    __u64 offset, unsigned int *got)
+{
+	ext2_filsys		fs;
+	ext2_extent_handle_t	handle = NULL;
+	char			*ptr = (char *) buf;
+	__u64			pos = offset, end = offset + count;
+	blk64_t			lblk, pblk, run;
+	unsigned int		bs, c;
+	int			uninit;
+	errcode_t		retval = 0;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+	fs = file->fs;
+	bs = fs->blocksize;
+
+	if (file->inode.i_flags & EXT4_INLINE_DATA_FL) {
+		if (offset >= EXT2_I_SIZE(&file->inode))
+			goto out;
+		if (count > EXT2_I_SIZE(&file->inode) - offset)
+			count = EXT2_I_SIZE(&file->inode) - offset;
+		return file_rw_at(file, buf, NULL, count, offset, got);
+	}
+
+	/* The block buffer may hold newer data, and is used for bouncing */
+	retval = ext2fs_file_flush(file);
+	if (retval)
+		goto out;
+	file->flags &= ~EXT2_FILE_BUF_VALID;
+
+	if (end > EXT2_I_SIZE(&file->inode))
+		end = EXT2_I_SIZE(&file->inode);
+	if (pos >= end)
+		goto out;
+	retval = file_map_open(file, &handle);
+	if (retval)
+		goto out;
+
+	while (pos < end) {
+		lblk = pos / bs;
+		retval = file_map_run(file, handle, lblk,
+				      (end - 1) / bs - lblk + 1,
+				      &pblk, &run, &uninit);
+		if (retval)
+			break;
+
+		if (!pblk || uninit) {
+			c = run * bs - pos % bs;
+			if (c > end - pos)
+				c = end - pos;
+			memset(ptr, 0, c);
+		} else if (pos % bs == 0 && end - pos >= bs) {
+			if (run > (end - pos) / bs)
+				run = (end - pos) / bs;
+			retval = io_channel_read_blk64(fs->io, pblk, run, ptr);
+			if (retval)
+				break;
+			c = run * bs;
+		} else {
+			/* Partial block at the start or end */
+			retval = io_channel_read_blk64(fs->io, pblk, 1,
+						       file->buf);
+			if (retval)
+				break;
+			c = bs - pos % bs;
+			if (c > end - pos)
+				c = end - pos;
+			memcpy(ptr, file->buf + pos % bs, c);
+		}
+		pos += c;
+		ptr += c;
+	}
+
+out:
+	if (handle)
+		ext2fs_extent_free(handle);
+	if (got)
+		*got = pos > offset ? pos - offset : 0;
+	return retval;
+}
+
+/*
+ * Write nbytes from buf at offset, without moving the file position.
+ * The whole blocks past EOF of an extent-mapped file are allocated
+ * together, so that they come out as few, large extents, and every run
+ * of whole blocks which is already mapped is written with a single
+ * request.  Partial blocks and holes before EOF go through the block
+ * buffer.  The data is written in order, so if the write fails, *written
+ * is the length of what did reach the file, the size covers it, and the
+ * blocks allocated past that are freed again.
+ */
+errcode_t ext2fs_file_pwrite(ext2_file_t file, const void *buf,
+			     unsigned int nbytes, __u64 offset,
+			     unsigned int *written)
+{
+	ext2_filsys		fs;
+	ext2_extent_handle_t	handle = NULL;
+	const char		*ptr = (const char *) buf;
+	blk64_t			start, end, alloc, eof, lblk, pblk, run;
+	unsigned int		bs, c, done = 0;
+	__u64			pos;
+	int			uninit;
+	errcode_t		retval, rc;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+	fs = file->fs;
+	bs = fs->blocksize;
+
+	if (!(file->flags & EXT2_FILE_WRITE))
+		return EXT2_ET_FILE_RO;
+
+	if (written)
+		*written = 0;
+	if ((file->inode.i_flags & EXT4_INLINE_DATA_FL) || !file->ino ||
+	    (fs->flags & EXT2_FLAG_SHARE_DUP))
+		return file_rw_at(file, NULL, buf, nbytes, offset, written);
+
+	retval = ext2fs_file_flush(file);
+	if (retval)
+		return retval;
+	file->flags &= ~EXT2_FILE_BUF_VALID;
+
+	/* Whole blocks covered by the write, and those of them past EOF */
+	start = (offset + bs - 1) / bs;
+	end = (offset + nbytes) / bs;
+	alloc = (EXT2_I_SIZE(&file->inode) + bs - 1) / bs;
+	if (alloc < start)
+		alloc = start;
+	if (alloc > end || !(file->inode.i_flags & EXT4_EXTENTS_FL))
+		alloc = end;
+
+	if (start >= end)
+		return file_rw_at(file, NULL, buf, nbytes, offset, written);
+
+	/* Partial block at the start */
+	if (offset < start * bs) {
+		retval = file_rw_at(file, NULL, ptr, start * bs - offset,
+				    offset, &c);
+		if (!retval)
+			retval = ext2fs_file_flush(file);
+		if (retval)
+			goto out;
+		done = start * bs - offset;
+	}
+
+	if (alloc < end) {
+		retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT |
+					  EXT2_FALLOCATE_INIT_BEYOND_EOF,
+					  file->ino, &file->inode, ~0ULL,
+					  alloc, end - alloc);
+		if (!retval)
+			retval = ext2fs_write_inode(fs, file->ino,
+						    &file->inode);
+		if (retval)
+			goto out;
+	}
+
+	retval = file_map_open(file, &handle);
+	if (retval)
+		goto out;
+	for (lblk = start; lblk < end; lblk += run) {
+		retval = file_map_run(file, handle, lblk, end - lblk,
+				      &pblk, &run, &uninit);
+		if (retval)
+			goto out;
+		pos = lblk * bs;
+		if (pblk && !uninit) {
+			retval = io_channel_write_blk64(fs->io, pblk, run,
+							ptr + (pos - offset));
+			if (retval)
+				goto out;
+			done = (lblk + run) * bs - offset;
+			continue;
+		}
+		retval = file_rw_at(file, NULL, ptr + (pos - offset),
+				    run * bs, pos, &c);
+		if (!retval)
+			retval = ext2fs_file_flush(file);
+		if (retval)
+			goto out;
+		done = (lblk + run) * bs - offset;
+		/* The extent tree changed under the handle */
+		if (handle) {
+			ext2fs_extent_free(handle);
+			retval = file_map_open(file, &handle);
+			if (retval)
+				goto out;
+		}
+	}
+
+	/* Partial block at the end */
+	if (end * bs < offset + nbytes) {
+		pos = end * bs;
+		retval = file_rw_at(file, NULL, ptr + (pos - offset),
+				    offset + nbytes - pos, pos, &c);
+		if (!retval)
+			retval = ext2fs_file_flush(file);
+		if (retval)
+			goto out;
+	}
+	done = nbytes;
+
+out:
+	if (handle)
+		ext2fs_extent_free(handle);
+	/* Update inode size to cover what was written */
+	if (done && EXT2_I_SIZE(&file->inode) < offset + done) {
+		rc = ext2fs_file_set_size2(file, offset + done);
+		if (!retval)
+			retval = rc;
+	}
+	if (written)
+		*written = done;
+	if (!retval)
+		return 0;
+	/* Don't leave initialized blocks past EOF behind */
+	if (alloc < end) {
+		eof = (EXT2_I_SIZE(&file->inode) + bs - 1) / bs;
+		if (eof < alloc)
+			eof = alloc;
+		if (eof < end)
+			ext2fs_punch(fs, file->ino, &file->inode, NULL,
+				     eof, end - 1);
+	}
+	return retval;
+}
+
 errcode_t ext2fs_file_llseek(ext2_file_t file, __u64 offset,
 			    int whence, __u64 *ret_pos)
 {
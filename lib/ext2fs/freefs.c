@@ -38,6 +38,10 @@ void ext2fs_free(ext2_filsys fs)
 		ext2fs_free_mem(&fs->orig_super);
 	if (fs->group_desc)
 		ext2fs_free_mem(&fs->group_desc);
+	if (fs->lazy_gdt) {
+		ext2fs_free_mem(&fs->lazy_gdt->loaded);
+		ext2fs_free_mem(&fs->lazy_gdt);
+	}
 	if (fs->block_map)
 		ext2fs_free_block_bitmap(fs->block_map);
 	if (fs->inode_map)
@@ -97,7 +101,9 @@ void ext2fs_free_dblist(ext2_dblist dblist)
 	if (!dblist || (dblist->magic != EXT2_ET_MAGIC_DBLIST))
 		return;
 
-	if (dblist->list)
+	if (dblist->scratch)
+		ext2fs_free_scratch_mem(&dblist->list);
+	else if (dblist->list)
 		ext2fs_free_mem(&dblist->list);
 	dblist->list = 0;
 	if (dblist->fs && dblist->fs->dblist == dblist)
@@ -440,23 +440,11 @@ errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap gen_bmap,
 }
 
 /*
- * Compare @mem to zero buffer by 256 bytes.
  * Return 1 if @mem is zeroed memory, otherwise return 0.
  */
 int ext2fs_mem_is_zero(const char *mem, size_t len)
 {
-	static const char zero_buf[256];
-
-	while (len >= sizeof(zero_buf)) {
-		if (memcmp(mem, zero_buf, sizeof(zero_buf)))
-			return 0;
-		len -= sizeof(zero_buf);
-		mem += sizeof(zero_buf);
-	}
-	/* Deal with leftover bytes. */
-	if (len)
-		return !memcmp(mem, zero_buf, len);
-	return 1;
+	return ext2fs_skip_bytes(mem, len, 0) == len;
 }
 
 /*
@@ -117,6 +117,12 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 		else
 			ops = &ext2fs_blkmap64_rbtree;
 		break;
+	case EXT2FS_BMAP64_ROARING:
+		ops = &ext2fs_blkmap64_roaring;
+		break;
+	case EXT2FS_BMAP64_PAGED:
+		ops = &ext2fs_blkmap64_paged;
+		break;
 	default:
 		return EINVAL;
 	}
@@ -176,6 +182,42 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 	return 0;
 }
 
+/*
+ * Translate a bitmap backend name, as found in a configuration file or
+ * on the command line, into one of the EXT2FS_BMAP64_* types.
+ */
+errcode_t ext2fs_parse_bitmap_type(const char *str, unsigned int *type)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	type;
+	} types[] = {
+		{ "bitarray",	EXT2FS_BMAP64_BITARRAY },
+		{ "rbtree",	EXT2FS_BMAP64_RBTREE },
+		{ "autodir",	EXT2FS_BMAP64_AUTODIR },
+		{ "roaring",	EXT2FS_BMAP64_ROARING },
+		{ "paged",	EXT2FS_BMAP64_PAGED },
+	};
+	unsigned long	num;
+	char		*end;
+	unsigned int	i;
+
+	if (!str || !*str)
+		return EXT2_ET_INVALID_ARGUMENT;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (!strcmp(str, types[i].name)) {
+			*type = types[i].type;
+			return 0;
+		}
+	}
+	num = strtoul(str, &end, 0);
+	if (*end || num < EXT2FS_BMAP64_BITARRAY ||
+	    num > EXT2FS_BMAP64_PAGED)
+		return EXT2_ET_INVALID_ARGUMENT;
+	*type = num;
+	return 0;
+}
+
 #ifdef ENABLE_BMAP_STATS
 static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap_64 bitmap)
 {
@@ -945,50 +987,259 @@ errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
 	return ENOENT;
 }
 
-errcode_t ext2fs_count_used_blocks(ext2_filsys fs, blk64_t start,
-				   blk64_t end, blk64_t *out)
+/*
+ * Count the bits which are set between start and end, inclusive.  For
+ * a cluster bitmap this is the number of clusters in use which overlap
+ * the range.
+ */
+errcode_t ext2fs_count_set_generic_bmap(ext2fs_generic_bitmap bitmap,
+					__u64 start, __u64 end, __u64 *out)
 {
-	blk64_t		next;
-	blk64_t		tot_set = 0;
-	errcode_t	retval = 0;
+	ext2fs_generic_bitmap_64 bmap64 = (ext2fs_generic_bitmap_64) bitmap;
+	__u64 cstart, cend, pos, next, count = 0;
+	errcode_t retval;
 
-	while (start < end) {
-		retval = ext2fs_find_first_set_block_bitmap2(fs->block_map,
-							start, end, &next);
-		if (retval) {
-			if (retval == ENOENT)
-				retval = 0;
-			break;
+	if (!bitmap)
+		return EINVAL;
+
+	if (EXT2FS_IS_32_BITMAP(bitmap)) {
+		if (((start) & ~0xffffffffULL) ||
+		    ((end) & ~0xffffffffULL) || start > end) {
+			ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, start);
+			return EINVAL;
 		}
-		start = next;
-
-		retval = ext2fs_find_first_zero_block_bitmap2(fs->block_map,
-							start, end, &next);
-		if (retval == 0) {
-			tot_set += next - start;
-			start  = next + 1;
-		} else if (retval == ENOENT) {
-			retval = 0;
-			tot_set += end - start + 1;
+
+		for (pos = start; pos <= end; pos++)
+			if (ext2fs_test_generic_bitmap(bitmap, pos))
+				count++;
+		*out = count;
+		return 0;
+	}
+
+	if (!EXT2FS_IS_64_BITMAP(bitmap))
+		return EINVAL;
+
+	cstart = start >> bmap64->cluster_bits;
+	cend = end >> bmap64->cluster_bits;
+
+	if (cstart < bmap64->start || cend > bmap64->end || start > end) {
+		warn_bitmap(bmap64, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
+	}
+
+	if (bmap64->bitmap_ops->count_set)
+		return bmap64->bitmap_ops->count_set(bmap64, cstart, cend, out);
+
+	if (!bmap64->bitmap_ops->find_first_set ||
+	    !bmap64->bitmap_ops->find_first_zero) {
+		for (pos = cstart; pos <= cend; pos++)
+			if (bmap64->bitmap_ops->test_bmap(bmap64, pos))
+				count++;
+		goto out;
+	}
+
+	for (pos = cstart; ; pos = next + 1) {
+		retval = bmap64->bitmap_ops->find_first_set(bmap64, pos,
+							    cend, &next);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
+		pos = next;
+
+		retval = bmap64->bitmap_ops->find_first_zero(bmap64, pos,
+							     cend, &next);
+		if (retval == ENOENT) {
+			count += cend - pos + 1;
 			break;
-		} else
+		}
+		if (retval)
+			return retval;
+		count += next - pos;
+		if (next == cend)
 			break;
 	}
+out:
+	*out = count;
+	return 0;
+}
+
+/* Chunk of bits fetched from each bitmap while comparing them */
+#define DIFF_CHUNK_BITS		8192
+
+static void xor_bytes(unsigned char *a, const unsigned char *b, size_t nbytes)
+{
+	__u64	w1, w2;
+	size_t	i = 0;
+
+	for (; i + 8 <= nbytes; i += 8) {
+		memcpy(&w1, a + i, 8);
+		memcpy(&w2, b + i, 8);
+		w1 ^= w2;
+		memcpy(a + i, &w1, 8);
+	}
+	for (; i < nbytes; i++)
+		a[i] ^= b[i];
+}
+
+/*
+ * Find the first bit in start..end, inclusive, which differs between
+ * bm1 and bm2, and the end of the run of differing bits which starts
+ * there; that run may mix bits set in either bitmap.  The bitmaps are
+ * fetched a chunk at a time and XORed a word at a time, so that long
+ * stretches where they agree are passed over quickly.  The chunks start
+ * on a byte boundary from the start of the bitmap, as the backends'
+ * get_bmap_range methods expect.  Returns ENOENT if the bitmaps agree
+ * over the whole range.
+ */
+errcode_t ext2fs_find_first_diff_generic_bmap(ext2fs_generic_bitmap gen_bm1,
+					      ext2fs_generic_bitmap gen_bm2,
+					      __u64 start, __u64 end,
+					      __u64 *out_start, __u64 *out_end)
+{
+	ext2fs_generic_bitmap_64 bm1 = (ext2fs_generic_bitmap_64) gen_bm1;
+	ext2fs_generic_bitmap_64 bm2 = (ext2fs_generic_bitmap_64) gen_bm2;
+	unsigned char buf1[DIFF_CHUNK_BITS / 8], buf2[DIFF_CHUNK_BITS / 8];
+	__u64	cstart, cend, pos, first = 0, last;
+	unsigned int n, bit, nbytes;
+	int	found = 0;
+	errcode_t retval;
+
+	if (!bm1 || !bm2)
+		return EINVAL;
+
+	if (EXT2FS_IS_32_BITMAP(bm1) || EXT2FS_IS_32_BITMAP(bm2)) {
+		if (((start) & ~0xffffffffULL) ||
+		    ((end) & ~0xffffffffULL) || start > end) {
+			ext2fs_warn_bitmap2(gen_bm1, EXT2FS_TEST_ERROR, start);
+			return EINVAL;
+		}
+		for (pos = start; pos <= end; pos++) {
+			if (!ext2fs_test_generic_bitmap(gen_bm1, pos) ==
+			    !ext2fs_test_generic_bitmap(gen_bm2, pos)) {
+				if (found)
+					break;
+				continue;
+			}
+			if (!found)
+				first = pos;
+			found = 1;
+		}
+		if (!found)
+			return ENOENT;
+		*out_start = first;
+		*out_end = pos - 1;
+		return 0;
+	}
+
+	if (!EXT2FS_IS_64_BITMAP(bm1) || !EXT2FS_IS_64_BITMAP(bm2) ||
+	    bm1->cluster_bits != bm2->cluster_bits)
+		return EINVAL;
 
+	cstart = start >> bm1->cluster_bits;
+	cend = end >> bm1->cluster_bits;
+
+	if (cstart < bm1->start || cend > bm1->end ||
+	    cstart < bm2->start || cend > bm2->end || start > end) {
+		warn_bitmap(bm1, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
+	}
+
+	if (bm1->start != bm2->start) {
+		for (pos = cstart; pos <= cend; pos++) {
+			if (!bm1->bitmap_ops->test_bmap(bm1, pos) ==
+			    !bm2->bitmap_ops->test_bmap(bm2, pos)) {
+				if (found)
+					break;
+				continue;
+			}
+			if (!found)
+				first = pos;
+			found = 1;
+		}
+		if (!found)
+			return ENOENT;
+		last = pos - 1;
+		goto out;
+	}
+
+	for (pos = cstart - ((cstart - bm1->start) & 7); pos <= cend;
+	     pos += n) {
+		n = DIFF_CHUNK_BITS;
+		if (cend - pos + 1 < n)
+			n = cend - pos + 1;
+		nbytes = (n + 7) / 8;
+		/* Not every backend clears the bits it has nothing for */
+		memset(buf1, 0, nbytes);
+		memset(buf2, 0, nbytes);
+		retval = bm1->bitmap_ops->get_bmap_range(bm1, pos, n, buf1);
+		if (retval)
+			return retval;
+		retval = bm2->bitmap_ops->get_bmap_range(bm2, pos, n, buf2);
+		if (retval)
+			return retval;
+		xor_bytes(buf1, buf2, nbytes);
+		if (n % 8)
+			buf1[nbytes - 1] &= (1 << (n % 8)) - 1;
+		if (pos < cstart)
+			buf1[0] &= ~((1 << (cstart - pos)) - 1);
+
+		bit = 0;
+		if (!found) {
+			bit = ext2fs_skip_bytes(buf1, nbytes, 0);
+			if (bit == nbytes)
+				continue;
+			bit *= 8;
+			while (!ext2fs_test_bit(bit, buf1))
+				bit++;
+			first = pos + bit;
+			found = 1;
+		}
+
+		/* Now look for the end of the run */
+		while (bit < n && (bit % 8) && ext2fs_test_bit(bit, buf1))
+			bit++;
+		if (bit < n && !(bit % 8))
+			bit = 8 * (bit / 8 + ext2fs_skip_bytes(buf1 + bit / 8,
+							nbytes - bit / 8, 0xff));
+		while (bit < n && ext2fs_test_bit(bit, buf1))
+			bit++;
+		if (bit < n) {
+			last = pos + bit - 1;
+			goto out;
+		}
+	}
+	if (!found)
+		return ENOENT;
+	last = cend;
+out:
+	*out_start = first << bm1->cluster_bits;
+	*out_end = last << bm1->cluster_bits;
+	return 0;
+}
+
+errcode_t ext2fs_count_used_blocks(ext2_filsys fs, blk64_t start,
+				   blk64_t end, blk64_t *out)
+{
+	__u64		tot_set;
+	errcode_t	retval;
+
+	retval = ext2fs_count_set_generic_bmap(fs->block_map, start, end,
+					       &tot_set);
 	if (!retval)
-		*out = tot_set;
+		*out = EXT2FS_C2B(fs, tot_set);
 	return retval;
 }
 
 errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
 				     blk64_t end, blk64_t *out)
 {
-	blk64_t		tot_set = 0;
-	errcode_t	retval = 0;
-
-	retval = ext2fs_count_used_blocks(fs, start, end, &tot_set);
+	__u64		tot_set;
+	errcode_t	retval;
 
+	retval = ext2fs_count_set_generic_bmap(fs->block_map, start, end,
+					       &tot_set);
 	if (!retval)
-		*out = EXT2FS_NUM_B2C(fs, tot_set);
+		*out = tot_set;
 	return retval;
 }
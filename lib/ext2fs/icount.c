@@ -40,6 +40,20 @@
  * e2fsck's pass 2.  Pass 2 increments inode counts as it finds them,
  * so this extra bitmap avoids searching the sorted list to see if a
  * particular inode is on the sorted list already.
+ *
+ * Since pass 2 finds the inodes in directory order rather than inode
+ * order, the sorted list can have entries inserted all over it, and
+ * each insertion moves the tail of the list.  With
+ * EXT2_ICOUNT_OPT_GROUPMAP the counts are instead kept in a small table
+ * per block group, allocated when the first count in the group is
+ * stored, and the bitmaps are not used.  While only a few inodes in
+ * the group have a non-zero count, the table is a sorted list of
+ * (offset, count) pairs; once that list would be bigger than an array
+ * of counts for every inode in the group, it is converted to such an
+ * array, using 2, 8, 16 or 32 bits per inode as needed to hold the
+ * largest count.  So a lookup is either a direct index or a binary
+ * search of a list no bigger than the group's array, and an insertion
+ * moves at most one group's worth of entries.
  */
 
 struct ext2_icount_el {
@@ -47,6 +61,13 @@ struct ext2_icount_el {
 	__u32		count;
 };
 
+struct icount_group {
+	void		*data;
+	__u32		nr;	/* entries in use, for a sorted list */
+	__u32		alloc;	/* entries allocated, for a sorted list */
+	int		bits;	/* bits per inode, or 0 for a sorted list */
+};
+
 struct ext2_icount {
 	errcode_t		magic;
 	ext2fs_inode_bitmap	single;
@@ -57,11 +78,15 @@ struct ext2_icount {
 	ext2_ino_t		cursor;
 	struct ext2_icount_el	*list;
 	struct ext2_icount_el	*last_lookup;
+	int			scratch;	/* list/fullmap in scratch memory */
 #ifdef CONFIG_TDB
 	char			*tdb_fn;
 	TDB_CONTEXT		*tdb;
 #endif
 	__u16			*fullmap;
+	struct icount_group	*groups;
+	dgrp_t			num_groups;
+	__u32			ipg;
 };
 
 /*
@@ -79,6 +104,10 @@ void ext2fs_free_icount(ext2_icount_t icount)
 		return;
 
 	icount->magic = 0;
+	if (icount->scratch) {
+		ext2fs_free_scratch_mem(&icount->list);
+		ext2fs_free_scratch_mem(&icount->fullmap);
+	}
 	if (icount->list)
 		ext2fs_free_mem(&icount->list);
 	if (icount->single)
@@ -97,6 +126,15 @@ void ext2fs_free_icount(ext2_icount_t icount)
 	if (icount->fullmap)
 		ext2fs_free_mem(&icount->fullmap);
 
+	if (icount->groups) {
+		dgrp_t	g;
+
+		for (g = 0; g < icount->num_groups; g++)
+			if (icount->groups[g].data)
+				ext2fs_free_mem(&icount->groups[g].data);
+		ext2fs_free_mem(&icount->groups);
+	}
+
 	ext2fs_free_mem(&icount);
 }
 
@@ -127,6 +165,18 @@ static errcode_t alloc_icount(ext2_filsys fs, int flags, ext2_icount_t *ret)
 		}
 	}
 
+	if (flags & EXT2_ICOUNT_OPT_GROUPMAP) {
+		icount->num_groups = fs->group_desc_count;
+		icount->ipg = fs->super->s_inodes_per_group;
+		retval = ext2fs_get_arrayzero(icount->num_groups,
+					      sizeof(struct icount_group),
+					      &icount->groups);
+		if (retval)
+			goto errout;
+		*ret = icount;
+		return 0;
+	}
+
 	retval = ext2fs_allocate_inode_bitmap(fs, "icount", &icount->single);
 	if (retval)
 		goto errout;
@@ -272,7 +322,7 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 	if (retval)
 		return retval;
 
-	if (icount->fullmap)
+	if (icount->fullmap || icount->groups)
 		goto successout;
 
 	if (size) {
@@ -356,11 +406,16 @@ static struct ext2_icount_el *insert_icount_el(ext2_icount_t icount,
 #if 0
 		printf("Reallocating icount %u entries...\n", new_size);
 #endif
-		retval = ext2fs_resize_mem((size_t) icount->size *
-					   sizeof(struct ext2_icount_el),
-					   (size_t) new_size *
-					   sizeof(struct ext2_icount_el),
-					   &icount->list);
+		if (icount->scratch)
+			retval = ext2fs_resize_scratch_mem((size_t) new_size *
+					sizeof(struct ext2_icount_el),
+					&icount->list);
+		else
+			retval = ext2fs_resize_mem((size_t) icount->size *
+					sizeof(struct ext2_icount_el),
+					(size_t) new_size *
+					sizeof(struct ext2_icount_el),
+					&icount->list);
 		if (retval)
 			return 0;
 		icount->size = new_size;
@@ -429,6 +484,202 @@ static struct ext2_icount_el *get_icount_el(ext2_icount_t icount,
 	return 0;
 }
 
+/*
+ * Helpers for the per-group tables used by EXT2_ICOUNT_OPT_GROUPMAP
+ */
+static int group_bits_needed(__u32 count)
+{
+	if (count <= 3)
+		return 2;
+	if (count <= 0xff)
+		return 8;
+	if (count <= 0xffff)
+		return 16;
+	return 32;
+}
+
+static unsigned long group_array_bytes(ext2_icount_t icount, int bits)
+{
+	return ((unsigned long) icount->ipg * bits + 7) / 8;
+}
+
+static __u32 group_array_get(struct icount_group *grp, __u32 off)
+{
+	switch (grp->bits) {
+	case 2:
+		return (((__u8 *) grp->data)[off >> 2] >> ((off & 3) << 1)) & 3;
+	case 8:
+		return ((__u8 *) grp->data)[off];
+	case 16:
+		return ((__u16 *) grp->data)[off];
+	default:
+		return ((__u32 *) grp->data)[off];
+	}
+}
+
+static void group_array_set(struct icount_group *grp, __u32 off, __u32 count)
+{
+	__u8	*p;
+
+	switch (grp->bits) {
+	case 2:
+		p = (__u8 *) grp->data + (off >> 2);
+		*p = (*p & ~(3 << ((off & 3) << 1))) | (count << ((off & 3) << 1));
+		break;
+	case 8:
+		((__u8 *) grp->data)[off] = count;
+		break;
+	case 16:
+		((__u16 *) grp->data)[off] = count;
+		break;
+	default:
+		((__u32 *) grp->data)[off] = count;
+		break;
+	}
+}
+
+/*
+ * Return the position of the first entry in a group's sorted list whose
+ * offset is not less than off.
+ */
+static __u32 group_list_search(struct icount_group *grp, __u32 off)
+{
+	struct ext2_icount_el *list = grp->data;
+	__u32	low = 0, high = grp->nr, mid;
+
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (list[mid].ino < off)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/*
+ * Convert a group's table to an array with the given number of bits
+ * per inode.
+ */
+static errcode_t group_to_array(ext2_icount_t icount,
+				struct icount_group *grp, int bits)
+{
+	struct icount_group	new;
+	struct ext2_icount_el	*list;
+	errcode_t		retval;
+	__u32			i;
+
+	new.bits = bits;
+	new.nr = new.alloc = 0;
+	retval = ext2fs_get_memzero(group_array_bytes(icount, bits),
+				    &new.data);
+	if (retval)
+		return retval;
+	if (grp->bits) {
+		for (i = 0; i < icount->ipg; i++)
+			group_array_set(&new, i, group_array_get(grp, i));
+	} else {
+		list = grp->data;
+		for (i = 0; i < grp->nr; i++)
+			group_array_set(&new, list[i].ino, list[i].count);
+	}
+	if (grp->data)
+		ext2fs_free_mem(&grp->data);
+	*grp = new;
+	return 0;
+}
+
+static __u32 get_group_count(ext2_icount_t icount, ext2_ino_t ino)
+{
+	struct icount_group	*grp;
+	struct ext2_icount_el	*list;
+	__u32			off, pos;
+
+	grp = &icount->groups[(ino - 1) / icount->ipg];
+	off = (ino - 1) % icount->ipg;
+	if (!grp->data)
+		return 0;
+	if (grp->bits)
+		return group_array_get(grp, off);
+	list = grp->data;
+	pos = group_list_search(grp, off);
+	if (pos < grp->nr && list[pos].ino == off)
+		return list[pos].count;
+	return 0;
+}
+
+static errcode_t set_group_count(ext2_icount_t icount, ext2_ino_t ino,
+				 __u32 count)
+{
+	struct icount_group	*grp;
+	struct ext2_icount_el	*list;
+	errcode_t		retval;
+	__u32			off, pos, new_alloc, i;
+	int			bits;
+
+	grp = &icount->groups[(ino - 1) / icount->ipg];
+	off = (ino - 1) % icount->ipg;
+	if (!grp->data && !count)
+		return 0;
+
+	if (grp->bits) {
+		bits = group_bits_needed(count);
+		if (bits > grp->bits) {
+			retval = group_to_array(icount, grp, bits);
+			if (retval)
+				return retval;
+		}
+		group_array_set(grp, off, count);
+		return 0;
+	}
+
+	list = grp->data;
+	pos = group_list_search(grp, off);
+	if (pos < grp->nr && list[pos].ino == off) {
+		if (count) {
+			list[pos].count = count;
+			return 0;
+		}
+		memmove(&list[pos], &list[pos + 1],
+			(grp->nr - pos - 1) * sizeof(struct ext2_icount_el));
+		grp->nr--;
+		return 0;
+	}
+	if (!count)
+		return 0;
+
+	if (grp->nr >= grp->alloc) {
+		new_alloc = grp->alloc ? grp->alloc * 2 : 8;
+		bits = group_bits_needed(count);
+		for (i = 0; i < grp->nr; i++)
+			if (group_bits_needed(list[i].count) > bits)
+				bits = group_bits_needed(list[i].count);
+		if ((unsigned long) new_alloc * sizeof(struct ext2_icount_el) >=
+		    group_array_bytes(icount, bits)) {
+			retval = group_to_array(icount, grp, bits);
+			if (retval)
+				return retval;
+			group_array_set(grp, off, count);
+			return 0;
+		}
+		retval = ext2fs_resize_mem((size_t) grp->alloc *
+					   sizeof(struct ext2_icount_el),
+					   (size_t) new_alloc *
+					   sizeof(struct ext2_icount_el),
+					   &grp->data);
+		if (retval)
+			return retval;
+		grp->alloc = new_alloc;
+		list = grp->data;
+	}
+	memmove(&list[pos + 1], &list[pos],
+		(grp->nr - pos) * sizeof(struct ext2_icount_el));
+	list[pos].ino = off;
+	list[pos].count = count;
+	grp->nr++;
+	return 0;
+}
+
 static errcode_t set_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 				 __u32 count)
 {
@@ -511,6 +762,34 @@ errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *out)
 
 	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
 
+	if (icount->groups) {
+		struct icount_group	*grp;
+		struct ext2_icount_el	*list;
+		dgrp_t			g;
+
+		for (g = 0; g < icount->num_groups; g++) {
+			grp = &icount->groups[g];
+			if (grp->bits || !grp->data)
+				continue;
+			if (grp->nr > grp->alloc) {
+				fprintf(out, "%s: group %u nr > alloc\n",
+					bad, g);
+				return EXT2_ET_INVALID_ARGUMENT;
+			}
+			list = grp->data;
+			for (i = 0; i < grp->nr; i++) {
+				if (list[i].ino >= icount->ipg ||
+				    !list[i].count ||
+				    (i && list[i-1].ino >= list[i].ino)) {
+					fprintf(out, "%s: group %u list[%d] "
+						"ino=%u count=%u\n", bad, g,
+						i, list[i].ino, list[i].count);
+					ret = EXT2_ET_INVALID_ARGUMENT;
+				}
+			}
+		}
+		return ret;
+	}
 	if (icount->count > icount->size) {
 		fprintf(out, "%s: count > size\n", bad);
 		return EXT2_ET_INVALID_ARGUMENT;
@@ -534,6 +813,10 @@ errcode_t ext2fs_icount_fetch(ext2_icount_t icount, ext2_ino_t ino, __u16 *ret)
 	if (!ino || (ino > icount->num_inodes))
 		return EXT2_ET_INVALID_ARGUMENT;
 
+	if (icount->groups) {
+		*ret = icount_16_xlate(get_group_count(icount, ino));
+		return 0;
+	}
 	if (!icount->fullmap) {
 		if (ext2fs_test_inode_bitmap2(icount->single, ino)) {
 			*ret = 1;
@@ -560,7 +843,11 @@ errcode_t ext2fs_icount_increment(ext2_icount_t icount, ext2_ino_t ino,
 	if (!ino || (ino > icount->num_inodes))
 		return EXT2_ET_INVALID_ARGUMENT;
 
-	if (icount->fullmap) {
+	if (icount->groups) {
+		curr_value = get_group_count(icount, ino) + 1;
+		if (set_group_count(icount, ino, curr_value))
+			return EXT2_ET_NO_MEMORY;
+	} else if (icount->fullmap) {
 		curr_value = icount_16_xlate(icount->fullmap[ino] + 1);
 		icount->fullmap[ino] = curr_value;
 	} else if (ext2fs_test_inode_bitmap2(icount->single, ino)) {
@@ -620,6 +907,18 @@ errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
 
 	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
 
+	if (icount->groups) {
+		curr_value = get_group_count(icount, ino);
+		if (!curr_value)
+			return EXT2_ET_INVALID_ARGUMENT;
+		curr_value--;
+		if (set_group_count(icount, ino, curr_value))
+			return EXT2_ET_NO_MEMORY;
+		if (ret)
+			*ret = icount_16_xlate(curr_value);
+		return 0;
+	}
+
 	if (icount->fullmap) {
 		if (!icount->fullmap[ino])
 			return EXT2_ET_INVALID_ARGUMENT;
@@ -671,6 +970,8 @@ errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 
 	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
 
+	if (icount->groups)
+		return set_group_count(icount, ino, count);
 	if (icount->fullmap)
 		return set_inode_count(icount, ino, count);
 
@@ -709,7 +1010,75 @@ ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount)
 	return icount->size;
 }
 
+/*
+ * Move the sorted list (or the full map) out of the heap into a scratch
+ * file in the directory dir.  The inode bitmaps stay where they are.
+ * The per-group tables can't be moved.
+ */
+errcode_t ext2fs_icount_use_scratch(ext2_icount_t icount, const char *dir)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
+
+	if (icount->scratch)
+		return 0;
+	if (icount->groups)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (icount->fullmap) {
+		retval = ext2fs_move_to_scratch_mem(dir,
+				sizeof(*icount->fullmap) * icount->num_inodes,
+				&icount->fullmap);
+		if (retval)
+			return retval;
+	} else if (icount->list) {
+		retval = ext2fs_move_to_scratch_mem(dir, (size_t) icount->size *
+					sizeof(struct ext2_icount_el),
+					&icount->list);
+		if (retval)
+			return retval;
+	}
+	icount->last_lookup = NULL;
+	icount->scratch = 1;
+	return 0;
+}
+
+/*
+ * Return the number of bytes of heap memory used by the sorted list, the
+ * full map or the per-group tables; the inode bitmaps are not included.
+ */
+unsigned long long ext2fs_icount_heap_size(ext2_icount_t icount)
+{
+	if (!icount || icount->magic != EXT2_ET_MAGIC_ICOUNT ||
+	    icount->scratch)
+		return 0;
+	if (icount->groups) {
+		unsigned long long	bytes;
+		struct icount_group	*grp;
+		dgrp_t			g;
+
+		bytes = (unsigned long long) icount->num_groups *
+			sizeof(struct icount_group);
+		for (g = 0, grp = icount->groups; g < icount->num_groups;
+		     g++, grp++) {
+			if (grp->bits)
+				bytes += group_array_bytes(icount, grp->bits);
+			else
+				bytes += (unsigned long long) grp->alloc *
+					sizeof(struct ext2_icount_el);
+		}
+		return bytes;
+	}
+	if (icount->fullmap)
+		return (unsigned long long) sizeof(*icount->fullmap) *
+			icount->num_inodes;
+	return (unsigned long long) icount->size *
+		sizeof(struct ext2_icount_el);
+}
+
 #ifdef DEBUG
+#include <stdlib.h>
+#include <sys/time.h>
 
 ext2_filsys	test_fs;
 ext2_icount_t	icount;
@@ -899,10 +1268,169 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 }
 
 
+/*
+ * A deterministic pseudo-random number generator for the random test
+ */
+static __u32 rnd_state = 2463534242U;
+
+static __u32 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static ext2_filsys make_fs(unsigned int inodes)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+
+	memset(&param, 0, sizeof(param));
+	param.s_log_block_size = 2;
+	param.s_inodes_count = inodes;
+	ext2fs_blocks_count_set(&param, (blk64_t) inodes * 4);
+	retval = ext2fs_initialize("test fs", EXT2_FLAG_64BITS, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err("make_fs", retval, "while initializing filesystem");
+		exit(1);
+	}
+	return fs;
+}
+
+/*
+ * Count links the way pass 2 does: the inodes show up in directory
+ * order, each directory also counts itself for "." and its parent for
+ * "..", and the parents are skewed so that a few directories get very
+ * large counts.  Then drop some of the links again, and check every
+ * count against a plain array.
+ */
+static int run_random(ext2_filsys fs, const char *name, int flags, int bench)
+{
+	ext2_ino_t	num = fs->super->s_inodes_count;
+	ext2_ino_t	*order, *dirs, *parent, ino, tmp;
+	ext2_ino_t	i, n = 0, ndirs = 0;
+	__u32		*ref;
+	ext2_icount_t	ic;
+	struct timeval	start, end;
+	errcode_t	retval;
+	__u16		val;
+	int		problem = 0;
+
+	rnd_state = 2463534242U;
+	order = calloc(num + 1, sizeof(ext2_ino_t));
+	dirs = calloc(num + 1, sizeof(ext2_ino_t));
+	parent = calloc(num + 1, sizeof(ext2_ino_t));
+	ref = calloc(num + 1, sizeof(__u32));
+	if (!order || !dirs || !parent || !ref) {
+		com_err("run_random", ENOMEM, "while allocating test arrays");
+		exit(1);
+	}
+	for (ino = 1; ino <= num; ino++) {
+		if (rnd() & 1)
+			continue;
+		order[n++] = ino;
+		if ((rnd() & 7) == 0) {
+			parent[ino] = ndirs ? dirs[rnd() % (1 + rnd() % ndirs)] :
+				ino;
+			dirs[ndirs++] = ino;
+		}
+	}
+	for (i = n - 1; i > 0; i--) {
+		ino = rnd() % (i + 1);
+		tmp = order[i];
+		order[i] = order[ino];
+		order[ino] = tmp;
+	}
+
+	retval = ext2fs_create_icount2(fs, flags, 0, 0, &ic);
+	if (retval) {
+		com_err("run_random", retval, "while creating icount");
+		exit(1);
+	}
+	gettimeofday(&start, NULL);
+	for (i = 0; i < n; i++) {
+		ino = order[i];
+		retval = ext2fs_icount_increment(ic, ino, 0);
+		ref[ino]++;
+		if (!retval && parent[ino]) {
+			retval = ext2fs_icount_increment(ic, ino, 0);
+			ref[ino]++;
+			if (!retval)
+				retval = ext2fs_icount_increment(ic,
+							parent[ino], 0);
+			ref[parent[ino]]++;
+		}
+		if (retval) {
+			com_err("run_random", retval,
+				"while calling icount_increment");
+			exit(1);
+		}
+	}
+	for (i = 0; n && i < 70000; i++) {
+		ext2fs_icount_increment(ic, order[0], 0);
+		ref[order[0]]++;
+	}
+	for (i = 1; i < n; i += 3) {
+		retval = ext2fs_icount_decrement(ic, order[i], 0);
+		if (retval) {
+			com_err("run_random", retval,
+				"while calling icount_decrement");
+			exit(1);
+		}
+		ref[order[i]]--;
+	}
+	for (ino = 1; ino <= num; ino++) {
+		ext2fs_icount_fetch(ic, ino, &val);
+		if (val != icount_16_xlate(ref[ino])) {
+			if (problem++ < 10)
+				printf("%s: inode %u count %u, expected %u\n",
+				       name, ino, val, ref[ino]);
+		}
+	}
+	gettimeofday(&end, NULL);
+	if (ext2fs_icount_validate(ic, stdout))
+		problem++;
+	if (bench)
+		printf("%-10s %10.3f s  %12llu bytes\n", name,
+		       (end.tv_sec - start.tv_sec) +
+		       (end.tv_usec - start.tv_usec) / 1000000.0,
+		       ext2fs_icount_heap_size(ic));
+	else
+		printf("%s: %s\n", name, problem ? "NOT OK" : "OK");
+	ext2fs_free_icount(ic);
+	free(order);
+	free(dirs);
+	free(parent);
+	free(ref);
+	return problem;
+}
+
+static int run_random_all(unsigned int inodes, int bench)
+{
+	ext2_filsys	fs = make_fs(inodes);
+	int		failed = 0;
+
+	printf("%u inodes in %u groups of %u\n", fs->super->s_inodes_count,
+	       fs->group_desc_count, fs->super->s_inodes_per_group);
+	failed += run_random(fs, "list", EXT2_ICOUNT_OPT_INCREMENT, bench);
+	failed += run_random(fs, "fullmap", EXT2_ICOUNT_OPT_INCREMENT |
+			     EXT2_ICOUNT_OPT_FULLMAP, bench);
+	failed += run_random(fs, "groupmap", EXT2_ICOUNT_OPT_GROUPMAP, bench);
+	ext2fs_free(fs);
+	return failed;
+}
+
 int main(int argc, char **argv)
 {
 	int failed = 0;
 
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		return run_random_all(argc > 2 ? strtoul(argv[2], 0, 0) :
+				      4 * 1024 * 1024, 1);
+
 	setup();
 	printf("Standard icount run:\n");
 	failed += run_test(0, 0, 0, prog);
@@ -914,6 +1442,12 @@ int main(int argc, char **argv)
 	failed += run_test(0, 0, ".", prog);
 	printf("\nMultiple bitmap test with tdb:\n");
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, ".", prog);
+	printf("\nGroup map test:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_GROUPMAP, 0, 0, prog);
+	printf("\nGroup map extended test:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_GROUPMAP, 0, 0, extended);
+	printf("\nRandom test:\n");
+	failed += run_random_all(65536, 0);
 	if (failed)
 		printf("FAILED!\n");
 	return failed;
@@ -212,6 +212,9 @@ errcode_t ext2fs_image_super_write(ext2_filsys fs, int fd,
 
 	if (fs->group_desc == NULL)
 		return EXT2_ET_NO_GDESC;
+	retval = ext2fs_read_group_descs(fs);
+	if (retval)
+		return retval;
 
 	buf = malloc(fs->blocksize);
 	if (!buf)
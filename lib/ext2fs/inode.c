@@ -56,9 +56,41 @@ struct ext2_struct_inode_scan {
 	void *			done_group_data;
 	int			bad_block_ptr;
 	int			scan_flags;
-	int			reserved[6];
+	dgrp_t			ra_group;	/* next group to read ahead */
+	int			reserved[5];
 };
 
+/*
+ * Number of block groups whose inode tables are read ahead of the one
+ * being scanned, so that the device is busy with the next tables while
+ * the caller works through the current one.
+ */
+#define EXT2_INODE_SCAN_READAHEAD_GROUPS	2
+
+/*
+ * When the file system was opened with EXT2_FLAG_THREADS, the inode
+ * cache (and its block buffer, which is also used to read-modify-write
+ * the inode table) is locked, so that inodes may be read and written
+ * from several threads at once.  Anything else which changes the file
+ * system still has to be serialized by the caller.
+ */
+#ifdef HAVE_PTHREAD
+static void icache_lock(struct ext2_inode_cache *icache)
+{
+	if (icache->threads)
+		pthread_mutex_lock(&icache->mutex);
+}
+
+static void icache_unlock(struct ext2_inode_cache *icache)
+{
+	if (icache->threads)
+		pthread_mutex_unlock(&icache->mutex);
+}
+#else
+#define icache_lock(icache)	do { } while (0)
+#define icache_unlock(icache)	do { } while (0)
+#endif
+
 /*
  * This routine flushes the icache, if it exists.
  */
@@ -69,10 +101,12 @@ errcode_t ext2fs_flush_icache(ext2_filsys fs)
 	if (!fs->icache)
 		return 0;
 
+	icache_lock(fs->icache);
 	for (i=0; i < fs->icache->cache_size; i++)
 		fs->icache->cache[i].ino = 0;
 
 	fs->icache->buffer_blk = 0;
+	icache_unlock(fs->icache);
 	return 0;
 }
 
@@ -92,6 +126,10 @@ void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
 	icache->buffer_blk = 0;
+#ifdef HAVE_PTHREAD
+	if (icache->threads)
+		pthread_mutex_destroy(&icache->mutex);
+#endif
 	ext2fs_free_mem(&icache);
 }
 
@@ -115,6 +153,12 @@ errcode_t ext2fs_create_inode_cache(ext2_filsys fs, unsigned int cache_size)
 	fs->icache->cache_last = -1;
 	fs->icache->cache_size = cache_size;
 	fs->icache->refcount = 1;
+#ifdef HAVE_PTHREAD
+	if (fs->flags & EXT2_FLAG_THREADS) {
+		pthread_mutex_init(&fs->icache->mutex, NULL);
+		fs->icache->threads = 1;
+	}
+#endif
 	retval = ext2fs_get_array(fs->icache->cache_size,
 				  sizeof(struct ext2_inode_cache_ent),
 				  &fs->icache->cache);
@@ -258,6 +302,60 @@ void ext2fs_set_inode_callback(ext2_inode_scan scan,
 	scan->done_group_data = done_group_data;
 }
 
+/*
+ * Ask the I/O manager to start reading the inode tables of the current
+ * group and of the groups just ahead of it.  Only the part of each
+ * table which can hold in-use inodes is requested, and groups whose
+ * inode tables are uninitialized or missing are skipped, just as the
+ * scan itself does.
+ */
+static void inode_scan_readahead(ext2_inode_scan scan)
+{
+	ext2_filsys	fs = scan->fs;
+	dgrp_t		last = scan->current_group +
+			       EXT2_INODE_SCAN_READAHEAD_GROUPS;
+	blk64_t		blk;
+	__u32		inodes;
+	blk_t		num;
+
+	if (scan->scan_flags & EXT2_SF_NO_READAHEAD)
+		return;
+	if (scan->ra_group < scan->current_group)
+		scan->ra_group = scan->current_group;
+	if (last >= fs->group_desc_count)
+		last = fs->group_desc_count - 1;
+
+	for (; scan->ra_group <= last; scan->ra_group++) {
+		if ((scan->scan_flags & EXT2_SF_DO_LAZY) &&
+		    ext2fs_bg_flags_test(fs, scan->ra_group,
+					 EXT2_BG_INODE_UNINIT))
+			continue;
+		blk = ext2fs_inode_table_loc(fs, scan->ra_group);
+		if (!blk || blk < fs->super->s_first_data_block ||
+		    blk + fs->inode_blocks_per_group - 1 >=
+		    ext2fs_blocks_count(fs->super))
+			continue;
+		num = fs->inode_blocks_per_group;
+		if (ext2fs_has_group_desc_csum(fs)) {
+			inodes = EXT2_INODES_PER_GROUP(fs->super);
+			if (inodes > ext2fs_bg_itable_unused(fs, scan->ra_group))
+				inodes -= ext2fs_bg_itable_unused(fs,
+							scan->ra_group);
+			else
+				inodes = 0;
+			num = ((unsigned long long) inodes * scan->inode_size +
+			       fs->blocksize - 1) / fs->blocksize;
+			if (num > fs->inode_blocks_per_group)
+				num = fs->inode_blocks_per_group;
+		}
+		if (num && io_channel_cache_readahead(fs->io, blk, num)) {
+			/* Not supported by this I/O manager; stop trying */
+			scan->scan_flags |= EXT2_SF_NO_READAHEAD;
+			return;
+		}
+	}
+}
+
 int ext2fs_inode_scan_flags(ext2_inode_scan scan, int set_flags,
 			    int clear_flags)
 {
@@ -316,6 +414,7 @@ errcode_t ext2fs_inode_scan_goto_blockgroup(ext2_inode_scan scan,
 	scan->current_group = group - 1;
 	scan->groups_left = scan->fs->group_desc_count - group;
 	scan->bad_block_ptr = 0;
+	scan->ra_group = 0;
 	return get_next_blockgroup(scan);
 }
 
@@ -558,6 +657,7 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 		memset(scan->inode_buffer, 0,
 		       (size_t) num_blocks * scan->fs->blocksize);
 	} else {
+		inode_scan_readahead(scan);
 		retval = io_channel_read_blk64(scan->fs->io,
 					     scan->current_block,
 					     (int) num_blocks,
@@ -753,9 +853,13 @@ errcode_t ext2fs_get_next_inode(ext2_inode_scan scan, ext2_ino_t *ino,
 /*
  * Functions to read and write a single inode.
  */
-errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
-			     struct ext2_inode * inode, int bufsize,
-			     int flags)
+
+/*
+ * Read an inode through the inode cache, which must be locked.
+ */
+static errcode_t read_inode_cached(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode, int bufsize,
+				   int flags)
 {
 	blk64_t		block_nr;
 	dgrp_t		group;
@@ -769,30 +873,6 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 	struct ext2_inode_large	*iptr;
 	int		cache_slot, fail_csum;
 
-	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
-
-	if (ext2fs_has_feature_journal_dev(fs->super))
-		return EXT2_ET_EXTERNAL_JOURNAL_NOSUPP;
-
-	if (fs->blocksize < 1024)
-		return EXT2_FILSYS_CORRUPTED; /* Should never happen */
-
-	/* Check to see if user has an override function */
-	if (fs->read_inode &&
-	    ((bufsize == sizeof(struct ext2_inode)) ||
-	     (EXT2_INODE_SIZE(fs->super) == sizeof(struct ext2_inode)))) {
-		retval = (fs->read_inode)(fs, ino, inode);
-		if (retval != EXT2_ET_CALLBACK_NOTHANDLED)
-			return retval;
-	}
-	if ((ino == 0) || (ino > fs->super->s_inodes_count))
-		return EXT2_ET_BAD_INODE_NUM;
-	/* Create inode cache if not present */
-	if (!fs->icache) {
-		retval = ext2fs_create_inode_cache(fs, 4);
-		if (retval)
-			return retval;
-	}
 	/* Check to see if it's in the inode cache */
 	for (i = 0; i < fs->icache->cache_size; i++) {
 		if (fs->icache->cache[i].ino == ino) {
@@ -877,6 +957,42 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 	return 0;
 }
 
+errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
+			     struct ext2_inode * inode, int bufsize,
+			     int flags)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (ext2fs_has_feature_journal_dev(fs->super))
+		return EXT2_ET_EXTERNAL_JOURNAL_NOSUPP;
+
+	if (fs->blocksize < 1024)
+		return EXT2_FILSYS_CORRUPTED; /* Should never happen */
+
+	/* Check to see if user has an override function */
+	if (fs->read_inode &&
+	    ((bufsize == sizeof(struct ext2_inode)) ||
+	     (EXT2_INODE_SIZE(fs->super) == sizeof(struct ext2_inode)))) {
+		retval = (fs->read_inode)(fs, ino, inode);
+		if (retval != EXT2_ET_CALLBACK_NOTHANDLED)
+			return retval;
+	}
+	if ((ino == 0) || (ino > fs->super->s_inodes_count))
+		return EXT2_ET_BAD_INODE_NUM;
+	/* Create inode cache if not present */
+	if (!fs->icache) {
+		retval = ext2fs_create_inode_cache(fs, 4);
+		if (retval)
+			return retval;
+	}
+	icache_lock(fs->icache);
+	retval = read_inode_cached(fs, ino, inode, bufsize, flags);
+	icache_unlock(fs->icache);
+	return retval;
+}
+
 errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 				 struct ext2_inode * inode, int bufsize)
 {
@@ -932,25 +1048,26 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			goto errout;
 	}
 
-	/* Check to see if the inode cache needs to be updated */
-	if (fs->icache) {
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				memcpy(fs->icache->cache[i].inode, inode,
-				       (bufsize > length) ? length : bufsize);
-				break;
-			}
-		}
-	} else {
+	if (!fs->icache) {
 		retval = ext2fs_create_inode_cache(fs, 4);
 		if (retval)
 			goto errout;
 	}
+	icache_lock(fs->icache);
+
+	/* Check to see if the inode cache needs to be updated */
+	for (i=0; i < fs->icache->cache_size; i++) {
+		if (fs->icache->cache[i].ino == ino) {
+			memcpy(fs->icache->cache[i].inode, inode,
+			       (bufsize > length) ? length : bufsize);
+			break;
+		}
+	}
 	memcpy(w_inode, inode, (bufsize > length) ? length : bufsize);
 
 	if (!(fs->flags & EXT2_FLAG_RW)) {
 		retval = EXT2_ET_RO_FILSYS;
-		goto errout;
+		goto unlock;
 	}
 
 #ifdef WORDS_BIGENDIAN
@@ -960,7 +1077,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	if ((flags & WRITE_INODE_NOCSUM) == 0) {
 		retval = ext2fs_inode_csum_set(fs, ino, w_inode);
 		if (retval)
-			goto errout;
+			goto unlock;
 	}
 
 	group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
@@ -970,13 +1087,13 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	block_nr = ext2fs_inode_table_loc(fs, (unsigned) group);
 	if (!block_nr) {
 		retval = EXT2_ET_MISSING_INODE_TABLE;
-		goto errout;
+		goto unlock;
 	}
 	if ((block_nr < fs->super->s_first_data_block) ||
 	    (block_nr + fs->inode_blocks_per_group - 1 >=
 	     ext2fs_blocks_count(fs->super))) {
 		retval = EXT2_ET_GDESC_BAD_INODE_TABLE;
-		goto errout;
+		goto unlock;
 	}
 	block_nr += block;
 
@@ -993,7 +1110,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			retval = io_channel_read_blk64(fs->io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
-				goto errout;
+				goto unlock;
 			fs->icache->buffer_blk = block_nr;
 		}
 
@@ -1004,7 +1121,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 		retval = io_channel_write_blk64(fs->io, block_nr, 1,
 					      fs->icache->buffer);
 		if (retval)
-			goto errout;
+			goto unlock;
 
 		offset = 0;
 		ptr += clen;
@@ -1013,6 +1130,8 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	}
 
 	fs->flags |= EXT2_FLAG_CHANGED;
+unlock:
+	icache_unlock(fs->icache);
 errout:
 	ext2fs_free_mem(&w_inode);
 	return retval;
@@ -123,6 +123,26 @@ errcode_t io_channel_zeroout(io_channel channel, unsigned long long block,
 	return EXT2_ET_UNIMPLEMENTED;
 }
 
+/*
+ * Copy count blocks from the file fd, starting at byte offset, to the
+ * channel starting at block, without passing the data through user
+ * space.  Returns EXT2_ET_UNIMPLEMENTED if this can't be done between
+ * the two files, in which case the caller should copy the data itself.
+ */
+errcode_t io_channel_copy_file_range(io_channel channel,
+				     unsigned long long block, int fd,
+				     ext2_loff_t offset,
+				     unsigned long long count)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->copy_file_range)
+		return (channel->manager->copy_file_range)(channel, block, fd,
+							   offset, count);
+
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
 errcode_t io_channel_alloc_buf(io_channel io, int count, void *ptr)
 {
 	size_t	size;
@@ -150,3 +170,109 @@ errcode_t io_channel_cache_readahead(io_channel io, unsigned long long block,
 
 	return io->manager->cache_readahead(io, block, count);
 }
+
+/*
+ * Read a vector of possibly scattered block runs.  I/O managers which
+ * implement read_blkv may issue the requests in any order and keep
+ * several of them in flight at once; otherwise they are read one at a
+ * time.  The error for each request is stored in reqs[i].error, and if
+ * done is non-NULL it is called as each request completes.  Returns the
+ * error of the first failed request, in array order.
+ */
+errcode_t io_channel_read_blkv(io_channel channel, struct io_blk_req *reqs,
+			       int nr, io_blk_req_done done, void *priv_data)
+{
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (nr <= 0)
+		return 0;
+
+	if (channel->manager->read_blkv) {
+		retval = (channel->manager->read_blkv)(channel, reqs, nr,
+						       done, priv_data);
+		if (retval) {
+			for (i = 0; i < nr; i++)
+				reqs[i].error = retval;
+			return retval;
+		}
+	} else {
+		for (i = 0; i < nr; i++) {
+			reqs[i].error = io_channel_read_blk64(channel,
+						reqs[i].block, reqs[i].count,
+						reqs[i].buf);
+			if (done)
+				(done)(channel, &reqs[i], priv_data);
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		if (reqs[i].error)
+			return reqs[i].error;
+	return 0;
+}
+
+/*
+ * Write a vector of possibly scattered block runs.  I/O managers which
+ * implement write_blkv may issue the requests in any order and keep
+ * several of them in flight at once, so a block should not be written
+ * twice in one call, and a caller which needs one write to reach the
+ * disk before another must flush the channel in between.  Errors are
+ * reported as for io_channel_read_blkv().
+ */
+errcode_t io_channel_write_blkv(io_channel channel, struct io_blk_req *reqs,
+				int nr, io_blk_req_done done, void *priv_data)
+{
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (nr <= 0)
+		return 0;
+
+	if (channel->manager->write_blkv) {
+		retval = (channel->manager->write_blkv)(channel, reqs, nr,
+							done, priv_data);
+		if (retval) {
+			for (i = 0; i < nr; i++)
+				reqs[i].error = retval;
+			return retval;
+		}
+	} else {
+		for (i = 0; i < nr; i++) {
+			reqs[i].error = io_channel_write_blk64(channel,
+						reqs[i].block, reqs[i].count,
+						reqs[i].buf);
+			if (done)
+				(done)(channel, &reqs[i], priv_data);
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		if (reqs[i].error)
+			return reqs[i].error;
+	return 0;
+}
+
+/*
+ * Return the I/O manager a program should use for its device or image
+ * file.  Setting E2FSPROGS_IO_MANAGER=uring selects the io_uring I/O
+ * manager; otherwise def is returned.
+ */
+io_manager io_channel_select_manager(io_manager def)
+{
+	char *cp = ext2fs_safe_getenv("E2FSPROGS_IO_MANAGER");
+
+	if (!cp)
+		return def;
+	if (!strcmp(cp, "uring"))
+		return uring_io_manager;
+#ifndef _WIN32
+	if (!strcmp(cp, "unix"))
+		return unix_io_manager;
+#endif
+	return def;
+}
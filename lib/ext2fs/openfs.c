@@ -29,7 +29,7 @@
 
 #include "ext2_fs.h"
 
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 blk64_t ext2fs_descriptor_block_loc2(ext2_filsys fs, blk64_t group_block,
@@ -454,6 +454,25 @@ retry:
 			first_meta_bg = fs->desc_blocks;
 	} else
 		first_meta_bg = fs->desc_blocks;
+	if ((flags & EXT2_FLAG_LAZY_LOAD) && !(flags & EXT2_FLAG_IMAGE_FILE)) {
+		/*
+		 * Leave the descriptor blocks on disk; ext2fs_group_desc()
+		 * reads each one in the first time one of its groups is
+		 * looked at.
+		 */
+		retval = ext2fs_get_memzero(sizeof(struct ext2fs_lazy_gdt),
+					    &fs->lazy_gdt);
+		if (retval)
+			goto cleanup;
+		retval = ext2fs_get_memzero((fs->desc_blocks + 7) / 8,
+					    &fs->lazy_gdt->loaded);
+		if (retval)
+			goto cleanup;
+		fs->lazy_gdt->group_block = group_block;
+		fs->lazy_gdt->first_meta_bg = first_meta_bg;
+		fs->lazy_gdt->group_zero_adjust = group_zero_adjust;
+		goto skip_read_gdt;
+	}
 	if (first_meta_bg) {
 		retval = io_channel_read_blk(fs->io, group_block +
 					     group_zero_adjust + 1,
@@ -492,6 +511,7 @@ retry:
 		dest += fs->blocksize;
 	}
 
+skip_read_gdt:
 	fs->stride = fs->super->s_raid_stride;
 
 	/*
@@ -534,6 +554,17 @@ skip_read_bg:
 		ext2fs_set_feature_shared_blocks(fs->super);
 	}
 
+	/*
+	 * Create the inode cache up front, so that threads do not race to
+	 * create it on their first inode read.
+	 */
+	if ((flags & EXT2_FLAG_THREADS) &&
+	    !ext2fs_has_feature_journal_dev(fs->super)) {
+		retval = ext2fs_create_inode_cache(fs, 4);
+		if (retval)
+			goto cleanup;
+	}
+
 	if (ext2fs_has_feature_casefold(fs->super))
 		fs->encoding = ext2fs_load_nls_table(fs->super->s_encoding);
 
@@ -550,6 +581,89 @@ cleanup:
 	return retval;
 }
 
+/*
+ * Read in descriptor block i of a file system opened with
+ * EXT2_FLAG_LAZY_LOAD.  A block which can't be read is left zeroed, and
+ * the error is kept to be returned by ext2fs_read_group_descs(), since
+ * ext2fs_group_desc() has no way to report it.  Descriptor blocks below
+ * s_first_meta_bg are contiguous on disk, so a few of the following ones
+ * are read along with the one asked for.
+ */
+#define LAZY_GDT_READ_BLOCKS	16
+
+errcode_t ext2fs_load_desc_block(ext2_filsys fs, dgrp_t i)
+{
+	struct ext2fs_lazy_gdt *lazy = fs->lazy_gdt;
+	char		*dest;
+	blk64_t		blk;
+	dgrp_t		n = 1;
+	errcode_t	retval;
+#ifdef WORDS_BIGENDIAN
+	unsigned int	desc_size = EXT2_DESC_SIZE(fs->super) & ~7;
+	unsigned int	j;
+#endif
+
+	if (!lazy || i >= fs->desc_blocks || ext2fs_test_bit(i, lazy->loaded))
+		return 0;
+
+	if (i < lazy->first_meta_bg) {
+		blk = lazy->group_block + lazy->group_zero_adjust + 1 + i;
+		while (n < LAZY_GDT_READ_BLOCKS &&
+		       i + n < lazy->first_meta_bg &&
+		       !ext2fs_test_bit(i + n, lazy->loaded))
+			n++;
+	} else
+		blk = ext2fs_descriptor_block_loc2(fs, lazy->group_block, i);
+
+	dest = (char *) fs->group_desc + (size_t) i * fs->blocksize;
+	retval = io_channel_read_blk64(fs->io, blk, n, dest);
+	if (retval) {
+		memset(dest, 0, (size_t) n * fs->blocksize);
+		if (!lazy->error)
+			lazy->error = retval;
+	}
+#ifdef WORDS_BIGENDIAN
+	else {
+		for (j = 0; j < n * EXT2_DESC_PER_BLOCK(fs->super); j++)
+			ext2fs_swap_group_desc2(fs, (struct ext2_group_desc *)
+						(dest + j * desc_size));
+	}
+#endif
+	while (n--)
+		ext2fs_set_bit(i++, lazy->loaded);
+	return retval;
+}
+
+/*
+ * Read in all of the group descriptors which haven't been read yet.
+ * This is a no-op unless the file system was opened with
+ * EXT2_FLAG_LAZY_LOAD.
+ */
+errcode_t ext2fs_read_group_descs(ext2_filsys fs)
+{
+	struct ext2fs_lazy_gdt *lazy = fs->lazy_gdt;
+	errcode_t	retval;
+	dgrp_t		i;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!lazy)
+		return 0;
+	for (i = lazy->first_meta_bg; i < fs->desc_blocks; i++)
+		if (!ext2fs_test_bit(i, lazy->loaded))
+			io_channel_cache_readahead(fs->io,
+				ext2fs_descriptor_block_loc2(fs,
+						lazy->group_block, i), 1);
+	for (i = 0; i < fs->desc_blocks; i++)
+		ext2fs_load_desc_block(fs, i);
+	retval = lazy->error;
+	if (retval)
+		return retval;
+	ext2fs_free_mem(&lazy->loaded);
+	ext2fs_free_mem(&fs->lazy_gdt);
+	return 0;
+}
+
 /*
  * Set/get the filesystem data I/O channel.
  *
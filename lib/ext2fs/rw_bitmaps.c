@@ -28,7 +28,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 #ifdef HAVE_PTHREAD
@@ -68,6 +68,21 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	if (!(fs->flags & EXT2_FLAG_RW))
 		return EXT2_ET_RO_FILSYS;
 
+	/*
+	 * A bitmap which couldn't be read in full must not be written
+	 * back over the on-disk copy.
+	 */
+	if (do_block) {
+		retval = ext2fs_paged_bmap_error(fs->block_map);
+		if (retval)
+			return retval;
+	}
+	if (do_inode) {
+		retval = ext2fs_paged_bmap_error(fs->inode_map);
+		if (retval)
+			return retval;
+	}
+
 	csum_flag = ext2fs_has_group_desc_csum(fs);
 
 	inode_nbytes = block_nbytes = 0;
@@ -94,6 +109,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
 		    )
 			goto skip_this_block_bitmap;
+		/* Bitmaps never read in are unchanged on disk */
+		if (!ext2fs_paged_bmap_page_loaded(fs->block_map, i))
+			goto skip_this_block_bitmap;
 
 		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
 				blk_itr, block_nbytes << 3, block_buf);
@@ -137,6 +155,8 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT)
 		    )
 			goto skip_this_inode_bitmap;
+		if (!ext2fs_paged_bmap_page_loaded(fs->inode_map, i))
+			goto skip_this_inode_bitmap;
 
 		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
 				ino_itr, inode_nbytes << 3, inode_buf);
@@ -180,39 +200,43 @@ errout:
 	return retval;
 }
 
-static errcode_t mark_uninit_bg_group_blocks(ext2_filsys fs)
+static void mark_uninit_bg_blocks(ext2_filsys fs, dgrp_t i,
+				  ext2fs_block_bitmap bmap)
 {
-	dgrp_t			i;
 	blk64_t			blk;
-	ext2fs_block_bitmap	bmap = fs->block_map;
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (!ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT))
-			continue;
+	ext2fs_reserve_super_and_bgd(fs, i, bmap);
 
-		ext2fs_reserve_super_and_bgd(fs, i, bmap);
+	/*
+	 * Mark the blocks used for the inode table
+	 */
+	blk = ext2fs_inode_table_loc(fs, i);
+	if (blk)
+		ext2fs_mark_block_bitmap_range2(bmap, blk,
+					fs->inode_blocks_per_group);
 
-		/*
-		 * Mark the blocks used for the inode table
-		 */
-		blk = ext2fs_inode_table_loc(fs, i);
-		if (blk)
-			ext2fs_mark_block_bitmap_range2(bmap, blk,
-						fs->inode_blocks_per_group);
+	/*
+	 * Mark block used for the block bitmap
+	 */
+	blk = ext2fs_block_bitmap_loc(fs, i);
+	if (blk && blk < ext2fs_blocks_count(fs->super))
+		ext2fs_mark_block_bitmap2(bmap, blk);
 
-		/*
-		 * Mark block used for the block bitmap
-		 */
-		blk = ext2fs_block_bitmap_loc(fs, i);
-		if (blk && blk < ext2fs_blocks_count(fs->super))
-			ext2fs_mark_block_bitmap2(bmap, blk);
+	/*
+	 * Mark block used for the inode bitmap
+	 */
+	blk = ext2fs_inode_bitmap_loc(fs, i);
+	if (blk && blk < ext2fs_blocks_count(fs->super))
+		ext2fs_mark_block_bitmap2(bmap, blk);
+}
 
-		/*
-		 * Mark block used for the inode bitmap
-		 */
-		blk = ext2fs_inode_bitmap_loc(fs, i);
-		if (blk && blk < ext2fs_blocks_count(fs->super))
-			ext2fs_mark_block_bitmap2(bmap, blk);
+static errcode_t mark_uninit_bg_group_blocks(ext2_filsys fs)
+{
+	dgrp_t			i;
+
+	for (i = 0; i < fs->group_desc_count; i++) {
+		if (ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT))
+			mark_uninit_bg_blocks(fs, i, fs->block_map);
 	}
 	return 0;
 }
@@ -281,13 +305,51 @@ cleanup:
 	return retval;
 }
 
+/*
+ * The on-disk bitmaps for this many groups are read with a single
+ * io_channel_read_blkv() call, so that the I/O manager can merge the
+ * reads of adjacent bitmaps (as laid out by flex_bg) and keep several
+ * of them in flight at once.
+ */
+#define READ_BITMAPS_BATCH	32
+
+/*
+ * The batched reads are done with the channel's read error handler
+ * switched off, since the I/O manager may issue them in any order.  A
+ * bitmap whose read failed is read again on its own when its group
+ * comes up, and only then is the handler called, so that errors are
+ * still reported (and reading still stops) in group order.
+ */
+typedef errcode_t (*read_error_func)(io_channel channel, unsigned long block,
+				     int count, void *data, size_t size,
+				     int actual_bytes_read, errcode_t error);
+
+static errcode_t reread_bitmap(ext2_filsys fs, read_error_func read_error,
+			       blk64_t blk, char *buf)
+{
+	errcode_t retval;
+
+	retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+	if (retval && read_error) {
+		memset(buf, 0, fs->blocksize);
+		retval = (read_error)(fs->io, blk, 1, buf, fs->blocksize, 0,
+				      retval);
+	}
+	return retval;
+}
+
 static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 					  dgrp_t start, dgrp_t end,
 					  mutex_t *mutex,
+					  read_error_func read_error,
 					  int *tail_flags)
 {
-	dgrp_t i;
-	char *block_bitmap = 0, *inode_bitmap = 0;
+	dgrp_t i, batch, batch_end;
+	char *block_bitmaps = 0, *inode_bitmaps = 0;
+	char *block_bitmap, *inode_bitmap;
+	struct io_blk_req reqs[2 * READ_BITMAPS_BATCH], *req;
+	int block_req[READ_BITMAPS_BATCH], inode_req[READ_BITMAPS_BATCH];
+	int nreq;
 	errcode_t retval = 0;
 	int block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
@@ -302,7 +364,8 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	csum_flag = ext2fs_has_group_desc_csum(fs);
 
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
-		retval = io_channel_alloc_buf(fs->io, 0, &block_bitmap);
+		retval = io_channel_alloc_buf(fs->io, READ_BITMAPS_BATCH,
+					      &block_bitmaps);
 		if (retval)
 			goto cleanup;
 	} else {
@@ -310,7 +373,8 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	}
 
 	if (flags & EXT2FS_BITMAPS_INODE) {
-		retval = io_channel_alloc_buf(fs->io, 0, &inode_bitmap);
+		retval = io_channel_alloc_buf(fs->io, READ_BITMAPS_BATCH,
+					      &inode_bitmaps);
 		if (retval)
 			goto cleanup;
 	} else {
@@ -321,16 +385,16 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
 		blk = (ext2fs_le32_to_cpu(fs->image_header->offset_inodemap) / fs->blocksize);
 		ino_cnt = fs->super->s_inodes_count;
-		while (inode_bitmap && ino_cnt > 0) {
+		while (inode_bitmaps && ino_cnt > 0) {
 			retval = io_channel_read_blk64(fs->image_io, blk++,
-						     1, inode_bitmap);
+						     1, inode_bitmaps);
 			if (retval)
 				goto cleanup;
 			cnt = fs->blocksize << 3;
 			if (cnt > ino_cnt)
 				cnt = ino_cnt;
 			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
+					       ino_itr, cnt, inode_bitmaps);
 			if (retval)
 				goto cleanup;
 			ino_itr += cnt;
@@ -340,16 +404,16 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 		       fs->blocksize);
 		blk_cnt = EXT2_GROUPS_TO_CLUSTERS(fs->super,
 						  fs->group_desc_count);
-		while (block_bitmap && blk_cnt > 0) {
+		while (block_bitmaps && blk_cnt > 0) {
 			retval = io_channel_read_blk64(fs->image_io, blk++,
-						     1, block_bitmap);
+						     1, block_bitmaps);
 			if (retval)
 				goto cleanup;
 			cnt = fs->blocksize << 3;
 			if (cnt > blk_cnt)
 				cnt = blk_cnt;
 			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-				       blk_itr, cnt, block_bitmap);
+				       blk_itr, cnt, block_bitmaps);
 			if (retval)
 				goto cleanup;
 			blk_itr += cnt;
@@ -360,89 +424,132 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 
 	blk_itr += ((blk64_t)start * (block_nbytes << 3));
 	ino_itr += ((blk64_t)start * (inode_nbytes << 3));
-	for (i = start; i <= end; i++) {
-		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if ((csum_flag &&
-			     ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			     ext2fs_group_desc_csum_verify(fs, i)) ||
-			    (blk >= ext2fs_blocks_count(fs->super)))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
+	for (batch = start; batch <= end; batch = batch_end + 1) {
+		batch_end = end;
+		if (end - batch >= READ_BITMAPS_BATCH)
+			batch_end = batch + READ_BITMAPS_BATCH - 1;
+
+		nreq = 0;
+		for (i = batch; i <= batch_end; i++) {
+			block_req[i - batch] = inode_req[i - batch] = -1;
+			if (block_bitmaps) {
+				blk = ext2fs_block_bitmap_loc(fs, i);
+				if ((csum_flag &&
+				     ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
+				     ext2fs_group_desc_csum_verify(fs, i)) ||
+				    (blk >= ext2fs_blocks_count(fs->super)))
+					blk = 0;
+				if (blk) {
+					req = &reqs[nreq];
+					req->block = blk;
+					req->count = 1;
+					req->buf = block_bitmaps +
+						(i - batch) * fs->blocksize;
+					block_req[i - batch] = nreq++;
 				}
-				/* verify block bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_block_bitmap_csum_verify(fs, i,
-						block_bitmap, block_nbytes)) {
-					retval =
-					EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
-					goto cleanup;
+			}
+			if (inode_bitmaps) {
+				blk = ext2fs_inode_bitmap_loc(fs, i);
+				if ((csum_flag &&
+				     ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
+				     ext2fs_group_desc_csum_verify(fs, i)) ||
+				    (blk >= ext2fs_blocks_count(fs->super)))
+					blk = 0;
+				if (blk) {
+					req = &reqs[nreq];
+					req->block = blk;
+					req->count = 1;
+					req->buf = inode_bitmaps +
+						(i - batch) * fs->blocksize;
+					inode_req[i - batch] = nreq++;
 				}
-				if (!bitmap_tail_verify((unsigned char *) block_bitmap,
-							block_nbytes, fs->blocksize - 1))
-					*tail_flags |= EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
-			} else
-				memset(block_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			unix_pthread_mutex_lock(mutex);
-			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-					       blk_itr, cnt, block_bitmap);
-			unix_pthread_mutex_unlock(mutex);
-			if (retval)
-				goto cleanup;
-			blk_itr += block_nbytes << 3;
+			}
 		}
-		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if ((csum_flag &&
-			     ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			     ext2fs_group_desc_csum_verify(fs, i)) ||
-			    (blk >= ext2fs_blocks_count(fs->super)))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
+		/* Errors are dealt with per request below, in group order */
+		(void) io_channel_read_blkv(fs->io, reqs, nreq, NULL, NULL);
+
+		for (i = batch; i <= batch_end; i++) {
+			if (block_bitmaps) {
+				block_bitmap = block_bitmaps +
+					(i - batch) * fs->blocksize;
+				if (block_req[i - batch] >= 0) {
+					req = &reqs[block_req[i - batch]];
+					if (req->error &&
+					    reread_bitmap(fs, read_error,
+							  req->block,
+							  block_bitmap)) {
+						retval = EXT2_ET_BLOCK_BITMAP_READ;
+						goto cleanup;
+					}
+					/* verify block bitmap checksum */
+					if (!(fs->flags &
+					      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+					    !ext2fs_block_bitmap_csum_verify(fs, i,
+							block_bitmap, block_nbytes)) {
+						retval =
+						EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
+						goto cleanup;
+					}
+					if (!bitmap_tail_verify((unsigned char *) block_bitmap,
+								block_nbytes, fs->blocksize - 1))
+						*tail_flags |= EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
+				} else
+					memset(block_bitmap, 0, block_nbytes);
+				cnt = block_nbytes << 3;
+				unix_pthread_mutex_lock(mutex);
+				retval = ext2fs_set_block_bitmap_range2(fs->block_map,
+						       blk_itr, cnt, block_bitmap);
+				unix_pthread_mutex_unlock(mutex);
+				if (retval)
 					goto cleanup;
-				}
-
-				/* verify inode bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_inode_bitmap_csum_verify(fs, i,
-						inode_bitmap, inode_nbytes)) {
-					retval =
-					EXT2_ET_INODE_BITMAP_CSUM_INVALID;
+				blk_itr += block_nbytes << 3;
+			}
+			if (inode_bitmaps) {
+				inode_bitmap = inode_bitmaps +
+					(i - batch) * fs->blocksize;
+				if (inode_req[i - batch] >= 0) {
+					req = &reqs[inode_req[i - batch]];
+					if (req->error &&
+					    reread_bitmap(fs, read_error,
+							  req->block,
+							  inode_bitmap)) {
+						retval = EXT2_ET_INODE_BITMAP_READ;
+						goto cleanup;
+					}
+
+					/* verify inode bitmap checksum */
+					if (!(fs->flags &
+					      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+					    !ext2fs_inode_bitmap_csum_verify(fs, i,
+							inode_bitmap, inode_nbytes)) {
+						retval =
+						EXT2_ET_INODE_BITMAP_CSUM_INVALID;
+						goto cleanup;
+					}
+					if (!bitmap_tail_verify((unsigned char *) inode_bitmap,
+								inode_nbytes, fs->blocksize - 1))
+						*tail_flags |= EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
+				} else
+					memset(inode_bitmap, 0, inode_nbytes);
+				cnt = inode_nbytes << 3;
+				unix_pthread_mutex_lock(mutex);
+				retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
+						       ino_itr, cnt, inode_bitmap);
+				unix_pthread_mutex_unlock(mutex);
+				if (retval)
 					goto cleanup;
-				}
-				if (!bitmap_tail_verify((unsigned char *) inode_bitmap,
-							inode_nbytes, fs->blocksize - 1))
-					*tail_flags |= EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
-			cnt = inode_nbytes << 3;
-			unix_pthread_mutex_lock(mutex);
-			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
-			unix_pthread_mutex_unlock(mutex);
-			if (retval)
-				goto cleanup;
-			ino_itr += inode_nbytes << 3;
+				ino_itr += inode_nbytes << 3;
+			}
 		}
+		if (batch_end == end)
+			break;
 	}
 
 cleanup:
-	if (inode_bitmap)
-		ext2fs_free_mem(&inode_bitmap);
-	if (block_bitmap)
-		ext2fs_free_mem(&block_bitmap);
+	if (inode_bitmaps)
+		ext2fs_free_mem(&inode_bitmaps);
+	if (block_bitmaps)
+		ext2fs_free_mem(&block_bitmaps);
 	return retval;
 }
 
@@ -480,6 +587,7 @@ static void read_bitmaps_cleanup_on_error(ext2_filsys fs, int flags)
 static errcode_t read_bitmaps_range(ext2_filsys fs, int flags,
 				    dgrp_t start, dgrp_t end)
 {
+	read_error_func read_error;
 	errcode_t retval;
 	int tail_flags = 0;
 
@@ -487,8 +595,11 @@ static errcode_t read_bitmaps_range(ext2_filsys fs, int flags,
 	if (retval)
 		return retval;
 
+	read_error = fs->io->read_error;
+	fs->io->read_error = NULL;
 	retval = read_bitmaps_range_start(fs, flags, start, end,
-					  NULL, &tail_flags);
+					  NULL, read_error, &tail_flags);
+	fs->io->read_error = read_error;
 	if (retval == 0)
 		retval = read_bitmaps_range_end(fs, flags, tail_flags);
 	if (retval)
@@ -496,6 +607,124 @@ static errcode_t read_bitmaps_range(ext2_filsys fs, int flags,
 	return retval;
 }
 
+/*
+ * With EXT2_FLAG_LAZY_LOAD the bitmaps are paged bitmaps with one page
+ * per group, and the on-disk bitmap of a group is only read the first
+ * time the group's page is used.  These are the page loaders.
+ */
+static errcode_t load_block_bitmap_page(ext2_filsys fs,
+					ext2fs_generic_bitmap bmap,
+					__u64 page, void *bits)
+{
+	dgrp_t		i = page;
+	int		block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
+	char		*buf;
+	blk64_t		blk;
+	errcode_t	retval;
+
+	if (i >= fs->group_desc_count)
+		return 0;
+	blk = ext2fs_block_bitmap_loc(fs, i);
+	if ((ext2fs_has_group_desc_csum(fs) &&
+	     ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
+	     ext2fs_group_desc_csum_verify(fs, i)) ||
+	    (blk >= ext2fs_blocks_count(fs->super)))
+		blk = 0;
+	if (blk) {
+		retval = io_channel_alloc_buf(fs->io, 0, &buf);
+		if (retval)
+			return retval;
+		retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+		if (retval)
+			retval = EXT2_ET_BLOCK_BITMAP_READ;
+		else if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+			 !ext2fs_block_bitmap_csum_verify(fs, i, buf,
+							  block_nbytes))
+			retval = EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
+		else {
+			if (!bitmap_tail_verify((unsigned char *) buf,
+						block_nbytes, fs->blocksize - 1))
+				fs->flags |= EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
+			memcpy(bits, buf, block_nbytes);
+		}
+		ext2fs_free_mem(&buf);
+		return retval;
+	}
+	if (ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT))
+		mark_uninit_bg_blocks(fs, i, (ext2fs_block_bitmap) bmap);
+	return 0;
+}
+
+static errcode_t load_inode_bitmap_page(ext2_filsys fs,
+					ext2fs_generic_bitmap bmap EXT2FS_ATTR((unused)),
+					__u64 page, void *bits)
+{
+	dgrp_t		i = page;
+	int		inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
+	char		*buf;
+	blk64_t		blk;
+	errcode_t	retval;
+
+	if (i >= fs->group_desc_count)
+		return 0;
+	blk = ext2fs_inode_bitmap_loc(fs, i);
+	if ((ext2fs_has_group_desc_csum(fs) &&
+	     ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
+	     ext2fs_group_desc_csum_verify(fs, i)) ||
+	    (blk >= ext2fs_blocks_count(fs->super)))
+		blk = 0;
+	if (!blk)
+		return 0;
+	retval = io_channel_alloc_buf(fs->io, 0, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+	if (retval)
+		retval = EXT2_ET_INODE_BITMAP_READ;
+	else if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+		 !ext2fs_inode_bitmap_csum_verify(fs, i, buf, inode_nbytes))
+		retval = EXT2_ET_INODE_BITMAP_CSUM_INVALID;
+	else {
+		if (!bitmap_tail_verify((unsigned char *) buf,
+					inode_nbytes, fs->blocksize - 1))
+			fs->flags |= EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
+		memcpy(bits, buf, inode_nbytes);
+	}
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+static errcode_t read_bitmaps_lazy(ext2_filsys fs, int flags)
+{
+	int		type = fs->default_bitmap_type;
+	errcode_t	retval;
+
+	fs->default_bitmap_type = EXT2FS_BMAP64_PAGED;
+	retval = read_bitmaps_range_prepare(fs, flags);
+	fs->default_bitmap_type = type;
+	if (retval)
+		return retval;
+
+	if (flags & EXT2FS_BITMAPS_BLOCK) {
+		retval = ext2fs_paged_bmap_set_loader(fs->block_map,
+						      load_block_bitmap_page);
+		if (retval)
+			goto errout;
+		fs->flags &= ~EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
+	}
+	if (flags & EXT2FS_BITMAPS_INODE) {
+		retval = ext2fs_paged_bmap_set_loader(fs->inode_map,
+						      load_inode_bitmap_page);
+		if (retval)
+			goto errout;
+		fs->flags &= ~EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
+	}
+	return 0;
+errout:
+	read_bitmaps_cleanup_on_error(fs, flags);
+	return retval;
+}
+
 #ifdef HAVE_PTHREAD
 struct read_bitmaps_thread_info {
 	ext2_filsys	rbt_fs;
@@ -504,6 +733,7 @@ struct read_bitmaps_thread_info {
 	dgrp_t		rbt_grp_end;
 	errcode_t	rbt_retval;
 	pthread_mutex_t *rbt_mutex;
+	read_error_func	rbt_read_error;
 	int		rbt_tail_flags;
 };
 
@@ -513,7 +743,8 @@ static void *read_bitmaps_thread(void *data)
 
 	rbt->rbt_retval = read_bitmaps_range_start(rbt->rbt_fs, rbt->rbt_flags,
 				rbt->rbt_grp_start, rbt->rbt_grp_end,
-				rbt->rbt_mutex, &rbt->rbt_tail_flags);
+				rbt->rbt_mutex, rbt->rbt_read_error,
+				&rbt->rbt_tail_flags);
 	return NULL;
 }
 #endif
@@ -525,6 +756,7 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 	pthread_t *thread_ids = NULL;
 	struct read_bitmaps_thread_info *thread_infos = NULL;
 	pthread_mutex_t rbt_mutex = PTHREAD_MUTEX_INITIALIZER;
+	read_error_func read_error;
 	errcode_t retval;
 	errcode_t rc;
 	unsigned flexbg_size = 1U << fs->super->s_log_groups_per_flex;
@@ -542,6 +774,11 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 		return write_bitmaps(fs, flags & EXT2FS_BITMAPS_INODE,
 				     flags & EXT2FS_BITMAPS_BLOCK);
 
+	if ((fs->flags & EXT2_FLAG_LAZY_LOAD) &&
+	    (fs->flags & EXT2_FLAG_64BITS) &&
+	    !(fs->flags & EXT2_FLAG_IMAGE_FILE))
+		return read_bitmaps_lazy(fs, flags);
+
 #ifdef HAVE_PTHREAD
 	if (((fs->io->flags & CHANNEL_FLAGS_THREADS) == 0) ||
 	    (num_threads == 1) || (fs->flags & EXT2_FLAG_IMAGE_FILE))
@@ -587,11 +824,14 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 	if (retval)
 		goto out;
 
+	read_error = fs->io->read_error;
+	fs->io->read_error = NULL;
 //	fprintf(stdout, "Multiple threads triggered to read bitmaps\n");
 	for (i = 0; i < num_threads; i++) {
 		thread_infos[i].rbt_fs = fs;
 		thread_infos[i].rbt_flags = flags;
 		thread_infos[i].rbt_mutex = &rbt_mutex;
+		thread_infos[i].rbt_read_error = read_error;
 		thread_infos[i].rbt_tail_flags = 0;
 		if (i == 0)
 			thread_infos[i].rbt_grp_start = 0;
@@ -618,6 +858,7 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 			retval = rc;
 		tail_flags |= thread_infos[i].rbt_tail_flags;
 	}
+	fs->io->read_error = read_error;
 out:
 	rc = pthread_attr_destroy(&attr);
 	if (rc && !retval)
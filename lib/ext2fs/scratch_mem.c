@@ -0,0 +1,193 @@
+/*
+ * scratch_mem.c --- file-backed memory for large in-memory tables
+ *
+ * Some of the tables built while checking a file system (the directory
+ * block list, inode link counts, and so on) grow with the size of the
+ * file system.  This lets such a table be moved out of the heap into an
+ * unlinked scratch file which is mapped into memory.  The table keeps
+ * its layout, but its pages can be written back and dropped by the
+ * kernel under memory pressure instead of counting against the
+ * program's anonymous memory.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+/*
+ * Each mapping starts with this header, so that the file descriptor and
+ * the mapped length can be found from the pointer handed to the caller.
+ * The header is padded so the caller's data stays suitably aligned.
+ */
+struct scratch_hdr {
+	int		fd;
+	unsigned long	mapped;
+};
+
+#define SCRATCH_HDR_SIZE	64
+
+/* Grow the file in chunks so that appending to a table stays cheap */
+#define SCRATCH_CHUNK		(1024 * 1024)
+
+static struct scratch_hdr *scratch_hdr(void *ptr)
+{
+	return (struct scratch_hdr *) ((char *) ptr - SCRATCH_HDR_SIZE);
+}
+
+static errcode_t scratch_map(int fd, unsigned long size, void *ptr)
+{
+	struct scratch_hdr *hdr;
+	unsigned long	len;
+	char		*p;
+
+	len = size + SCRATCH_HDR_SIZE;
+	if (len < size)
+		return EXT2_ET_NO_MEMORY;
+	len = (len + SCRATCH_CHUNK - 1) & ~((unsigned long) SCRATCH_CHUNK - 1);
+	if (ftruncate(fd, len) < 0)
+		return errno;
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return errno;
+	hdr = (struct scratch_hdr *) p;
+	hdr->fd = fd;
+	hdr->mapped = len;
+	p += SCRATCH_HDR_SIZE;
+	memcpy(ptr, &p, sizeof(p));
+	return 0;
+}
+#endif
+
+/*
+ * Allocate size bytes of zeroed memory backed by a scratch file created
+ * in the directory dir.
+ */
+errcode_t ext2fs_get_scratch_mem(const char *dir EXT2FS_ATTR((unused)),
+				 unsigned long size EXT2FS_ATTR((unused)),
+				 void *ptr EXT2FS_ATTR((unused)))
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	errcode_t	retval;
+	mode_t		save_umask;
+	char		*fn;
+	int		fd;
+
+	retval = ext2fs_get_mem(strlen(dir) + 32, &fn);
+	if (retval)
+		return retval;
+	sprintf(fn, "%s/e2fsprogs-scratch-XXXXXX", dir);
+	save_umask = umask(077);
+	fd = mkstemp(fn);
+	umask(save_umask);
+	if (fd < 0) {
+		retval = errno;
+		ext2fs_free_mem(&fn);
+		return retval;
+	}
+	(void) unlink(fn);
+	ext2fs_free_mem(&fn);
+
+	retval = scratch_map(fd, size, ptr);
+	if (retval)
+		close(fd);
+	return retval;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Resize memory allocated by ext2fs_get_scratch_mem().  As with
+ * ext2fs_resize_mem() the memory may move; newly added space is zeroed.
+ */
+errcode_t ext2fs_resize_scratch_mem(unsigned long size EXT2FS_ATTR((unused)),
+				    void *ptr EXT2FS_ATTR((unused)))
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	struct scratch_hdr *hdr;
+	unsigned long	old_len;
+	errcode_t	retval;
+	void		*p;
+
+	memcpy(&p, ptr, sizeof(p));
+	hdr = scratch_hdr(p);
+	if (size <= hdr->mapped - SCRATCH_HDR_SIZE)
+		return 0;
+	old_len = hdr->mapped;
+	retval = scratch_map(hdr->fd, size, ptr);
+	if (retval)
+		return retval;
+	munmap(hdr, old_len);
+	return 0;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Release memory allocated by ext2fs_get_scratch_mem(), along with its
+ * scratch file.
+ */
+void ext2fs_free_scratch_mem(void *ptr EXT2FS_ATTR((unused)))
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	struct scratch_hdr *hdr;
+	void		*p;
+	int		fd;
+
+	memcpy(&p, ptr, sizeof(p));
+	if (!p)
+		return;
+	hdr = scratch_hdr(p);
+	fd = hdr->fd;
+	munmap(hdr, hdr->mapped);
+	close(fd);
+	p = NULL;
+	memcpy(ptr, &p, sizeof(p));
+#endif
+}
+
+/*
+ * Move size bytes of heap memory allocated with ext2fs_get_mem() into a
+ * scratch file in dir.  On success the heap memory is freed and *ptr
+ * points at the copy; on failure *ptr is left alone.
+ */
+errcode_t ext2fs_move_to_scratch_mem(const char *dir, unsigned long size,
+				     void *ptr)
+{
+	errcode_t	retval;
+	void		*old, *new;
+
+	retval = ext2fs_get_scratch_mem(dir, size, &new);
+	if (retval)
+		return retval;
+	memcpy(&old, ptr, sizeof(old));
+	if (old)
+		memcpy(new, old, size);
+	ext2fs_free_mem(&old);
+	memcpy(ptr, &new, sizeof(new));
+	return 0;
+}
@@ -11,6 +11,7 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -27,6 +28,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 unsigned char bitarray[] = {
 	0x80, 0xF0, 0x40, 0x40, 0x0, 0x0, 0x0, 0x0, 0x10, 0x20, 0x00, 0x00
@@ -38,6 +40,18 @@ int bits_list[] = {
 
 #define BIG_TEST_BIT   (((unsigned) 1 << 31) + 42)
 
+/* Larger than the 64 KiB a u16 vector lane can count without wrapping */
+#define BIG_COUNT_SIZE	(256 * 1024 + 13)
+
+static unsigned int count_bits_byte(unsigned char c)
+{
+	unsigned int res = 0;
+
+	for (; c; c >>= 1)
+		res += c & 1;
+	return res;
+}
+
 
 int main(int argc, char **argv)
 {
@@ -284,5 +298,67 @@ int main(int argc, char **argv)
 
 	printf("64-bit: ext2fs_fast_set_bit big_test successful\n");
 	free(bigarray);
+
+	/* Test ext2fs_bitcount with every alignment and tail length */
+	bigarray = malloc(300);
+	if (!bigarray) {
+		fprintf(stderr, "Failed to allocate scratch buffer\n");
+		exit(1);
+	}
+	srand(42);
+	for (i = 0; i < 300; i++)
+		bigarray[i] = rand();
+	for (i = 0; i < 40; i++) {
+		for (size = 0; size + i <= 300; size += 7) {
+			unsigned int expected = 0;
+
+			for (j = 0; j < size * 8; j++)
+				if (ext2fs_test_bit(j, bigarray + i))
+					expected++;
+			if (ext2fs_bitcount(bigarray + i, size) != expected) {
+				printf("ext2fs_bitcount(%d, %d) returned %u, "
+				       "expected %u\n", i, size,
+				       ext2fs_bitcount(bigarray + i, size),
+				       expected);
+				exit(1);
+			}
+		}
+	}
+	printf("ext2fs_bitcount test succeeded.\n");
+	free(bigarray);
+
+	/*
+	 * Test ext2fs_count_bits on runs long enough to overflow the
+	 * vector implementations' partial sums, both all ones and random,
+	 * against a plain byte at a time count.
+	 */
+	bigarray = malloc(BIG_COUNT_SIZE);
+	if (!bigarray) {
+		fprintf(stderr, "Failed to allocate scratch buffer\n");
+		exit(1);
+	}
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < BIG_COUNT_SIZE; i++)
+			bigarray[i] = j ? rand() : 0xFF;
+		for (i = 0; i < 3; i++) {
+			size_t len = BIG_COUNT_SIZE - i * 4099;
+			__u64 expected = 0, got;
+			size_t k;
+
+			for (k = 0; k < len; k++)
+				expected += count_bits_byte(bigarray[k]);
+			got = ext2fs_count_bits(bigarray, len);
+			if (got != expected) {
+				printf("ext2fs_count_bits(%s, %zu) returned "
+				       "%llu, expected %llu\n",
+				       j ? "random" : "0xff", len,
+				       (unsigned long long) got,
+				       (unsigned long long) expected);
+				exit(1);
+			}
+		}
+	}
+	printf("ext2fs_count_bits big buffer test succeeded.\n");
+	free(bigarray);
 	exit(0);
 }
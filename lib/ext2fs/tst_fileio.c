@@ -0,0 +1,392 @@
+/*
+ * tst_fileio.c --- test ext2fs_file_pread() and ext2fs_file_pwrite()
+ *
+ * Every write is also made to an in-memory copy of the file, and the
+ * file is read back after each step, both with ext2fs_file_pread() at
+ * various offsets and with the older ext2fs_file_read(), and compared
+ * against that copy.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define BLOCK_SIZE	1024
+#define FILE_BLOCKS	64
+#define MAX_SIZE	(FILE_BLOCKS * BLOCK_SIZE)
+
+static char		ref[MAX_SIZE];
+static __u64		ref_size;
+static char		buf[MAX_SIZE + BLOCK_SIZE];
+static int		failed;
+
+/* Writes of more than one block fail while this is set */
+static int		fail_writes;
+static struct struct_io_manager fail_manager;
+static errcode_t	(*real_write_blk64)(io_channel channel,
+					    unsigned long long block,
+					    int count, const void *data);
+
+static errcode_t fail_write_blk64(io_channel channel,
+				  unsigned long long block, int count,
+				  const void *data)
+{
+	if (fail_writes && count > 1)
+		return EIO;
+	return real_write_blk64(channel, block, count, data);
+}
+
+static void fill(char *p, unsigned int len, int seed)
+{
+	unsigned int	i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (char) (seed + i * 7 + i / BLOCK_SIZE);
+}
+
+static __u64 file_size(ext2_file_t file)
+{
+	return EXT2_I_SIZE(ext2fs_file_get_inode(file));
+}
+
+static void check(ext2_file_t file, const char *what)
+{
+	static const __u64 offsets[] = { 0, 1, BLOCK_SIZE - 1, BLOCK_SIZE,
+					 5 * BLOCK_SIZE + 17 };
+	unsigned int	got, i, len;
+	__u64		size, pos, off;
+	errcode_t	retval;
+
+	size = file_size(file);
+	if (size != ref_size) {
+		printf("%s: size %llu, expected %llu\n", what,
+		       (unsigned long long) size,
+		       (unsigned long long) ref_size);
+		failed++;
+		return;
+	}
+
+	/* The whole file, and reads which start or end mid-block */
+	for (i = 0; i <= sizeof(offsets) / sizeof(offsets[0]); i++) {
+		if (i < sizeof(offsets) / sizeof(offsets[0])) {
+			off = offsets[i];
+			len = 3 * BLOCK_SIZE + 5;
+		} else {
+			off = 0;
+			len = sizeof(buf);
+		}
+		memset(buf, 0xee, sizeof(buf));
+		retval = ext2fs_file_pread(file, buf, len, off, &got);
+		if (retval) {
+			com_err(what, retval, "while reading %u at %llu", len,
+				(unsigned long long) off);
+			failed++;
+			return;
+		}
+		if (off + len > ref_size)
+			len = off > ref_size ? 0 : ref_size - off;
+		if (got != len || memcmp(buf, ref + off, len)) {
+			printf("%s: pread of %u at %llu got the wrong data\n",
+			       what, len, (unsigned long long) off);
+			failed++;
+			return;
+		}
+	}
+
+	/* The file position is not used or moved by pread/pwrite */
+	retval = ext2fs_file_llseek(file, 0, EXT2_SEEK_CUR, &pos);
+	if (retval || pos != 0) {
+		printf("%s: file position moved to %llu\n", what,
+		       (unsigned long long) pos);
+		failed++;
+		return;
+	}
+
+	/* What reaches the disk must agree with the old read path */
+	memset(buf, 0xee, sizeof(buf));
+	retval = ext2fs_file_read(file, buf, sizeof(buf), &got);
+	ext2fs_file_llseek(file, 0, EXT2_SEEK_SET, NULL);
+	if (retval || got != ref_size || memcmp(buf, ref, ref_size)) {
+		printf("%s: ext2fs_file_read got the wrong data\n", what);
+		failed++;
+	}
+}
+
+static void do_pwrite(ext2_file_t file, __u64 off, unsigned int len,
+		      int seed, const char *what)
+{
+	char		data[MAX_SIZE];
+	unsigned int	written;
+	errcode_t	retval;
+
+	fill(data, len, seed);
+	retval = ext2fs_file_pwrite(file, data, len, off, &written);
+	if (retval || written != len) {
+		com_err(what, retval, "while writing %u at %llu", len,
+			(unsigned long long) off);
+		failed++;
+		return;
+	}
+	if (off > ref_size)
+		memset(ref + ref_size, 0, off - ref_size);
+	memcpy(ref + off, data, len);
+	if (off + len > ref_size)
+		ref_size = off + len;
+	check(file, what);
+}
+
+static ext2_ino_t new_file(ext2_filsys fs, int extents)
+{
+	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	ext2_ino_t		ino;
+	errcode_t		retval;
+
+	retval = ext2fs_new_inode(fs, EXT2_ROOT_INO, LINUX_S_IFREG | 0644,
+				  0, &ino);
+	if (retval) {
+		com_err("new_file", retval, "while allocating an inode");
+		exit(1);
+	}
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	memset(&inode, 0, sizeof(inode));
+	inode.i_mode = LINUX_S_IFREG | 0644;
+	inode.i_links_count = 1;
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (!retval && extents) {
+		retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+		if (!retval) {
+			ext2fs_extent_free(handle);
+			retval = ext2fs_write_inode(fs, ino, &inode);
+		}
+	}
+	if (retval) {
+		com_err("new_file", retval, "while writing inode %u", ino);
+		exit(1);
+	}
+	return ino;
+}
+
+/*
+ * Make a write past EOF fail once it gets to the whole blocks.  When
+ * it starts skip bytes into a block, that partial block is written
+ * first, and must be reported and kept; nothing else may be.
+ */
+static void failed_write(ext2_filsys fs, ext2_file_t file, ext2_ino_t ino,
+			 unsigned int skip)
+{
+	struct ext2_inode *inode = ext2fs_file_get_inode(file);
+	blk64_t		free_blocks, i_blocks, used, pblk, lblk, eof;
+	unsigned int	written, expected;
+	__u64		off;
+	errcode_t	retval;
+
+	eof = (file_size(file) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	off = eof * BLOCK_SIZE + skip;
+	expected = skip ? BLOCK_SIZE - skip : 0;
+	free_blocks = ext2fs_free_blocks_count(fs->super);
+	i_blocks = ext2fs_get_stat_i_blocks(fs, inode);
+	fill(buf, 8 * BLOCK_SIZE, 7);
+	fail_writes = 1;
+	retval = ext2fs_file_pwrite(file, buf, 8 * BLOCK_SIZE, off, &written);
+	fail_writes = 0;
+	if (!retval) {
+		printf("failed write: write did not fail\n");
+		failed++;
+	}
+	if (written != expected) {
+		printf("failed write: reported %u bytes written, "
+		       "expected %u\n", written, expected);
+		failed++;
+	}
+	used = (ext2fs_get_stat_i_blocks(fs, inode) - i_blocks) /
+		(BLOCK_SIZE / 512);
+	if (free_blocks - ext2fs_free_blocks_count(fs->super) != used) {
+		printf("failed write: %lld blocks leaked\n",
+		       (long long) (free_blocks - used -
+				    ext2fs_free_blocks_count(fs->super)));
+		failed++;
+	}
+	if (expected) {
+		memset(ref + ref_size, 0, off - ref_size);
+		memcpy(ref + off, buf, expected);
+		ref_size = off + expected;
+		eof++;
+	}
+	for (lblk = eof; lblk < eof + 8; lblk++) {
+		retval = ext2fs_bmap2(fs, ino, NULL, NULL, 0, lblk, NULL,
+				      &pblk);
+		if (retval || pblk) {
+			printf("failed write: block %llu mapped past EOF\n",
+			       (unsigned long long) lblk);
+			failed++;
+			break;
+		}
+	}
+	check(file, "failed write");
+}
+
+static void test_file(ext2_filsys fs, int extents)
+{
+	const char	*name = extents ? "extents" : "blockmap";
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	blk64_t		lblk, pblk;
+	__u64		size;
+	int		i;
+	unsigned int	written;
+	errcode_t	retval;
+
+	ino = new_file(fs, extents);
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	if (retval) {
+		com_err(name, retval, "while opening inode %u", ino);
+		exit(1);
+	}
+	memset(ref, 0, sizeof(ref));
+	ref_size = 0;
+
+	/* Extending past EOF, ending with a partial block */
+	do_pwrite(file, 0, 10 * BLOCK_SIZE + 100, 1, "extend");
+	/* Partial head and tail past EOF, leaving a hole before them */
+	do_pwrite(file, 20 * BLOCK_SIZE + 300, 3 * BLOCK_SIZE, 2, "hole");
+	/* Over mapped blocks, the partial EOF block and the hole */
+	do_pwrite(file, 5 * BLOCK_SIZE + 17, 10 * BLOCK_SIZE, 3, "overwrite");
+	/* Entirely inside a block */
+	do_pwrite(file, 2 * BLOCK_SIZE + 10, 20, 4, "inside");
+	/* Whole blocks straight after EOF */
+	size = file_size(file);
+	do_pwrite(file, (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE,
+		  4 * BLOCK_SIZE, 5, "append");
+
+	if (extents) {
+		/* Uninitialized extents read as zeroes until written */
+		size = file_size(file);
+		lblk = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_UNINIT,
+					  ino, ext2fs_file_get_inode(file),
+					  ~0ULL, lblk, 8);
+		if (!retval)
+			retval = ext2fs_file_set_size2(file,
+					(lblk + 8) * BLOCK_SIZE);
+		/* Put something other than zeroes in the blocks themselves */
+		memset(buf, 0x5a, BLOCK_SIZE);
+		for (i = 0; !retval && i < 8; i++) {
+			retval = ext2fs_bmap2(fs, ino, NULL, NULL, 0, lblk + i,
+					      NULL, &pblk);
+			if (!retval)
+				retval = io_channel_write_blk64(fs->io, pblk, 1,
+								buf);
+		}
+		if (retval) {
+			com_err(name, retval, "while allocating uninit blocks");
+			exit(1);
+		}
+		memset(ref + ref_size, 0, (lblk + 8) * BLOCK_SIZE - ref_size);
+		ref_size = (lblk + 8) * BLOCK_SIZE;
+		check(file, "uninit");
+		do_pwrite(file, (lblk + 2) * BLOCK_SIZE + 5, 3 * BLOCK_SIZE,
+			  6, "uninit write");
+	}
+
+	/*
+	 * A failed write must not leave blocks allocated past EOF.  Only
+	 * extent-mapped files allocate them ahead of the write.
+	 */
+	if (extents) {
+		failed_write(fs, file, ino, 0);
+		failed_write(fs, file, ino, 100);
+	}
+
+	/* Reads entirely past EOF return nothing */
+	retval = ext2fs_file_pread(file, buf, BLOCK_SIZE, ref_size + 1,
+				   &written);
+	if (retval || written) {
+		printf("%s: read past EOF returned %u bytes\n", name, written);
+		failed++;
+	}
+
+	retval = ext2fs_file_close(file);
+	if (retval) {
+		com_err(name, retval, "while closing inode %u", ino);
+		failed++;
+	}
+}
+
+static ext2_filsys setup(const char *device)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, 8192);
+	param.s_log_block_size = 0;	/* 1k blocks */
+	param.s_inodes_count = 256;
+	param.s_rev_level = EXT2_DYNAMIC_REV;
+	param.s_inode_size = 256;
+	param.s_feature_incompat = EXT3_FEATURE_INCOMPAT_EXTENTS;
+
+	retval = ext2fs_initialize(device, EXT2_FLAG_64BITS, &param,
+				   unix_io_manager, &fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing %s", device);
+		exit(1);
+	}
+	retval = ext2fs_allocate_tables(fs);
+	if (retval) {
+		com_err("setup", retval, "while allocating tables");
+		exit(1);
+	}
+
+	fail_manager = *fs->io->manager;
+	real_write_blk64 = fail_manager.write_blk64;
+	fail_manager.write_blk64 = fail_write_blk64;
+	fs->io->manager = &fail_manager;
+	return fs;
+}
+
+int main(int argc, char **argv)
+{
+	char		device[] = "/tmp/tst_fileio.XXXXXX";
+	ext2_filsys	fs;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(device);
+	if (fd < 0 || ftruncate(fd, 8192 * BLOCK_SIZE) < 0) {
+		perror("tst_fileio: creating the test image");
+		exit(1);
+	}
+	close(fd);
+
+	fs = setup(device);
+	test_file(fs, 1);
+	printf("tst_fileio(extents): %s\n", failed ? "FAILED" : "OK");
+	if (!failed) {
+		test_file(fs, 0);
+		printf("tst_fileio(blockmap): %s\n", failed ? "FAILED" : "OK");
+	}
+	ext2fs_free(fs);
+	unlink(device);
+	return failed ? 1 : 0;
+}
@@ -2,7 +2,10 @@
  * unix_io.c --- This is the Unix (well, really POSIX) implementation
  *	of the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a sharded, hash-indexed block cache with CLOCK
+ * replacement.  Its size can be set in blocks with the "cache_blocks"
+ * option, or in megabytes with the "cache_size" option or the
+ * UNIX_IO_CACHE_SIZE environment variable.
  *
  * Includes support for Windows NT support under Cygwin.
  *
@@ -64,6 +67,14 @@
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
+#if defined(HAVE_PREADV64) || defined(HAVE_PREADV)
+#include <sys/uio.h>
+#define HAVE_UNIX_READ_BLKV
+#endif
+#if defined(HAVE_PWRITEV64) || defined(HAVE_PWRITEV)
+#include <sys/uio.h>
+#define HAVE_UNIX_WRITE_BLKV
+#endif
 
 #if defined(__linux__) && defined(_IO) && !defined(BLKROGET)
 #define BLKROGET   _IO(0x12, 94) /* Get read-only status (0 = read_write).  */
@@ -75,40 +86,6 @@
 #include "ext2fs.h"
 #include "ext2fsP.h"
 
-static inline int find_last_bit_set(int x)
-{
-	int r = 32;
-
-	if (!x)
-		return 0;
-	if (!(x & 0xffff0000u)) {
-		x = (x & 0xffffu) << 16;
-		r -= 16;
-	}
-	if (!(x & 0xff000000u)) {
-		x = (x & 0xffffffu) << 8;
-		r -= 8;
-	}
-	if (!(x & 0xf0000000u)) {
-		x = (x & 0xfffffffu) << 4;
-		r -= 4;
-	}
-	if (!(x & 0xc0000000u)) {
-		x = (x & 0x3fffffffu) << 2;
-		r -= 2;
-	}
-	if (!(x & 0x80000000u)) {
-		r -= 1;
-	}
-	return r;
-}
-
-/* Get high bit set out of 32-bit argument, -1 if none set */
-static inline int highbit32(uint32_t v)
-{
-	return find_last_bit_set(v) - 1;
-}
-
 /*
  * For checking structure magic numbers...
  */
@@ -119,32 +96,60 @@ static inline int highbit32(uint32_t v)
 struct unix_cache {
 	char			*buf;
 	unsigned long long	block;
-	int			access_time;
+	struct unix_cache	*hash_next;
 	unsigned		dirty:1;
 	unsigned		in_use:1;
 	unsigned		write_err:1;
+	unsigned		referenced:1;
+};
+
+/*
+ * The cache is split into shards, each with its own lock, hash table
+ * and CLOCK hand.  Each run of CACHE_SHARD_RUN adjacent blocks lands in
+ * a single shard, so that dirty neighbours can be written back together
+ * when one of them is evicted.
+ */
+struct unix_cache_shard {
+	struct unix_cache	*entries;
+	unsigned int		nr_entries;
+	unsigned int		clock_hand;
+	struct unix_cache	**hash;
+	unsigned int		hash_mask;
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned long long	evictions;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		mutex;
+#endif
 };
 
 #define DEFAULT_CACHE_SIZE 8
 #define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
 #define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
+#define READV_MAX_IOVS 64	/* Requests merged into one preadv()/pwritev() */
+#define CACHE_MAX_SHARDS 16
+#define CACHE_SHARD_MIN 256	/* Smallest shard worth splitting off */
+#define CACHE_SHARD_RUN 16	/* Adjacent blocks kept in the same shard */
+#define FLUSH_MAX_RUN 64	/* Dirty blocks written back in one write */
 
 struct unix_private_data {
 	int	magic;
 	int	dev;
 	int	flags;
 	int	align;
-	int	access_time;
 	ext2_loff_t offset;
 	struct unix_cache *cache;
 	unsigned int cache_size;
-	unsigned int cache_hash_shift;
+	unsigned long long cache_bytes;
+	struct unix_cache_shard *shards;
+	unsigned int nr_shards;
 	void	*bounce;
+	void	*run_buf;	/* FLUSH_MAX_RUN blocks for write_cached_run */
 	struct struct_io_stats io_stats;
 #ifdef HAVE_PTHREAD
-	pthread_mutex_t cache_mutex;
 	pthread_mutex_t bounce_mutex;
 	pthread_mutex_t stats_mutex;
+	pthread_mutex_t run_mutex;
 #endif
 };
 
@@ -152,7 +157,7 @@ struct unix_private_data {
 			       ((uintptr_t) ((align)-1))) == 0)
 
 typedef enum lock_kind {
-	CACHE_MTX, BOUNCE_MTX, STATS_MTX
+	BOUNCE_MTX, STATS_MTX, RUN_MTX
 } kind_t;
 
 #ifdef HAVE_PTHREAD
@@ -161,12 +166,12 @@ static inline pthread_mutex_t *get_mutex(struct unix_private_data *data,
 {
 	if (data->flags & IO_FLAG_THREADS) {
 		switch (kind) {
-		case CACHE_MTX:
-			return &data->cache_mutex;
 		case BOUNCE_MTX:
 			return &data->bounce_mutex;
 		case STATS_MTX:
 			return &data->stats_mutex;
+		case RUN_MTX:
+			return &data->run_mutex;
 		}
 	}
 	return NULL;
@@ -193,6 +198,40 @@ static inline void mutex_unlock(struct unix_private_data *data, kind_t kind)
 #endif
 }
 
+static inline void shard_lock(struct unix_private_data *data,
+			      struct unix_cache_shard *shard)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_lock(&shard->mutex);
+#endif
+}
+
+static inline void shard_unlock(struct unix_private_data *data,
+				struct unix_cache_shard *shard)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+static void lock_all_shards(struct unix_private_data *data)
+{
+	unsigned int	i;
+
+	for (i = 0; i < data->nr_shards; i++)
+		shard_lock(data, &data->shards[i]);
+}
+
+static void unlock_all_shards(struct unix_private_data *data)
+{
+	unsigned int	i;
+
+	for (i = data->nr_shards; i > 0; i--)
+		shard_unlock(data, &data->shards[i - 1]);
+}
+
 static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 {
 	errcode_t	retval = 0;
@@ -204,7 +243,20 @@ static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 	if (stats) {
+		unsigned long long hits = 0, misses = 0, evictions = 0;
+		unsigned int	i;
+
+		for (i = 0; i < data->nr_shards; i++) {
+			shard_lock(data, &data->shards[i]);
+			hits += data->shards[i].hits;
+			misses += data->shards[i].misses;
+			evictions += data->shards[i].evictions;
+			shard_unlock(data, &data->shards[i]);
+		}
 		mutex_lock(data, STATS_MTX);
+		data->io_stats.cache_hits = hits;
+		data->io_stats.cache_misses = misses;
+		data->io_stats.cache_evictions = evictions;
 		*stats = &data->io_stats;
 		mutex_unlock(data, STATS_MTX);
 	}
@@ -345,7 +397,6 @@ error_unlock:
 }
 
 #define RAW_WRITE_NO_HANDLER	(1U << 0)
-#define RAW_WRITE_NOLOCK	(1U << 1)
 
 static errcode_t raw_write_blk(io_channel channel,
 			       struct unix_private_data *data,
@@ -405,15 +456,13 @@ static errcode_t raw_write_blk(io_channel channel,
 	    (IS_ALIGNED(buf, channel->align) &&
 	     IS_ALIGNED(location, channel->align) &&
 	     IS_ALIGNED(size, channel->align))) {
-		if (!(flags & RAW_WRITE_NOLOCK))
-			mutex_lock(data, BOUNCE_MTX);
+		mutex_lock(data, BOUNCE_MTX);
 		if (ext2fs_llseek(data->dev, location, SEEK_SET) < 0) {
 			retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 			goto error_unlock;
 		}
 		actual = write(data->dev, buf, size);
-		if (!(flags & RAW_WRITE_NOLOCK))
-			mutex_unlock(data, BOUNCE_MTX);
+		mutex_unlock(data, BOUNCE_MTX);
 		if (actual < 0) {
 			retval = errno;
 			goto error_out;
@@ -448,8 +497,7 @@ bounce_write:
 	while (size > 0) {
 		int actual_w;
 
-		if (!(flags & RAW_WRITE_NOLOCK))
-			mutex_lock(data, BOUNCE_MTX);
+		mutex_lock(data, BOUNCE_MTX);
 		if (size < align_size || offset) {
 			if (ext2fs_llseek(data->dev, aligned_blk * align_size,
 					  SEEK_SET) < 0) {
@@ -478,8 +526,7 @@ bounce_write:
 			goto error_unlock;
 		}
 		actual_w = write(data->dev, data->bounce, align_size);
-		if (!(flags & RAW_WRITE_NOLOCK))
-			mutex_unlock(data, BOUNCE_MTX);
+		mutex_unlock(data, BOUNCE_MTX);
 		if (actual_w < 0) {
 			retval = errno;
 			goto error_out;
@@ -495,8 +542,7 @@ bounce_write:
 	return 0;
 
 error_unlock:
-	if (!(flags & RAW_WRITE_NOLOCK))
-		mutex_unlock(data, BOUNCE_MTX);
+	mutex_unlock(data, BOUNCE_MTX);
 error_out:
 	if (((flags & RAW_WRITE_NO_HANDLER) == 0) && channel->write_error)
 		retval = (channel->write_error)(channel, block, count, buf,
@@ -509,331 +555,556 @@ error_out:
  * Here we implement the cache functions
  */
 
-/* Allocate the cache buffers */
+/*  2^63 + 2^61 - 2^57 + 2^54 - 2^51 - 2^18 + 1 */
+#define GOLDEN_RATIO_PRIME	0x9e37fffffffc0001ULL
+
+static inline unsigned int cache_hash(unsigned long long block)
+{
+	return (unsigned int) ((block * GOLDEN_RATIO_PRIME) >> 32);
+}
+
+static inline struct unix_cache_shard *
+cache_shard(struct unix_private_data *data, unsigned long long block)
+{
+	return data->shards +
+		(cache_hash(block / CACHE_SHARD_RUN) & (data->nr_shards - 1));
+}
+
+/* Free a cache's buffers, hash tables and locks */
+static void destroy_cache(struct unix_cache *cache, unsigned int size,
+			  struct unix_cache_shard *shards,
+			  unsigned int nr_shards, int destroy_locks)
+{
+	unsigned int		i;
+
+	if (cache) {
+		for (i = 0; i < size; i++)
+			if (cache[i].buf)
+				ext2fs_free_mem(&cache[i].buf);
+		ext2fs_free_mem(&cache);
+	}
+	if (!shards)
+		return;
+	for (i = 0; i < nr_shards; i++) {
+		if (shards[i].hash)
+			ext2fs_free_mem(&shards[i].hash);
+#ifdef HAVE_PTHREAD
+		if (destroy_locks)
+			pthread_mutex_destroy(&shards[i].mutex);
+#endif
+	}
+	ext2fs_free_mem(&shards);
+}
+
+/*
+ * Allocate a cache of size blocks, replacing the current one, whose
+ * contents are discarded.  Threaded channels get one shard for every
+ * CACHE_SHARD_MIN blocks, up to CACHE_MAX_SHARDS.
+ */
 static errcode_t alloc_cache(io_channel channel,
-			     struct unix_private_data *data)
+			     struct unix_private_data *data,
+			     unsigned int size)
 {
+	struct unix_cache	*cache = NULL, *next;
+	struct unix_cache_shard	*shards = NULL, *shard;
+	unsigned int		i, nr_shards = 1, buckets;
 	errcode_t		retval;
-	struct unix_cache	*cache;
-	unsigned int		i;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-		retval = io_channel_alloc_buf(channel, 0, &cache->buf);
+	if (data->flags & IO_FLAG_THREADS)
+		while (nr_shards < CACHE_MAX_SHARDS &&
+		       size / (nr_shards * 2) >= CACHE_SHARD_MIN)
+			nr_shards *= 2;
+
+	retval = ext2fs_get_arrayzero(size, sizeof(struct unix_cache), &cache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_arrayzero(nr_shards,
+				      sizeof(struct unix_cache_shard), &shards);
+	if (retval)
+		goto errout;
+	for (i = 0; i < size; i++) {
+		retval = io_channel_alloc_buf(channel, 0, &cache[i].buf);
 		if (retval)
-			return retval;
+			goto errout;
+	}
+	for (i = 0, shard = shards, next = cache; i < nr_shards;
+	     i++, shard++) {
+		shard->entries = next;
+		shard->nr_entries = size / nr_shards +
+			(i < size % nr_shards ? 1 : 0);
+		next += shard->nr_entries;
+		for (buckets = 1; buckets < shard->nr_entries; buckets <<= 1)
+			;
+		retval = ext2fs_get_arrayzero(buckets,
+					      sizeof(struct unix_cache *),
+					      &shard->hash);
+		if (retval)
+			goto errout;
+		shard->hash_mask = buckets - 1;
 	}
-	if (channel->align || data->flags & IO_FLAG_FORCE_BOUNCE) {
-		if (data->bounce)
-			ext2fs_free_mem(&data->bounce);
-		retval = io_channel_alloc_buf(channel, 0, &data->bounce);
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS) {
+		for (i = 0; i < nr_shards; i++) {
+			retval = pthread_mutex_init(&shards[i].mutex, NULL);
+			if (retval) {
+				while (i > 0)
+					pthread_mutex_destroy(&shards[--i].mutex);
+				goto errout;
+			}
+		}
 	}
+#endif
+
+	destroy_cache(data->cache, data->cache_size, data->shards,
+		      data->nr_shards, data->flags & IO_FLAG_THREADS);
+	/*
+	 * The run buffer is only an optimization: without it runs are
+	 * written back a block at a time.
+	 */
+	if (data->run_buf)
+		ext2fs_free_mem(&data->run_buf);
+	if (io_channel_alloc_buf(channel, FLUSH_MAX_RUN, &data->run_buf))
+		data->run_buf = NULL;
+	data->cache = cache;
+	data->cache_size = size;
+	data->shards = shards;
+	data->nr_shards = nr_shards;
+	return 0;
+
+errout:
+	destroy_cache(cache, size, shards, nr_shards, 0);
 	return retval;
 }
 
+/* Allocate the bounce buffer used for unaligned O_DIRECT I/O */
+static errcode_t alloc_bounce(io_channel channel,
+			      struct unix_private_data *data)
+{
+	if (data->bounce)
+		ext2fs_free_mem(&data->bounce);
+	if (channel->align || data->flags & IO_FLAG_FORCE_BOUNCE)
+		return io_channel_alloc_buf(channel, 0, &data->bounce);
+	return 0;
+}
+
 /* Free the cache buffers */
 static void free_cache(struct unix_private_data *data)
 {
-	struct unix_cache	*cache;
-	unsigned int		i;
-
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-	}
+	destroy_cache(data->cache, data->cache_size, data->shards,
+		      data->nr_shards, data->flags & IO_FLAG_THREADS);
+	data->cache = NULL;
+	data->cache_size = 0;
+	data->shards = NULL;
+	data->nr_shards = 0;
+	if (data->run_buf)
+		ext2fs_free_mem(&data->run_buf);
 	if (data->bounce)
 		ext2fs_free_mem(&data->bounce);
 }
 
+/*
+ * Number of blocks in the cache.  If its size was given in bytes, this
+ * follows the channel's block size.
+ */
+static unsigned int cache_size_blocks(io_channel channel,
+				      struct unix_private_data *data)
+{
+	unsigned long long	size;
+
+	if (!data->cache_bytes)
+		return data->cache_size ? data->cache_size :
+			DEFAULT_CACHE_SIZE;
+	size = data->cache_bytes / channel->block_size;
+	if (size < 1)
+		size = 1;
+	if (size > INT32_MAX)
+		size = INT32_MAX;
+	return size;
+}
+
 #ifndef NO_IO_CACHE
 
-/*  2^63 + 2^61 - 2^57 + 2^54 - 2^51 - 2^18 + 1 */
-#define GOLDEN_RATIO_PRIME	0x9e37fffffffc0001UL
-#ifndef CACHE_LINE_SIZE
-/* if the system didn't tell us, guess something reasonable */
-#define CACHE_LINE_SIZE		64
-#endif
+/*
+ * Try to find a block in the cache.  The caller must hold the shard
+ * lock.
+ */
+static struct unix_cache *find_cached_block(struct unix_cache_shard *shard,
+					    unsigned long long block)
+{
+	struct unix_cache	*cache;
 
-/* buffer cache hashing function, crudely stolen from xfsprogs */
-static unsigned int
-cache_hash(struct unix_private_data *data, blk64_t blkno)
+	for (cache = shard->hash[cache_hash(block) & shard->hash_mask];
+	     cache; cache = cache->hash_next)
+		if (cache->block == block)
+			return cache;
+	return NULL;
+}
+
+static int is_cached(struct unix_private_data *data, unsigned long long block)
 {
-	uint64_t	hashval = blkno;
-	uint64_t	tmp;
+	struct unix_cache_shard	*shard = cache_shard(data, block);
+	int			ret;
 
-	/* the default cache size is small, just do a linear scan */
-	if (data->cache_size <= DEFAULT_CACHE_SIZE)
-		return 0;
+	shard_lock(data, shard);
+	ret = find_cached_block(shard, block) != NULL;
+	shard_unlock(data, shard);
+	return ret;
+}
+
+static void hash_cache(struct unix_cache_shard *shard,
+		       struct unix_cache *cache)
+{
+	struct unix_cache **head;
+
+	head = &shard->hash[cache_hash(cache->block) & shard->hash_mask];
+	cache->hash_next = *head;
+	*head = cache;
+}
+
+/* Remove a cache entry from its shard */
+static void drop_cache(struct unix_cache_shard *shard,
+		       struct unix_cache *cache)
+{
+	struct unix_cache **pp;
+
+	pp = &shard->hash[cache_hash(cache->block) & shard->hash_mask];
+	while (*pp != cache)
+		pp = &(*pp)->hash_next;
+	*pp = cache->hash_next;
+	cache->hash_next = NULL;
+	cache->in_use = 0;
+	cache->dirty = 0;
+	cache->write_err = 0;
+	cache->referenced = 0;
+}
 
-	tmp = hashval ^ (GOLDEN_RATIO_PRIME + hashval) / CACHE_LINE_SIZE;
-	tmp = tmp ^ ((tmp ^ GOLDEN_RATIO_PRIME) >> data->cache_hash_shift);
-	return tmp % data->cache_size;
+static int cache_block_cmp(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	if (ca->block < cb->block)
+		return -1;
+	if (ca->block > cb->block)
+		return 1;
+	return 0;
 }
 
 /*
- * Try to find a block in the cache.  If the block is not found, and
- * eldest is a non-zero pointer, then fill in eldest with the cache
- * entry to that should be reused.
+ * Write back n (at most FLUSH_MAX_RUN) dirty cache entries for
+ * consecutive blocks with a single write, gathered in the channel's
+ * run buffer.  If that fails, each block is retried on its own so that
+ * write_err ends up set only on the blocks which really failed.
  */
-static struct unix_cache *find_cached_block(struct unix_private_data *data,
-					    unsigned long long block,
-					    struct unix_cache **eldest)
+static errcode_t write_cached_run(io_channel channel,
+				  struct unix_private_data *data,
+				  struct unix_cache **run, int n)
 {
-	struct unix_cache	*cache, *unused_cache, *oldest_cache;
-	unsigned int		hash = cache_hash(data, block);
-	unsigned int		i;
-
-	unused_cache = oldest_cache = 0;
-	/* walk [hash..] cache elements */
-	for (i = hash, cache = data->cache + hash;
-	     i < data->cache_size;
-	     i++, cache++) {
-		if (!cache->in_use) {
-			if (!unused_cache)
-				unused_cache = cache;
-			continue;
-		}
-		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
-			data->io_stats.cache_hits++;
-			return cache;
+	errcode_t	retval, retval2 = 0;
+	char		*buf;
+	int		i;
+
+	if (n > 1 && data->run_buf) {
+		mutex_lock(data, RUN_MTX);
+		buf = data->run_buf;
+		for (i = 0; i < n; i++)
+			memcpy(buf + (size_t) i * channel->block_size,
+			       run[i]->buf, channel->block_size);
+		retval = raw_write_blk(channel, data, run[0]->block, n, buf,
+				       RAW_WRITE_NO_HANDLER);
+		mutex_unlock(data, RUN_MTX);
+		if (retval == 0) {
+			for (i = 0; i < n; i++) {
+				run[i]->dirty = 0;
+				run[i]->write_err = 0;
+			}
+			return 0;
 		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
 	}
-	/* walk [..hash] since we didnt find a good slot yet */
-	for (i = 0, cache = data->cache; i < hash; i++, cache++) {
-		if (!cache->in_use) {
-			if (!unused_cache)
-				unused_cache = cache;
-			continue;
-		}
-		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
-			data->io_stats.cache_hits++;
-			return cache;
+
+	for (i = 0; i < n; i++) {
+		retval = raw_write_blk(channel, data, run[i]->block, 1,
+				       run[i]->buf, RAW_WRITE_NO_HANDLER);
+		if (retval) {
+			run[i]->write_err = 1;
+			retval2 = retval;
+		} else {
+			run[i]->dirty = 0;
+			run[i]->write_err = 0;
 		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
 	}
-	if (eldest)
-		*eldest = (unused_cache) ? unused_cache : oldest_cache;
-	data->io_stats.cache_misses++;
-	return 0;
+	return retval2;
 }
 
 /*
- * Reuse a particular cache entry for another block.
+ * Write back a dirty entry which is about to be evicted, together with
+ * the dirty blocks around it in the same CACHE_SHARD_RUN group.
  */
-static errcode_t reuse_cache(io_channel channel,
-		struct unix_private_data *data, struct unix_cache *cache,
-		unsigned long long block)
+static errcode_t write_back_run(io_channel channel,
+				struct unix_private_data *data,
+				struct unix_cache_shard *shard,
+				struct unix_cache *cache)
 {
-	if (cache->dirty && cache->in_use) {
-		errcode_t retval;
+	struct unix_cache	*run[CACHE_SHARD_RUN], *c;
+	unsigned long long	first, last, group, blk;
+	errcode_t		retval;
+	int			n = 0;
+
+	group = cache->block / CACHE_SHARD_RUN;
+	first = last = cache->block;
+	while (first > group * CACHE_SHARD_RUN &&
+	       (c = find_cached_block(shard, first - 1)) &&
+	       c->dirty && !c->write_err)
+		first--;
+	while ((last + 1) / CACHE_SHARD_RUN == group &&
+	       (c = find_cached_block(shard, last + 1)) &&
+	       c->dirty && !c->write_err)
+		last++;
+	for (blk = first; blk <= last; blk++)
+		run[n++] = find_cached_block(shard, blk);
+
+	retval = write_cached_run(channel, data, run, n);
+	return cache->write_err ? retval : 0;
+}
 
-		retval = raw_write_blk(channel, data, cache->block, 1,
-				       cache->buf, RAW_WRITE_NO_HANDLER);
-		if (retval) {
-			cache->write_err = 1;
-			return retval;
-		}
+/*
+ * Find the cache entry for a block, or claim one for it using the
+ * CLOCK algorithm.  Must be called with the shard lock held.  If a
+ * dirty victim can't be written back, it is returned in *ret with
+ * write_err set, and the error is returned.
+ */
+static errcode_t get_cache_entry(io_channel channel,
+				 struct unix_private_data *data,
+				 struct unix_cache_shard *shard,
+				 unsigned long long block,
+				 struct unix_cache **ret, int *hit)
+{
+	struct unix_cache	*cache;
+	errcode_t		retval;
+
+	cache = find_cached_block(shard, block);
+	*hit = (cache != NULL);
+	if (cache) {
+		*ret = cache;
+		return 0;
+	}
+
+	while (1) {
+		cache = &shard->entries[shard->clock_hand];
+		if (++shard->clock_hand >= shard->nr_entries)
+			shard->clock_hand = 0;
+		if (!cache->in_use || !cache->referenced)
+			break;
+		cache->referenced = 0;
 	}
+	*ret = cache;
 
+	if (cache->in_use) {
+		if (cache->dirty) {
+			retval = write_back_run(channel, data, shard, cache);
+			if (retval)
+				return retval;
+		}
+		drop_cache(shard, cache);
+		shard->evictions++;
+	}
 	cache->in_use = 1;
-	cache->dirty = 0;
-	cache->write_err = 0;
 	cache->block = block;
-	cache->access_time = ++data->access_time;
+	hash_cache(shard, cache);
 	return 0;
 }
 
+/*
+ * Report a failed write back of a cache entry to the channel's write
+ * error handler.  Called with the shard lock held, which is released.
+ */
+static void cache_write_error(io_channel channel,
+			      struct unix_private_data *data,
+			      struct unix_cache_shard *shard,
+			      struct unix_cache *cache, errcode_t error)
+{
+	if (cache->write_err && channel->write_error) {
+		char *err_buf = NULL;
+		unsigned long long err_block = cache->block;
+
+		if (io_channel_alloc_buf(channel, 0, &err_buf))
+			err_buf = NULL;
+		else
+			memcpy(err_buf, cache->buf, channel->block_size);
+		drop_cache(shard, cache);
+		shard_unlock(data, shard);
+		(channel->write_error)(channel, err_block, 1, err_buf,
+				       channel->block_size, -1, error);
+		if (err_buf)
+			ext2fs_free_mem(&err_buf);
+	} else
+		shard_unlock(data, shard);
+}
+
 #define FLUSH_INVALIDATE	0x01
-#define FLUSH_NOLOCK		0x02
 
 /*
- * Flush all of the blocks in the cache
+ * Flush all of the blocks in the cache.  Dirty blocks are sorted so
+ * that runs of adjacent blocks go out with a single write.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
 				     int flags)
 {
-	struct unix_cache	*cache;
+	struct unix_cache	*cache, **dirty = NULL;
 	errcode_t		retval, retval2 = 0;
-	unsigned int		i;
+	unsigned int		i, j, nr_dirty = 0;
 	int			errors_found = 0;
 
-	if ((flags & FLUSH_NOLOCK) == 0)
-		mutex_lock(data, CACHE_MTX);
-	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-		if (cache->dirty) {
-			int raw_flags = RAW_WRITE_NO_HANDLER;
-
-			if (flags & FLUSH_NOLOCK)
-				raw_flags |= RAW_WRITE_NOLOCK;
-
-			retval = raw_write_blk(channel, data,
-					       cache->block, 1, cache->buf,
-					       raw_flags);
+	lock_all_shards(data);
+
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++)
+		if (cache->in_use && cache->dirty)
+			nr_dirty++;
+	if (nr_dirty &&
+	    ext2fs_get_array(nr_dirty, sizeof(struct unix_cache *),
+			     &dirty) == 0) {
+		for (i=0, j=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			if (cache->in_use && cache->dirty)
+				dirty[j++] = cache;
+		qsort(dirty, nr_dirty, sizeof(struct unix_cache *),
+		      cache_block_cmp);
+		for (i = 0; i < nr_dirty; i = j) {
+			for (j = i + 1; j < nr_dirty && j - i < FLUSH_MAX_RUN &&
+			     dirty[j]->block == dirty[j-1]->block + 1; j++)
+				;
+			retval = write_cached_run(channel, data, dirty + i,
+						  j - i);
+			if (retval) {
+				errors_found = 1;
+				retval2 = retval;
+			}
+		}
+		ext2fs_free_mem(&dirty);
+	} else if (nr_dirty) {
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++) {
+			if (!cache->in_use || !cache->dirty)
+				continue;
+			retval = write_cached_run(channel, data, &cache, 1);
 			if (retval) {
-				cache->write_err = 1;
 				errors_found = 1;
 				retval2 = retval;
-			} else {
-				cache->dirty = 0;
-				cache->write_err = 0;
-				if (flags & FLUSH_INVALIDATE)
-					cache->in_use = 0;
 			}
-		} else if (flags & FLUSH_INVALIDATE) {
-			cache->in_use = 0;
 		}
 	}
-	if ((flags & FLUSH_NOLOCK) == 0)
-		mutex_unlock(data, CACHE_MTX);
+	if (flags & FLUSH_INVALIDATE) {
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			if (cache->in_use && !cache->dirty)
+				drop_cache(cache_shard(data, cache->block),
+					   cache);
+	}
 retry:
-	while (errors_found) {
-		if ((flags & FLUSH_NOLOCK) == 0)
-			mutex_lock(data, CACHE_MTX);
-		errors_found = 0;
-		for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
-			if (!cache->in_use || !cache->write_err)
-				continue;
-			errors_found = 1;
-			if (cache->write_err && channel->write_error) {
-				char *err_buf = NULL;
-				unsigned long long err_block = cache->block;
-
-				cache->dirty = 0;
-				cache->in_use = 0;
-				cache->write_err = 0;
-				if (io_channel_alloc_buf(channel, 0,
-							 &err_buf))
-					err_buf = NULL;
-				else
-					memcpy(err_buf, cache->buf,
-					       channel->block_size);
-				mutex_unlock(data, CACHE_MTX);
-				(channel->write_error)(channel, err_block,
-					1, err_buf, channel->block_size, -1,
-					retval2);
-				if (err_buf)
-					ext2fs_free_mem(&err_buf);
-				mutex_lock(data, CACHE_MTX);
-				goto retry;
-			} else
-				cache->write_err = 0;
+	for (i=0, cache = data->cache; errors_found && i < data->cache_size;
+	     i++, cache++) {
+		if (!cache->in_use || !cache->write_err)
+			continue;
+		if (channel->write_error) {
+			char *err_buf = NULL;
+			unsigned long long err_block = cache->block;
+
+			if (io_channel_alloc_buf(channel, 0, &err_buf))
+				err_buf = NULL;
+			else
+				memcpy(err_buf, cache->buf,
+				       channel->block_size);
+			drop_cache(cache_shard(data, cache->block), cache);
+			unlock_all_shards(data);
+			(channel->write_error)(channel, err_block,
+				1, err_buf, channel->block_size, -1,
+				retval2);
+			if (err_buf)
+				ext2fs_free_mem(&err_buf);
+			lock_all_shards(data);
+			goto retry;
 		}
-		if ((flags & FLUSH_NOLOCK) == 0)
-			mutex_unlock(data, CACHE_MTX);
+		cache->write_err = 0;
 	}
+	unlock_all_shards(data);
 	return retval2;
 }
 
-/* Shrink the cache buffers */
-static errcode_t shrink_cache(io_channel channel,
-			      struct unix_private_data *data,
-			      unsigned int new_size)
+/*
+ * Write back, and with FLUSH_INVALIDATE also drop, the cached copies
+ * of count blocks starting at block, before they are read or written
+ * around the cache.  A block which can't be written back stays dirty
+ * in the cache for the next flush to retry.
+ */
+static errcode_t flush_cached_range(io_channel channel,
+				    struct unix_private_data *data,
+				    unsigned long long block,
+				    unsigned long long count,
+				    int flags)
 {
-	struct unix_cache	*cache, *new_cache;
-	unsigned int		i;
-	errcode_t		retval;
-
-	mutex_lock(data, CACHE_MTX);
-
-	retval = flush_cached_blocks(channel, data,
-			FLUSH_INVALIDATE | FLUSH_NOLOCK);
-	if (retval)
-		goto unlock;
-
-	for (i = new_size, cache = data->cache + new_size;
-	     i < data->cache_size;
-	     i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
+	struct unix_cache_shard	*shard;
+	struct unix_cache	*cache;
+	errcode_t		retval, retval2 = 0;
+	unsigned long long	i;
+	unsigned int		j;
+
+	if (count > data->cache_size) {
+		for (j = 0, shard = data->shards; j < data->nr_shards;
+		     j++, shard++) {
+			shard_lock(data, shard);
+			for (i = 0; i < shard->nr_entries; i++) {
+				cache = &shard->entries[i];
+				if (!cache->in_use || cache->block < block ||
+				    cache->block - block >= count)
+					continue;
+				if (cache->dirty) {
+					retval = write_cached_run(channel,
+						data, &cache, 1);
+					if (retval) {
+						retval2 = retval;
+						continue;
+					}
+				}
+				if (flags & FLUSH_INVALIDATE)
+					drop_cache(shard, cache);
+			}
+			shard_unlock(data, shard);
+		}
+		return retval2;
 	}
 
-	new_cache = realloc(data->cache, new_size * sizeof(struct unix_cache));
-	if (!new_cache) {
-		retval = EXT2_ET_NO_MEMORY;
-		goto unlock;
+	for (i = 0; i < count; i++) {
+		shard = cache_shard(data, block + i);
+		shard_lock(data, shard);
+		cache = find_cached_block(shard, block + i);
+		if (cache && cache->dirty) {
+			retval = write_cached_run(channel, data, &cache, 1);
+			if (retval) {
+				retval2 = retval;
+				cache = NULL;
+			}
+		}
+		if (cache && (flags & FLUSH_INVALIDATE))
+			drop_cache(shard, cache);
+		shard_unlock(data, shard);
 	}
-
-	data->cache = new_cache;
-	data->cache_size = new_size;
-	data->cache_hash_shift = highbit32(data->cache_size);
-
-unlock:
-	mutex_unlock(data, CACHE_MTX);
-	return retval;
+	return retval2;
 }
 
-/* Grow the cache buffers */
-static errcode_t grow_cache(io_channel channel,
-			    struct unix_private_data *data,
-			    unsigned int new_size)
+/* Change the number of blocks in the cache */
+static errcode_t resize_cache(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned int new_size)
 {
-	struct unix_cache	*cache, *new_cache;
-	unsigned int		i;
 	errcode_t		retval;
 
-	mutex_lock(data, CACHE_MTX);
-
-	retval = flush_cached_blocks(channel, data,
-			FLUSH_INVALIDATE | FLUSH_NOLOCK);
+	if (data->cache_size == new_size)
+		return 0;
+	retval = flush_cached_blocks(channel, data, FLUSH_INVALIDATE);
 	if (retval)
-		goto unlock;
-
-	new_cache = realloc(data->cache, new_size * sizeof(struct unix_cache));
-	if (!new_cache) {
-		retval = EXT2_ET_NO_MEMORY;
-		goto unlock;
-	}
-	data->cache = new_cache;
-
-	for (i = data->cache_size, cache = new_cache + data->cache_size;
-	     i < new_size;
-	     i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		retval = io_channel_alloc_buf(channel, 0, &cache->buf);
-		if (retval) {
-			while (i > data->cache_size) {
-				cache--; i--;
-				if (cache->buf)
-					ext2fs_free_mem(&cache->buf);
-			}
-			goto unlock;
-		}
-	}
-
-	data->cache_size = new_size;
-	data->cache_hash_shift = highbit32(data->cache_size);
-
-unlock:
-	mutex_unlock(data, CACHE_MTX);
-	return retval;
+		return retval;
+	return alloc_cache(channel, data, new_size);
 }
 #endif /* NO_IO_CACHE */
 
@@ -884,6 +1155,8 @@ static errcode_t unix_open_channel(const char *name, int fd,
 	struct unix_private_data *data = NULL;
 	errcode_t	retval;
 	ext2fs_struct_stat st;
+	unsigned long long tmp;
+	char		*cache_env, *end;
 #ifdef __linux__
 	struct		utsname ut;
 #endif
@@ -926,16 +1199,16 @@ static errcode_t unix_open_channel(const char *name, int fd,
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 4;
+	data->io_stats.num_fields = 5;
 	data->flags = flags;
 	data->dev = fd;
 
-	data->cache_size = DEFAULT_CACHE_SIZE;
-	data->cache_hash_shift = highbit32(data->cache_size);
-	data->cache = calloc(DEFAULT_CACHE_SIZE, sizeof(struct unix_cache));
-	if (!data->cache) {
-		retval = EXT2_ET_NO_MEMORY;
-		goto cleanup;
+	/* UNIX_IO_CACHE_SIZE gives the size of the block cache in MB */
+	cache_env = ext2fs_safe_getenv("UNIX_IO_CACHE_SIZE");
+	if (cache_env) {
+		tmp = strtoull(cache_env, &end, 0);
+		if (*end == 0 && tmp > 0 && tmp < (1ULL << 32))
+			data->cache_bytes = tmp << 20;
 	}
 
 #if defined(O_DIRECT)
@@ -986,7 +1259,10 @@ static errcode_t unix_open_channel(const char *name, int fd,
 	}
 #endif
 
-	if ((retval = alloc_cache(io, data)))
+	retval = alloc_cache(io, data, cache_size_blocks(io, data));
+	if (retval)
+		goto cleanup;
+	if ((retval = alloc_bounce(io, data)))
 		goto cleanup;
 
 #ifdef BLKROGET
@@ -1040,18 +1316,18 @@ static errcode_t unix_open_channel(const char *name, int fd,
 #ifdef HAVE_PTHREAD
 	if (flags & IO_FLAG_THREADS) {
 		io->flags |= CHANNEL_FLAGS_THREADS;
-		retval = pthread_mutex_init(&data->cache_mutex, NULL);
+		retval = pthread_mutex_init(&data->bounce_mutex, NULL);
 		if (retval)
 			goto cleanup;
-		retval = pthread_mutex_init(&data->bounce_mutex, NULL);
+		retval = pthread_mutex_init(&data->stats_mutex, NULL);
 		if (retval) {
-			pthread_mutex_destroy(&data->cache_mutex);
+			pthread_mutex_destroy(&data->bounce_mutex);
 			goto cleanup;
 		}
-		retval = pthread_mutex_init(&data->stats_mutex, NULL);
+		retval = pthread_mutex_init(&data->run_mutex, NULL);
 		if (retval) {
-			pthread_mutex_destroy(&data->cache_mutex);
 			pthread_mutex_destroy(&data->bounce_mutex);
+			pthread_mutex_destroy(&data->stats_mutex);
 			goto cleanup;
 		}
 	}
@@ -1063,10 +1339,7 @@ cleanup:
 	if (data) {
 		if (io->manager != unixfd_io_manager && data->dev >= 0)
 			close(data->dev);
-		if (data->cache) {
-			free_cache(data);
-			free(data->cache);
-		}
+		free_cache(data);
 		ext2fs_free_mem(&data);
 	}
 	if (io) {
@@ -1150,12 +1423,11 @@ static errcode_t unix_close(io_channel channel)
 	if (channel->manager != unixfd_io_manager && close(data->dev) < 0)
 		retval = errno;
 	free_cache(data);
-	free(data->cache);
 #ifdef HAVE_PTHREAD
 	if (data->flags & IO_FLAG_THREADS) {
-		pthread_mutex_destroy(&data->cache_mutex);
 		pthread_mutex_destroy(&data->bounce_mutex);
 		pthread_mutex_destroy(&data->stats_mutex);
+		pthread_mutex_destroy(&data->run_mutex);
 	}
 #endif
 
@@ -1170,39 +1442,50 @@ static errcode_t unix_set_blksize(io_channel channel, int blksize)
 {
 	struct unix_private_data *data;
 	errcode_t		retval = 0;
+	int			old_blksize;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 	if (channel->block_size != blksize) {
-		mutex_lock(data, CACHE_MTX);
-		mutex_lock(data, BOUNCE_MTX);
 #ifndef NO_IO_CACHE
-		if ((retval = flush_cached_blocks(channel, data, FLUSH_NOLOCK))){
-			mutex_unlock(data, BOUNCE_MTX);
-			mutex_unlock(data, CACHE_MTX);
+		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
-		}
 #endif
 
+		mutex_lock(data, BOUNCE_MTX);
+		old_blksize = channel->block_size;
 		channel->block_size = blksize;
-		free_cache(data);
-		retval = alloc_cache(channel, data);
+		retval = alloc_cache(channel, data,
+				     cache_size_blocks(channel, data));
+		if (retval == 0)
+			retval = alloc_bounce(channel, data);
+		else
+			channel->block_size = old_blksize;
 		mutex_unlock(data, BOUNCE_MTX);
-		mutex_unlock(data, CACHE_MTX);
 	}
 	return retval;
 }
 
+/* Number of blocks touched by an I/O of count blocks (or -count bytes) */
+static unsigned long long io_blocks(io_channel channel, int count)
+{
+	if (count >= 0)
+		return count;
+	return ((unsigned long long) -count + channel->block_size - 1) /
+		channel->block_size;
+}
+
 static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *buf)
 {
 	struct unix_private_data *data;
+	struct unix_cache_shard *shard;
 	struct unix_cache *cache;
 	errcode_t	retval;
 	char		*cp;
-	int		i, j;
+	int		i, j, hit;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
@@ -1214,83 +1497,71 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	if (data->flags & IO_FLAG_NOCACHE)
 		return raw_read_blk(channel, data, block, count, buf);
 	/*
-	 * If we're doing an odd-sized read or a very large read,
-	 * flush out the cache and then do a direct read.
+	 * If we're doing an odd-sized read or a very large read, write
+	 * out any dirty cached copies and then do a direct read.
 	 */
 	if (count < 0 || count > WRITE_DIRECT_SIZE) {
-		if ((retval = flush_cached_blocks(channel, data, 0)))
+		if ((retval = flush_cached_range(channel, data, block,
+						 io_blocks(channel, count), 0)))
 			return retval;
 		return raw_read_blk(channel, data, block, count, buf);
 	}
 
 	cp = buf;
-	mutex_lock(data, CACHE_MTX);
 	while (count > 0) {
 		/* If it's in the cache, use it! */
-		if ((cache = find_cached_block(data, block, NULL))) {
+		shard = cache_shard(data, block);
+		shard_lock(data, shard);
+		if ((cache = find_cached_block(shard, block))) {
 #ifdef DEBUG
 			printf("Using cached block %lu\n", block);
 #endif
+			cache->referenced = 1;
+			shard->hits++;
 			memcpy(cp, cache->buf, channel->block_size);
+			shard_unlock(data, shard);
 			count--;
 			block++;
 			cp += channel->block_size;
 			continue;
 		}
+		shard_unlock(data, shard);
 
 		/*
 		 * Find the number of uncached blocks so we can do a
 		 * single read request
 		 */
 		for (i=1; i < count; i++)
-			if (find_cached_block(data, block+i, NULL))
+			if (is_cached(data, block+i))
 				break;
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
 #endif
-		mutex_unlock(data, CACHE_MTX);
 		if ((retval = raw_read_blk(channel, data, block, i, cp)))
 			return retval;
-		mutex_lock(data, CACHE_MTX);
 
 		/* Save the results in the cache */
 		for (j=0; j < i; j++) {
-			if (!find_cached_block(data, block, &cache)) {
-				retval = reuse_cache(channel, data,
-						     cache, block);
-				if (retval)
-					goto call_write_handler;
+			shard = cache_shard(data, block);
+			shard_lock(data, shard);
+			retval = get_cache_entry(channel, data, shard, block,
+						 &cache, &hit);
+			if (retval) {
+				cache_write_error(channel, data, shard,
+						  cache, retval);
+				return retval;
+			}
+			if (!hit) {
+				shard->misses++;
 				memcpy(cache->buf, cp, channel->block_size);
 			}
+			shard_unlock(data, shard);
 			count--;
 			block++;
 			cp += channel->block_size;
 		}
 	}
-	mutex_unlock(data, CACHE_MTX);
 	return 0;
-
-call_write_handler:
-	if (cache->write_err && channel->write_error) {
-		char *err_buf = NULL;
-		unsigned long long err_block = cache->block;
-
-		cache->dirty = 0;
-		cache->in_use = 0;
-		cache->write_err = 0;
-		if (io_channel_alloc_buf(channel, 0, &err_buf))
-			err_buf = NULL;
-		else
-			memcpy(err_buf, cache->buf, channel->block_size);
-		mutex_unlock(data, CACHE_MTX);
-		(channel->write_error)(channel, err_block, 1, err_buf,
-				       channel->block_size, -1,
-				       retval);
-		if (err_buf)
-			ext2fs_free_mem(&err_buf);
-	} else
-		mutex_unlock(data, CACHE_MTX);
-	return retval;
 #endif /* NO_IO_CACHE */
 }
 
@@ -1304,10 +1575,11 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse;
-	errcode_t	retval = 0;
+	struct unix_cache_shard *shard;
+	struct unix_cache *cache;
+	errcode_t	retval = 0, err;
 	const char	*cp;
-	int		writethrough;
+	int		writethrough, hit;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
@@ -1320,11 +1592,13 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 		return raw_write_blk(channel, data, block, count, buf, 0);
 	/*
 	 * If we're doing an odd-sized write or a very large write,
-	 * flush out the cache completely and then do a direct write.
+	 * flush out the cached copies of those blocks and then do a
+	 * direct write.
 	 */
 	if (count < 0 || count > WRITE_DIRECT_SIZE) {
-		if ((retval = flush_cached_blocks(channel, data,
-						  FLUSH_INVALIDATE)))
+		if ((retval = flush_cached_range(channel, data, block,
+						 io_blocks(channel, count),
+						 FLUSH_INVALIDATE)))
 			return retval;
 		return raw_write_blk(channel, data, block, count, buf, 0);
 	}
@@ -1339,47 +1613,28 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 		retval = raw_write_blk(channel, data, block, count, buf, 0);
 
 	cp = buf;
-	mutex_lock(data, CACHE_MTX);
 	while (count > 0) {
-		cache = find_cached_block(data, block, &reuse);
-		if (!cache) {
-			errcode_t err;
-
-			cache = reuse;
-			err = reuse_cache(channel, data, cache, block);
-			if (err)
-				goto call_write_handler;
+		shard = cache_shard(data, block);
+		shard_lock(data, shard);
+		err = get_cache_entry(channel, data, shard, block, &cache,
+				      &hit);
+		if (err) {
+			cache_write_error(channel, data, shard, cache, err);
+			return err;
 		}
+		if (hit)
+			shard->hits++;
+		else
+			shard->misses++;
 		if (cache->buf != cp)
 			memcpy(cache->buf, cp, channel->block_size);
 		cache->dirty = !writethrough;
+		cache->referenced = 1;
+		shard_unlock(data, shard);
 		count--;
 		block++;
 		cp += channel->block_size;
 	}
-	mutex_unlock(data, CACHE_MTX);
-	return retval;
-
-call_write_handler:
-	if (cache->write_err && channel->write_error) {
-		char *err_buf = NULL;
-		unsigned long long err_block = cache->block;
-
-		cache->dirty = 0;
-		cache->in_use = 0;
-		cache->write_err = 0;
-		if (io_channel_alloc_buf(channel, 0, &err_buf))
-			err_buf = NULL;
-		else
-			memcpy(err_buf, cache->buf, channel->block_size);
-		mutex_unlock(data, CACHE_MTX);
-		(channel->write_error)(channel, err_block, 1, err_buf,
-				       channel->block_size, -1,
-				       retval);
-		if (err_buf)
-			ext2fs_free_mem(&err_buf);
-	} else
-		mutex_unlock(data, CACHE_MTX);
 	return retval;
 #endif /* NO_IO_CACHE */
 }
@@ -1402,6 +1657,244 @@ static errcode_t unix_cache_readahead(io_channel channel,
 #endif
 }
 
+#if defined(HAVE_UNIX_READ_BLKV) || defined(HAVE_UNIX_WRITE_BLKV)
+/*
+ * Requests for the same block keep their order in the array, so that
+ * the last write to a block is still the one which sticks.
+ */
+static int req_block_cmp(const void *a, const void *b)
+{
+	const struct io_blk_req *ra = *(const struct io_blk_req * const *) a;
+	const struct io_blk_req *rb = *(const struct io_blk_req * const *) b;
+
+	if (ra->block < rb->block)
+		return -1;
+	if (ra->block > rb->block)
+		return 1;
+	if (ra < rb)
+		return -1;
+	if (ra > rb)
+		return 1;
+	return 0;
+}
+
+static errcode_t sort_reqs(struct io_blk_req *reqs, int nr,
+			   struct io_blk_req ***ret_sorted)
+{
+	struct io_blk_req **sorted;
+	errcode_t	retval;
+	int		i;
+
+	retval = ext2fs_get_array(nr, sizeof(struct io_blk_req *), &sorted);
+	if (retval)
+		return retval;
+	for (i = 0; i < nr; i++)
+		sorted[i] = &reqs[i];
+	/* Callers usually hand us the requests in order already */
+	for (i = 1; i < nr; i++)
+		if (reqs[i].block < reqs[i-1].block)
+			break;
+	if (i < nr)
+		qsort(sorted, nr, sizeof(struct io_blk_req *), req_block_cmp);
+	*ret_sorted = sorted;
+	return 0;
+}
+#endif
+
+#ifdef HAVE_UNIX_READ_BLKV
+
+/*
+ * Sort the requests by block number and read each run of physically
+ * adjacent requests with a single preadv().  Requests which can't be
+ * merged, and runs which fail or come back short, go through
+ * unix_read_blk64() one at a time so that the cache and the read error
+ * handler behave exactly as they would for an ordinary read.
+ */
+static errcode_t unix_read_blkv(io_channel channel, struct io_blk_req *reqs,
+				int nr, io_blk_req_done done, void *priv_data)
+{
+	struct unix_private_data *data;
+	struct io_blk_req **sorted, *req;
+	struct iovec	iov[READV_MAX_IOVS];
+	ext2_loff_t	location;
+	ssize_t		size, actual;
+	errcode_t	retval;
+	int		i, j, k, n;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = sort_reqs(reqs, nr, &sorted);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < nr; i = j) {
+		location = ((ext2_loff_t) sorted[i]->block *
+			    channel->block_size) + data->offset;
+		size = 0;
+		for (j = i, n = 0; j < nr && n < READV_MAX_IOVS; j++, n++) {
+			req = sorted[j];
+			if (req->count <= 0)
+				break;
+			if (j > i && req->block != sorted[j-1]->block +
+						   sorted[j-1]->count)
+				break;
+			iov[n].iov_base = req->buf;
+			iov[n].iov_len = (size_t) req->count *
+				channel->block_size;
+			if (channel->align &&
+			    (!IS_ALIGNED(iov[n].iov_base, channel->align) ||
+			     !IS_ALIGNED(iov[n].iov_len, channel->align) ||
+			     !IS_ALIGNED(location, channel->align)))
+				break;
+			size += iov[n].iov_len;
+		}
+		if (n == 0)
+			j = i + 1;
+
+		actual = -1;
+#ifndef NO_IO_CACHE
+		/* The merged read bypasses the cache */
+		if (n > 1 && (data->flags & IO_FLAG_NOCACHE) == 0 &&
+		    flush_cached_range(channel, data, sorted[i]->block,
+				       size / channel->block_size, 0))
+			n = 1;
+#endif
+		if (n > 1 && (data->flags & IO_FLAG_FORCE_BOUNCE) == 0) {
+#ifdef HAVE_PREADV64
+			actual = preadv64(data->dev, iov, n, location);
+#else
+			if (sizeof(off_t) >= sizeof(ext2_loff_t))
+				actual = preadv(data->dev, iov, n, location);
+#endif
+		}
+		if (actual == size) {
+			mutex_lock(data, STATS_MTX);
+			data->io_stats.bytes_read += size;
+			mutex_unlock(data, STATS_MTX);
+			for (k = i; k < j; k++) {
+				sorted[k]->error = 0;
+				if (done)
+					(done)(channel, sorted[k], priv_data);
+			}
+			continue;
+		}
+
+		for (k = i; k < j; k++) {
+			req = sorted[k];
+			req->error = unix_read_blk64(channel, req->block,
+						     req->count, req->buf);
+			if (done)
+				(done)(channel, req, priv_data);
+		}
+	}
+	ext2fs_free_mem(&sorted);
+	return 0;
+}
+#endif /* HAVE_UNIX_READ_BLKV */
+
+#ifdef HAVE_UNIX_WRITE_BLKV
+static ssize_t req_size(io_channel channel, struct io_blk_req *req)
+{
+	if (req->count < 0)
+		return -req->count;
+	return (ssize_t) req->count * channel->block_size;
+}
+
+/*
+ * Sort the requests by block number and write each run of requests
+ * which are physically adjacent, byte for byte, with a single
+ * pwritev().  The cached copies of the blocks in a merged run are
+ * dropped first, just as for a large write through unix_write_blk64().
+ * Anything which can't be merged, or a run which fails, is written with
+ * unix_write_blk64() one request at a time.
+ */
+static errcode_t unix_write_blkv(io_channel channel, struct io_blk_req *reqs,
+				 int nr, io_blk_req_done done, void *priv_data)
+{
+	struct unix_private_data *data;
+	struct io_blk_req **sorted, *req;
+	struct iovec	iov[READV_MAX_IOVS];
+	ext2_loff_t	location, next;
+	ssize_t		size, actual;
+	errcode_t	retval;
+	int		i, j, k, n;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = sort_reqs(reqs, nr, &sorted);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < nr; i = j) {
+		location = ((ext2_loff_t) sorted[i]->block *
+			    channel->block_size) + data->offset;
+		next = location;
+		size = 0;
+		for (j = i, n = 0; j < nr && n < READV_MAX_IOVS; j++, n++) {
+			req = sorted[j];
+			if (req->count == 0)
+				break;
+			if (j > i && ((ext2_loff_t) req->block *
+				      channel->block_size) + data->offset != next)
+				break;
+			iov[n].iov_base = req->buf;
+			iov[n].iov_len = req_size(channel, req);
+			if (channel->align &&
+			    (!IS_ALIGNED(iov[n].iov_base, channel->align) ||
+			     !IS_ALIGNED(iov[n].iov_len, channel->align) ||
+			     !IS_ALIGNED(next, channel->align)))
+				break;
+			size += iov[n].iov_len;
+			next += iov[n].iov_len;
+		}
+		if (n == 0)
+			j = i + 1;
+
+		actual = -1;
+#ifndef NO_IO_CACHE
+		if (n > 1 && (data->flags & IO_FLAG_NOCACHE) == 0 &&
+		    flush_cached_range(channel, data, sorted[i]->block,
+				       (size + channel->block_size - 1) /
+				       channel->block_size, FLUSH_INVALIDATE))
+			n = 1;
+#endif
+		if (n > 1 && (data->flags & IO_FLAG_FORCE_BOUNCE) == 0) {
+#ifdef HAVE_PWRITEV64
+			actual = pwritev64(data->dev, iov, n, location);
+#else
+			if (sizeof(off_t) >= sizeof(ext2_loff_t))
+				actual = pwritev(data->dev, iov, n, location);
+#endif
+		}
+		if (actual == size) {
+			mutex_lock(data, STATS_MTX);
+			data->io_stats.bytes_written += size;
+			mutex_unlock(data, STATS_MTX);
+			for (k = i; k < j; k++) {
+				sorted[k]->error = 0;
+				if (done)
+					(done)(channel, sorted[k], priv_data);
+			}
+			continue;
+		}
+
+		for (k = i; k < j; k++) {
+			req = sorted[k];
+			req->error = unix_write_blk64(channel, req->block,
+						      req->count, req->buf);
+			if (done)
+				(done)(channel, req, priv_data);
+		}
+	}
+	ext2fs_free_mem(&sorted);
+	return 0;
+}
+#endif /* HAVE_UNIX_WRITE_BLKV */
+
 static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 				int count, const void *buf)
 {
@@ -1428,9 +1921,14 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 
 #ifndef NO_IO_CACHE
 	/*
-	 * Flush out the cache completely
+	 * Flush out the cached copies of the blocks being written
 	 */
-	if ((retval = flush_cached_blocks(channel, data, FLUSH_INVALIDATE)))
+	if (size > 0 &&
+	    (retval = flush_cached_range(channel, data,
+				offset / channel->block_size,
+				(offset + size - 1) / channel->block_size -
+				offset / channel->block_size + 1,
+				FLUSH_INVALIDATE)))
 		return retval;
 #endif
 
@@ -1518,11 +2016,23 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 		if (errno || size == 0 || size > INT32_MAX)
 			return EXT2_ET_INVALID_ARGUMENT;
 
-		if (data->cache_size == size)
-			return 0;
-		if (data->cache_size > size)
-			return shrink_cache(channel, data, size);
-		return grow_cache(channel, data, size);
+		data->cache_bytes = 0;
+		return resize_cache(channel, data, size);
+	}
+	if (!strcmp(option, "cache_size")) {
+		unsigned long long	mb;
+
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		errno = 0;
+		mb = strtoull(arg, &end, 0);
+		if (errno || *end || mb == 0 || mb >= (1ULL << 32))
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		data->cache_bytes = mb << 20;
+		return resize_cache(channel, data,
+				    cache_size_blocks(channel, data));
 	}
 #endif
 	return EXT2_ET_INVALID_ARGUMENT;
@@ -1545,6 +2055,14 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 	if (channel->flags & CHANNEL_FLAGS_NODISCARD)
 		goto unimplemented;
 
+#ifndef NO_IO_CACHE
+	ret = flush_cached_range(channel, data, block, count,
+				 FLUSH_INVALIDATE);
+	if (ret)
+		return ret;
+	ret = EOPNOTSUPP;
+#endif
+
 	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
 #ifdef BLKDISCARD
 		__u64 range[2];
@@ -1622,6 +2140,13 @@ static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+#ifndef NO_IO_CACHE
+	ret = flush_cached_range(channel, data, block, count,
+				 FLUSH_INVALIDATE);
+	if (ret)
+		return ret;
+#endif
+
 	if (!(channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE)) {
 		/* Regular file, try to use truncate/punch/zero. */
 		struct stat statbuf;
@@ -1666,6 +2191,105 @@ unimplemented:
 #pragma GCC diagnostic pop
 #endif
 
+/*
+ * Copy file data into an image file without reading it into memory.
+ * A reflink (FICLONERANGE) is tried first, since it shares the data
+ * blocks instead of copying them; it only works when everything is
+ * aligned to the host file system's block size.  Otherwise the copy
+ * is handed to copy_file_range(), which the host file system may still
+ * be able to do without moving the data through the page cache.
+ */
+#if defined(__linux__) && !defined(FICLONERANGE)
+struct file_clone_range {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	src_length;
+	__u64	dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+#if __GNUC_PREREQ (4, 6)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+static errcode_t unix_copy_file_range(io_channel channel,
+				      unsigned long long block, int fd,
+				      ext2_loff_t offset,
+				      unsigned long long count)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	struct unix_private_data *data;
+	ext2_loff_t	len, dest;
+	loff_t		in_off, out_off;
+	ssize_t		ret;
+	errcode_t	retval;
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+#endif
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE)
+		return EXT2_ET_UNIMPLEMENTED;
+
+#ifndef NO_IO_CACHE
+	retval = flush_cached_range(channel, data, block, count,
+				    FLUSH_INVALIDATE);
+	if (retval)
+		return retval;
+#endif
+
+	len = (ext2_loff_t) count * channel->block_size;
+	dest = ((ext2_loff_t) block * channel->block_size) + data->offset;
+
+	/*
+	 * Only count the data once all of it is in place; on failure the
+	 * caller writes the range again the usual way.
+	 */
+#ifdef FICLONERANGE
+	range.src_fd = fd;
+	range.src_offset = offset;
+	range.src_length = len;
+	range.dest_offset = dest;
+	if (ioctl(data->dev, FICLONERANGE, &range) == 0)
+		goto success;
+#endif
+
+	in_off = offset;
+	out_off = dest;
+	while (out_off - dest < len) {
+		ret = copy_file_range(fd, &in_off, data->dev, &out_off,
+				      len - (out_off - dest), 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP ||
+			    errno == EBADF)
+				return EXT2_ET_UNIMPLEMENTED;
+			return errno;
+		}
+		if (ret == 0)
+			return EXT2_ET_SHORT_READ;
+	}
+#ifdef FICLONERANGE
+success:
+#endif
+	mutex_lock(data, STATS_MTX);
+	data->io_stats.bytes_written += len;
+	mutex_unlock(data, STATS_MTX);
+	return 0;
+#else
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+}
+#if __GNUC_PREREQ (4, 6)
+#pragma GCC diagnostic pop
+#endif
+
 static struct struct_io_manager struct_unix_manager = {
 	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
 	.name		= "Unix I/O Manager",
@@ -1683,6 +2307,13 @@ static struct struct_io_manager struct_unix_manager = {
 	.discard	= unix_discard,
 	.cache_readahead	= unix_cache_readahead,
 	.zeroout	= unix_zeroout,
+#ifdef HAVE_UNIX_READ_BLKV
+	.read_blkv	= unix_read_blkv,
+#endif
+	.copy_file_range	= unix_copy_file_range,
+#ifdef HAVE_UNIX_WRITE_BLKV
+	.write_blkv	= unix_write_blkv,
+#endif
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
@@ -1704,6 +2335,13 @@ static struct struct_io_manager struct_unixfd_manager = {
 	.discard	= unix_discard,
 	.cache_readahead	= unix_cache_readahead,
 	.zeroout	= unix_zeroout,
+#ifdef HAVE_UNIX_READ_BLKV
+	.read_blkv	= unix_read_blkv,
+#endif
+	.copy_file_range	= unix_copy_file_range,
+#ifdef HAVE_UNIX_WRITE_BLKV
+	.write_blkv	= unix_write_blkv,
+#endif
 };
 
 io_manager unixfd_io_manager = &struct_unixfd_manager;
@@ -0,0 +1,1130 @@
+/*
+ * uring_io.c --- I/O manager which submits requests through a Linux
+ *	io_uring.
+ *
+ * Unlike unix_io, which issues one synchronous pread/pwrite per block
+ * run, this manager splits large requests into chunks and queues all of
+ * them with a single io_uring_enter() call, keeping up to queue_depth
+ * I/Os in flight.  There is no block cache; every request goes to the
+ * device (or to the page cache of an image file).
+ *
+ * When the channel is opened with IO_FLAG_DIRECT_IO, unaligned requests
+ * go through a bounce buffer which is registered with the ring, so that
+ * the kernel does not need to map and pin it for every request.
+ *
+ * The queue depth can be set with the URING_IO_QUEUE_DEPTH environment
+ * variable or the "queue_depth" channel option.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#if !defined(__FreeBSD__) && !defined(__NetBSD__) && !defined(__OpenBSD__)
+#define _XOPEN_SOURCE 600
+#ifndef _LARGEFILE_SOURCE
+#define _LARGEFILE_SOURCE
+#endif
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_SYS_MOUNT_H
+#include <sys/mount.h>
+#endif
+#if HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "ext2fsP.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+	defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define URING_DEFAULT_QUEUE_DEPTH	64
+#define URING_MAX_QUEUE_DEPTH		4096
+#define URING_CHUNK_SIZE		(256 * 1024)
+#define URING_BOUNCE_CHUNKS		16
+/* Failed io_uring_enter() calls in a row before giving up on the ring */
+#define URING_ENTER_RETRIES		1000
+
+struct uring_ring {
+	int			fd;
+	unsigned int		entries;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ptr;
+	void			*cq_ptr;
+	size_t			sq_len;
+	size_t			cq_len;
+	size_t			sqes_len;
+};
+
+/* One chunk of a request, as submitted to the ring */
+struct uring_op {
+	struct iovec		iov;
+	ext2_loff_t		offset;
+	int			res;
+};
+
+struct uring_private_data {
+	int			magic;
+	int			dev;
+	int			flags;
+	ext2_loff_t		offset;
+	unsigned int		queue_depth;
+	struct uring_ring	ring;
+	struct uring_op		*ops;
+	char			*bounce;
+	size_t			bounce_size;
+	int			bounce_fixed;
+	struct struct_io_stats	io_stats;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		mutex;
+#endif
+};
+
+#define IS_ALIGNED(n, align) ((((uintptr_t) n) & \
+			       ((uintptr_t) ((align)-1))) == 0)
+
+static inline void uring_lock(struct uring_private_data *data)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_lock(&data->mutex);
+#endif
+}
+
+static inline void uring_unlock(struct uring_private_data *data)
+{
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_unlock(&data->mutex);
+#endif
+}
+
+/*
+ * Ring setup and teardown
+ */
+static void ring_exit(struct uring_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+static errcode_t ring_init(struct uring_ring *ring, unsigned int entries)
+{
+	struct io_uring_params	p;
+	char			*sq, *cq;
+	errcode_t		retval;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return errno;
+	}
+	ring->entries = p.sq_entries;
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	ring->sq_ptr = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+	ring->cq_ptr = cq;
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+
+err:
+	retval = errno;
+	ring_exit(ring);
+	return retval;
+}
+
+/*
+ * (Re)allocate the ring, the op array and the bounce buffer for the
+ * current queue depth.  The bounce buffer is only needed for O_DIRECT.
+ */
+static void uring_free_queue(struct uring_private_data *data)
+{
+	ring_exit(&data->ring);
+	if (data->ops)
+		ext2fs_free_mem(&data->ops);
+	if (data->bounce)
+		ext2fs_free_mem(&data->bounce);
+	data->bounce_size = 0;
+	data->bounce_fixed = 0;
+}
+
+static errcode_t uring_alloc_queue(io_channel channel,
+				   struct uring_private_data *data)
+{
+	struct iovec	iov;
+	errcode_t	retval;
+
+	retval = ring_init(&data->ring, data->queue_depth);
+	if (retval)
+		return retval;
+	/* The kernel may round the number of entries up */
+	if (data->queue_depth > data->ring.entries)
+		data->queue_depth = data->ring.entries;
+
+	retval = ext2fs_get_array(data->queue_depth, sizeof(struct uring_op),
+				  &data->ops);
+	if (retval)
+		goto err;
+
+	if (!channel->align)
+		return 0;
+
+	data->bounce_size = (size_t) URING_CHUNK_SIZE *
+		(data->queue_depth < URING_BOUNCE_CHUNKS ?
+		 data->queue_depth : URING_BOUNCE_CHUNKS);
+	retval = ext2fs_get_memalign(data->bounce_size, channel->align,
+				     &data->bounce);
+	if (retval)
+		goto err;
+	/*
+	 * Registering the buffer can fail if RLIMIT_MEMLOCK is too
+	 * small; it is only an optimization, so just carry on.
+	 */
+	iov.iov_base = data->bounce;
+	iov.iov_len = data->bounce_size;
+	if (syscall(__NR_io_uring_register, data->ring.fd,
+		    IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+		data->bounce_fixed = 1;
+	return 0;
+
+err:
+	uring_free_queue(data);
+	return retval;
+}
+
+/* Only the bytes which were actually transferred are counted */
+static inline void uring_count_bytes(struct uring_private_data *data,
+				     int write, size_t bytes)
+{
+	if (write)
+		data->io_stats.bytes_written += bytes;
+	else
+		data->io_stats.bytes_read += bytes;
+}
+
+/*
+ * Submit the first nr entries of data->ops and wait for all of them.
+ * Chunks that complete short are finished synchronously.  Returns the
+ * first error seen, and adds the number of bytes moved before the first
+ * failing chunk to *actual.
+ *
+ * It doesn't return while any chunk is still in flight, since the
+ * kernel could go on using the caller's buffers, unless io_uring_enter()
+ * keeps failing without completing anything.  Then the chunks still
+ * outstanding are failed with its error and the ring is torn down, which
+ * makes the kernel cancel them and keeps their completions from being
+ * mistaken for later ones.  From then on the channel does its I/O with
+ * pread/pwrite.
+ */
+static errcode_t uring_submit_ops(struct uring_private_data *data,
+				  int write, int fixed, int nr,
+				  size_t *actual)
+{
+	struct uring_ring	*ring = &data->ring;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	struct uring_op		*op;
+	unsigned int		tail, head, mask;
+	int			i, queued, inflight = 0, contiguous = 1;
+	int			retries = 0;
+	errcode_t		retval = 0;
+	ssize_t			ret;
+
+	if (ring->fd < 0) {
+		for (i = 0; i < nr; i++) {
+			op = &data->ops[i];
+			do {
+				if (write)
+					ret = pwrite64(data->dev,
+						       op->iov.iov_base,
+						       op->iov.iov_len,
+						       op->offset);
+				else
+					ret = pread64(data->dev,
+						      op->iov.iov_base,
+						      op->iov.iov_len,
+						      op->offset);
+			} while (ret < 0 && errno == EINTR);
+			op->res = ret < 0 ? -errno : ret;
+		}
+		goto done;
+	}
+
+	mask = *ring->sq_mask;
+	tail = *ring->sq_tail;
+	for (i = 0; i < nr; i++) {
+		op = &data->ops[i];
+		op->res = -EINPROGRESS;
+		sqe = &ring->sqes[tail & mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = data->dev;
+		sqe->off = op->offset;
+		sqe->user_data = i;
+		if (fixed) {
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED :
+					      IORING_OP_READ_FIXED;
+			sqe->addr = (uintptr_t) op->iov.iov_base;
+			sqe->len = op->iov.iov_len;
+			sqe->buf_index = 0;
+		} else {
+			sqe->opcode = write ? IORING_OP_WRITEV :
+					      IORING_OP_READV;
+			sqe->addr = (uintptr_t) &op->iov;
+			sqe->len = 1;
+		}
+		ring->sq_array[tail & mask] = tail & mask;
+		tail++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	queued = nr;
+	while (queued || inflight) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, queued,
+			      1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EBUSY && queued) {
+				retval = errno;
+				/* Take back what the kernel never saw */
+				tail -= queued;
+				__atomic_store_n(ring->sq_tail, tail,
+						 __ATOMIC_RELEASE);
+				queued = 0;
+			} else if (!queued) {
+				/*
+				 * Whatever went wrong, the requests in
+				 * flight still read into or write from the
+				 * caller's buffers, so keep waiting for
+				 * them, for a while.
+				 */
+				if (++retries > URING_ENTER_RETRIES)
+					break;
+				sched_yield();
+			}
+			ret = 0;
+		}
+		queued -= ret;
+		inflight += ret;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail,
+					       __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			data->ops[cqe->user_data].res = cqe->res;
+			head++;
+			inflight--;
+			retries = 0;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (inflight) {
+		if (!retval)
+			retval = errno;
+		for (i = 0; i < nr; i++)
+			if (data->ops[i].res == -EINPROGRESS)
+				data->ops[i].res = -retval;
+		ring_exit(ring);
+		data->bounce_fixed = 0;
+	}
+	if (retval)
+		return retval;
+
+done:
+	for (i = 0; i < nr; i++) {
+		char		*buf;
+		size_t		len;
+		ext2_loff_t	off;
+
+		op = &data->ops[i];
+		if (op->res < 0) {
+			if (!retval)
+				retval = -op->res;
+			contiguous = 0;
+			continue;
+		}
+		uring_count_bytes(data, write, op->res);
+		if (contiguous)
+			*actual += op->res;
+		if ((size_t) op->res == op->iov.iov_len)
+			continue;
+
+		/* Finish a short transfer synchronously */
+		buf = (char *) op->iov.iov_base + op->res;
+		len = op->iov.iov_len - op->res;
+		off = op->offset + op->res;
+		while (len && contiguous) {
+			if (write)
+				ret = pwrite64(data->dev, buf, len, off);
+			else
+				ret = pread64(data->dev, buf, len, off);
+			if (ret <= 0) {
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (!retval)
+					retval = ret < 0 ? errno : (write ?
+						EXT2_ET_SHORT_WRITE :
+						EXT2_ET_SHORT_READ);
+				contiguous = 0;
+				break;
+			}
+			uring_count_bytes(data, write, ret);
+			buf += ret;
+			off += ret;
+			len -= ret;
+			*actual += ret;
+		}
+		if (len)
+			contiguous = 0;
+	}
+	return retval;
+}
+
+/*
+ * Read or write size bytes at location, split into chunks of at most
+ * URING_CHUNK_SIZE, with up to queue_depth chunks in flight.
+ */
+static errcode_t uring_rw(struct uring_private_data *data, int write,
+			  int fixed, ext2_loff_t location, char *buf,
+			  size_t size, size_t *actual)
+{
+	errcode_t	retval = 0;
+	size_t		len;
+	int		nr;
+
+	while (size && !retval) {
+		for (nr = 0; size && nr < (int) data->queue_depth; nr++) {
+			len = size > URING_CHUNK_SIZE ? URING_CHUNK_SIZE : size;
+			data->ops[nr].iov.iov_base = buf;
+			data->ops[nr].iov.iov_len = len;
+			data->ops[nr].offset = location;
+			buf += len;
+			location += len;
+			size -= len;
+		}
+		retval = uring_submit_ops(data, write, fixed, nr, actual);
+	}
+	return retval;
+}
+
+/*
+ * O_DIRECT fallback for buffers, offsets or sizes which aren't aligned:
+ * move the data through the (registered) bounce buffer, reading in the
+ * partial edges of each window first when writing.
+ */
+static errcode_t uring_rw_bounce(io_channel channel,
+				 struct uring_private_data *data, int write,
+				 ext2_loff_t location, char *buf, size_t size,
+				 size_t *actual)
+{
+	ext2_loff_t	start, end, win_start, win_end;
+	size_t		win, skip, len, done;
+	int		align = channel->align;
+	errcode_t	retval;
+
+	start = location - (location % align);
+	end = location + size;
+	if (end % align)
+		end += align - (end % align);
+
+	for (win_start = start; win_start < end; win_start = win_end) {
+		win = data->bounce_size;
+		if ((ext2_loff_t) win > end - win_start)
+			win = end - win_start;
+		win_end = win_start + win;
+		skip = win_start < location ? location - win_start : 0;
+		len = win - skip;
+		if ((ext2_loff_t) (win_start + skip + len) > location +
+		    (ext2_loff_t) size)
+			len = location + size - (win_start + skip);
+
+		if (!write || skip || len != win) {
+			if (write)
+				memset(data->bounce, 0, win);
+			done = 0;
+			retval = uring_rw(data, 0, data->bounce_fixed,
+					  win_start, data->bounce, win, &done);
+			if (retval && !write) {
+				if (done > skip) {
+					done -= skip;
+					memcpy(buf, data->bounce + skip,
+					       done < len ? done : len);
+					*actual += done < len ? done : len;
+				}
+				return retval;
+			}
+			if (retval && retval != EXT2_ET_SHORT_READ)
+				return retval;
+		}
+		if (write) {
+			memcpy(data->bounce + skip, buf, len);
+			done = 0;
+			retval = uring_rw(data, 1, data->bounce_fixed,
+					  win_start, data->bounce, win, &done);
+			if (retval)
+				return retval;
+		} else
+			memcpy(buf, data->bounce + skip, len);
+		buf += len;
+		*actual += len;
+	}
+	return 0;
+}
+
+static errcode_t uring_io(io_channel channel, struct uring_private_data *data,
+			  int write, ext2_loff_t location, void *buf,
+			  size_t size, size_t *actual)
+{
+	errcode_t	retval;
+
+	*actual = 0;
+	uring_lock(data);
+	if (channel->align &&
+	    (!IS_ALIGNED(buf, channel->align) ||
+	     !IS_ALIGNED(location, channel->align) ||
+	     !IS_ALIGNED(size, channel->align)))
+		retval = uring_rw_bounce(channel, data, write, location,
+					 buf, size, actual);
+	else
+		retval = uring_rw(data, write, 0, location, buf, size,
+				  actual);
+	uring_unlock(data);
+	return retval;
+}
+
+static errcode_t uring_read_blk64(io_channel channel, unsigned long long block,
+				  int count, void *buf)
+{
+	struct uring_private_data *data;
+	ext2_loff_t	location;
+	size_t		size, actual;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? (size_t) -count :
+		(size_t) count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = uring_io(channel, data, 0, location, buf, size, &actual);
+	if (retval) {
+		memset((char *) buf + actual, 0, size - actual);
+		if (channel->read_error)
+			retval = (channel->read_error)(channel, block, count,
+						       buf, size, actual,
+						       retval);
+	}
+	return retval;
+}
+
+static errcode_t uring_read_blk(io_channel channel, unsigned long block,
+				int count, void *buf)
+{
+	return uring_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t uring_write_blk64(io_channel channel,
+				   unsigned long long block,
+				   int count, const void *buf)
+{
+	struct uring_private_data *data;
+	ext2_loff_t	location;
+	size_t		size, actual;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? (size_t) -count :
+		(size_t) count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = uring_io(channel, data, 1, location, (void *) buf, size,
+			  &actual);
+	if (retval && channel->write_error)
+		retval = (channel->write_error)(channel, block, count, buf,
+						size, actual, retval);
+	return retval;
+}
+
+static errcode_t uring_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *buf)
+{
+	return uring_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t uring_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *buf)
+{
+	struct uring_private_data *data;
+	size_t		actual;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (channel->align != 0)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	return uring_io(channel, data, 1, offset + data->offset,
+			(void *) buf, size, &actual);
+}
+
+static errcode_t uring_open(const char *name, int flags,
+			    io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct uring_private_data *data = NULL;
+	errcode_t	retval;
+	ext2fs_struct_stat st;
+	int		open_flags;
+	char		*cp;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct uring_private_data), &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->io_stats.num_fields = 2;
+	data->flags = flags;
+	data->dev = -1;
+	data->ring.fd = -1;
+
+	io->manager = uring_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
+	if (flags & IO_FLAG_EXCLUSIVE)
+		open_flags |= O_EXCL;
+#if defined(O_DIRECT)
+	if (flags & IO_FLAG_DIRECT_IO)
+		open_flags |= O_DIRECT;
+#endif
+	data->dev = ext2fs_open_file(name, open_flags, 0);
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+#if defined(O_DIRECT)
+	if (flags & IO_FLAG_DIRECT_IO)
+		io->align = ext2fs_get_dio_alignment(data->dev);
+#endif
+
+	if (ext2fs_fstat(data->dev, &st) == 0) {
+		if (ext2fsP_is_disk_device(st.st_mode))
+			io->flags |= CHANNEL_FLAGS_BLOCK_DEVICE;
+		else
+			io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
+	}
+
+	data->queue_depth = URING_DEFAULT_QUEUE_DEPTH;
+	cp = ext2fs_safe_getenv("URING_IO_QUEUE_DEPTH");
+	if (cp) {
+		unsigned long qd = strtoul(cp, NULL, 0);
+
+		if (qd && qd <= URING_MAX_QUEUE_DEPTH)
+			data->queue_depth = qd;
+	}
+	retval = uring_alloc_queue(io, data);
+	if (retval)
+		goto cleanup;
+
+#ifdef HAVE_PTHREAD
+	if (flags & IO_FLAG_THREADS) {
+		io->flags |= CHANNEL_FLAGS_THREADS;
+		retval = pthread_mutex_init(&data->mutex, NULL);
+		if (retval)
+			goto cleanup;
+	}
+#endif
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data) {
+		uring_free_queue(data);
+		if (data->dev >= 0)
+			close(data->dev);
+		ext2fs_free_mem(&data);
+	}
+	if (io->name)
+		ext2fs_free_mem(&io->name);
+	ext2fs_free_mem(&io);
+	return retval;
+}
+
+static errcode_t uring_close(io_channel channel)
+{
+	struct uring_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	uring_free_queue(data);
+	if (close(data->dev) < 0)
+		retval = errno;
+#ifdef HAVE_PTHREAD
+	if (data->flags & IO_FLAG_THREADS)
+		pthread_mutex_destroy(&data->mutex);
+#endif
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t uring_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t uring_flush(io_channel channel)
+{
+	struct uring_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+#ifdef HAVE_FSYNC
+	if (fsync(data->dev) != 0)
+		return errno;
+#endif
+	return 0;
+}
+
+static errcode_t uring_set_option(io_channel channel, const char *option,
+				  const char *arg)
+{
+	struct uring_private_data *data;
+	unsigned long long tmp;
+	errcode_t retval;
+	char *end;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!arg)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	if (!strcmp(option, "offset")) {
+		tmp = strtoull(arg, &end, 0);
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->offset = tmp;
+		if (data->offset < 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return 0;
+	}
+	if (!strcmp(option, "queue_depth")) {
+		tmp = strtoull(arg, &end, 0);
+		if (*end || tmp == 0 || tmp > URING_MAX_QUEUE_DEPTH)
+			return EXT2_ET_INVALID_ARGUMENT;
+		uring_lock(data);
+		uring_free_queue(data);
+		data->queue_depth = tmp;
+		retval = uring_alloc_queue(channel, data);
+		uring_unlock(data);
+		return retval;
+	}
+	/* There is no block cache, so there is nothing to turn on or off */
+	if (!strcmp(option, "cache")) {
+		if (strcmp(arg, "on") && strcmp(arg, "off"))
+			return EXT2_ET_INVALID_ARGUMENT;
+		return 0;
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t uring_get_stats(io_channel channel, io_stats *stats)
+{
+	struct uring_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
+
+#if defined(__linux__) && !defined(BLKDISCARD)
+#define BLKDISCARD		_IO(0x12,119)
+#endif
+
+static errcode_t uring_discard(io_channel channel, unsigned long long block,
+			       unsigned long long count)
+{
+	struct uring_private_data *data;
+	int		ret = -1;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (channel->flags & CHANNEL_FLAGS_NODISCARD)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	errno = EOPNOTSUPP;
+	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
+#ifdef BLKDISCARD
+		__u64 range[2];
+
+		range[0] = (__u64)(block) * channel->block_size + data->offset;
+		range[1] = (__u64)(count) * channel->block_size;
+		ret = ioctl(data->dev, BLKDISCARD, &range);
+#endif
+	} else {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+		ret = fallocate(data->dev,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(off_t)(block) * channel->block_size +
+				data->offset,
+				(off_t)(count) * channel->block_size);
+#endif
+	}
+	if (ret < 0) {
+		if (errno == EOPNOTSUPP) {
+			channel->flags |= CHANNEL_FLAGS_NODISCARD;
+			return EXT2_ET_UNIMPLEMENTED;
+		}
+		return errno;
+	}
+	return 0;
+}
+
+static errcode_t uring_zeroout(io_channel channel, unsigned long long block,
+			       unsigned long long count)
+{
+	struct uring_private_data *data;
+	ext2fs_struct_stat st;
+	ext2_loff_t	start, len;
+	int		ret = -1;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (count == 0)
+		return 0;
+	start = (ext2_loff_t) block * channel->block_size + data->offset;
+	len = (ext2_loff_t) count * channel->block_size;
+
+	if (!(channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE)) {
+		/* Extend a regular file which is too short */
+		if (ext2fs_fstat(data->dev, &st))
+			return errno;
+		if (st.st_size < start + len &&
+		    ftruncate(data->dev, start + len))
+			return errno;
+	}
+
+	if (channel->flags & CHANNEL_FLAGS_NOZEROOUT)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	errno = EOPNOTSUPP;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+	ret = fallocate(data->dev, FALLOC_FL_ZERO_RANGE, start, len);
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE) && \
+	defined(FALLOC_FL_KEEP_SIZE)
+	if (ret < 0)
+		ret = fallocate(data->dev,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				start, len);
+#endif
+	if (ret < 0) {
+		if (errno == EOPNOTSUPP) {
+			channel->flags |= CHANNEL_FLAGS_NOZEROOUT;
+			return EXT2_ET_UNIMPLEMENTED;
+		}
+		return errno;
+	}
+	return 0;
+}
+
+static errcode_t uring_cache_readahead(io_channel channel,
+				       unsigned long long block,
+				       unsigned long long count)
+{
+#ifdef POSIX_FADV_WILLNEED
+	struct uring_private_data *data;
+
+	data = (struct uring_private_data *)channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+	return posix_fadvise(data->dev,
+			     (ext2_loff_t)block * channel->block_size + data->offset,
+			     (ext2_loff_t)count * channel->block_size,
+			     POSIX_FADV_WILLNEED);
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Queue as many whole requests as fit in the ring and submit them with
+ * one io_uring_enter() call.  Requests which need the O_DIRECT bounce
+ * buffer, or which are too large to share the ring, are handled on
+ * their own.  If a batch fails, its requests are redone one at a time so
+ * that the read or write error handler sees each failure.
+ */
+static errcode_t uring_blkv(io_channel channel, int write,
+			    struct io_blk_req *reqs, int nr,
+			    io_blk_req_done done, void *priv_data)
+{
+	struct uring_private_data *data;
+	struct io_blk_req *req;
+	ext2_loff_t	location;
+	size_t		size, len, actual;
+	unsigned int	nops, need;
+	errcode_t	retval;
+	char		*buf;
+	int		i, j, k;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr; i = j) {
+		nops = 0;
+		retval = 0;
+		uring_lock(data);
+		for (j = i; j < nr; j++) {
+			req = &reqs[j];
+			if (req->count == 0 || (req->count < 0 && !write))
+				break;
+			size = (req->count < 0) ? (size_t) -req->count :
+				(size_t) req->count * channel->block_size;
+			location = ((ext2_loff_t) req->block *
+				    channel->block_size) + data->offset;
+			if (channel->align &&
+			    (!IS_ALIGNED(req->buf, channel->align) ||
+			     !IS_ALIGNED(location, channel->align) ||
+			     !IS_ALIGNED(size, channel->align)))
+				break;
+			need = (size + URING_CHUNK_SIZE - 1) / URING_CHUNK_SIZE;
+			if (nops + need > data->queue_depth)
+				break;
+			for (buf = req->buf; size; size -= len) {
+				len = size > URING_CHUNK_SIZE ?
+					URING_CHUNK_SIZE : size;
+				data->ops[nops].iov.iov_base = buf;
+				data->ops[nops].iov.iov_len = len;
+				data->ops[nops].offset = location;
+				nops++;
+				buf += len;
+				location += len;
+			}
+		}
+		if (nops) {
+			actual = 0;
+			retval = uring_submit_ops(data, write, 0, nops,
+						  &actual);
+		}
+		uring_unlock(data);
+
+		if (j == i)
+			j = i + 1;
+		for (k = i; k < j; k++) {
+			req = &reqs[k];
+			if ((retval || !nops) && write)
+				req->error = uring_write_blk64(channel,
+						req->block, req->count,
+						req->buf);
+			else if (retval || !nops)
+				req->error = uring_read_blk64(channel,
+						req->block, req->count,
+						req->buf);
+			else
+				req->error = 0;
+			if (done)
+				(done)(channel, req, priv_data);
+		}
+	}
+	return 0;
+}
+
+static errcode_t uring_read_blkv(io_channel channel, struct io_blk_req *reqs,
+				 int nr, io_blk_req_done done, void *priv_data)
+{
+	return uring_blkv(channel, 0, reqs, nr, done, priv_data);
+}
+
+static errcode_t uring_write_blkv(io_channel channel, struct io_blk_req *reqs,
+				  int nr, io_blk_req_done done,
+				  void *priv_data)
+{
+	return uring_blkv(channel, 1, reqs, nr, done, priv_data);
+}
+
+static struct struct_io_manager struct_uring_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "io_uring I/O Manager",
+	.open		= uring_open,
+	.close		= uring_close,
+	.set_blksize	= uring_set_blksize,
+	.read_blk	= uring_read_blk,
+	.write_blk	= uring_write_blk,
+	.flush		= uring_flush,
+	.write_byte	= uring_write_byte,
+	.set_option	= uring_set_option,
+	.get_stats	= uring_get_stats,
+	.read_blk64	= uring_read_blk64,
+	.write_blk64	= uring_write_blk64,
+	.discard	= uring_discard,
+	.cache_readahead	= uring_cache_readahead,
+	.zeroout	= uring_zeroout,
+	.read_blkv	= uring_read_blkv,
+	.write_blkv	= uring_write_blkv,
+};
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+static errcode_t uring_open(const char *name EXT2FS_ATTR((unused)),
+			    int flags EXT2FS_ATTR((unused)),
+			    io_channel *channel EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+static errcode_t uring_close(io_channel channel EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+static struct struct_io_manager struct_uring_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "io_uring I/O Manager",
+	.open		= uring_open,
+	.close		= uring_close,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
+io_manager uring_io_manager = &struct_uring_manager;
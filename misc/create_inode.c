@@ -34,11 +34,15 @@
 #include <linux/fsverity.h>
 #include <linux/fs.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
 #include "ext2fs/ext2_types.h"
 #include "ext2fs/fiemap.h"
+#include "ext2fs/ext3_extents.h"
 
 #include "create_inode.h"
 #include "support/nls-enable.h"
@@ -49,6 +53,7 @@
 #define COPY_FILE_BUFLEN	65536
 
 int link_append_flag = EXT2FS_LINK_EXPAND;
+int populate_fs_threads = 1;
 
 #define COPY_FLAGS_MASK	(EXT2_SECRM_FL | EXT2_UNRM_FL | EXT2_COMPR_FL | \
 			 EXT2_SYNC_FL | EXT2_IMMUTABLE_FL | EXT2_APPEND_FL | \
@@ -415,20 +420,19 @@ static ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
 #endif /* !defined HAVE_PREAD64 && !defined HAVE_PREAD */
 
 static errcode_t write_all(ext2_file_t e2_file, __u64 off, const char *buf, unsigned int n_bytes) {
-	errcode_t err = ext2fs_file_llseek(e2_file, off, EXT2_SEEK_SET, NULL);
-	if (err)
-		return err;
+	errcode_t err;
 
 	const char *ptr = buf;
 	while (n_bytes) {
 		unsigned int written;
-		err = ext2fs_file_write(e2_file, ptr, n_bytes, &written);
+		err = ext2fs_file_pwrite(e2_file, ptr, n_bytes, off, &written);
 		if (err)
 			return err;
 		if (written == 0)
 			return EIO;
 		n_bytes -= written;
 		ptr += written;
+		off += written;
 	}
 
 	return 0;
@@ -438,9 +442,8 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 				 off_t start, off_t end, char *buf,
 				 char *zerobuf)
 {
-	off_t off, bpos;
+	off_t off, bpos, rpos;
 	ssize_t got, blen;
-	char *ptr;
 	errcode_t err = 0;
 
 	for (off = start; off < end; off += COPY_FILE_BUFLEN) {
@@ -455,18 +458,23 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 			err = errno;
 			goto fail;
 		}
-		for (bpos = 0, ptr = buf; bpos < got; bpos += fs->blocksize) {
-			blen = fs->blocksize;
-			if (blen > got - bpos)
-				blen = got - bpos;
-			if (memcmp(ptr, zerobuf, blen) == 0) {
-				ptr += blen;
+		/* Write each run of non-zero blocks in one go */
+		for (bpos = 0; bpos < got; bpos = rpos) {
+			for (rpos = bpos; rpos < got; rpos += blen) {
+				blen = fs->blocksize;
+				if (blen > got - rpos)
+					blen = got - rpos;
+				if (memcmp(buf + rpos, zerobuf, blen) == 0)
+					break;
+			}
+			if (rpos == bpos) {
+				rpos += blen;
 				continue;
 			}
-			err = write_all(e2_file, off + bpos, ptr, blen);
+			err = write_all(e2_file, off + bpos, buf + bpos,
+					rpos - bpos);
 			if (err)
 				goto fail;
-			ptr += blen;
 		}
 	}
 fail:
@@ -705,6 +713,659 @@ static errcode_t copy_fs_verity(ext2_filsys fs, int fd,
 }
 #endif
 
+/* Block allocation state for the file being copied */
+struct copy_file_map {
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	last;		/* last extent added */
+	int			have_last;
+	blk64_t			goal;
+};
+
+/*
+ * Map lblk..lblk+len-1 to pblk, growing the last extent of the file if
+ * the new blocks follow on from it.
+ */
+static errcode_t add_extent(struct copy_file_map *map, blk64_t lblk,
+			    blk64_t pblk, blk64_t len)
+{
+	struct ext2fs_extent	*last = &map->last;
+	struct ext2fs_extent	extent;
+	blk64_t			n;
+	errcode_t		err;
+
+	while (len) {
+		if (map->have_last && last->e_len < EXT_INIT_MAX_LEN &&
+		    last->e_lblk + last->e_len == lblk &&
+		    last->e_pblk + last->e_len == pblk) {
+			n = EXT_INIT_MAX_LEN - last->e_len;
+			if (n > len)
+				n = len;
+			err = ext2fs_extent_goto(map->handle, last->e_lblk);
+			if (err)
+				return err;
+			last->e_len += n;
+			err = ext2fs_extent_replace(map->handle, 0, last);
+		} else {
+			n = len > EXT_INIT_MAX_LEN ? EXT_INIT_MAX_LEN : len;
+			extent.e_lblk = lblk;
+			extent.e_pblk = pblk;
+			extent.e_len = n;
+			extent.e_flags = 0;
+			if (map->have_last) {
+				err = ext2fs_extent_goto(map->handle,
+							 last->e_lblk);
+				if (err)
+					return err;
+			}
+			err = ext2fs_extent_insert(map->handle,
+					map->have_last ?
+					EXT2_EXTENT_INSERT_AFTER : 0, &extent);
+			*last = extent;
+			map->have_last = 1;
+		}
+		if (!err)
+			err = ext2fs_extent_fix_parents(map->handle);
+		if (err)
+			return err;
+		lblk += n;
+		pblk += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static errcode_t open_file_map(ext2_filsys fs, ext2_ino_t ino,
+			       struct copy_file_map *map)
+{
+	errcode_t	retval;
+
+	memset(map, 0, sizeof(*map));
+	map->ino = ino;
+	retval = ext2fs_read_inode(fs, ino, &map->inode);
+	if (retval)
+		return retval;
+	retval = ext2fs_extent_open2(fs, ino, &map->inode, &map->handle);
+	if (retval)
+		return retval;
+	map->goal = ext2fs_find_inode_goal(fs, ino, &map->inode, 0);
+	return 0;
+}
+
+static errcode_t close_file_map(ext2_filsys fs, struct copy_file_map *map)
+{
+	ext2fs_extent_free(map->handle);
+	return ext2fs_write_inode(fs, map->ino, &map->inode);
+}
+
+/*
+ * Allocate blocks for logical blocks lblk..lblk+len-1 of the file, as a
+ * single run starting at the current goal if possible.  The first
+ * physical block and the number of blocks actually mapped (which may
+ * be less than len) are returned in pblk and plen.
+ */
+static errcode_t alloc_file_blocks(ext2_filsys fs, struct copy_file_map *map,
+				   blk64_t lblk, blk64_t len,
+				   blk64_t *pblk, blk64_t *plen)
+{
+	errcode_t	err;
+
+	err = ext2fs_new_range(fs, 0, map->goal, len, NULL, pblk, plen);
+	if (err)
+		return err;
+	if (*plen > len)
+		*plen = len;
+	ext2fs_block_alloc_stats_range(fs, *pblk, *plen, +1);
+	err = ext2fs_iblk_add_blocks(fs, &map->inode, *plen);
+	if (!err)
+		err = add_extent(map, lblk, *pblk, *plen);
+	if (err)
+		return err;
+	map->goal = *pblk + *plen;
+	return 0;
+}
+
+/*
+ * With POPULATE_FS_COPY_FILE_RANGE, the blocks for each region of data
+ * in a file are allocated up front, and the data is then moved straight
+ * from the source file into the image with io_channel_copy_file_range(),
+ * which can reflink it or let the host file system copy it.  Since the
+ * data is never looked at, blocks of zeroes inside a data region are
+ * allocated rather than left as holes.
+ */
+static int use_copy_file_range;
+static int copy_file_range_failed;
+
+static errcode_t copy_blocks_slow(ext2_filsys fs, int fd, off_t size,
+				  blk64_t pblk, blk64_t lblk, blk64_t count,
+				  char **buf)
+{
+	unsigned int	max = COPY_FILE_BUFLEN / fs->blocksize, n;
+	off_t		off = lblk * fs->blocksize;
+	ssize_t		want, got;
+	errcode_t	err;
+
+	if (!*buf) {
+		err = ext2fs_get_mem(COPY_FILE_BUFLEN, buf);
+		if (err)
+			return err;
+	}
+	while (count) {
+		n = count > max ? max : count;
+		want = (ssize_t) n * fs->blocksize;
+		if (want > size - off)
+			want = size - off;
+#ifdef HAVE_PREAD64
+		got = pread64(fd, *buf, want, off);
+#elif HAVE_PREAD
+		got = pread(fd, *buf, want, off);
+#else
+		got = my_pread(fd, *buf, want, off);
+#endif
+		if (got < 0)
+			return errno;
+		memset(*buf + got, 0, (size_t) n * fs->blocksize - got);
+		err = io_channel_write_blk64(fs->io, pblk, n, *buf);
+		if (err)
+			return err;
+		pblk += n;
+		off += (off_t) n * fs->blocksize;
+		count -= n;
+	}
+	return 0;
+}
+
+static errcode_t copy_blocks(ext2_filsys fs, int fd, off_t size,
+			     blk64_t pblk, blk64_t lblk, blk64_t count,
+			     char **buf)
+{
+	blk64_t		whole = count;
+	errcode_t	err;
+
+	/* A partial last block has to be padded with zeroes */
+	if ((lblk + count) * fs->blocksize > (blk64_t) size)
+		whole--;
+	if (whole && !copy_file_range_failed) {
+		err = io_channel_copy_file_range(fs->io, pblk, fd,
+						 lblk * fs->blocksize, whole);
+		if (err == EXT2_ET_UNIMPLEMENTED) {
+			/* Don't keep trying for every file */
+			copy_file_range_failed = 1;
+		} else if (err) {
+			return err;
+		} else {
+			pblk += whole;
+			lblk += whole;
+			count -= whole;
+		}
+	}
+	if (!count)
+		return 0;
+	return copy_blocks_slow(fs, fd, size, pblk, lblk, count, buf);
+}
+
+static errcode_t copy_file_range_fast(ext2_filsys fs, int fd,
+				      struct stat *statbuf, ext2_ino_t ino)
+{
+	struct copy_file_map map;
+	blk64_t		lblk, end, done = 0, pblk, plen;
+	off_t		data = 0, hole, size = statbuf->st_size;
+	char		*buf = NULL;
+	errcode_t	err, retval;
+
+	retval = open_file_map(fs, ino, &map);
+	if (retval)
+		return retval;
+
+	while (data < size) {
+		hole = size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		data = lseek(fd, data, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			/* No hole information, so copy all of it */
+			data = done * fs->blocksize;
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > size)
+				hole = size;
+		}
+#endif
+		lblk = data / fs->blocksize;
+		if (lblk < done)
+			lblk = done;
+		end = (hole + fs->blocksize - 1) / fs->blocksize;
+		while (lblk < end) {
+			retval = alloc_file_blocks(fs, &map, lblk, end - lblk,
+						   &pblk, &plen);
+			if (!retval)
+				retval = copy_blocks(fs, fd, size, pblk, lblk,
+						     plen, &buf);
+			if (retval)
+				goto out;
+			lblk += plen;
+		}
+		done = end;
+		data = end * fs->blocksize;
+	}
+out:
+	ext2fs_free_mem(&buf);
+	err = close_file_map(fs, &map);
+	if (!retval)
+		retval = err;
+	return retval;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * When populating a large file system, reading the source files and
+ * writing their data into the image is done by a pool of threads.  The
+ * directory walk, inode creation and block allocation all stay on the
+ * calling thread, in the same order as before, so that the resulting
+ * image is laid out the same way however many threads are used.
+ *
+ * Each regular file is read in chunks by the threads, which also note
+ * which of its blocks are all zeroes.  The calling thread takes the
+ * chunks back in file order, and map_chunk() allocates blocks for the
+ * non-zero runs with ext2fs_new_range(), starting each run at the end
+ * of the previous one so that they stay contiguous, and adds them to
+ * the file's extent tree.  The chunk is then handed back to the
+ * threads, which write it to the allocated blocks through the
+ * (thread-safe) io channel, while the calling thread moves on to the
+ * next chunk or file.
+ */
+#define COPY_CHUNK_LEN		(1024 * 1024)
+#define COPY_MAX_CHUNKS		64
+
+#define CHUNK_READ		1	/* waiting to be read */
+#define CHUNK_READY		2	/* read, waiting for allocation */
+#define CHUNK_WRITE		3	/* allocated, waiting to be written */
+
+struct copy_run {
+	blk64_t		pblk;
+	unsigned int	buf_blk;
+	unsigned int	count;
+};
+
+struct copy_chunk {
+	struct copy_chunk *next;	/* work queue */
+	struct copy_chunk *file_next;	/* chunks of the current file */
+	int		state;
+	int		fd;
+	off_t		off;
+	ssize_t		want;
+	ssize_t		len;
+	errcode_t	err;
+	char		*buf;
+	char		*nonzero;	/* one flag per block */
+	struct copy_run	*runs;
+	unsigned int	num_runs;
+};
+
+struct copy_pipeline {
+	ext2_filsys		fs;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		work_cond;
+	pthread_cond_t		done_cond;
+	struct copy_chunk	*head, *tail;
+	int			in_flight;
+	int			max_chunks;
+	int			shutdown;
+	errcode_t		err;
+	int			num_threads;
+	pthread_t		*threads;
+};
+
+static struct copy_pipeline *copy_pipeline;
+
+static void free_chunk(struct copy_chunk *chunk)
+{
+	ext2fs_free_mem(&chunk->buf);
+	ext2fs_free_mem(&chunk->nonzero);
+	ext2fs_free_mem(&chunk->runs);
+	ext2fs_free_mem(&chunk);
+}
+
+static void read_chunk(ext2_filsys fs, struct copy_chunk *chunk)
+{
+	unsigned int	blk, nblocks;
+	ssize_t		got, blen;
+	char		*ptr;
+
+	chunk->len = 0;
+	while (chunk->len < chunk->want) {
+#ifdef HAVE_PREAD64
+		got = pread64(chunk->fd, chunk->buf + chunk->len,
+			      chunk->want - chunk->len,
+			      chunk->off + chunk->len);
+#elif HAVE_PREAD
+		got = pread(chunk->fd, chunk->buf + chunk->len,
+			    chunk->want - chunk->len,
+			    chunk->off + chunk->len);
+#else
+		got = my_pread(chunk->fd, chunk->buf + chunk->len,
+			       chunk->want - chunk->len,
+			       chunk->off + chunk->len);
+#endif
+		if (got < 0) {
+			chunk->err = errno;
+			return;
+		}
+		if (got == 0)
+			break;
+		chunk->len += got;
+	}
+
+	nblocks = (chunk->len + fs->blocksize - 1) / fs->blocksize;
+	for (blk = 0, ptr = chunk->buf; blk < nblocks;
+	     blk++, ptr += fs->blocksize) {
+		blen = fs->blocksize;
+		if (blen > chunk->len - (ptr - chunk->buf))
+			blen = chunk->len - (ptr - chunk->buf);
+		/* Pad the last block so that whole blocks can be written */
+		if (blen < fs->blocksize)
+			memset(ptr + blen, 0, fs->blocksize - blen);
+		chunk->nonzero[blk] = ptr[0] ||
+			memcmp(ptr, ptr + 1, blen - 1) != 0;
+	}
+}
+
+static errcode_t write_chunk(ext2_filsys fs, struct copy_chunk *chunk)
+{
+	struct copy_run	*run;
+	unsigned int	i;
+	errcode_t	err;
+
+	for (i = 0, run = chunk->runs; i < chunk->num_runs; i++, run++) {
+		err = io_channel_write_blk64(fs->io, run->pblk, run->count,
+					     chunk->buf +
+					     run->buf_blk * fs->blocksize);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static void *copy_thread_func(void *arg)
+{
+	struct copy_pipeline	*p = arg;
+	struct copy_chunk	*chunk;
+	errcode_t		err;
+
+	pthread_mutex_lock(&p->mutex);
+	while (1) {
+		while (!p->head && !p->shutdown)
+			pthread_cond_wait(&p->work_cond, &p->mutex);
+		chunk = p->head;
+		if (!chunk)
+			break;
+		p->head = chunk->next;
+		if (!p->head)
+			p->tail = NULL;
+		pthread_mutex_unlock(&p->mutex);
+
+		if (chunk->state == CHUNK_READ) {
+			read_chunk(p->fs, chunk);
+			pthread_mutex_lock(&p->mutex);
+			chunk->state = CHUNK_READY;
+		} else {
+			err = write_chunk(p->fs, chunk);
+			free_chunk(chunk);
+			pthread_mutex_lock(&p->mutex);
+			if (err && !p->err)
+				p->err = err;
+			p->in_flight--;
+		}
+		pthread_cond_broadcast(&p->done_cond);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+/* Called with the pipeline mutex held */
+static void queue_chunk(struct copy_pipeline *p, struct copy_chunk *chunk,
+			int state)
+{
+	chunk->state = state;
+	chunk->next = NULL;
+	if (p->tail)
+		p->tail->next = chunk;
+	else
+		p->head = chunk;
+	p->tail = chunk;
+	pthread_cond_signal(&p->work_cond);
+}
+
+static errcode_t start_copy_pipeline(ext2_filsys fs, int num_threads)
+{
+	struct copy_pipeline	*p;
+	errcode_t		retval;
+	const char		*tmp;
+	int			i;
+
+	retval = ext2fs_get_memzero(sizeof(*p), &p);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(num_threads, sizeof(pthread_t),
+				  &p->threads);
+	if (retval) {
+		ext2fs_free_mem(&p);
+		return retval;
+	}
+	p->fs = fs;
+	p->max_chunks = COPY_MAX_CHUNKS;
+	/* The test suite makes the queue small enough to fill up */
+	tmp = getenv("E2FSPROGS_COPY_MAX_CHUNKS");
+	if (tmp && atoi(tmp) > 0)
+		p->max_chunks = atoi(tmp);
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->work_cond, NULL);
+	pthread_cond_init(&p->done_cond, NULL);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&p->threads[i], NULL, copy_thread_func, p))
+			break;
+	}
+	p->num_threads = i;
+	if (!p->num_threads) {
+		/* Just copy the data the old way */
+		pthread_cond_destroy(&p->done_cond);
+		pthread_cond_destroy(&p->work_cond);
+		pthread_mutex_destroy(&p->mutex);
+		ext2fs_free_mem(&p->threads);
+		ext2fs_free_mem(&p);
+		return 0;
+	}
+	copy_pipeline = p;
+	return 0;
+}
+
+/*
+ * Wait for the outstanding writes, stop the threads and return the
+ * first write error, if any.
+ */
+static errcode_t stop_copy_pipeline(void)
+{
+	struct copy_pipeline	*p = copy_pipeline;
+	errcode_t		retval;
+	int			i;
+
+	if (!p)
+		return 0;
+	pthread_mutex_lock(&p->mutex);
+	while (p->in_flight)
+		pthread_cond_wait(&p->done_cond, &p->mutex);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->work_cond);
+	pthread_mutex_unlock(&p->mutex);
+	for (i = 0; i < p->num_threads; i++)
+		pthread_join(p->threads[i], NULL);
+	pthread_cond_destroy(&p->done_cond);
+	pthread_cond_destroy(&p->work_cond);
+	pthread_mutex_destroy(&p->mutex);
+	retval = p->err;
+	ext2fs_free_mem(&p->threads);
+	ext2fs_free_mem(&p);
+	copy_pipeline = NULL;
+	return retval;
+}
+
+/*
+ * Allocate blocks for the non-zero runs in a chunk, and work out where
+ * in the file system each piece of the chunk has to be written.
+ */
+static errcode_t map_chunk(ext2_filsys fs, struct copy_file_map *map,
+			   struct copy_chunk *chunk)
+{
+	struct copy_run	*run;
+	blk64_t		lblk, pblk, plen, len;
+	unsigned int	i, j, nblocks;
+	errcode_t	err;
+
+	nblocks = (chunk->len + fs->blocksize - 1) / fs->blocksize;
+	lblk = chunk->off / fs->blocksize;
+	for (i = 0; i < nblocks; i = j) {
+		if (!chunk->nonzero[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < nblocks && chunk->nonzero[j]; j++)
+			;
+		len = j - i;
+		while (len) {
+			err = alloc_file_blocks(fs, map, lblk + j - len, len,
+						&pblk, &plen);
+			if (err)
+				return err;
+			run = &chunk->runs[chunk->num_runs++];
+			run->pblk = pblk;
+			run->buf_blk = j - len;
+			run->count = plen;
+			len -= plen;
+		}
+	}
+	return 0;
+}
+
+static errcode_t copy_file_threaded(ext2_filsys fs, int fd,
+				    struct stat *statbuf, ext2_ino_t ino)
+{
+	struct copy_pipeline	*p = copy_pipeline;
+	struct copy_chunk	*chunk, *first = NULL, *last = NULL;
+	struct copy_file_map	map;
+	unsigned int		nblocks = COPY_CHUNK_LEN / fs->blocksize;
+	off_t			off = 0;
+	errcode_t		err, retval = 0;
+
+	pthread_mutex_lock(&p->mutex);
+	retval = p->err;
+	pthread_mutex_unlock(&p->mutex);
+	if (retval)
+		return retval;
+
+	retval = open_file_map(fs, ino, &map);
+	if (retval)
+		return retval;
+
+	while (!retval && (off < statbuf->st_size || first)) {
+		/* Keep the threads busy reading ahead in this file */
+		pthread_mutex_lock(&p->mutex);
+		while (off < statbuf->st_size &&
+		       p->in_flight < p->max_chunks) {
+			pthread_mutex_unlock(&p->mutex);
+			chunk = NULL;
+			err = ext2fs_get_memzero(sizeof(*chunk), &chunk);
+			if (!err)
+				err = ext2fs_get_mem(COPY_CHUNK_LEN, &chunk->buf);
+			if (!err)
+				err = ext2fs_get_array(nblocks, 1,
+						       &chunk->nonzero);
+			if (!err)
+				err = ext2fs_get_array(nblocks,
+						       sizeof(struct copy_run),
+						       &chunk->runs);
+			pthread_mutex_lock(&p->mutex);
+			if (err) {
+				if (chunk)
+					free_chunk(chunk);
+				retval = err;
+				break;
+			}
+			chunk->fd = fd;
+			chunk->off = off;
+			chunk->want = COPY_CHUNK_LEN;
+			if (chunk->want > statbuf->st_size - off)
+				chunk->want = statbuf->st_size - off;
+			off += chunk->want;
+			if (last)
+				last->file_next = chunk;
+			else
+				first = chunk;
+			last = chunk;
+			p->in_flight++;
+			queue_chunk(p, chunk, CHUNK_READ);
+		}
+		if (!first) {
+			if (retval || off >= statbuf->st_size) {
+				pthread_mutex_unlock(&p->mutex);
+				break;
+			}
+			/* Every slot is taken by a write; wait for one */
+			while (p->in_flight >= p->max_chunks)
+				pthread_cond_wait(&p->done_cond, &p->mutex);
+			pthread_mutex_unlock(&p->mutex);
+			continue;
+		}
+		/* Take the chunks back in file order */
+		chunk = first;
+		while (chunk->state != CHUNK_READY)
+			pthread_cond_wait(&p->done_cond, &p->mutex);
+		first = chunk->file_next;
+		if (!first)
+			last = NULL;
+		if (!retval && chunk->err)
+			retval = chunk->err;
+		if (retval || chunk->len == 0) {
+			p->in_flight--;
+			pthread_mutex_unlock(&p->mutex);
+			free_chunk(chunk);
+			if (!retval)
+				off = statbuf->st_size;	/* file shrank */
+			continue;
+		}
+		pthread_mutex_unlock(&p->mutex);
+
+		retval = map_chunk(fs, &map, chunk);
+
+		pthread_mutex_lock(&p->mutex);
+		if (retval || !chunk->num_runs) {
+			p->in_flight--;
+			free_chunk(chunk);
+		} else
+			queue_chunk(p, chunk, CHUNK_WRITE);
+		pthread_mutex_unlock(&p->mutex);
+	}
+
+	/* The threads must be done with fd before the caller closes it */
+	pthread_mutex_lock(&p->mutex);
+	while (first) {
+		chunk = first;
+		while (chunk->state != CHUNK_READY)
+			pthread_cond_wait(&p->done_cond, &p->mutex);
+		first = chunk->file_next;
+		p->in_flight--;
+		free_chunk(chunk);
+	}
+	pthread_mutex_unlock(&p->mutex);
+
+	err = close_file_map(fs, &map);
+	if (!retval)
+		retval = err;
+	return retval;
+}
+#endif /* HAVE_PTHREAD */
+
 static errcode_t copy_file(ext2_filsys fs, int fd, struct stat *statbuf,
 			   unsigned long flags, ext2_ino_t ino)
 {
@@ -712,6 +1373,15 @@ static errcode_t copy_file(ext2_filsys fs, int fd, struct stat *statbuf,
 	char *buf = NULL, *zerobuf = NULL;
 	errcode_t err, close_err;
 
+	if (use_copy_file_range && statbuf->st_size &&
+	    !(flags & EXT4_VERITY_FL))
+		return copy_file_range_fast(fs, fd, statbuf, ino);
+#ifdef HAVE_PTHREAD
+	if (copy_pipeline && statbuf->st_size >= COPY_CHUNK_LEN &&
+	    !(flags & EXT4_VERITY_FL))
+		return copy_file_threaded(fs, fd, statbuf, ino);
+#endif
+
 	err = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &e2_file);
 	if (err)
 		return err;
@@ -1248,13 +1918,56 @@ errcode_t populate_fs3(ext2_filsys fs, ext2_ino_t parent_ino,
 		}
 	}
 
+	if ((flags & POPULATE_FS_COPY_FILE_RANGE) &&
+	    fs->io->manager->copy_file_range &&
+	    ext2fs_has_feature_extents(fs->super) &&
+	    !ext2fs_has_feature_inline_data(fs->super) &&
+	    !ext2fs_has_feature_bigalloc(fs->super) &&
+	    !(fs->flags & EXT2_FLAG_SHARE_DUP))
+		use_copy_file_range = 1;
+
+#ifdef HAVE_PTHREAD
+	/*
+	 * The data is written through fs->io from several threads, which
+	 * is only safe if it was opened with IO_FLAG_THREADS.
+	 */
+	if (populate_fs_threads > 1 && (fs->flags & EXT2_FLAG_THREADS) &&
+	    fs->io->manager == unix_io_manager &&
+	    ext2fs_has_feature_extents(fs->super) &&
+	    !ext2fs_has_feature_inline_data(fs->super) &&
+	    !ext2fs_has_feature_bigalloc(fs->super) &&
+	    !(fs->flags & EXT2_FLAG_SHARE_DUP)) {
+		retval = start_copy_pipeline(fs, populate_fs_threads);
+		if (retval) {
+			com_err(__func__, retval,
+				_("while starting file copy threads"));
+			goto out;
+		}
+	}
+#endif
+
 	retval = __populate_fs(fs, parent_ino, source, root, &hdlinks,
 			       &file_info, flags, fs_callbacks);
 
+#ifdef HAVE_PTHREAD
+	{
+		errcode_t err = stop_copy_pipeline();
+
+		if (err) {
+			com_err(__func__, err,
+				_("while writing file data"));
+			if (!retval)
+				retval = err;
+		}
+	}
+#endif
+
 out:
 	free(file_info.path);
 	free(hdlinks.hdl);
 	link_append_flag = EXT2FS_LINK_EXPAND;
+	use_copy_file_range = 0;
+	copy_file_range_failed = 0;
 	return retval;
 }
 
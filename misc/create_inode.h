@@ -33,6 +33,7 @@ struct file_info {
 /* flags for populate_fs3 */
 #define POPULATE_FS_NO_COPY_XATTRS	0x0001
 #define POPULATE_FS_LINK_APPEND		0x0002
+#define POPULATE_FS_COPY_FILE_RANGE	0x0004
 
 struct fs_ops_callbacks {
 	errcode_t (* create_new_inode)(ext2_filsys fs, const char *target_path,
@@ -43,6 +44,13 @@ struct fs_ops_callbacks {
 		ext2_ino_t parent_ino, ext2_ino_t root, mode_t mode);
 };
 
+/*
+ * Number of threads used by populate_fs3() to copy file data; the file
+ * system must have been opened with EXT2_FLAG_THREADS for more than one
+ * to be used.
+ */
+extern int populate_fs_threads;
+
 /* For populating the filesystem */
 extern errcode_t populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			     const char *source_dir, ext2_ino_t root);
@@ -308,10 +308,9 @@ static errcode_t copy_file_chunk_tar(ext2_filsys fs, struct archive *archive,
 				     ext2_file_t e2_file, off_t start,
 				     off_t end, char *buf, char *zerobuf)
 {
-	off_t off, bpos;
+	off_t off, bpos, rpos;
 	ssize_t got, blen;
 	unsigned int written;
-	char *ptr;
 	errcode_t err = 0;
 
 	for (off = start; off < end; off += COPY_FILE_BUFLEN) {
@@ -320,29 +319,27 @@ static errcode_t copy_file_chunk_tar(ext2_filsys fs, struct archive *archive,
 			err = errno;
 			goto fail;
 		}
-		for (bpos = 0, ptr = buf; bpos < got; bpos += fs->blocksize) {
-			blen = fs->blocksize;
-			if (blen > got - bpos)
-				blen = got - bpos;
-			if (memcmp(ptr, zerobuf, blen) == 0) {
-				ptr += blen;
+		/* Write each run of non-zero blocks in one go */
+		for (bpos = 0; bpos < got; bpos = rpos) {
+			for (rpos = bpos; rpos < got; rpos += blen) {
+				blen = fs->blocksize;
+				if (blen > got - rpos)
+					blen = got - rpos;
+				if (memcmp(buf + rpos, zerobuf, blen) == 0)
+					break;
+			}
+			if (rpos == bpos) {
+				rpos += blen;
 				continue;
 			}
-			err = ext2fs_file_llseek(e2_file, off + bpos,
-						 EXT2_SEEK_SET, NULL);
+			err = ext2fs_file_pwrite(e2_file, buf + bpos,
+						 rpos - bpos, off + bpos,
+						 &written);
 			if (err)
 				goto fail;
-			while (blen > 0) {
-				err = ext2fs_file_write(e2_file, ptr, blen,
-							&written);
-				if (err)
-					goto fail;
-				if (written == 0) {
-					err = EIO;
-					goto fail;
-				}
-				blen -= written;
-				ptr += written;
+			if ((off_t) written != rpos - bpos) {
+				err = EIO;
+				goto fail;
 			}
 		}
 	}
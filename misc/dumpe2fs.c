@@ -38,6 +38,7 @@ extern int optind;
 #include "ext2fs/ext2fs.h"
 #include "e2p/e2p.h"
 #include "ext2fs/kernel-jbd.h"
+#include "ext2fs/cimage.h"
 #include <uuid/uuid.h>
 
 #include "support/devname.h"
@@ -89,7 +90,13 @@ static void print_free(unsigned long group, char * bitmap,
 
 	offset /= ratio;
 	offset += group * num;
-	for (i = 0; i < num; i++)
+	for (i = 0; i < num; i++) {
+		/* Step over fully allocated bytes without testing each bit */
+		if (!(i & 7) && i + 8 <= num &&
+		    ((unsigned char *) bitmap)[i >> 3] == 0xff) {
+			i += 7;
+			continue;
+		}
 		if (!in_use (bitmap, i))
 		{
 			if (p)
@@ -105,6 +112,7 @@ static void print_free(unsigned long group, char * bitmap,
 			i = j;
 			p = 1;
 		}
+	}
 }
 
 static void print_bg_opt(int bg_flags, int mask,
@@ -590,6 +598,7 @@ int main (int argc, char ** argv)
 	errcode_t	retval_csum = 0;
 	const char	*error_csum = NULL;
 	ext2_filsys	fs;
+	io_manager	io_ptr = unix_io_manager;
 	int		print_badblocks = 0;
 	blk64_t		use_superblock = 0;
 	int		use_blocksize = 0;
@@ -688,6 +697,8 @@ int main (int argc, char ** argv)
 		flags |= EXT2_FLAG_IMAGE_FILE;
 	if (header_only)
 		flags |= EXT2_FLAG_SUPER_ONLY;
+	if (ext2fs_cimage_probe(device_name))
+		io_ptr = cimage_io_manager;
 try_open_again:
 	if (use_superblock && !use_blocksize) {
 		for (use_blocksize = EXT2_MIN_BLOCK_SIZE;
@@ -695,14 +706,14 @@ try_open_again:
 		     use_blocksize *= 2) {
 			retval = ext2fs_open (device_name, flags,
 					      use_superblock,
-					      use_blocksize, unix_io_manager,
+					      use_blocksize, io_ptr,
 					      &fs);
 			if (!retval)
 				break;
 		}
 	} else {
 		retval = ext2fs_open(device_name, flags, use_superblock,
-				     use_blocksize, unix_io_manager, &fs);
+				     use_blocksize, io_ptr, &fs);
 	}
 	flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
 	if (retval && !retval_csum) {
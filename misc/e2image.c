@@ -40,6 +40,9 @@ extern int optind;
 #include <sys/types.h>
 #include <assert.h>
 #include <signal.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
@@ -49,6 +52,7 @@ extern int optind;
 #include "e2p/e2p.h"
 #include "ext2fs/e2image.h"
 #include "ext2fs/qcow2.h"
+#include "ext2fs/cimage.h"
 
 #include "support/nls-enable.h"
 #include "support/plausible.h"
@@ -61,6 +65,7 @@ extern int optind;
 /* Image types */
 #define E2IMAGE_RAW	1
 #define E2IMAGE_QCOW2	2
+#define E2IMAGE_CIMAGE	4
 
 /* Image flags */
 #define E2IMAGE_INSTALL_FLAG	1
@@ -79,6 +84,11 @@ static char move_mode;
 static char show_progress;
 static char *check_buf;
 static int skipped_blocks;
+static int num_threads = 1;	/* -j */
+static int cimage_codec = -1;	/* -z */
+static char *cimage_base;	/* -d */
+static struct ext2_cimage_hdr cimage_base_hdr;
+static char cimage_base_name[EXT2_CIMAGE_BASE_NAME_LEN];
 
 static blk64_t align_offset(blk64_t offset, unsigned int n)
 {
@@ -105,7 +115,8 @@ static int get_bits_from_size(size_t size)
 
 static void usage(void)
 {
-	fprintf(stderr, _("Usage: %s [ -r|-Q ] [ -f ] [ -b superblock ] [ -B blocksize ] "
+	fprintf(stderr, _("Usage: %s [ -r|-Q|-Z ] [ -f ] [ -b superblock ] [ -B blocksize ] "
+			  "[ -j threads ] [ -z codec ] [ -d base_image ] "
 			  "device image-file\n"),
 		program_name);
 	fprintf(stderr, _("       %s -I device image-file\n"), program_name);
@@ -579,6 +590,272 @@ static int print_progress(blk64_t num, blk64_t total)
 		       calc_percent(num, total));
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * Reading metadata blocks ahead with worker threads (-j).
+ *
+ * The raw and QCOW2 writers walk meta_block_map in block order and read
+ * each marked block when they reach it, so a large file system is
+ * copied one small synchronous read at a time.  With -j, a pool of
+ * workers reads the marked blocks just ahead of the writer into a ring
+ * of buffers, each through its own io_channel, and read_meta_block()
+ * hands them back in order; the output is written by the main thread
+ * exactly as before.  Only the main thread looks at meta_block_map, and
+ * it publishes the blocks which fit in the ring as it goes.  Anything a
+ * worker failed to read is read again the usual way, so read errors
+ * are reported just as they would be without threads.
+ */
+#define META_PREFETCH_RUN	32	/* blocks a worker reads at once */
+
+enum meta_slot_state {
+	META_SLOT_EMPTY,
+	META_SLOT_READING,
+	META_SLOT_READY,
+};
+
+struct meta_slot {
+	unsigned long long	idx;
+	blk64_t			blk;
+	enum meta_slot_state	state;
+	errcode_t		err;
+	char			*buf;
+};
+
+struct meta_prefetch {
+	ext2_filsys		fs;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		work_cond;	/* workers wait here */
+	pthread_cond_t		ready_cond;	/* the writer waits here */
+	int			idle;	/* workers waiting for work */
+	int			waiting; /* the writer is waiting */
+	unsigned long long	seq;	/* next block to be handed out */
+	unsigned long long	next;	/* next block to be read */
+	unsigned long long	filled;	/* blocks published in want[] */
+	blk64_t			scan;	/* where to look for the next one */
+	int			done;	/* all marked blocks published */
+	int			nslots;
+	struct meta_slot	*slots;
+	blk64_t			*want;
+	int			stop;
+	int			num_threads;
+	pthread_t		*threads;
+};
+
+static struct meta_prefetch *meta_prefetch;
+
+static void *meta_prefetch_thread(void *arg)
+{
+	struct meta_prefetch *pf = arg;
+	ext2_filsys fs = pf->fs;
+	struct io_blk_req reqs[META_PREFETCH_RUN];
+	struct meta_slot *slot;
+	char opt[64];
+	io_channel io;
+	int i, n;
+
+	if (fs->io->manager->open(fs->device_name, 0, &io))
+		return NULL;
+	if (io_channel_set_blksize(io, fs->blocksize))
+		goto out;
+	if (source_offset) {
+		snprintf(opt, sizeof(opt), "offset=%llu",
+			 (unsigned long long) source_offset);
+		if (io_channel_set_options(io, opt))
+			goto out;
+	}
+	io_channel_set_options(io, "cache=off");
+
+	pthread_mutex_lock(&pf->mutex);
+	while (!pf->stop) {
+		if (pf->next >= pf->filled && pf->done)
+			break;
+		for (n = 0; n < META_PREFETCH_RUN && pf->next < pf->filled;
+		     n++) {
+			slot = &pf->slots[pf->next % pf->nslots];
+			if (slot->state != META_SLOT_EMPTY)
+				break;
+			slot->idx = pf->next;
+			slot->blk = pf->want[pf->next % pf->nslots];
+			slot->state = META_SLOT_READING;
+			pf->next++;
+			reqs[n].block = slot->blk;
+			reqs[n].count = 1;
+			reqs[n].buf = slot->buf;
+			reqs[n].error = 0;
+			reqs[n].priv = slot;
+		}
+		if (n == 0) {
+			pf->idle++;
+			pthread_cond_wait(&pf->work_cond, &pf->mutex);
+			pf->idle--;
+			continue;
+		}
+		pthread_mutex_unlock(&pf->mutex);
+
+		(void) io_channel_read_blkv(io, reqs, n, NULL, NULL);
+
+		pthread_mutex_lock(&pf->mutex);
+		for (i = 0; i < n; i++) {
+			slot = reqs[i].priv;
+			slot->err = reqs[i].error;
+			slot->state = META_SLOT_READY;
+		}
+		if (pf->waiting)
+			pthread_cond_signal(&pf->ready_cond);
+	}
+	pthread_mutex_unlock(&pf->mutex);
+out:
+	io_channel_close(io);
+	return NULL;
+}
+
+/* Publish the marked blocks which now fit in the ring */
+static void meta_prefetch_publish(struct meta_prefetch *pf)
+{
+	blk64_t end = ext2fs_blocks_count(pf->fs->super) - 1;
+	blk64_t blk;
+
+	while (!pf->done && pf->filled < pf->seq + pf->nslots) {
+		if (pf->scan > end ||
+		    ext2fs_find_first_set_block_bitmap2(meta_block_map,
+							pf->scan, end, &blk)) {
+			pf->done = 1;
+			break;
+		}
+		pf->want[pf->filled++ % pf->nslots] = blk;
+		pf->scan = blk + 1;
+	}
+}
+
+static void start_meta_prefetch(ext2_filsys fs)
+{
+	struct meta_prefetch *pf;
+	int i;
+
+	if (num_threads <= 1 || move_mode ||
+	    fs->io->manager != unix_io_manager || !fs->device_name)
+		return;
+
+	if (ext2fs_get_memzero(sizeof(*pf), &pf))
+		return;
+	pf->nslots = 2 * META_PREFETCH_RUN * num_threads;
+	if (ext2fs_get_arrayzero(pf->nslots, sizeof(struct meta_slot),
+				 &pf->slots))
+		goto errout;
+	for (i = 0; i < pf->nslots; i++)
+		if (io_channel_alloc_buf(fs->io, 1, &pf->slots[i].buf))
+			goto errout;
+	if (ext2fs_get_array(pf->nslots, sizeof(blk64_t), &pf->want) ||
+	    ext2fs_get_array(num_threads, sizeof(pthread_t), &pf->threads))
+		goto errout;
+
+	pf->fs = fs;
+	pf->scan = fs->super->s_first_data_block;
+	pthread_mutex_init(&pf->mutex, NULL);
+	pthread_cond_init(&pf->work_cond, NULL);
+	pthread_cond_init(&pf->ready_cond, NULL);
+	meta_prefetch_publish(pf);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&pf->threads[i], NULL,
+				   meta_prefetch_thread, pf))
+			break;
+	}
+	pf->num_threads = i;
+	meta_prefetch = pf;
+	return;
+
+errout:
+	if (pf->slots)
+		for (i = 0; i < pf->nslots; i++)
+			if (pf->slots[i].buf)
+				ext2fs_free_mem(&pf->slots[i].buf);
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&pf->want);
+	ext2fs_free_mem(&pf->slots);
+	ext2fs_free_mem(&pf);
+}
+
+/*
+ * Read marked block blk into buf.  The writers must ask for the marked
+ * blocks at or above s_first_data_block in increasing order.
+ */
+static errcode_t read_meta_block(ext2_filsys fs, blk64_t blk, char *buf)
+{
+	struct meta_prefetch *pf = meta_prefetch;
+	struct meta_slot *slot;
+	int hit = 0;
+
+	if (!pf)
+		return io_channel_read_blk64(fs->io, blk, 1, buf);
+
+	pthread_mutex_lock(&pf->mutex);
+	if (pf->filled < pf->seq + pf->nslots / 2)
+		meta_prefetch_publish(pf);
+	slot = &pf->slots[pf->seq % pf->nslots];
+	while (slot->idx == pf->seq && slot->state == META_SLOT_READING) {
+		pf->waiting = 1;
+		pthread_cond_wait(&pf->ready_cond, &pf->mutex);
+		pf->waiting = 0;
+	}
+	if (slot->idx == pf->seq && slot->state == META_SLOT_READY) {
+		if (slot->blk == blk && !slot->err) {
+			memcpy(buf, slot->buf, fs->blocksize);
+			hit = 1;
+		}
+		slot->state = META_SLOT_EMPTY;
+	} else if (pf->next <= pf->seq) {
+		/* The workers have fallen behind; don't let them catch up */
+		pf->next = pf->seq + 1;
+	}
+	pf->seq++;
+	/* Wake a worker once there is a full run for it to read */
+	if (pf->idle && (pf->seq % META_PREFETCH_RUN) == 0)
+		pthread_cond_signal(&pf->work_cond);
+	pthread_mutex_unlock(&pf->mutex);
+
+	if (hit)
+		return 0;
+	return io_channel_read_blk64(fs->io, blk, 1, buf);
+}
+
+static void stop_meta_prefetch(void)
+{
+	struct meta_prefetch *pf = meta_prefetch;
+	int i;
+
+	if (!pf)
+		return;
+	pthread_mutex_lock(&pf->mutex);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->work_cond);
+	pthread_mutex_unlock(&pf->mutex);
+	for (i = 0; i < pf->num_threads; i++)
+		pthread_join(pf->threads[i], NULL);
+	pthread_cond_destroy(&pf->work_cond);
+	pthread_cond_destroy(&pf->ready_cond);
+	pthread_mutex_destroy(&pf->mutex);
+	for (i = 0; i < pf->nslots; i++)
+		ext2fs_free_mem(&pf->slots[i].buf);
+	ext2fs_free_mem(&pf->slots);
+	ext2fs_free_mem(&pf->want);
+	ext2fs_free_mem(&pf->threads);
+	ext2fs_free_mem(&meta_prefetch);
+}
+#else
+static void start_meta_prefetch(ext2_filsys fs EXT2FS_ATTR((unused)))
+{
+}
+
+static errcode_t read_meta_block(ext2_filsys fs, blk64_t blk, char *buf)
+{
+	return io_channel_read_blk64(fs->io, blk, 1, buf);
+}
+
+static void stop_meta_prefetch(void)
+{
+}
+#endif
+
 static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 {
 	errcode_t	retval;
@@ -678,7 +955,7 @@ more_blocks:
 		}
 		if ((blk >= fs->super->s_first_data_block) &&
 		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+			retval = read_meta_block(fs, blk, buf);
 			if (retval) {
 				com_err(program_name, retval,
 					_("error reading block %llu"),
@@ -1211,7 +1488,7 @@ static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 	for (blk = 0; blk < ext2fs_blocks_count(fs->super); blk++) {
 		if ((blk >= fs->super->s_first_data_block) &&
 		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+			retval = read_meta_block(fs, blk, buf);
 			if (retval) {
 				com_err(program_name, retval,
 					_("error reading block %llu"),
@@ -1282,6 +1559,539 @@ static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 	free_qcow2_image(img);
 }
 
+/*
+ * Compressed images (-Z).
+ *
+ * Each marked block which isn't all zeroes is looked up by its SHA-512
+ * digest, and only stored if it hasn't been seen before.  The distinct
+ * blocks are collected into frames, and the per-chunk block maps are
+ * built as the blocks go by; both are compressed by a pool of -j worker
+ * threads and written out in the order they were handed over, so that
+ * the image does not depend on the number of threads.  See
+ * lib/ext2fs/cimage.h for the format.
+ *
+ * When a base image is given with -d, each block is first compared
+ * with the block in the base image, and only marked as unchanged in the
+ * chunk map if it is the same, so the new image becomes a delta layer
+ * holding just the blocks which changed.
+ */
+#define CIMAGE_DIGEST_LEN	24
+
+struct cimage_dedup_ent {
+	unsigned char	digest[CIMAGE_DIGEST_LEN];
+	__u64		ref;
+};
+
+struct cimage_job {
+	int		state;
+	int		is_chunk;
+	__u64		num;		/* frame or chunk number */
+	__u32		blocks;		/* in a frame */
+	size_t		len;
+	char		*raw;
+	char		*out;
+	char		*data;		/* what to write: raw or out */
+	size_t		data_len;
+};
+
+#define CIMAGE_JOB_FREE		0
+#define CIMAGE_JOB_QUEUED	1
+#define CIMAGE_JOB_BUSY		2
+#define CIMAGE_JOB_DONE		3
+
+struct cimage_writer {
+	ext2_filsys		fs;
+	int			fd;
+	struct ext2_cimage_hdr	hdr;
+	ext2_loff_t		offset;	/* where the next job is written */
+	size_t			frame_len;
+	size_t			map_len;
+
+	char			*frame_buf;	/* frame being filled */
+	__u32			frame_fill;
+	char			*map_buf;	/* chunk map being filled */
+	__u64			map_chunk;
+	int			map_used;
+
+	struct cimage_dedup_ent	*dedup;
+	__u64			dedup_size;	/* a power of two */
+
+	struct ext2_cimage_frame *frames;
+	__u64			frames_size;
+	struct ext2_cimage_chunk *chunks;
+	__u64			chunks_size;
+
+	struct cimage_job	*jobs;
+	int			njobs;
+	unsigned long long	head;	/* next job to be queued */
+	unsigned long long	tail;	/* next job to be written */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		mutex;
+	pthread_cond_t		work_cond;
+	pthread_cond_t		done_cond;
+	unsigned long long	next_work;
+	int			stop;
+	int			num_threads;
+	pthread_t		*threads;
+#endif
+};
+
+static void cimage_compress_job(struct cimage_writer *w,
+				struct cimage_job *job)
+{
+	size_t out_len = job->len - 1;
+
+	if (ext2fs_cimage_compress(w->hdr.codec, job->raw, job->len,
+				   job->out, &out_len) == 0) {
+		job->data = job->out;
+		job->data_len = out_len;
+	} else {
+		/* Store it as is */
+		job->data = job->raw;
+		job->data_len = job->len;
+	}
+}
+
+#ifdef HAVE_PTHREAD
+static void *cimage_compress_thread(void *arg)
+{
+	struct cimage_writer *w = arg;
+	struct cimage_job *job;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		if (w->next_work < w->head) {
+			job = &w->jobs[w->next_work++ % w->njobs];
+			job->state = CIMAGE_JOB_BUSY;
+			pthread_mutex_unlock(&w->mutex);
+
+			cimage_compress_job(w, job);
+
+			pthread_mutex_lock(&w->mutex);
+			job->state = CIMAGE_JOB_DONE;
+			pthread_cond_signal(&w->done_cond);
+			continue;
+		}
+		if (w->stop)
+			break;
+		pthread_cond_wait(&w->work_cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+#endif
+
+static void *cimage_grow(void *table, __u64 *size, size_t ent_size)
+{
+	__u64 new_size = *size ? *size * 2 : 1024;
+	errcode_t retval;
+
+	retval = ext2fs_resize_mem(*size * ent_size, new_size * ent_size,
+				   &table);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while allocating compressed image tables"));
+		exit(1);
+	}
+	*size = new_size;
+	return table;
+}
+
+/* Write out the oldest queued job, waiting for it to be compressed */
+static void cimage_write_job(struct cimage_writer *w)
+{
+	struct cimage_job *job = &w->jobs[w->tail % w->njobs];
+	struct ext2_cimage_chunk *c;
+	struct ext2_cimage_frame *f;
+
+#ifdef HAVE_PTHREAD
+	if (w->threads) {
+		pthread_mutex_lock(&w->mutex);
+		while (job->state != CIMAGE_JOB_DONE)
+			pthread_cond_wait(&w->done_cond, &w->mutex);
+		pthread_mutex_unlock(&w->mutex);
+	}
+#endif
+	generic_write(w->fd, job->data, job->data_len, NO_BLK);
+	if (job->is_chunk) {
+		if (w->hdr.nr_chunks >= w->chunks_size)
+			w->chunks = cimage_grow(w->chunks, &w->chunks_size,
+						sizeof(*w->chunks));
+		c = &w->chunks[w->hdr.nr_chunks++];
+		c->chunk = ext2fs_cpu_to_le64(job->num);
+		c->offset = ext2fs_cpu_to_le64(w->offset);
+		c->length = ext2fs_cpu_to_le32(job->data_len);
+		c->reserved = 0;
+	} else {
+		if (job->num >= w->frames_size)
+			w->frames = cimage_grow(w->frames, &w->frames_size,
+						sizeof(*w->frames));
+		f = &w->frames[job->num];
+		f->offset = ext2fs_cpu_to_le64(w->offset);
+		f->length = ext2fs_cpu_to_le32(job->data_len);
+		f->blocks = ext2fs_cpu_to_le32(job->blocks);
+	}
+	w->offset += job->data_len;
+	job->state = CIMAGE_JOB_FREE;
+	w->tail++;
+}
+
+/*
+ * Queue the contents of *buf for compression; *buf is swapped with the
+ * job's buffer, so the caller gets a free buffer back.
+ */
+static void cimage_queue(struct cimage_writer *w, int is_chunk, __u64 num,
+			 __u32 blocks, size_t len, char **buf)
+{
+	struct cimage_job *job;
+	char *tmp;
+
+	if (w->head - w->tail >= (unsigned long long) w->njobs)
+		cimage_write_job(w);
+	job = &w->jobs[w->head % w->njobs];
+	tmp = job->raw;
+	job->raw = *buf;
+	*buf = tmp;
+	job->is_chunk = is_chunk;
+	job->num = num;
+	job->blocks = blocks;
+	job->len = len;
+#ifdef HAVE_PTHREAD
+	if (w->threads) {
+		pthread_mutex_lock(&w->mutex);
+		job->state = CIMAGE_JOB_QUEUED;
+		w->head++;
+		pthread_cond_signal(&w->work_cond);
+		pthread_mutex_unlock(&w->mutex);
+		return;
+	}
+#endif
+	cimage_compress_job(w, job);
+	job->state = CIMAGE_JOB_DONE;
+	w->head++;
+}
+
+static void cimage_flush_map(struct cimage_writer *w)
+{
+	if (!w->map_used)
+		return;
+	cimage_queue(w, 1, w->map_chunk, 0, w->map_len, &w->map_buf);
+	memset(w->map_buf, 0, w->map_len);
+	w->map_used = 0;
+}
+
+static void cimage_flush_frame(struct cimage_writer *w)
+{
+	if (!w->frame_fill)
+		return;
+	cimage_queue(w, 0, (w->hdr.unique_blocks - 1) / w->hdr.frame_blocks,
+		     w->frame_fill, (size_t) w->frame_fill * w->fs->blocksize,
+		     &w->frame_buf);
+	w->frame_fill = 0;
+}
+
+/* Return the slot for digest in the dedup table, growing it if need be */
+static struct cimage_dedup_ent *cimage_dedup_slot(struct cimage_writer *w,
+						  unsigned char *digest)
+{
+	struct cimage_dedup_ent *ent, *old = w->dedup;
+	__u64 i, old_size = w->dedup_size, mask, hash;
+	errcode_t retval;
+
+	if (w->hdr.unique_blocks >= w->dedup_size / 2) {
+		w->dedup_size = old_size ? old_size * 2 : 65536;
+		retval = ext2fs_get_arrayzero(w->dedup_size,
+					      sizeof(struct cimage_dedup_ent),
+					      &w->dedup);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while allocating block hash table"));
+			exit(1);
+		}
+		for (i = 0; i < old_size; i++) {
+			if (!old[i].ref)
+				continue;
+			ent = cimage_dedup_slot(w, old[i].digest);
+			*ent = old[i];
+		}
+		ext2fs_free_mem(&old);
+	}
+	mask = w->dedup_size - 1;
+	memcpy(&hash, digest, sizeof(hash));
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		ent = &w->dedup[i];
+		if (!ent->ref ||
+		    !memcmp(ent->digest, digest, CIMAGE_DIGEST_LEN))
+			return ent;
+	}
+}
+
+static void cimage_set_chunk(struct cimage_writer *w, blk64_t blk)
+{
+	__u64 chunk = blk / w->hdr.chunk_blocks;
+
+	if (chunk != w->map_chunk) {
+		cimage_flush_map(w);
+		w->map_chunk = chunk;
+	}
+}
+
+/* Record that blk is the same as in the base image */
+static void cimage_add_base(struct cimage_writer *w, blk64_t blk)
+{
+	cimage_set_chunk(w, blk);
+	((__u64 *) w->map_buf)[blk % w->hdr.chunk_blocks] =
+		ext2fs_cpu_to_le64(EXT2_CIMAGE_BLOCK_BASE);
+	w->map_used = 1;
+}
+
+static void cimage_add_block(struct cimage_writer *w, blk64_t blk, char *buf)
+{
+	unsigned char digest[EXT2FS_SHA512_LENGTH];
+	struct cimage_dedup_ent *ent;
+	__u64 ref;
+
+	cimage_set_chunk(w, blk);
+	if (check_zero_block(buf, w->fs->blocksize))
+		return;
+
+	ext2fs_sha512((unsigned char *) buf, w->fs->blocksize, digest);
+	ent = cimage_dedup_slot(w, digest);
+	if (ent->ref) {
+		ref = ent->ref;
+	} else {
+		ref = ++w->hdr.unique_blocks;
+		memcpy(ent->digest, digest, CIMAGE_DIGEST_LEN);
+		ent->ref = ref;
+		memcpy(w->frame_buf + (size_t) w->frame_fill * w->fs->blocksize,
+		       buf, w->fs->blocksize);
+		if (++w->frame_fill == w->hdr.frame_blocks)
+			cimage_flush_frame(w);
+	}
+	((__u64 *) w->map_buf)[blk % w->hdr.chunk_blocks] =
+		ext2fs_cpu_to_le64(ref);
+	w->map_used = 1;
+}
+
+static void cimage_start_threads(struct cimage_writer *w)
+{
+#ifdef HAVE_PTHREAD
+	int i;
+
+	if (num_threads <= 1 ||
+	    ext2fs_get_array(num_threads, sizeof(pthread_t), &w->threads))
+		return;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->work_cond, NULL);
+	pthread_cond_init(&w->done_cond, NULL);
+	for (i = 0; i < num_threads; i++)
+		if (pthread_create(&w->threads[i], NULL,
+				   cimage_compress_thread, w))
+			break;
+	w->num_threads = i;
+	if (i == 0) {
+		pthread_cond_destroy(&w->done_cond);
+		pthread_cond_destroy(&w->work_cond);
+		pthread_mutex_destroy(&w->mutex);
+		ext2fs_free_mem(&w->threads);
+	}
+#endif
+}
+
+static void cimage_stop_threads(struct cimage_writer *w)
+{
+#ifdef HAVE_PTHREAD
+	int i;
+
+	if (!w->threads)
+		return;
+	pthread_mutex_lock(&w->mutex);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->work_cond);
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0; i < w->num_threads; i++)
+		pthread_join(w->threads[i], NULL);
+	pthread_cond_destroy(&w->done_cond);
+	pthread_cond_destroy(&w->work_cond);
+	pthread_mutex_destroy(&w->mutex);
+	ext2fs_free_mem(&w->threads);
+#endif
+}
+
+static void output_cimage_meta_data_blocks(ext2_filsys fs, int fd)
+{
+	struct cimage_writer	w;
+	struct ext2_cimage_hdr	hdr;
+	io_channel		base = NULL;
+	errcode_t		retval;
+	blk64_t			blk;
+	size_t			buf_len;
+	char			*buf, *base_buf = NULL;
+	int			i;
+
+	memset(&w, 0, sizeof(w));
+	w.fs = fs;
+	w.fd = fd;
+	w.hdr.magic = EXT2_CIMAGE_MAGIC;
+	w.hdr.version = EXT2_CIMAGE_VERSION;
+	w.hdr.hdr_size = EXT2_CIMAGE_HDR_SIZE;
+	w.hdr.codec = cimage_codec;
+	w.hdr.block_size = fs->blocksize;
+	w.hdr.chunk_blocks = EXT2_CIMAGE_CHUNK_BLOCKS;
+	w.hdr.frame_blocks = EXT2_CIMAGE_FRAME_BLOCKS;
+	w.hdr.blocks_count = ext2fs_blocks_count(fs->super);
+	w.frame_len = (size_t) w.hdr.frame_blocks * fs->blocksize;
+	w.map_len = w.hdr.chunk_blocks * sizeof(__u64);
+	w.map_chunk = ~0ULL;
+	buf_len = w.frame_len > w.map_len ? w.frame_len : w.map_len;
+
+	w.njobs = num_threads > 1 ? 2 * num_threads + 2 : 1;
+	retval = ext2fs_get_arrayzero(w.njobs, sizeof(struct cimage_job),
+				      &w.jobs);
+	for (i = 0; !retval && i < w.njobs; i++) {
+		retval = ext2fs_get_mem(buf_len, &w.jobs[i].raw);
+		if (!retval)
+			retval = ext2fs_get_mem(buf_len, &w.jobs[i].out);
+	}
+	if (!retval)
+		retval = ext2fs_get_mem(buf_len, &w.frame_buf);
+	if (!retval)
+		retval = ext2fs_get_memzero(buf_len, &w.map_buf);
+	if (!retval)
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (!retval && cimage_base)
+		retval = ext2fs_get_mem(fs->blocksize, &base_buf);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while allocating buffer"));
+		exit(1);
+	}
+
+	if (cimage_base) {
+		if (cimage_base_hdr.block_size != fs->blocksize) {
+			com_err(program_name, 0,
+				_("base image %s has a different block size"),
+				cimage_base);
+			exit(1);
+		}
+		retval = cimage_io_manager->open(cimage_base, 0, &base);
+		if (!retval)
+			retval = io_channel_set_blksize(base, fs->blocksize);
+		if (retval) {
+			com_err(program_name, retval,
+				_("while opening base image %s"), cimage_base);
+			exit(1);
+		}
+		w.hdr.flags |= EXT2_CIMAGE_FLAG_DELTA;
+		w.hdr.base_checksum = cimage_base_hdr.checksum;
+		strcpy(w.hdr.base_name, cimage_base_name);
+	}
+
+	/* The header is written last, once the image is complete */
+	memset(&hdr, 0, sizeof(hdr));
+	generic_write(fd, &hdr, sizeof(hdr), NO_BLK);
+	w.offset = sizeof(hdr);
+
+	cimage_start_threads(&w);
+	for (blk = fs->super->s_first_data_block;
+	     blk < ext2fs_blocks_count(fs->super); blk++) {
+		if (!ext2fs_test_block_bitmap2(meta_block_map, blk))
+			continue;
+		retval = read_meta_block(fs, blk, buf);
+		if (retval) {
+			com_err(program_name, retval,
+				_("error reading block %llu"),
+				(unsigned long long) blk);
+			continue;
+		}
+		if (scramble_block_map &&
+		    ext2fs_test_block_bitmap2(scramble_block_map, blk))
+			scramble_dir_block(fs, blk, buf);
+		if (base && !io_channel_read_blk64(base, blk, 1, base_buf) &&
+		    !memcmp(buf, base_buf, fs->blocksize))
+			cimage_add_base(&w, blk);
+		else
+			cimage_add_block(&w, blk, buf);
+	}
+	cimage_flush_map(&w);
+	cimage_flush_frame(&w);
+	while (w.tail < w.head)
+		cimage_write_job(&w);
+	cimage_stop_threads(&w);
+
+	w.hdr.nr_frames = (w.hdr.unique_blocks + w.hdr.frame_blocks - 1) /
+		w.hdr.frame_blocks;
+	w.hdr.frame_table_offset = w.offset;
+	generic_write(fd, w.frames, w.hdr.nr_frames * sizeof(*w.frames),
+		      NO_BLK);
+	w.offset += w.hdr.nr_frames * sizeof(*w.frames);
+	w.hdr.chunk_table_offset = w.offset;
+	generic_write(fd, w.chunks, w.hdr.nr_chunks * sizeof(*w.chunks),
+		      NO_BLK);
+
+	hdr = w.hdr;
+	ext2fs_cimage_hdr_to_disk(&hdr);
+	seek_set(fd, 0);
+	generic_write(fd, &hdr, sizeof(hdr), NO_BLK);
+
+	for (i = 0; i < w.njobs; i++) {
+		ext2fs_free_mem(&w.jobs[i].raw);
+		ext2fs_free_mem(&w.jobs[i].out);
+	}
+	ext2fs_free_mem(&w.jobs);
+	ext2fs_free_mem(&w.frame_buf);
+	ext2fs_free_mem(&w.map_buf);
+	ext2fs_free_mem(&w.dedup);
+	ext2fs_free_mem(&w.frames);
+	ext2fs_free_mem(&w.chunks);
+	ext2fs_free_mem(&buf);
+	ext2fs_free_mem(&base_buf);
+	if (base)
+		io_channel_close(base);
+}
+
+/*
+ * Work out the name recorded for the base image of a delta image: just
+ * its file name if it is in the same directory as the new image, so
+ * that the two can be moved together, and its absolute path otherwise.
+ */
+static void cimage_set_base_name(const char *image_fn)
+{
+	char	*base_path, *image_dir, *dir, *cp;
+	const char *name;
+	size_t	len;
+
+	base_path = realpath(cimage_base, NULL);
+	dir = strdup(image_fn);
+	if (!base_path || !dir) {
+		com_err(program_name, errno, _("while trying to open %s"),
+			cimage_base);
+		exit(1);
+	}
+	cp = strrchr(dir, '/');
+	if (cp)
+		cp[cp == dir] = 0;
+	image_dir = realpath(cp ? dir : ".", NULL);
+
+	name = base_path;
+	cp = strrchr(base_path, '/');
+	len = cp - base_path;
+	if (!len)
+		len = 1;
+	if (image_dir && strlen(image_dir) == len &&
+	    !strncmp(image_dir, base_path, len))
+		name = cp + 1;
+	if (strlen(name) >= EXT2_CIMAGE_BASE_NAME_LEN) {
+		com_err(program_name, 0, _("base image name too long - %s"),
+			name);
+		exit(1);
+	}
+	strcpy(cimage_base_name, name);
+	free(image_dir);
+	free(dir);
+	free(base_path);
+}
+
 static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 				 blk64_t superblock)
 {
@@ -1405,10 +2215,14 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags,
 	}
 	use_inode_shortcuts(fs, 0);
 
+	start_meta_prefetch(fs);
 	if (type & E2IMAGE_QCOW2)
 		output_qcow2_meta_data_blocks(fs, fd);
+	else if (type & E2IMAGE_CIMAGE)
+		output_cimage_meta_data_blocks(fs, fd);
 	else
 		output_meta_data_blocks(fs, fd, flags);
+	stop_meta_prefetch();
 
 	ext2fs_free_mem(&block_buf);
 	ext2fs_close_inode_scan(scan);
@@ -1436,10 +2250,11 @@ static void install_image(char *device, char *image_fn, int type)
 #ifdef CONFIG_TESTIO_DEBUG
 	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
 		io_ptr = test_io_manager;
-		test_io_backing_manager = unix_io_manager;
+		test_io_backing_manager =
+			io_channel_select_manager(unix_io_manager);
 	} else
 #endif
-		io_ptr = unix_io_manager;
+		io_ptr = io_channel_select_manager(unix_io_manager);
 
 	retval = ext2fs_open (image_fn, open_flag, 0, 0,
 			      io_ptr, &fs);
@@ -1497,7 +2312,7 @@ int main (int argc, char ** argv)
 	int c;
 	errcode_t retval;
 	ext2_filsys fs;
-	char *image_fn, offset_opt[64];
+	char *image_fn, offset_opt[64], *tmp;
 	struct ext2_qcow2_hdr *header = NULL;
 	int open_flag = EXT2_FLAG_64BITS | EXT2_FLAG_THREADS |
 		EXT2_FLAG_IGNORE_CSUM_ERRORS;
@@ -1512,6 +2327,7 @@ int main (int argc, char ** argv)
 	struct stat st;
 	blk64_t superblock = 0;
 	int blocksize = 0;
+	io_manager io_ptr;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -1527,7 +2343,7 @@ int main (int argc, char ** argv)
 	else
 		usage();
 	add_error_table(&et_ext2_error_table);
-	while ((c = getopt(argc, argv, "b:B:nrsIQafo:O:pc")) != EOF)
+	while ((c = getopt(argc, argv, "b:B:d:nrsIQafj:o:O:pcZz:")) != EOF)
 		switch (c) {
 		case 'b':
 			superblock = strtoull(optarg, NULL, 0);
@@ -1548,6 +2364,23 @@ int main (int argc, char ** argv)
 				usage();
 			img_type |= E2IMAGE_RAW;
 			break;
+		case 'Z':
+			if (img_type)
+				usage();
+			img_type |= E2IMAGE_CIMAGE;
+			break;
+		case 'd':
+			cimage_base = optarg;
+			break;
+		case 'z':
+			cimage_codec = ext2fs_cimage_codec(optarg);
+			if (cimage_codec < 0) {
+				com_err(program_name, 0,
+					_("invalid compression type - %s"),
+					optarg);
+				exit(1);
+			}
+			break;
 		case 's':
 			flags |= E2IMAGE_SCRAMBLE_FLAG;
 			break;
@@ -1557,6 +2390,14 @@ int main (int argc, char ** argv)
 		case 'f':
 			ignore_rw_mount = 1;
 			break;
+		case 'j':
+			num_threads = strtoul(optarg, &tmp, 0);
+			if (*tmp || num_threads < 1 || num_threads > 1024) {
+				com_err(program_name, 0,
+					_("invalid thread count - %s"), optarg);
+				exit(1);
+			}
+			break;
 		case 'n':
 			nop_flag = 1;
 			break;
@@ -1606,11 +2447,55 @@ int main (int argc, char ** argv)
 			_("Move mode requires all data mode."));
 		exit(1);
 	}
+	if (cimage_codec >= 0 && img_type != E2IMAGE_CIMAGE) {
+		com_err(program_name, 0, "%s", _("-z option can only be used "
+						 "with compressed images."));
+		exit(1);
+	}
+	if (cimage_base && img_type != E2IMAGE_CIMAGE) {
+		com_err(program_name, 0, "%s", _("-d option can only be used "
+						 "with compressed images."));
+		exit(1);
+	}
+	if (img_type == E2IMAGE_CIMAGE) {
+		if (cimage_codec < 0) {
+			cimage_codec = EXT2_CIMAGE_CODEC_ZSTD;
+			if (ext2fs_cimage_codec_init(cimage_codec))
+				cimage_codec = EXT2_CIMAGE_CODEC_LZ4;
+		}
+		retval = ext2fs_cimage_codec_init(cimage_codec);
+		if (retval) {
+			com_err(program_name, retval, _("while loading %s"),
+				ext2fs_cimage_codec_name(cimage_codec));
+			exit(1);
+		}
+	}
 	device_name = argv[optind];
 	if (move_mode)
 		image_fn = device_name;
 	else image_fn = argv[optind+1];
 
+	if (cimage_base) {
+		struct stat base_st;
+
+		retval = ext2fs_cimage_read_hdr(cimage_base, &cimage_base_hdr);
+		if (retval) {
+			com_err(program_name, retval,
+				_("while reading base image %s"), cimage_base);
+			exit(1);
+		}
+		if (stat(cimage_base, &base_st) == 0 &&
+		    stat(image_fn, &st) == 0 &&
+		    base_st.st_dev == st.st_dev &&
+		    base_st.st_ino == st.st_ino) {
+			com_err(program_name, 0, "%s",
+				_("The base image can not be overwritten "
+				  "by the new image."));
+			exit(1);
+		}
+		cimage_set_base_name(image_fn);
+	}
+
 	retval = ext2fs_check_if_mounted(device_name, &mount_flags);
 	if (retval) {
 		com_err(program_name, retval, "%s", _("checking if mounted"));
@@ -1640,9 +2525,13 @@ int main (int argc, char ** argv)
 			goto skip_device;
 		}
 	}
+	if (ext2fs_cimage_probe(device_name))
+		io_ptr = cimage_io_manager;
+	else
+		io_ptr = io_channel_select_manager(unix_io_manager);
 	sprintf(offset_opt, "offset=%llu", (unsigned long long) source_offset);
-	retval = ext2fs_open2(device_name, offset_opt, open_flag,
-			      superblock, blocksize, unix_io_manager, &fs);
+	retval = ext2fs_open2(device_name, source_offset ? offset_opt : NULL,
+			      open_flag, superblock, blocksize, io_ptr, &fs);
         if (retval) {
 		com_err (program_name, retval, _("while trying to open %s"),
 			 device_name);
@@ -1677,6 +2566,12 @@ skip_device:
 			_("QCOW2 image can not be written to the stdout!\n"));
 		exit(1);
 	}
+	if ((img_type & E2IMAGE_CIMAGE) && (fd == 1)) {
+		com_err(program_name, 0, "%s",
+			_("Compressed image can not be written to the "
+			  "stdout!\n"));
+		exit(1);
+	}
 	if (fd != 1) {
 		if (fstat(fd, &st)) {
 			com_err(program_name, 0, "%s",
@@ -211,12 +211,33 @@ struct fuse2fs_file_handle {
 	int check_flags;
 };
 
+/*
+ * Requests which only read the file system take bfl shared, so that
+ * several of them (e.g. reads of different files) can run at once;
+ * anything which allocates or frees blocks or inodes, or otherwise
+ * changes more than one inode, takes it exclusive.  libext2fs locks its
+ * inode cache and the unix_io block cache when opened with
+ * EXT2_FLAG_THREADS.  The atime updates done by readers are serialized
+ * per inode by ilock, and error reports by errlock.
+ */
+#define FUSE2FS_ILOCKS		64
+
+/*
+ * Sequential writes to a file are collected in a writeback buffer of up
+ * to this many bytes, and written out (with the blocks past EOF
+ * allocated in one go) when it fills up, or before any request which
+ * takes bfl exclusive.  Readers look at the buffer as well as the disk.
+ */
+#define FUSE2FS_WB_SIZE		(4 * 1024 * 1024)
+
 /* Main program context */
 #define FUSE2FS_MAGIC		(0xEF53DEADUL)
 struct fuse2fs {
 	unsigned long magic;
 	ext2_filsys fs;
-	pthread_mutex_t bfl;
+	pthread_rwlock_t bfl;
+	pthread_mutex_t ilock[FUSE2FS_ILOCKS];
+	pthread_mutex_t errlock;
 	char *device;
 	char *shortdev;
 
@@ -240,6 +261,15 @@ struct fuse2fs {
 	unsigned int next_generation;
 	unsigned long long cache_size;
 	char *lockfile;
+
+	/* writeback buffer, under bfl */
+	char *wb_buf;
+	ext2_ino_t wb_ino;
+	int wb_flags;
+	__u64 wb_pos;
+	size_t wb_len;
+	errcode_t wb_err;
+	ext2_ino_t wb_err_ino;
 };
 
 #define FUSE2FS_CHECK_MAGIC(fs, ptr, num) do {if ((ptr)->magic != (num)) \
@@ -483,15 +513,13 @@ static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
 	return 0;
 }
 
-static int update_atime(ext2_filsys fs, ext2_ino_t ino)
+static int __update_atime(ext2_filsys fs, ext2_ino_t ino)
 {
 	errcode_t err;
 	struct ext2_inode_large inode, *pinode;
 	struct timespec atime, mtime, now;
 	double datime, dmtime, dnow;
 
-	if (!(fs->flags & EXT2_FLAG_RW))
-		return 0;
 	err = fuse2fs_read_inode(fs, ino, &inode);
 	if (err)
 		return translate_error(fs, ino, err);
@@ -521,6 +549,21 @@ static int update_atime(ext2_filsys fs, ext2_ino_t ino)
 	return 0;
 }
 
+/* Readers call this with bfl held shared, so lock the inode */
+static int update_atime(ext2_filsys fs, ext2_ino_t ino)
+{
+	struct fuse2fs *ff = fs->priv_data;
+	pthread_mutex_t *ilock = &ff->ilock[ino % FUSE2FS_ILOCKS];
+	int ret;
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return 0;
+	pthread_mutex_lock(ilock);
+	ret = __update_atime(fs, ino);
+	pthread_mutex_unlock(ilock);
+	return ret;
+}
+
 static int update_mtime(ext2_filsys fs, ext2_ino_t ino,
 			struct ext2_inode_large *pinode)
 {
@@ -610,6 +653,99 @@ static int fs_writeable(ext2_filsys fs)
 	return (fs->flags & EXT2_FLAG_RW) && (fs->super->s_error_count == 0);
 }
 
+/* Write to a file without going through a file handle's position */
+static errcode_t fuse2fs_pwrite(ext2_filsys fs, ext2_ino_t ino,
+				int open_flags, const char *buf,
+				size_t len, __u64 offset)
+{
+	ext2_file_t efp;
+	unsigned int got;
+	errcode_t err, err2;
+
+	err = ext2fs_file_open(fs, ino, open_flags, &efp);
+	if (err)
+		return err;
+	err = ext2fs_file_pwrite(efp, buf, len, offset, &got);
+	err2 = ext2fs_file_close(efp);
+	return err ? err : err2;
+}
+
+/*
+ * Write back the data held in the writeback buffer.  This may happen
+ * during a request on some other file, so a failure is kept until the
+ * next write, fsync or close of the file it belongs to reports it.
+ * Only one failure is kept; another one which comes while it is still
+ * pending is only logged.
+ */
+static errcode_t fuse2fs_writeback(struct fuse2fs *ff)
+{
+	errcode_t err;
+
+	if (!ff->wb_len)
+		return 0;
+
+	dbg_printf(ff, "%s: ino=%d off=%jd len=%zu\n", __func__, ff->wb_ino,
+		   (intmax_t) ff->wb_pos, ff->wb_len);
+	err = fuse2fs_pwrite(ff->fs, ff->wb_ino, ff->wb_flags,
+			     ff->wb_buf, ff->wb_len, ff->wb_pos);
+	if (err && !ff->wb_err) {
+		ff->wb_err = err;
+		ff->wb_err_ino = ff->wb_ino;
+	} else if (err)
+		translate_error(ff->fs, ff->wb_ino, err);
+	ff->wb_len = 0;
+	return err;
+}
+
+/* Take bfl exclusive; the request then sees all data written so far */
+static void fuse2fs_wrlock(struct fuse2fs *ff)
+{
+	pthread_rwlock_wrlock(&ff->bfl);
+	fuse2fs_writeback(ff);
+}
+
+/*
+ * Return (and clear) a writeback error for ino, as write, fsync and
+ * close do
+ */
+static int fuse2fs_writeback_error(struct fuse2fs *ff, ext2_ino_t ino)
+{
+	errcode_t err = ff->wb_err;
+
+	if (!err || ff->wb_err_ino != ino)
+		return 0;
+	ff->wb_err = 0;
+	return translate_error(ff->fs, ino, err);
+}
+
+/*
+ * Copy the part of a read which falls in the writeback buffer over what
+ * was read from the disk, and return the new length of the read.
+ */
+static unsigned int fuse2fs_read_wb(struct fuse2fs *ff, char *buf,
+				    size_t len, __u64 offset,
+				    unsigned int got)
+{
+	__u64 end = offset + len, from = offset;
+
+	if (end > ff->wb_pos + ff->wb_len)
+		end = ff->wb_pos + ff->wb_len;
+	if (end <= offset)
+		return got;
+
+	/* Anything between EOF and the buffered data reads as zeroes */
+	if (offset + got < end) {
+		memset(buf + got, 0, end - offset - got);
+		got = end - offset;
+	}
+	if (from < ff->wb_pos)
+		from = ff->wb_pos;
+	if (from < end)
+		memcpy(buf + (from - offset), ff->wb_buf + (from - ff->wb_pos),
+		       end - from);
+	return got;
+}
+
 static inline int is_superuser(struct fuse2fs *ff, struct fuse_context *ctxt)
 {
 	if (ff->fakeroot)
@@ -786,8 +922,9 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 		return;
 	}
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	fs = ff->fs;
+	fuse2fs_writeback_error(ff, ff->wb_err_ino);
 
 	dbg_printf(ff, "%s: dev=%s\n", __func__, fs->device_name);
 	if (fs->flags & EXT2_FLAG_RW) {
@@ -812,6 +949,9 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 		dbg_printf(ff, "write: %lluk\n", stats->bytes_written >> 10);
 		dbg_printf(ff, "hits: %llu\n",   stats->cache_hits);
 		dbg_printf(ff, "misses: %llu\n", stats->cache_misses);
+		if (stats->num_fields >= 5)
+			dbg_printf(ff, "evictions: %llu\n",
+				   stats->cache_evictions);
 		dbg_printf(ff, "hit_ratio: %.1f%%\n",
 				(100.0 * stats->cache_hits) /
 				(stats->cache_hits + stats->cache_misses));
@@ -824,7 +964,7 @@ static void op_destroy(void *p EXT2FS_ATTR((unused)))
 		log_printf(ff, "%s %s.\n", _("unmounting filesystem"), uuid);
 	}
 
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 }
 
 /* Reopen @stream with @fileno */
@@ -984,6 +1124,7 @@ static void *op_init(struct fuse_conn_info *conn
 
 static int stat_inode(ext2_filsys fs, ext2_ino_t ino, struct stat *statbuf)
 {
+	struct fuse2fs *ff = fs->priv_data;
 	struct ext2_inode_large inode;
 	dev_t fakedev = 0;
 	errcode_t err;
@@ -1002,6 +1143,9 @@ static int stat_inode(ext2_filsys fs, ext2_ino_t ino, struct stat *statbuf)
 	statbuf->st_uid = inode_uid(inode);
 	statbuf->st_gid = inode_gid(inode);
 	statbuf->st_size = EXT2_I_SIZE(&inode);
+	if (ff->wb_len && ff->wb_ino == ino &&
+	    ff->wb_pos + ff->wb_len > (__u64) statbuf->st_size)
+		statbuf->st_size = ff->wb_pos + ff->wb_len;
 	statbuf->st_blksize = fs->blocksize;
 	statbuf->st_blocks = ext2fs_get_stat_i_blocks(fs,
 						EXT2_INODE(&inode));
@@ -1050,7 +1194,7 @@ static int op_getattr(const char *path, struct stat *statbuf
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf(ff, "%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -1058,7 +1202,7 @@ static int op_getattr(const char *path, struct stat *statbuf
 	}
 	ret = stat_inode(fs, ino, statbuf);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -1077,7 +1221,7 @@ static int op_readlink(const char *path, char *buf, size_t len)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf(ff, "%s: path=%s\n", __func__, path);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
@@ -1132,7 +1276,7 @@ static int op_readlink(const char *path, char *buf, size_t len)
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -1294,7 +1438,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1382,7 +1526,7 @@ static int op_mknod(const char *path, mode_t mode, dev_t dev)
 	if (ret)
 		goto out2;
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 out:
 	free(temp_path);
 	return ret;
@@ -1421,7 +1565,7 @@ static int op_mkdir(const char *path, mode_t mode)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1513,7 +1657,7 @@ static int op_mkdir(const char *path, mode_t mode)
 out3:
 	ext2fs_free_mem(&block);
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 out:
 	free(temp_path);
 	return ret;
@@ -1699,9 +1843,9 @@ static int op_unlink(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	ret = __op_unlink(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -1819,9 +1963,9 @@ static int op_rmdir(const char *path)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	ret = __op_rmdir(ff, path);
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -1855,7 +1999,7 @@ static int op_symlink(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -1924,7 +2068,7 @@ static int op_symlink(const char *src, const char *dest)
 		goto out2;
 	}
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 out:
 	free(temp_path);
 	return ret;
@@ -1979,7 +2123,7 @@ static int op_rename(const char *from, const char *to
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf(ff, "%s: renaming %s to %s\n", __func__, from, to);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 5)) {
 		ret = -ENOSPC;
 		goto out;
@@ -2184,7 +2328,7 @@ out2:
 	free(temp_from);
 	free(temp_to);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -2217,7 +2361,7 @@ static int op_link(const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 2)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -2276,7 +2420,7 @@ static int op_link(const char *src, const char *dest)
 		goto out2;
 
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 out:
 	free(temp_path);
 	return ret;
@@ -2385,7 +2529,7 @@ static int op_chmod(const char *path, mode_t mode
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -2439,7 +2583,7 @@ static int op_chmod(const char *path, mode_t mode
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -2459,7 +2603,7 @@ static int op_chown(const char *path, uid_t owner, gid_t group
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -2512,7 +2656,7 @@ static int op_chown(const char *path, uid_t owner, gid_t group
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -2603,7 +2747,7 @@ static int op_truncate(const char *path, off_t len
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -2624,7 +2768,7 @@ static int op_truncate(const char *path, off_t len
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return err;
 }
 
@@ -2739,9 +2883,12 @@ static int op_open(const char *path, struct fuse_file_info *fp)
 	int ret;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	if (fp->flags & O_TRUNC)
+		fuse2fs_wrlock(ff);
+	else
+		pthread_rwlock_rdlock(&ff->bfl);
 	ret = __op_open(ff, path, fp);
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -2753,6 +2900,7 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	struct fuse2fs *ff = (struct fuse2fs *)ctxt->private_data;
 	struct fuse2fs_file_handle *fh =
 		(struct fuse2fs_file_handle *)(uintptr_t)fp->fh;
+	struct ext2_inode_large inode;
 	ext2_filsys fs;
 	ext2_file_t efp;
 	errcode_t err;
@@ -2764,20 +2912,21 @@ static int op_read(const char *path EXT2FS_ATTR((unused)), char *buf,
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino,
 		   (intmax_t) offset, len);
-	pthread_mutex_lock(&ff->bfl);
-	err = ext2fs_file_open(fs, fh->ino, fh->open_flags, &efp);
+	pthread_rwlock_rdlock(&ff->bfl);
+	err = fuse2fs_read_inode(fs, fh->ino, &inode);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
 		goto out;
 	}
 
-	err = ext2fs_file_llseek(efp, offset, SEEK_SET, NULL);
+	err = ext2fs_file_open2(fs, fh->ino, EXT2_INODE(&inode),
+				fh->open_flags, &efp);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
-		goto out2;
+		goto out;
 	}
 
-	err = ext2fs_file_read(efp, buf, len, &got);
+	err = ext2fs_file_pread(efp, buf, len, offset, &got);
 	if (err) {
 		ret = translate_error(fs, fh->ino, err);
 		goto out2;
@@ -2792,13 +2941,16 @@ out2:
 		goto out;
 	}
 
+	if (ff->wb_len && ff->wb_ino == fh->ino)
+		got = fuse2fs_read_wb(ff, buf, len, offset, got);
+
 	if (fh->check_flags != X_OK && fs_writeable(fs)) {
 		ret = update_atime(fs, fh->ino);
 		if (ret)
 			goto out;
 	}
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return got ? (int) got : ret;
 }
 
@@ -2810,8 +2962,8 @@ static int op_write(const char *path EXT2FS_ATTR((unused)),
 	struct fuse2fs *ff = (struct fuse2fs *)ctxt->private_data;
 	struct fuse2fs_file_handle *fh =
 		(struct fuse2fs_file_handle *)(uintptr_t)fp->fh;
+	struct ext2_inode_large inode;
 	ext2_filsys fs;
-	ext2_file_t efp;
 	errcode_t err;
 	unsigned int got = 0;
 	int ret = 0;
@@ -2821,57 +2973,65 @@ static int op_write(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d off=%jd len=%jd\n", __func__, fh->ino,
 		   (intmax_t) offset, (intmax_t) len);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_wrlock(&ff->bfl);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
 	}
 
-	if (!fs_can_allocate(ff, FUSE2FS_B_TO_FSB(ff, len))) {
+	if (!fs_can_allocate(ff, FUSE2FS_B_TO_FSB(ff, len + ff->wb_len))) {
 		ret = -ENOSPC;
 		goto out;
 	}
 
-	err = ext2fs_file_open(fs, fh->ino, fh->open_flags, &efp);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
+	/* Write back the buffer unless this write carries on from it */
+	if (ff->wb_len && (ff->wb_ino != fh->ino ||
+			   ff->wb_pos + ff->wb_len != (__u64) offset ||
+			   ff->wb_len + len > FUSE2FS_WB_SIZE))
+		fuse2fs_writeback(ff);
+	ret = fuse2fs_writeback_error(ff, fh->ino);
+	if (ret)
 		goto out;
-	}
 
-	err = ext2fs_file_llseek(efp, offset, SEEK_SET, NULL);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out2;
-	}
-
-	err = ext2fs_file_write(efp, buf, len, &got);
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out2;
-	}
-
-	err = ext2fs_file_flush(efp);
+	err = fuse2fs_read_inode(fs, fh->ino, &inode);
 	if (err) {
-		got = 0;
 		ret = translate_error(fs, fh->ino, err);
-		goto out2;
+		goto out;
 	}
 
-out2:
-	err = ext2fs_file_close(efp);
-	if (ret)
-		goto out;
-	if (err) {
-		ret = translate_error(fs, fh->ino, err);
-		goto out;
+	if (len <= FUSE2FS_WB_SIZE && LINUX_S_ISREG(inode.i_mode) &&
+	    (inode.i_flags & EXT4_EXTENTS_FL) &&
+	    !(inode.i_flags & EXT4_INLINE_DATA_FL)) {
+		if (!ff->wb_buf) {
+			err = ext2fs_get_mem(FUSE2FS_WB_SIZE, &ff->wb_buf);
+			if (err) {
+				ret = translate_error(fs, fh->ino, err);
+				goto out;
+			}
+		}
+		if (!ff->wb_len) {
+			ff->wb_ino = fh->ino;
+			ff->wb_flags = fh->open_flags;
+			ff->wb_pos = offset;
+		}
+		memcpy(ff->wb_buf + ff->wb_len, buf, len);
+		ff->wb_len += len;
+	} else {
+		err = fuse2fs_pwrite(fs, fh->ino, fh->open_flags, buf, len,
+				     offset);
+		if (err) {
+			ret = translate_error(fs, fh->ino, err);
+			goto out;
+		}
 	}
+	got = len;
 
 	ret = update_mtime(fs, fh->ino, NULL);
 	if (ret)
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return got ? (int) got : ret;
 }
 
@@ -2890,14 +3050,15 @@ static int op_release(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
 	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
+		fuse2fs_wrlock(ff);
+		ret = fuse2fs_writeback_error(ff, fh->ino);
 		err = ext2fs_flush2(fs, EXT2_FLAG_FLUSH_NO_SYNC);
 		if (err)
 			ret = translate_error(fs, fh->ino, err);
+		pthread_rwlock_unlock(&ff->bfl);
 	}
 	fp->fh = 0;
-	pthread_mutex_unlock(&ff->bfl);
 
 	ext2fs_free_mem(&fh);
 
@@ -2921,13 +3082,14 @@ static int op_fsync(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d\n", __func__, fh->ino);
 	/* For now, flush everything, even if it's slow */
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
+	ret = fuse2fs_writeback_error(ff, fh->ino);
 	if (fs_writeable(fs) && fh->open_flags & EXT2_FILE_WRITE) {
 		err = ext2fs_flush2(fs, 0);
 		if (err)
 			ret = translate_error(fs, fh->ino, err);
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -2944,7 +3106,7 @@ static int op_statfs(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_CONTEXT(ff);
 	dbg_printf(ff, "%s: path=%s\n", __func__, path);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	buf->f_bsize = fs->blocksize;
 	buf->f_frsize = 0;
 
@@ -2977,7 +3139,7 @@ static int op_statfs(const char *path EXT2FS_ATTR((unused)),
 	if (!(fs->flags & EXT2_FLAG_RW))
 		buf->f_flag |= ST_RDONLY;
 	buf->f_namemax = EXT2_NAME_LEN;
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return 0;
 }
@@ -3020,7 +3182,7 @@ static int op_getxattr(const char *path, const char *key, char *value,
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -3052,7 +3214,7 @@ static int op_getxattr(const char *path, const char *key, char *value,
 
 	ext2fs_free_mem(&ptr);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -3092,7 +3254,7 @@ static int op_listxattr(const char *path, char *names, size_t len)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -3150,7 +3312,7 @@ out2:
 	if (err && !ret)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -3175,7 +3337,7 @@ static int op_setxattr(const char *path EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -3244,7 +3406,7 @@ out2:
 	if (!ret && err)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -3273,7 +3435,7 @@ static int op_removexattr(const char *path, const char *key)
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!ext2fs_has_feature_xattr(fs->super)) {
 		ret = -ENOTSUP;
 		goto out;
@@ -3340,7 +3502,7 @@ out2:
 	if (err && !ret)
 		ret = translate_error(fs, ino, err);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -3426,7 +3588,7 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 	i.fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(i.fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	i.buf = buf;
 	i.func = fill_func;
 	err = ext2fs_dir_iterate2(i.fs, fh->ino, 0, NULL, op_readdir_iter, &i);
@@ -3441,7 +3603,7 @@ static int op_readdir(const char *path EXT2FS_ATTR((unused)),
 			goto out;
 	}
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -3457,7 +3619,7 @@ static int op_access(const char *path, int mask)
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
 	dbg_printf(ff, "%s: path=%s mask=0x%x\n", __func__, path, mask);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
@@ -3469,7 +3631,7 @@ static int op_access(const char *path, int mask)
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -3504,7 +3666,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	a = *node_name;
 	*node_name = 0;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_can_allocate(ff, 1)) {
 		ret = -ENOSPC;
 		goto out2;
@@ -3594,7 +3756,7 @@ static int op_create(const char *path, mode_t mode, struct fuse_file_info *fp)
 	if (ret)
 		goto out2;
 out2:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 out:
 	free(temp_path);
 	return ret;
@@ -3618,7 +3780,7 @@ static int op_ftruncate(const char *path EXT2FS_ATTR((unused)),
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d len=%jd\n", __func__, fh->ino,
 		   (intmax_t) len);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -3650,7 +3812,7 @@ out2:
 		goto out;
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -3669,9 +3831,9 @@ static int op_fgetattr(const char *path EXT2FS_ATTR((unused)),
 	fs = ff->fs;
 	FUSE2FS_CHECK_MAGIC(fs, fh, FUSE2FS_FILE_MAGIC);
 	dbg_printf(ff, "%s: ino=%d\n", __func__, fh->ino);
-	pthread_mutex_lock(&ff->bfl);
+	pthread_rwlock_rdlock(&ff->bfl);
 	ret = stat_inode(fs, fh->ino, statbuf);
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -3695,7 +3857,7 @@ static int op_utimens(const char *path, const struct timespec ctv[2]
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -3747,7 +3909,7 @@ static int op_utimens(const char *path, const struct timespec ctv[2]
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -4114,7 +4276,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)),
 	int ret = 0;
 
 	FUSE2FS_CHECK_CONTEXT(ff);
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	switch ((unsigned long) cmd) {
 #ifdef SUPPORT_I_FLAGS
 	case EXT2_IOC_GETFLAGS:
@@ -4147,7 +4309,7 @@ static int op_ioctl(const char *path EXT2FS_ATTR((unused)),
 		dbg_printf(ff, "%s: Unknown ioctl %d\n", __func__, cmd);
 		ret = -ENOTTY;
 	}
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -4165,7 +4327,7 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 
 	FUSE2FS_CHECK_CONTEXT(ff);
 	fs = ff->fs;
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -4180,7 +4342,7 @@ static int op_bmap(const char *path, size_t blocksize EXT2FS_ATTR((unused)),
 	}
 
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 	return ret;
 }
 
@@ -4430,7 +4592,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	if (mode & ~(FL_ZERO_RANGE_FLAG | FL_PUNCH_HOLE_FLAG | FL_KEEP_SIZE_FLAG))
 		return -EOPNOTSUPP;
 
-	pthread_mutex_lock(&ff->bfl);
+	fuse2fs_wrlock(ff);
 	if (!fs_writeable(fs)) {
 		ret = -EROFS;
 		goto out;
@@ -4442,7 +4604,7 @@ static int op_fallocate(const char *path EXT2FS_ATTR((unused)), int mode,
 	else
 		ret = fallocate_helper(fp, mode, offset, len);
 out:
-	pthread_mutex_unlock(&ff->bfl);
+	pthread_rwlock_unlock(&ff->bfl);
 
 	return ret;
 }
@@ -4684,7 +4846,8 @@ int main(int argc, char *argv[])
 	errcode_t err;
 	FILE *orig_stderr = stderr;
 	char extra_args[BUFSIZ];
-	int ret;
+	pthread_rwlockattr_t rwattr;
+	int ret, i;
 	int flags = EXT2_FLAG_64BITS | EXT2_FLAG_THREADS | EXT2_FLAG_EXCLUSIVE |
 		    EXT2_FLAG_RW;
 
@@ -4692,6 +4855,18 @@ int main(int argc, char *argv[])
 	fctx.magic = FUSE2FS_MAGIC;
 	fctx.logfd = -1;
 
+	pthread_rwlockattr_init(&rwattr);
+#ifdef __GLIBC__
+	/* Don't let a stream of readers starve writers */
+	pthread_rwlockattr_setkind_np(&rwattr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&fctx.bfl, &rwattr);
+	pthread_rwlockattr_destroy(&rwattr);
+	for (i = 0; i < FUSE2FS_ILOCKS; i++)
+		pthread_mutex_init(&fctx.ilock[i], NULL);
+	pthread_mutex_init(&fctx.errlock, NULL);
+
 	ret = fuse_opt_parse(&args, &fctx, fuse2fs_opts, fuse2fs_opt_proc);
 	if (ret)
 		exit(1);
@@ -4940,8 +5115,6 @@ int main(int argc, char *argv[])
 	}
 
 	if (fctx.debug) {
-		int	i;
-
 		printf("FUSE2FS (%s): fuse arguments:", fctx.shortdev);
 		for (i = 0; i < args.argc; i++)
 			printf(" '%s'", args.argv[i]);
@@ -4949,9 +5122,7 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
-	pthread_mutex_init(&fctx.bfl, NULL);
 	ret = fuse_main(args.argc, args.argv, &fs_ops, &fctx);
-	pthread_mutex_destroy(&fctx.bfl);
 
 	switch(ret) {
 	case 0:
@@ -5004,6 +5175,12 @@ out:
 	if (fctx.device)
 		free(fctx.device);
 	fuse_opt_free_args(&args);
+	if (fctx.wb_buf)
+		ext2fs_free_mem(&fctx.wb_buf);
+	pthread_mutex_destroy(&fctx.errlock);
+	for (i = 0; i < FUSE2FS_ILOCKS; i++)
+		pthread_mutex_destroy(&fctx.ilock[i]);
+	pthread_rwlock_destroy(&fctx.bfl);
 	return ret;
 }
 
@@ -5136,6 +5313,8 @@ static int __translate_error(ext2_filsys fs, ext2_ino_t ino, errcode_t err,
 	if (!is_err)
 		return ret;
 
+	/* Readers may get here with bfl held shared */
+	pthread_mutex_lock(&ff->errlock);
 	if (ino)
 		err_printf(ff, "%s (inode #%d) at %s:%d.\n",
 			error_message(err), ino, file, line);
@@ -5166,6 +5345,7 @@ static int __translate_error(ext2_filsys fs, ext2_ino_t ino, errcode_t err,
 	ext2fs_flush(fs);
 	if (ff->panic_on_error)
 		abort();
+	pthread_mutex_unlock(&ff->errlock);
 
 	return ret;
 }
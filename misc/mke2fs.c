@@ -49,6 +49,9 @@ extern int optind;
 #ifdef HAVE_SYS_SYSMACROS_H
 #include <sys/sysmacros.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <libgen.h>
 #include <limits.h>
 #include <blkid/blkid.h>
@@ -101,6 +104,7 @@ int	journal_flags;
 int	journal_fc_size;
 static e2_blkcnt_t	orphan_file_blocks;
 static int	lazy_itable_init;
+static int	num_io_threads = 4;	/* -E threads */
 static int	assume_storage_prezeroed;
 static int	packed_meta_blocks;
 static int	populate_flags = POPULATE_FS_LINK_APPEND;
@@ -396,35 +400,315 @@ static errcode_t packed_allocate_tables(ext2_filsys fs)
 	return 0;
 }
 
+/*
+ * The number of inode table blocks in group i which mke2fs has to zero.
+ */
+static int itable_zero_blocks(ext2_filsys fs, dgrp_t i, int lazy_flag)
+{
+	if (!lazy_flag)
+		return fs->inode_blocks_per_group;
+	return ext2fs_div_ceil((fs->super->s_inodes_per_group -
+				ext2fs_bg_itable_unused(fs, i)) *
+			       EXT2_INODE_SIZE(fs->super),
+			       EXT2_BLOCK_SIZE(fs->super));
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Zeroing the inode tables one request at a time leaves most of a large
+ * array idle, so when there is a lot to zero, several threads each open
+ * their own io_channel on the device and take requests off a shared
+ * list.  Inode tables which are next to each other on disk (as flex_bg
+ * lays them out) are merged into a single request, which is split again
+ * only when it gets very large, so that the work can still be spread
+ * across the threads.
+ */
+#define ZERO_REQUEST_BYTES	(256 * 1024 * 1024)
+#define ZERO_WRITE_BYTES	(1024 * 1024)
+
+struct zero_request {
+	blk64_t		blk;
+	blk64_t		len;
+	dgrp_t		groups;		/* groups finished by this request */
+};
+
+struct zero_state {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	struct zero_request	*reqs;
+	unsigned int		num_reqs;
+	unsigned int		next_req;
+	unsigned int		running;
+	dgrp_t			groups_done;
+	errcode_t		retval;
+	blk64_t			err_blk;
+	blk64_t			err_len;
+};
+
+struct zero_thread {
+	struct zero_state	*state;
+	io_channel		io;
+	pthread_t		tid;
+};
+
+static errcode_t zero_request(io_channel io, blk64_t blk, blk64_t len,
+			      char **buf)
+{
+	unsigned int	count, max;
+	errcode_t	retval;
+
+	/* BLKZEROOUT on a block device, fallocate on a regular file */
+	retval = io_channel_zeroout(io, blk, len);
+	if (retval != EXT2_ET_UNIMPLEMENTED)
+		return retval;
+
+	max = ZERO_WRITE_BYTES / io->block_size;
+	if (!*buf) {
+		retval = ext2fs_get_memzero(ZERO_WRITE_BYTES, buf);
+		if (retval)
+			return retval;
+	}
+	while (len) {
+		count = len > max ? max : len;
+		retval = io_channel_write_blk64(io, blk, count, *buf);
+		if (retval)
+			return retval;
+		blk += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static void *zero_thread_func(void *arg)
+{
+	struct zero_thread	*t = arg;
+	struct zero_state	*state = t->state;
+	struct zero_request	*req;
+	char			*buf = NULL;
+	errcode_t		retval;
+
+	pthread_mutex_lock(&state->mutex);
+	while (!state->retval && state->next_req < state->num_reqs) {
+		req = &state->reqs[state->next_req++];
+		pthread_mutex_unlock(&state->mutex);
+		retval = zero_request(t->io, req->blk, req->len, &buf);
+		pthread_mutex_lock(&state->mutex);
+		if (retval) {
+			if (!state->retval) {
+				state->retval = retval;
+				state->err_blk = req->blk;
+				state->err_len = req->len;
+			}
+		} else
+			state->groups_done += req->groups;
+		pthread_cond_signal(&state->cond);
+	}
+	state->running--;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+	ext2fs_free_mem(&buf);
+	return NULL;
+}
+
+static errcode_t open_zero_channel(ext2_filsys fs, io_channel *ret_io)
+{
+	io_channel	io;
+	errcode_t	retval;
+	char		opt_string[40];
+	int		flags = IO_FLAG_RW;
+
+	if (fs->flags & EXT2_FLAG_DIRECT_IO)
+		flags |= IO_FLAG_DIRECT_IO;
+	retval = fs->io->manager->open(fs->device_name, flags, &io);
+	if (retval)
+		return retval;
+	retval = io_channel_set_blksize(io, fs->blocksize);
+	if (!retval && offset) {
+		sprintf(opt_string, "offset=%llu", (unsigned long long) offset);
+		retval = io_channel_set_options(io, opt_string);
+	}
+	if (!retval)
+		retval = io_channel_set_options(io, "cache=off");
+	if (retval) {
+		io_channel_close(io);
+		return retval;
+	}
+	*ret_io = io;
+	return 0;
+}
+
+/*
+ * Build the list of zeroing requests.  Returns the number of requests,
+ * or 0 if there is too little to zero to be worth starting threads.
+ */
+static unsigned int build_zero_requests(ext2_filsys fs, int lazy_flag,
+					struct zero_request **ret_reqs)
+{
+	struct zero_request *reqs, *req = NULL;
+	blk64_t		max_len, total = 0;
+	unsigned int	n = 0, alloc = fs->group_desc_count, pending = 0;
+	dgrp_t		i;
+
+	max_len = ZERO_REQUEST_BYTES / fs->blocksize;
+	if (ext2fs_get_array(alloc, sizeof(*reqs), &reqs))
+		return 0;
+	for (i = 0; i < fs->group_desc_count; i++) {
+		blk64_t blk = ext2fs_inode_table_loc(fs, i);
+		blk64_t num = itable_zero_blocks(fs, i, lazy_flag);
+
+		total += num;
+		if (!num) {
+			/* Nothing to zero, but still one step of progress */
+			if (req)
+				req->groups++;
+			else
+				pending++;
+			continue;
+		}
+		if (req && req->blk + req->len == blk &&
+		    req->len + num <= max_len) {
+			req->len += num;
+			req->groups++;
+			continue;
+		}
+		/* Only a huge flex_bg can make a request span more blocks */
+		while (num) {
+			if (n == alloc) {
+				alloc *= 2;
+				if (ext2fs_resize_mem(n * sizeof(*reqs),
+						      alloc * sizeof(*reqs),
+						      &reqs)) {
+					ext2fs_free_mem(&reqs);
+					return 0;
+				}
+			}
+			req = &reqs[n++];
+			req->blk = blk;
+			req->len = num > max_len ? max_len : num;
+			req->groups = 0;
+			blk += req->len;
+			num -= req->len;
+		}
+		req->groups = 1 + pending;
+		pending = 0;
+	}
+	if (n < 2 || total < 2 * max_len) {
+		ext2fs_free_mem(&reqs);
+		return 0;
+	}
+	*ret_reqs = reqs;
+	return n;
+}
+
+/*
+ * Zero the inode tables using num_io_threads threads.  Returns 0 once the
+ * tables have been zeroed, or 1 if the caller should zero them itself.
+ */
+static int zero_inode_tables_threaded(ext2_filsys fs, int lazy_flag,
+				      struct ext2fs_numeric_progress_struct *progress)
+{
+	struct zero_state	state;
+	struct zero_thread	*threads;
+	unsigned int		i, num_threads, num_open;
+	int			ret = 1;
+
+	if (num_io_threads <= 1 || sync_kludge || !fs->device_name ||
+	    fs->io->manager != unix_io_manager)
+		return 1;
+
+	memset(&state, 0, sizeof(state));
+	state.num_reqs = build_zero_requests(fs, lazy_flag, &state.reqs);
+	if (!state.num_reqs)
+		return 1;
+	num_threads = num_io_threads;
+	if (num_threads > state.num_reqs)
+		num_threads = state.num_reqs;
+	if (ext2fs_get_arrayzero(num_threads, sizeof(*threads), &threads)) {
+		ext2fs_free_mem(&state.reqs);
+		return 1;
+	}
+	for (num_open = 0; num_open < num_threads; num_open++) {
+		if (open_zero_channel(fs, &threads[num_open].io))
+			break;
+		threads[num_open].state = &state;
+	}
+	if (num_open < 2 || io_channel_flush(fs->io))
+		goto out;
+	num_threads = num_open;
+
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	pthread_mutex_lock(&state.mutex);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, zero_thread_func,
+				   &threads[i]))
+			break;
+		state.running++;
+	}
+	num_threads = i;
+	while (state.running) {
+		pthread_cond_wait(&state.cond, &state.mutex);
+		ext2fs_numeric_progress_update(fs, progress,
+					       state.groups_done);
+	}
+	pthread_mutex_unlock(&state.mutex);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+	if (state.retval) {
+		fprintf(stderr, _("\nCould not write %llu "
+			  "blocks in inode table starting at %llu: %s\n"),
+			(unsigned long long) state.err_len,
+			(unsigned long long) state.err_blk,
+			error_message(state.retval));
+		exit(1);
+	}
+	/* Threads which never started leave their requests to the caller */
+	ret = (state.next_req < state.num_reqs);
+out:
+	for (i = 0; i < num_open; i++)
+		io_channel_close(threads[i].io);
+	ext2fs_free_mem(&threads);
+	ext2fs_free_mem(&state.reqs);
+	return ret;
+}
+#else
+static int zero_inode_tables_threaded(ext2_filsys fs EXT2FS_ATTR((unused)),
+				      int lazy_flag EXT2FS_ATTR((unused)),
+				      struct ext2fs_numeric_progress_struct *progress EXT2FS_ATTR((unused)))
+{
+	return 1;
+}
+#endif
+
 static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 {
 	errcode_t	retval;
 	blk64_t		start = 0;
 	dgrp_t		i;
-	int		len = 0;
+	int		len = 0, threaded;
 	struct ext2fs_numeric_progress_struct progress;
 
 	ext2fs_numeric_progress_init(fs, &progress,
 				     _("Writing inode tables: "),
 				     fs->group_desc_count);
 
+	threaded = !itable_zeroed &&
+		!zero_inode_tables_threaded(fs, lazy_flag, &progress);
+
 	for (i = 0; i < fs->group_desc_count; i++) {
 		blk64_t blk = ext2fs_inode_table_loc(fs, i);
-		int num = fs->inode_blocks_per_group;
+		int num = itable_zero_blocks(fs, i, lazy_flag);
 
 		ext2fs_numeric_progress_update(fs, &progress, i);
 
-		if (lazy_flag)
-			num = ext2fs_div_ceil((fs->super->s_inodes_per_group -
-					       ext2fs_bg_itable_unused(fs, i)) *
-					      EXT2_INODE_SIZE(fs->super),
-					      EXT2_BLOCK_SIZE(fs->super));
 		if (!lazy_flag || itable_zeroed) {
 			/* The kernel doesn't need to zero the itable blocks */
 			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
 			ext2fs_group_desc_csum_set(fs, i);
 		}
-		if (!itable_zeroed) {
+		if (!itable_zeroed && !threaded) {
 			if (len == 0) {
 				start = blk;
 				len = num;
@@ -948,6 +1232,9 @@ static void parse_extended_opts(struct ext2_super_block *param,
 		} else if (strcmp(token, "no_copy_xattrs") == 0) {
 			populate_flags |= POPULATE_FS_NO_COPY_XATTRS;
 			continue;
+		} else if (strcmp(token, "copy_file_range") == 0) {
+			populate_flags |= POPULATE_FS_COPY_FILE_RANGE;
+			continue;
 		} else if (strcmp(token, "num_backup_sb") == 0) {
 			if (!arg) {
 				r_usage++;
@@ -1081,6 +1368,20 @@ static void parse_extended_opts(struct ext2_super_block *param,
 				lazy_itable_init = strtoul(arg, &p, 0);
 			else
 				lazy_itable_init = 1;
+		} else if (!strcmp(token, "threads")) {
+			if (!arg) {
+				r_usage++;
+				badopt = token;
+				continue;
+			}
+			num_io_threads = strtoul(arg, &p, 0);
+			if (*p || num_io_threads < 1 || num_io_threads > 1024) {
+				fprintf(stderr,
+					_("Invalid number of threads: %s\n"),
+					arg);
+				r_usage++;
+				continue;
+			}
 		} else if (!strcmp(token, "assume_storage_prezeroed")) {
 			if (arg)
 				assume_storage_prezeroed = strtoul(arg, &p, 0);
@@ -1217,6 +1518,8 @@ static void parse_extended_opts(struct ext2_super_block *param,
 			"\tpacked_meta_blocks=<0 to disable, 1 to enable>\n"
 			"\tlazy_itable_init=<0 to disable, 1 to enable>\n"
 			"\tlazy_journal_init=<0 to disable, 1 to enable>\n"
+			"\tthreads=<number of threads for zeroing and copying>\n"
+			"\tcopy_file_range\n"
 			"\troot_owner=<uid of root dir>:<gid of root dir>\n"
 			"\troot_perms=<octal root directory permissions>\n"
 			"\troot_selinux=<selinux root directory label>\n"
@@ -3232,10 +3535,11 @@ int main (int argc, char *argv[])
 #ifdef CONFIG_TESTIO_DEBUG
 	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
 		io_ptr = test_io_manager;
-		test_io_backing_manager = default_io_manager;
+		test_io_backing_manager =
+			io_channel_select_manager(default_io_manager);
 	} else
 #endif
-		io_ptr = default_io_manager;
+		io_ptr = io_channel_select_manager(default_io_manager);
 
 	if (undo_file != NULL || should_do_undo(device_name)) {
 		retval = mke2fs_setup_tdb(device_name, &io_ptr);
@@ -3260,6 +3564,9 @@ int main (int argc, char *argv[])
 	 */
 	if (!quiet)
 		flags |= EXT2_FLAG_PRINT_PROGRESS;
+	/* populate_fs3() writes file data from several threads */
+	if (src_root && num_io_threads > 1)
+		flags |= EXT2_FLAG_THREADS;
 	if (android_sparse_file) {
 		char *android_sparse_params = malloc(strlen(device_name) + 48);
 
@@ -3745,6 +4052,7 @@ no_journal:
 		if (!quiet)
 			printf("%s", _("Copying files into the device: "));
 
+		populate_fs_threads = num_io_threads;
 		retval = populate_fs3(fs, EXT2_ROOT_INO, src_root,
 				      EXT2_ROOT_INO, populate_flags, NULL);
 		if (retval) {
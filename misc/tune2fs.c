@@ -3239,6 +3239,19 @@ retry_open:
 	open_flag |= EXT2_FLAG_64BITS | EXT2_FLAG_THREADS |
 		EXT2_FLAG_JOURNAL_DEV_OK;
 
+	/*
+	 * Most operations only touch the superblock, so only read the
+	 * group descriptors and bitmaps if and when they are needed.
+	 * Changing the UUID, the inode size or the features may rewrite
+	 * every checksum, and the bitmaps have to be verified against the
+	 * old ones before that happens.  Adding a journal or quota inodes,
+	 * or anything -E might do, allocates blocks, which should only be
+	 * done with bitmaps that are known to be good.
+	 */
+	if (!U_flag && !I_flag && !Q_flag && !features_cmd &&
+	    !extended_cmd && !journal_size && !journal_device)
+		open_flag |= EXT2_FLAG_LAZY_LOAD;
+
 	/* keep the filesystem struct around to dump MMP data */
 	open_flag |= EXT2_FLAG_NOFREE_ON_ERROR;
 
@@ -134,6 +134,19 @@ static EXT2_QSORT_TYPE extent_cmp(const void *a, const void *b)
 	return (db_a->old_loc - db_b->old_loc);
 }
 
+/*
+ * Sort the extent table by old location.  Lookups do this when needed,
+ * so it only has to be called before looking up from several threads.
+ */
+void ext2fs_sort_extent_table(ext2_extent extent)
+{
+	if (!extent->sorted) {
+		qsort(extent->list, extent->num,
+		      sizeof(struct ext2_extent_entry), extent_cmp);
+		extent->sorted = 1;
+	}
+}
+
 /*
  * Given an inode map and inode number, look up the old inode number
  * and return the new inode number.
@@ -144,11 +157,7 @@ __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
 	__u64	lowval, highval;
 	float	range;
 
-	if (!extent->sorted) {
-		qsort(extent->list, extent->num,
-		      sizeof(struct ext2_extent_entry), extent_cmp);
-		extent->sorted = 1;
-	}
+	ext2fs_sort_extent_table(extent);
 	low = 0;
 	high = extent->num-1;
 	while (low <= high) {
@@ -189,6 +198,32 @@ __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
 	return 0;
 }
 
+/*
+ * Return nonzero if any of the count locations starting at old_loc is
+ * in the extent table.
+ */
+int ext2fs_extent_overlaps(ext2_extent extent, __u64 old_loc, __u64 count)
+{
+	__s64	low, high, mid;
+
+	if (!count)
+		return 0;
+	ext2fs_sort_extent_table(extent);
+	/* Find the last entry which starts before the end of the range */
+	low = 0;
+	high = extent->num - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (extent->list[mid].old_loc < old_loc + count)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	if (high < 0 || extent->list[low].old_loc >= old_loc + count)
+		return 0;
+	return (extent->list[low].old_loc + extent->list[low].size > old_loc);
+}
+
 /*
  * For debugging only
  */
@@ -47,13 +47,40 @@ static char *device_name, *io_options;
 static void usage (char *prog)
 {
 	fprintf (stderr, _("Usage: %s [-d debug_flags] [-f] [-F] [-M] [-P] "
-			   "[-p] device [-b|-s|new_size] [-S RAID-stride] "
-			   "[-z undo_file]\n\n"),
+			   "[-p] [-j copy_depth] device [-b|-s|new_size] "
+			   "[-S RAID-stride] [-z undo_file]\n\n"),
 		 prog ? prog : "resize2fs");
 
 	exit (1);
 }
 
+/*
+ * The rate at which blocks were relocated, once the pass is done.  It's
+ * not worth reporting for a small move, which is over in no time.
+ */
+#define RELOC_RATE_MIN_BYTES	(64ULL * 1024 * 1024)
+
+static struct timeval reloc_start;
+
+static void print_reloc_rate(ext2_resize_t rfs, unsigned long max)
+{
+	unsigned long long bytes;
+	struct timeval	now;
+	double		secs;
+
+	bytes = (unsigned long long) max *
+		EXT2_CLUSTER_SIZE(rfs->old_fs->super);
+	if (bytes < RELOC_RATE_MIN_BYTES)
+		return;
+	gettimeofday(&now, 0);
+	secs = (now.tv_sec - reloc_start.tv_sec) +
+		(now.tv_usec - reloc_start.tv_usec) / 1000000.0;
+	if (secs <= 0)
+		return;
+	printf(_("Relocated %llu MiB in %.1f seconds (%.1f MiB/s)\n"),
+	       bytes >> 20, secs, (bytes >> 20) / secs);
+}
+
 static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 				      unsigned long cur, unsigned long max)
 {
@@ -89,6 +116,8 @@ static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 			break;
 		}
 		printf(_("Begin pass %d (max = %lu)\n"), pass, max);
+		if (pass == E2_RSZ_BLOCK_RELOC_PASS)
+			gettimeofday(&reloc_start, 0);
 		retval = ext2fs_progress_init(&progress, label, 30,
 					      40, max, 0);
 		if (retval)
@@ -102,6 +131,8 @@ static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 			ext2fs_progress_close(progress);
 		progress = 0;
 		rfs->prog_data = 0;
+		if (pass == E2_RSZ_BLOCK_RELOC_PASS)
+			print_reloc_rate(rfs, max);
 	}
 	return 0;
 }
@@ -263,13 +294,15 @@ int main (int argc, char ** argv)
 	io_manager	io_ptr;
 	char		*new_size_str = 0;
 	int		use_stride = -1;
+	int		copy_depth = 4;
 	ext2fs_struct_stat st_buf;
 	__s64		new_file_size;
 	unsigned int	sys_page_size = 4096;
 	unsigned int	blocksize;
 	long		sysval;
 	int		len, mount_flags;
-	char		*mtpt, *undo_file = NULL;
+	char		*mtpt, *undo_file = NULL, *cp;
+	unsigned int	bitmap_type;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -288,7 +321,7 @@ int main (int argc, char ** argv)
 	else
 		usage(NULL);
 
-	while ((c = getopt(argc, argv, "d:fFhMPpS:bsz:")) != EOF) {
+	while ((c = getopt(argc, argv, "d:fFhj:MPpS:bsz:")) != EOF) {
 		switch (c) {
 		case 'h':
 			usage(program_name);
@@ -299,6 +332,14 @@ int main (int argc, char ** argv)
 		case 'F':
 			flush = 1;
 			break;
+		case 'j':
+			copy_depth = strtol(optarg, &cp, 0);
+			if (*cp || copy_depth < 1) {
+				com_err(program_name, 0,
+					_("invalid copy depth - %s"), optarg);
+				exit(1);
+			}
+			break;
 		case 'M':
 			force_min_size = 1;
 			break;
@@ -395,15 +436,17 @@ int main (int argc, char ** argv)
 	if (!S_ISREG(st_buf.st_mode )) {
 		close(fd);
 		fd = -1;
-	}
+	} else if (!io_options)
+		flags |= RESIZE_COPY_FILE_RANGE;
 
 #ifdef CONFIG_TESTIO_DEBUG
 	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
 		io_ptr = test_io_manager;
-		test_io_backing_manager = unix_io_manager;
+		test_io_backing_manager =
+			io_channel_select_manager(unix_io_manager);
 	} else
 #endif
-		io_ptr = unix_io_manager;
+		io_ptr = io_channel_select_manager(unix_io_manager);
 
 	if (!(mount_flags & EXT2_MF_MOUNTED) && !print_min_size)
 		io_flags = EXT2_FLAG_RW | EXT2_FLAG_EXCLUSIVE;
@@ -425,6 +468,13 @@ int main (int argc, char ** argv)
 		exit (1);
 	}
 	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
+	if ((cp = getenv("RESIZE2FS_BITMAP_TYPE")) != NULL) {
+		if (ext2fs_parse_bitmap_type(cp, &bitmap_type))
+			fprintf(stderr, _("Invalid RESIZE2FS_BITMAP_TYPE '%s'; "
+					  "ignoring\n"), cp);
+		else
+			fs->default_bitmap_type = bitmap_type;
+	}
 
 	/*
 	 * Before acting on an unmounted filesystem, make sure it's ok,
@@ -668,7 +718,7 @@ int main (int argc, char ** argv)
 				 "%s to %llu (%dk) blocks.\n"),
 			       device_name, (unsigned long long) new_size,
 			       blocksize / 1024);
-		retval = resize_fs(fs, &new_size, flags,
+		retval = resize_fs(fs, &new_size, flags, copy_depth,
 				   ((flags & RESIZE_PERCENT_COMPLETE) ?
 				    resize_progress_func : 0));
 	}
@@ -36,6 +36,10 @@
 #include "config.h"
 #include "resize2fs.h"
 #include <time.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef __linux__			/* Kludge for debugging */
 #define RESIZE2FS_DEBUG
@@ -96,6 +100,7 @@ static int lazy_itable_init;
  * This is the top-level routine which does the dirty deed....
  */
 errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
+	    int copy_depth,
 	    errcode_t (*progress)(ext2_resize_t rfs, int pass,
 					  unsigned long cur,
 					  unsigned long max_val))
@@ -116,6 +121,7 @@ errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
 	rfs->old_fs = fs;
 	rfs->flags = flags;
 	rfs->itable_buf	 = 0;
+	rfs->copy_depth = copy_depth;
 	rfs->progress = progress;
 
 	init_resource_track(&overall_track, "overall resize2fs", fs->io);
@@ -1760,17 +1766,288 @@ static errcode_t resize2fs_get_alloc_block(ext2_filsys fs,
 	return 0;
 }
 
+/*
+ * The relocated blocks are copied in requests of up to COPY_REQ_BYTES,
+ * taken in order of their old location so that the reads stay mostly
+ * sequential.  Since a block is only ever moved to a block which is free
+ * in the old file system, no request reads what another one writes, and
+ * the requests can be carried out in any order.  When there is enough
+ * to move and the I/O channel allows it, copy_depth threads share the
+ * requests, so that that many copies are in flight at once.
+ */
+#define COPY_REQ_BYTES		(4 * 1024 * 1024)
+#define COPY_THREADS_MIN_BYTES	(64 * 1024 * 1024)
+
+struct copy_req {
+	blk64_t		old_blk;
+	blk64_t		new_blk;
+	blk64_t		len;
+};
+
+struct copy_list {
+	struct copy_req	*reqs;
+	unsigned int	num;
+	blk64_t		blocks;
+	int		src_fd;		/* for copy_file_range, or -1 */
+	int		copy_range;
+};
+
+static errcode_t build_copy_list(ext2_resize_t rfs, struct copy_list *copy)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	struct copy_req	*req = NULL;
+	unsigned int	alloc = 0;
+	__u64		old_blk, new_blk, size;
+	blk64_t		c, max_len;
+	errcode_t	retval;
+
+	max_len = COPY_REQ_BYTES / fs->blocksize;
+	if (max_len < (blk64_t) EXT2FS_CLUSTER_RATIO(fs))
+		max_len = EXT2FS_CLUSTER_RATIO(fs);
+
+	/* Walk the extent map in order of old location */
+	ext2fs_sort_extent_table(rfs->bmap);
+	retval = ext2fs_iterate_extent(rfs->bmap, 0, 0, 0);
+	if (retval)
+		return retval;
+	while (1) {
+		retval = ext2fs_iterate_extent(rfs->bmap, &old_blk, &new_blk,
+					       &size);
+		if (retval)
+			return retval;
+		if (!size)
+			break;
+		old_blk = C2B(old_blk);
+		new_blk = C2B(new_blk);
+		size = C2B(size);
+#ifdef RESIZE2FS_DEBUG
+		if (rfs->flags & RESIZE_DEBUG_BMOVE)
+			printf("Moving %llu blocks %llu->%llu\n",
+			       (unsigned long long) size,
+			       (unsigned long long) old_blk,
+			       (unsigned long long) new_blk);
+#endif
+		copy->blocks += size;
+		while (size) {
+			c = size > max_len ? max_len : size;
+			if (copy->num == alloc) {
+				unsigned int new_alloc = alloc ? alloc * 2 : 64;
+
+				retval = ext2fs_resize_mem(alloc * sizeof(*req),
+						new_alloc * sizeof(*req),
+						&copy->reqs);
+				if (retval)
+					return retval;
+				alloc = new_alloc;
+			}
+			req = &copy->reqs[copy->num++];
+			req->old_blk = old_blk;
+			req->new_blk = new_blk;
+			req->len = c;
+			old_blk += c;
+			new_blk += c;
+			size -= c;
+		}
+	}
+	return 0;
+}
+
+/*
+ * *copy_range says whether to try copy_file_range; it is cleared if the
+ * channel can't do it.  The threads each pass their own copy of the
+ * flag, which they merge back into copy->copy_range under the mutex.
+ */
+static errcode_t copy_one(ext2_filsys fs, struct copy_list *copy,
+			  struct copy_req *req, char *buf, int *copy_range)
+{
+	errcode_t	retval;
+
+	if (*copy_range) {
+		retval = io_channel_copy_file_range(fs->io, req->new_blk,
+				copy->src_fd,
+				(ext2_loff_t) req->old_blk * fs->blocksize,
+				req->len);
+		if (retval != EXT2_ET_UNIMPLEMENTED)
+			return retval;
+		/* Don't try again for every request */
+		*copy_range = 0;
+	}
+	retval = io_channel_read_blk64(fs->io, req->old_blk, req->len, buf);
+	if (retval)
+		return retval;
+	return io_channel_write_blk64(fs->io, req->new_blk, req->len, buf);
+}
+
+#ifdef HAVE_PTHREAD
+struct copy_state {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	ext2_filsys		fs;
+	struct copy_list	*copy;
+	unsigned int		next_req;
+	unsigned int		running;
+	blk64_t			blocks_done;
+	errcode_t		retval;
+};
+
+static void *copy_thread_func(void *arg)
+{
+	struct copy_state	*state = arg;
+	struct copy_req		*req;
+	char			*buf = NULL;
+	int			copy_range;
+	errcode_t		retval;
+
+	retval = io_channel_alloc_buf(state->fs->io,
+				      COPY_REQ_BYTES / state->fs->blocksize,
+				      &buf);
+	pthread_mutex_lock(&state->mutex);
+	if (retval && !state->retval)
+		state->retval = retval;
+	while (!state->retval && state->next_req < state->copy->num) {
+		req = &state->copy->reqs[state->next_req++];
+		copy_range = state->copy->copy_range;
+		pthread_mutex_unlock(&state->mutex);
+		retval = copy_one(state->fs, state->copy, req, buf,
+				  &copy_range);
+		pthread_mutex_lock(&state->mutex);
+		if (!copy_range)
+			state->copy->copy_range = 0;
+		if (retval) {
+			if (!state->retval)
+				state->retval = retval;
+		} else
+			state->blocks_done += req->len;
+		pthread_cond_signal(&state->cond);
+	}
+	state->running--;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+	ext2fs_free_mem(&buf);
+	return NULL;
+}
+
+static errcode_t copy_blocks_threaded(ext2_resize_t rfs,
+				      struct copy_list *copy, int to_move)
+{
+	ext2_filsys		fs = rfs->new_fs;
+	struct copy_state	state;
+	pthread_t		*tids;
+	errcode_t		retval;
+	unsigned long		moved = 0;
+	int			i, n = rfs->copy_depth;
+
+	if ((unsigned int) n > copy->num)
+		n = copy->num;
+	retval = ext2fs_get_array(n, sizeof(pthread_t), &tids);
+	if (retval)
+		return retval;
+	memset(&state, 0, sizeof(state));
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	state.fs = fs;
+	state.copy = copy;
+
+	pthread_mutex_lock(&state.mutex);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tids[i], NULL, copy_thread_func, &state))
+			break;
+		state.running++;
+	}
+	if (i == 0)
+		state.retval = EAGAIN;
+	while (state.running) {
+		pthread_cond_wait(&state.cond, &state.mutex);
+		if (rfs->progress && !state.retval &&
+		    state.blocks_done / EXT2FS_CLUSTER_RATIO(fs) != moved) {
+			moved = state.blocks_done / EXT2FS_CLUSTER_RATIO(fs);
+			pthread_mutex_unlock(&state.mutex);
+			retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS,
+						 moved, to_move);
+			pthread_mutex_lock(&state.mutex);
+			if (retval && !state.retval)
+				state.retval = retval;
+		}
+	}
+	retval = state.retval;
+	pthread_mutex_unlock(&state.mutex);
+
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+	ext2fs_free_mem(&tids);
+	return retval;
+}
+#endif
+
+static errcode_t copy_blocks(ext2_resize_t rfs, struct copy_list *copy,
+			     int to_move)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	char		*buf = NULL;
+	unsigned int	i;
+	unsigned long	moved = 0;
+	errcode_t	retval;
+
+	copy->src_fd = -1;
+	if (rfs->flags & RESIZE_COPY_FILE_RANGE) {
+		/*
+		 * The reads through src_fd must see everything which was
+		 * written through the channel so far.
+		 */
+		retval = io_channel_flush(fs->io);
+		if (retval)
+			return retval;
+		copy->src_fd = ext2fs_open_file(fs->device_name, O_RDONLY, 0);
+		copy->copy_range = (copy->src_fd >= 0);
+	}
+
+#ifdef HAVE_PTHREAD
+	if (rfs->copy_depth > 1 && copy->num > 1 &&
+	    (fs->io->flags & CHANNEL_FLAGS_THREADS) &&
+	    copy->blocks * fs->blocksize >= COPY_THREADS_MIN_BYTES) {
+		retval = copy_blocks_threaded(rfs, copy, to_move);
+		goto out;
+	}
+#endif
+
+	retval = io_channel_alloc_buf(fs->io, COPY_REQ_BYTES / fs->blocksize,
+				      &buf);
+	if (retval)
+		goto out;
+	for (i = 0; i < copy->num; i++) {
+		retval = copy_one(fs, copy, &copy->reqs[i], buf,
+				  &copy->copy_range);
+		if (retval)
+			goto out;
+		moved += copy->reqs[i].len / EXT2FS_CLUSTER_RATIO(fs);
+		if (rfs->progress) {
+			retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS,
+						 moved, to_move);
+			if (retval)
+				goto out;
+		}
+	}
+out:
+	ext2fs_free_mem(&buf);
+	if (copy->src_fd >= 0)
+		close(copy->src_fd);
+	return retval;
+}
+
 static errcode_t block_mover(ext2_resize_t rfs)
 {
-	blk64_t			blk, old_blk, new_blk;
+	blk64_t			blk, new_blk;
 	ext2_filsys		fs = rfs->new_fs;
 	ext2_filsys		old_fs = rfs->old_fs;
 	errcode_t		retval;
-	__u64			c, size;
-	int			to_move, moved;
+	int			to_move;
 	ext2_badblocks_list	badblock_list = 0;
 	int			bb_modified = 0;
+	struct copy_list	copy;
 
+	memset(&copy, 0, sizeof(copy));
 	fs->get_alloc_block = resize2fs_get_alloc_block;
 	old_fs->get_alloc_block = resize2fs_get_alloc_block;
 
@@ -1794,7 +2071,7 @@ static errcode_t block_mover(ext2_resize_t rfs)
 	 * The first step is to figure out where all of the blocks
 	 * will go.
 	 */
-	to_move = moved = 0;
+	to_move = 0;
 	init_block_alloc(rfs);
 	for (blk = B2C(old_fs->super->s_first_data_block);
 	     blk < ext2fs_blocks_count(old_fs->super);
@@ -1831,8 +2108,9 @@ static errcode_t block_mover(ext2_resize_t rfs)
 	/*
 	 * Step two is to actually move the blocks
 	 */
-	retval =  ext2fs_iterate_extent(rfs->bmap, 0, 0, 0);
-	if (retval) goto errout;
+	retval = build_copy_list(rfs, &copy);
+	if (retval)
+		goto errout;
 
 	if (rfs->progress) {
 		retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS,
@@ -1840,44 +2118,9 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		if (retval)
 			goto errout;
 	}
-	while (1) {
-		retval = ext2fs_iterate_extent(rfs->bmap, &old_blk, &new_blk, &size);
-		if (retval) goto errout;
-		if (!size)
-			break;
-		old_blk = C2B(old_blk);
-		new_blk = C2B(new_blk);
-		size = C2B(size);
-#ifdef RESIZE2FS_DEBUG
-		if (rfs->flags & RESIZE_DEBUG_BMOVE)
-			printf("Moving %llu blocks %llu->%llu\n",
-			       (unsigned long long) size,
-			       (unsigned long long) old_blk,
-			       (unsigned long long) new_blk);
-#endif
-		do {
-			c = size;
-			if (c > fs->inode_blocks_per_group)
-				c = fs->inode_blocks_per_group;
-			retval = io_channel_read_blk64(fs->io, old_blk, c,
-						       rfs->itable_buf);
-			if (retval) goto errout;
-			retval = io_channel_write_blk64(fs->io, new_blk, c,
-							rfs->itable_buf);
-			if (retval) goto errout;
-			size -= c;
-			new_blk += c;
-			old_blk += c;
-			moved += c;
-			if (rfs->progress) {
-				retval = (rfs->progress)(rfs,
-						E2_RSZ_BLOCK_RELOC_PASS,
-						moved, to_move);
-				if (retval)
-					goto errout;
-			}
-		} while (size > 0);
-	}
+	retval = copy_blocks(rfs, &copy, to_move);
+	if (retval)
+		goto errout;
 
 	io_channel_flush(fs->io);
 
@@ -1888,6 +2131,7 @@ errout:
 							badblock_list);
 		ext2fs_badblocks_list_free(badblock_list);
 	}
+	ext2fs_free_mem(&copy.reqs);
 	return retval;
 }
 
@@ -2179,6 +2423,271 @@ out:
 	return retval;
 
 }
+
+/*
+ * The inode scan and the inode reference update work through the inodes
+ * and directory blocks in batches.  For each batch, the checks which
+ * only read the file system and the (read-only) extent maps are made
+ * first, shared between copy_depth threads when the I/O channel allows
+ * it.  The results are then applied in order by the calling thread,
+ * which is the only one to write inodes, allocate blocks and inodes, or
+ * add to the directory block list.
+ */
+#define SHARD_BATCH		1024
+#define SHARD_BATCH_BYTES	(4 * 1024 * 1024)
+#define SHARD_CHUNK		16
+#define SHARD_BUF_BLOCKS	5	/* deepest extent tree we look into */
+
+typedef void (*shard_func_t)(ext2_resize_t rfs, void *batch,
+			     unsigned int i, char *buf);
+
+struct shard_state {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		mutex;
+#endif
+	ext2_resize_t		rfs;
+	shard_func_t		func;
+	void			*batch;
+	unsigned int		num;
+	unsigned int		next;
+	errcode_t		retval;
+};
+
+static void *shard_thread_func(void *arg)
+{
+	struct shard_state	*state = arg;
+	char			*buf = NULL;
+	unsigned int		i, end;
+	errcode_t		retval;
+
+	retval = ext2fs_get_array(SHARD_BUF_BLOCKS,
+				  state->rfs->old_fs->blocksize, &buf);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&state->mutex);
+#endif
+	if (retval && !state->retval)
+		state->retval = retval;
+	while (!state->retval && state->next < state->num) {
+		i = state->next;
+		end = i + SHARD_CHUNK;
+		if (end > state->num)
+			end = state->num;
+		state->next = end;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&state->mutex);
+#endif
+		for (; i < end; i++)
+			(state->func)(state->rfs, state->batch, i, buf);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&state->mutex);
+#endif
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&state->mutex);
+#endif
+	ext2fs_free_mem(&buf);
+	return NULL;
+}
+
+static errcode_t run_shards(ext2_resize_t rfs, shard_func_t func,
+			    void *batch, unsigned int num)
+{
+	struct shard_state	state;
+#ifdef HAVE_PTHREAD
+	pthread_t		*tids = NULL;
+	int			i = 0, n = rfs->copy_depth;
+
+	memset(&state, 0, sizeof(state));
+	pthread_mutex_init(&state.mutex, NULL);
+#else
+	memset(&state, 0, sizeof(state));
+#endif
+	state.rfs = rfs;
+	state.func = func;
+	state.batch = batch;
+	state.num = num;
+
+#ifdef HAVE_PTHREAD
+	if ((unsigned int) n > num / SHARD_CHUNK)
+		n = num / SHARD_CHUNK;
+	if (!(rfs->old_fs->io->flags & CHANNEL_FLAGS_THREADS) ||
+	    (rfs->flags & RESIZE_DEBUG_INODEMAP))
+		n = 1;
+	if (n > 1 && !ext2fs_get_array(n - 1, sizeof(pthread_t), &tids)) {
+		for (i = 0; i < n - 1; i++)
+			if (pthread_create(&tids[i], NULL, shard_thread_func,
+					   &state))
+				break;
+	}
+#endif
+	/* This thread takes its share too */
+	shard_thread_func(&state);
+#ifdef HAVE_PTHREAD
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+	ext2fs_free_mem(&tids);
+	pthread_mutex_destroy(&state.mutex);
+#endif
+	return state.retval;
+}
+
+static int blocks_moved(ext2_resize_t rfs, blk64_t blk, blk64_t count)
+{
+	ext2_filsys	fs = rfs->old_fs;
+
+	return ext2fs_extent_overlaps(rfs->bmap, B2C(blk),
+				      B2C(blk + count - 1) - B2C(blk) + 1);
+}
+
+/*
+ * Return nonzero if the extent tree node, or anything it maps, moved.
+ * Anything which looks wrong is left to ext2fs_block_iterate3() to
+ * deal with, so it counts as moved too.
+ */
+static int extent_node_moved(ext2_resize_t rfs, char *node, int size,
+			     char *buf, int level)
+{
+	ext2_filsys		fs = rfs->old_fs;
+	struct ext3_extent_header *eh = (struct ext3_extent_header *) node;
+	struct ext3_extent	*ex;
+	struct ext3_extent_idx	*ix;
+	blk64_t			blk;
+	unsigned int		len;
+	int			i, entries;
+
+	if (level >= SHARD_BUF_BLOCKS ||
+	    ext2fs_extent_header_verify(node, size))
+		return 1;
+	entries = ext2fs_le16_to_cpu(eh->eh_entries);
+	if (eh->eh_depth == 0) {
+		ex = EXT_FIRST_EXTENT(eh);
+		for (i = 0; i < entries; i++, ex++) {
+			blk = ext2fs_le32_to_cpu(ex->ee_start) +
+			      ((blk64_t) ext2fs_le16_to_cpu(ex->ee_start_hi)
+			       << 32);
+			len = ext2fs_le16_to_cpu(ex->ee_len);
+			if (len > EXT_INIT_MAX_LEN)
+				len -= EXT_INIT_MAX_LEN;
+			if (len && blocks_moved(rfs, blk, len))
+				return 1;
+		}
+		return 0;
+	}
+	ix = EXT_FIRST_INDEX(eh);
+	for (i = 0; i < entries; i++, ix++) {
+		blk = ext2fs_le32_to_cpu(ix->ei_leaf) +
+		      ((blk64_t) ext2fs_le16_to_cpu(ix->ei_leaf_hi) << 32);
+		if (blocks_moved(rfs, blk, 1) ||
+		    io_channel_read_blk64(fs->io, blk, 1, buf) ||
+		    extent_node_moved(rfs, buf, fs->blocksize,
+				      buf + fs->blocksize, level + 1))
+			return 1;
+	}
+	return 0;
+}
+
+static int ind_block_moved(ext2_resize_t rfs, blk64_t ind, int level,
+			   char *buf)
+{
+	ext2_filsys	fs = rfs->old_fs;
+	blk64_t		blk;
+	unsigned int	i, limit = fs->blocksize >> 2;
+
+	if (ind >= ext2fs_blocks_count(fs->super) ||
+	    ind < fs->super->s_first_data_block ||
+	    blocks_moved(rfs, ind, 1) ||
+	    io_channel_read_blk64(fs->io, ind, 1, buf))
+		return 1;
+	for (i = 0; i < limit; i++) {
+		blk = ext2fs_le32_to_cpu(((__u32 *) buf)[i]);
+		if (!blk)
+			continue;
+		if (level ? ind_block_moved(rfs, blk, level - 1,
+					    buf + fs->blocksize) :
+		    blocks_moved(rfs, blk, 1))
+			return 1;
+	}
+	return 0;
+}
+
+struct inode_batch {
+	char		*inodes;	/* num inodes of inode_size bytes */
+	ext2_ino_t	*inos;
+	char		*unmoved;	/* none of the inode's blocks moved */
+	unsigned int	num;
+	int		inode_size;
+	int		done;
+};
+
+/*
+ * Most files keep all of their blocks, and most of the scan would go to
+ * calling process_block() on every one of them only to find that.  Look
+ * at the block map (or extent tree) directly instead, so that such files
+ * can be skipped.  Directories are always iterated, since their blocks
+ * go into the directory block list.
+ */
+static void check_inode_blocks(ext2_resize_t rfs, void *arg, unsigned int i,
+			       char *buf)
+{
+	struct inode_batch	*batch = arg;
+	ext2_filsys		fs = rfs->old_fs;
+	struct ext2_inode	*inode;
+	int			j, moved = 0;
+
+	inode = (struct ext2_inode *) (batch->inodes + i * batch->inode_size);
+	batch->unmoved[i] = 0;
+	if (batch->inos[i] == EXT2_RESIZE_INO ||
+	    LINUX_S_ISDIR(inode->i_mode) ||
+	    !ext2fs_inode_has_valid_blocks2(fs, inode))
+		return;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		moved = extent_node_moved(rfs, (char *) inode->i_block,
+					  sizeof(inode->i_block), buf, 0);
+	} else {
+		for (j = 0; j < EXT2_NDIR_BLOCKS && !moved; j++)
+			if (inode->i_block[j])
+				moved = blocks_moved(rfs, inode->i_block[j], 1);
+		for (j = 0; j < 3 && !moved; j++)
+			if (inode->i_block[EXT2_IND_BLOCK + j])
+				moved = ind_block_moved(rfs,
+					inode->i_block[EXT2_IND_BLOCK + j],
+					j, buf);
+	}
+	batch->unmoved[i] = !moved;
+}
+
+/*
+ * Read the next batch of inodes which are in use.
+ */
+static errcode_t get_inode_batch(ext2_resize_t rfs, ext2_inode_scan scan,
+				 struct inode_batch *batch)
+{
+	struct ext2_inode	*inode;
+	ext2_ino_t		ino;
+	errcode_t		retval;
+
+	batch->num = 0;
+	while (!batch->done && batch->num < SHARD_BATCH) {
+		inode = (struct ext2_inode *) (batch->inodes +
+					       batch->num * batch->inode_size);
+		retval = ext2fs_get_next_inode_full(scan, &ino, inode,
+						    batch->inode_size);
+		if (retval)
+			return retval;
+		if (!ino) {
+			batch->done = 1;
+			break;
+		}
+		if (inode->i_links_count == 0 && ino != EXT2_RESIZE_INO)
+			continue; /* inode not in use */
+		batch->inos[batch->num++] = ino;
+	}
+	if (!rfs->bmap || !batch->num)
+		return 0;
+	return run_shards(rfs, check_inode_blocks, batch, batch->num);
+}
+
 static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 {
 	struct process_block_struct	pb;
@@ -2190,12 +2699,16 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 	ext2_ino_t		start_to_move;
 	int			inode_size;
 	int			update_ea_inode_refs = 0;
+	struct inode_batch	batch;
+	unsigned int		next = 0;
+	int			unmoved;
 
 	if ((rfs->old_fs->group_desc_count <=
 	     rfs->new_fs->group_desc_count) &&
 	    !rfs->bmap)
 		return 0;
 
+	memset(&batch, 0, sizeof(batch));
 	set_com_err_hook(quiet_com_err_proc);
 
 	retval = ext2fs_open_inode_scan(rfs->old_fs, 0, &scan);
@@ -2221,23 +2734,37 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 	pb.error = 0;
 	new_inode = EXT2_FIRST_INODE(rfs->new_fs->super);
 	inode_size = EXT2_INODE_SIZE(rfs->new_fs->super);
-	inode = malloc(inode_size);
-	if (!inode) {
-		retval = ENOMEM;
+	batch.inode_size = inode_size;
+	retval = ext2fs_get_array(SHARD_BATCH, inode_size, &batch.inodes);
+	if (retval)
 		goto errout;
-	}
+	retval = ext2fs_get_array(SHARD_BATCH, sizeof(ext2_ino_t),
+				  &batch.inos);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(SHARD_BATCH, &batch.unmoved);
+	if (retval)
+		goto errout;
+	if (rfs->bmap)
+		ext2fs_sort_extent_table(rfs->bmap);
 	/*
 	 * First, copy all of the inodes that need to be moved
 	 * elsewhere in the inode table
 	 */
 	while (1) {
-		retval = ext2fs_get_next_inode_full(scan, &ino, inode, inode_size);
-		if (retval) goto errout;
-		if (!ino)
-			break;
-
-		if (inode->i_links_count == 0 && ino != EXT2_RESIZE_INO)
-			continue; /* inode not in use */
+		if (next == batch.num) {
+			retval = get_inode_batch(rfs, scan, &batch);
+			if (retval)
+				goto errout;
+			if (!batch.num)
+				break;
+			next = 0;
+		}
+		ino = batch.inos[next];
+		inode = (struct ext2_inode *) (batch.inodes +
+					       next * inode_size);
+		unmoved = rfs->bmap && batch.unmoved[next];
+		next++;
 
 		pb.is_dir = LINUX_S_ISDIR(inode->i_mode);
 		pb.changed = 0;
@@ -2304,7 +2831,7 @@ remap_blocks:
 		 */
 		rfs->old_fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
 		if (ext2fs_inode_has_valid_blocks2(rfs->old_fs, inode) &&
-		    (rfs->bmap || pb.is_dir)) {
+		    (rfs->bmap || pb.is_dir) && !unmoved) {
 			pb.ino = new_inode;
 			pb.old_ino = ino;
 			pb.has_extents = inode->i_flags & EXT4_EXTENTS_FL;
@@ -2338,8 +2865,9 @@ remap_blocks:
 
 	if (update_ea_inode_refs &&
 	    ext2fs_has_feature_ea_inode(rfs->new_fs->super)) {
-		retval = fix_ea_inode_refs(rfs, inode, block_buf,
-					   start_to_move);
+		retval = fix_ea_inode_refs(rfs,
+					   (struct ext2_inode *) batch.inodes,
+					   block_buf, start_to_move);
 		if (retval)
 			goto errout;
 	}
@@ -2356,7 +2884,9 @@ errout:
 		ext2fs_close_inode_scan(scan);
 	if (block_buf)
 		ext2fs_free_mem(&block_buf);
-	free(inode);
+	ext2fs_free_mem(&batch.inodes);
+	ext2fs_free_mem(&batch.inos);
+	ext2fs_free_mem(&batch.unmoved);
 	return retval;
 }
 
@@ -2433,14 +2963,159 @@ static int check_and_change_inodes(ext2_ino_t dir,
 	return ret | DIRENT_CHANGED;
 }
 
+struct dir_batch {
+	struct ext2_db_entry2	*blocks;
+	char			*bufs;		/* num blocks */
+	errcode_t		*errs;
+	char			*moved;		/* an entry was translated */
+	unsigned int		num;
+	unsigned int		max;
+};
+
+static int get_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			 struct ext2_db_entry2 *db_info, void *priv_data)
+{
+	struct dir_batch *batch = (struct dir_batch *) priv_data;
+
+	batch->blocks[batch->num++] = *db_info;
+	return 0;
+}
+
+/*
+ * Read a directory block and translate the inode numbers in it, as
+ * check_and_change_inodes() does for each entry.  Writing it back and
+ * updating the directory's times is left to inode_ref_fix().
+ */
+static void translate_dir_block(ext2_resize_t rfs, void *arg, unsigned int i,
+				char *buf EXT2FS_ATTR((unused)))
+{
+	struct dir_batch	*batch = arg;
+	struct ext2_db_entry2	*db = &batch->blocks[i];
+	ext2_filsys		fs = rfs->old_fs;
+	char			*block = batch->bufs + i * fs->blocksize;
+	struct ext2_dir_entry	*dirent;
+	unsigned int		offset = 0, rec_len;
+	ext2_ino_t		new_inode;
+	errcode_t		retval;
+
+	batch->moved[i] = 0;
+	batch->errs[i] = 0;
+	/* Inline data directories are left to ext2fs_dir_iterate2() */
+	if (db->blockcnt < 0 || !db->blk)
+		return;
+	retval = ext2fs_read_dir_block4(fs, db->blk, block, 0, db->ino);
+	if (retval)
+		goto out;
+	while (offset < fs->blocksize - 8) {
+		dirent = (struct ext2_dir_entry *) (block + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			goto out;
+		if (((offset + rec_len) > fs->blocksize) ||
+		    (rec_len < 8) ||
+		    ((rec_len % 4) != 0) ||
+		    ((ext2fs_dirent_name_len(dirent)+8) > (int) rec_len)) {
+			retval = EXT2_ET_DIR_CORRUPTED;
+			goto out;
+		}
+		new_inode = dirent->inode ?
+			ext2fs_extent_translate(rfs->imap, dirent->inode) : 0;
+		if (new_inode) {
+#ifdef RESIZE2FS_DEBUG
+			if (rfs->flags & RESIZE_DEBUG_INODEMAP)
+				printf("Inode translate (dir=%u, name=%.*s, "
+				       "%u->%u)\n", db->ino,
+				       ext2fs_dirent_name_len(dirent),
+				       dirent->name, dirent->inode, new_inode);
+#endif
+			dirent->inode = new_inode;
+			batch->moved[i] = 1;
+		}
+		offset += rec_len;
+	}
+out:
+	batch->errs[i] = retval;
+}
+
+static errcode_t fix_dir_block(struct istruct *is, struct dir_batch *batch,
+				unsigned int i)
+{
+	ext2_resize_t		rfs = is->rfs;
+	ext2_filsys		fs = rfs->old_fs;
+	struct ext2_db_entry2	*db = &batch->blocks[i];
+	struct ext2_inode 	inode;
+	int			changed = batch->moved[i];
+	errcode_t		retval;
+
+	if (db->blockcnt < 0)
+		return 0;
+	if (!db->blk) {
+		retval = ext2fs_dir_iterate2(fs, db->ino,
+					     DIRENT_FLAG_INCLUDE_EMPTY, 0,
+					     check_and_change_inodes, is);
+		return retval ? retval : is->err;
+	}
+
+	if (rfs->progress) {
+		io_channel_flush(fs->io);
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
+					 ++is->num, is->max_dirs);
+		if (retval)
+			return retval;
+	}
+	if (batch->errs[i])
+		return batch->errs[i];
+
+	/* See check_and_change_inodes() */
+	if (ext2fs_has_feature_metadata_csum(fs->super) &&
+	    !ext2fs_test_inode_bitmap2(fs->inode_map, db->ino))
+		changed = 1;
+
+	if (batch->moved[i] && ext2fs_read_inode(fs, db->ino, &inode) == 0) {
+		inode.i_mtime = inode.i_ctime = fs->now ? fs->now : time(0);
+		retval = ext2fs_write_inode(fs, db->ino, &inode);
+		if (retval)
+			return retval;
+	}
+
+	if (!changed)
+		return 0;
+	return ext2fs_write_dir_block4(fs, db->blk,
+				       batch->bufs + i * fs->blocksize, 0,
+				       db->ino);
+}
+
 static errcode_t inode_ref_fix(ext2_resize_t rfs)
 {
 	errcode_t		retval;
 	struct istruct 		is;
+	struct dir_batch	batch;
+	unsigned long long	start;
+	unsigned int		i;
 
 	if (!rfs->imap)
 		return 0;
 
+	memset(&batch, 0, sizeof(batch));
+	batch.max = SHARD_BATCH_BYTES / rfs->old_fs->blocksize;
+	if (batch.max < SHARD_CHUNK)
+		batch.max = SHARD_CHUNK;
+	retval = ext2fs_get_array(batch.max, sizeof(struct ext2_db_entry2),
+				  &batch.blocks);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(batch.max, rfs->old_fs->blocksize,
+				  &batch.bufs);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(batch.max, sizeof(errcode_t), &batch.errs);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(batch.max, &batch.moved);
+	if (retval)
+		goto errout;
+	ext2fs_sort_extent_table(rfs->imap);
+
 	/*
 	 * Now, we iterate over all of the directories to update the
 	 * inode references
@@ -2457,23 +3132,38 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 			goto errout;
 	}
 
+	/*
+	 * The directory blocks are read and translated in batches (see
+	 * run_shards()), and then written back in order here.
+	 */
 	rfs->old_fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
-	retval = ext2fs_dblist_dir_iterate(rfs->old_fs->dblist,
-					   DIRENT_FLAG_INCLUDE_EMPTY, 0,
-					   check_and_change_inodes, &is);
+	for (start = 0; start < is.max_dirs; start += batch.num) {
+		batch.num = 0;
+		retval = ext2fs_dblist_iterate3(rfs->old_fs->dblist,
+						get_dir_block, start,
+						batch.max, &batch);
+		if (retval || !batch.num)
+			break;
+		retval = run_shards(rfs, translate_dir_block, &batch,
+				    batch.num);
+		for (i = 0; !retval && i < batch.num; i++)
+			retval = fix_dir_block(&is, &batch, i);
+		if (retval)
+			break;
+	}
 	rfs->old_fs->flags &= ~EXT2_FLAG_IGNORE_CSUM_ERRORS;
 	if (retval)
 		goto errout;
-	if (is.err) {
-		retval = is.err;
-		goto errout;
-	}
 
 	if (rfs->progress && (is.num < is.max_dirs))
 		(rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
 				is.max_dirs, is.max_dirs);
 
 errout:
+	ext2fs_free_mem(&batch.blocks);
+	ext2fs_free_mem(&batch.bufs);
+	ext2fs_free_mem(&batch.errs);
+	ext2fs_free_mem(&batch.moved);
 	ext2fs_free_extent_table(rfs->imap);
 	rfs->imap = 0;
 	return retval;
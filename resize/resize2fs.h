@@ -85,6 +85,8 @@ typedef struct ext2_sim_progress *ext2_sim_progmeter;
 #define RESIZE_ENABLE_64BIT		0x0400
 #define RESIZE_DISABLE_64BIT		0x0800
 
+#define RESIZE_COPY_FILE_RANGE		0x1000
+
 /*
  * This structure is used for keeping track of how much resources have
  * been used for a particular resize2fs pass.
@@ -114,6 +116,7 @@ struct ext2_resize_struct {
 	blk64_t		needed_blocks;
 	int		flags;
 	char		*itable_buf;
+	int		copy_depth;	/* copies in flight, threads */
 
 	/*
 	 * For the block allocator
@@ -142,6 +145,7 @@ struct ext2_resize_struct {
 
 /* prototypes */
 extern errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
+			   int copy_depth,
 			   errcode_t	(*progress)(ext2_resize_t rfs,
 					    int pass, unsigned long cur,
 					    unsigned long max));
@@ -160,6 +164,9 @@ extern void ext2fs_free_extent_table(ext2_extent extent);
 extern errcode_t ext2fs_add_extent_entry(ext2_extent extent,
 					 __u64 old_loc, __u64 new_loc);
 extern __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc);
+extern int ext2fs_extent_overlaps(ext2_extent extent, __u64 old_loc,
+				  __u64 count);
+extern void ext2fs_sort_extent_table(ext2_extent extent);
 extern void ext2fs_extent_dump(ext2_extent extent, FILE *out);
 extern errcode_t ext2fs_iterate_extent(ext2_extent extent, __u64 *old_loc,
 				       __u64 *new_loc, __u64 *size);